@@ -0,0 +1,95 @@
+// Copyright 2015 the kNet authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#pragma once
+
+#include "icongestion_controller.h"
+
+#include <array>
+
+namespace knet
+{
+	/*
+	* Model based congestion control after BBR (v1)
+	* Estimates the bottleneck bandwidth (windowed max of delivery rates) and the propagation delay (windowed min of round trips),
+	* paces at the bandwidth times a gain and keeps about two bandwidth delay products in flight
+	* Losses do not shrink the model, a timeout only limits the window until the next ack
+	*/
+	class BbrController : public ICongestionController
+	{
+	public:
+		enum class State : uint8_t
+		{
+			Startup, // Doubles the sending rate per round until the bandwidth stops growing
+			Drain, // Empties the queue startup built up
+			ProbeBandwidth, // Cycles the pacing gain around 1 to find more bandwidth
+			ProbeRtt, // Nearly empties the pipe to measure the propagation delay again
+		};
+	private:
+		static constexpr size_t bandwidthRounds = 10;
+
+		size_t maxDatagramSize;
+		State state = State::Startup;
+
+		// Max filter over the last rounds, one slot per round
+		std::array<double, bandwidthRounds> roundBandwidth;
+		double bottleneckBandwidth = 0.0;
+
+		// A round ends when a datagram sent after its start is acked
+		uint64_t roundCount = 0;
+		uint64_t nextRoundDelivered = 0;
+		bool roundStart = false;
+
+		std::chrono::nanoseconds minRtt = std::chrono::nanoseconds::max();
+		std::chrono::steady_clock::time_point minRttStamp;
+		std::chrono::steady_clock::time_point probeRttDone;
+		bool probeRttRoundDone = false;
+
+		// Startup exit, the bandwidth did not grow by a quarter for three rounds
+		double fullBandwidth = 0.0;
+		uint32_t fullBandwidthRounds = 0;
+		bool filledPipe = false;
+
+		double pacingGain;
+		double congestionWindowGain;
+		size_t cycleIndex = 0;
+		std::chrono::steady_clock::time_point cycleStamp;
+
+		size_t congestionWindow;
+		size_t bytesInFlight = 0;
+		bool timedOut = false;
+
+		void UpdateRound(const AckSample &sample);
+		void UpdateBandwidth(const AckSample &sample);
+		void UpdateMinRtt(const AckSample &sample);
+		void UpdateState(const AckSample &sample);
+		void UpdateCongestionWindow(const AckSample &sample);
+
+		size_t GetTargetWindow(double gain) const;
+		size_t GetMinimumWindow() const;
+	public:
+		explicit BbrController(size_t maxDatagramSize);
+
+		virtual CongestionControlType GetType() const final;
+
+		virtual void OnPacketSent(std::chrono::steady_clock::time_point sendTime, size_t bytes, size_t bytesInFlight) final;
+		virtual void OnAck(const AckSample &sample) final;
+		virtual void OnLoss(std::chrono::steady_clock::time_point now, size_t lostBytes, std::chrono::steady_clock::time_point lostSendTime) final;
+		virtual void OnRetransmissionTimeout(std::chrono::steady_clock::time_point now) final;
+
+		virtual size_t GetCongestionWindow() const final;
+		virtual double GetPacingRate() const final;
+
+		State GetState() const;
+
+		//! Gets the estimated bottleneck bandwidth
+		/*!
+		\return Bytes per second, 0 before the first sample
+		*/
+		double GetBottleneckBandwidth() const;
+
+		//! Gets the smallest round trip seen in the last 10 seconds
+		std::chrono::nanoseconds GetMinRtt() const;
+	};
+};
@@ -0,0 +1,75 @@
+// Copyright 2015 the kNet authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#pragma once
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+
+namespace knet
+{
+	enum class CongestionControlType : uint8_t
+	{
+		NewReno, /* Loss based, halves the window on loss */
+		Bbr, /* Model based, paces at the measured bottleneck bandwidth and keeps about one BDP in flight */
+		None, /* No window, sends whatever is queued */
+	};
+
+	// What the reliability layer learned from one ack
+	struct AckSample
+	{
+		std::chrono::steady_clock::time_point now;
+		size_t ackedBytes = 0;
+		size_t bytesInFlight = 0; // After removing the acked datagrams
+
+		// Send time of the newest acknowledged datagram, tells acks of datagrams sent before a loss apart
+		std::chrono::steady_clock::time_point newestSendTime;
+
+		// Zero if the ack gave no round trip sample
+		std::chrono::nanoseconds rtt{0};
+		std::chrono::nanoseconds smoothedRtt{0};
+
+		// Bytes per second delivered while the newest acknowledged datagram was in flight, 0 if unknown
+		double deliveryRate = 0.0;
+		bool appLimited = false; // The sender had nothing to send, the rate may be below the path's
+
+		// Bytes delivered in total, and when the newest acknowledged datagram was sent
+		uint64_t delivered = 0;
+		uint64_t priorDelivered = 0;
+	};
+
+	/*
+	* Decides how many bytes a connection may have in flight
+	* Called by the reliability layer on the thread running Process only
+	*/
+	class ICongestionController
+	{
+	public:
+		virtual ~ICongestionController() = default;
+
+		virtual CongestionControlType GetType() const = 0;
+
+		virtual void OnPacketSent(std::chrono::steady_clock::time_point sendTime, size_t bytes, size_t bytesInFlight) = 0;
+		virtual void OnAck(const AckSample &sample) = 0;
+
+		//! Called when the remote reported datagrams missing
+		/*!
+		\param[in] lostSendTime When the newest lost datagram was sent, losses of one window only react once
+		*/
+		virtual void OnLoss(std::chrono::steady_clock::time_point now, size_t lostBytes, std::chrono::steady_clock::time_point lostSendTime) = 0;
+
+		//! Called once when unacknowledged datagrams timed out
+		virtual void OnRetransmissionTimeout(std::chrono::steady_clock::time_point now) = 0;
+
+		//! Gets the bytes which may be in flight
+		virtual size_t GetCongestionWindow() const = 0;
+
+		//! Gets the rate the window should be spread out at
+		/*!
+		\return Bytes per second, 0 if the controller does not pace
+		*/
+		virtual double GetPacingRate() const = 0;
+	};
+};
@@ -0,0 +1,45 @@
+// Copyright 2015 the kNet authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#pragma once
+
+#include "icongestion_controller.h"
+
+namespace knet
+{
+	/*
+	* Loss based congestion control after RFC 5681 and RFC 6582
+	* Slow start doubles the window per round trip, congestion avoidance adds one datagram per round trip,
+	* a loss halves the window once per window of data and a timeout shrinks it to one datagram
+	*/
+	class NewRenoController : public ICongestionController
+	{
+	private:
+		size_t maxDatagramSize;
+		size_t congestionWindow;
+		size_t slowStartThreshold;
+
+		// Losses of datagrams sent before the current recovery started were already reacted to
+		std::chrono::steady_clock::time_point recoveryStart;
+
+		std::chrono::nanoseconds smoothedRtt{0};
+
+		// Bytes acked in congestion avoidance which did not add up to a whole datagram yet
+		size_t avoidanceBytes = 0;
+	public:
+		explicit NewRenoController(size_t maxDatagramSize);
+
+		virtual CongestionControlType GetType() const final;
+
+		virtual void OnPacketSent(std::chrono::steady_clock::time_point sendTime, size_t bytes, size_t bytesInFlight) final;
+		virtual void OnAck(const AckSample &sample) final;
+		virtual void OnLoss(std::chrono::steady_clock::time_point now, size_t lostBytes, std::chrono::steady_clock::time_point lostSendTime) final;
+		virtual void OnRetransmissionTimeout(std::chrono::steady_clock::time_point now) final;
+
+		virtual size_t GetCongestionWindow() const final;
+		virtual double GetPacingRate() const final;
+
+		size_t GetSlowStartThreshold() const;
+	};
+};
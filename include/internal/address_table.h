@@ -0,0 +1,332 @@
+// Copyright 2015 the kNet authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#pragma once
+
+#include "../sockets/socket_address.h"
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <utility>
+#include <vector>
+
+namespace knet
+{
+	namespace internal
+	{
+		/*
+		* Open addressing hash table from SocketAddress to shared objects, linear probing at most half full
+		* One writer thread changes the table, any thread may read through a Reader
+		* Inserts fill free slots in place and erases leave tombstones, only growing or clearing out tombstones publishes a rebuilt copy
+		* Replaced copies and erased objects are freed once no reader can still see them (epoch based), the writer never waits for readers
+		*/
+		template<typename T>
+		class AddressTable
+		{
+		private:
+			struct Entry
+			{
+				SocketAddress address; // Written before pointer is set and never changed afterwards
+				std::atomic<T*> pointer{nullptr}; // Free slot if null, readers only look at this and the address
+				std::shared_ptr<T> value; // Writer only, owns what pointer points to
+			};
+
+			struct Table
+			{
+				size_t mask = 0;
+				size_t count = 0;
+				size_t used = 0; // Live entries and tombstones, free slots end the probing
+				std::unique_ptr<Entry[]> entries;
+
+				explicit Table(size_t capacity)
+					: mask(capacity - 1), entries(new Entry[capacity])
+				{
+				}
+
+				size_t Locate(const SocketAddress &address) const
+				{
+					size_t index = address.Hash() & mask;
+
+					for (;;)
+					{
+						const T * pValue = entries[index].pointer.load(std::memory_order_acquire);
+
+						if (!pValue || (pValue != Tombstone() && entries[index].address == address))
+							return index;
+
+						index = (index + 1) & mask;
+					}
+				}
+
+				// Writer only, the free slot past the probe sequence of an address which is not in the table
+				size_t LocateFree(const SocketAddress &address) const
+				{
+					size_t index = address.Hash() & mask;
+
+					while (entries[index].pointer.load(std::memory_order_relaxed))
+						index = (index + 1) & mask;
+
+					return index;
+				}
+			};
+
+			static constexpr size_t minCapacity = 16;
+			static constexpr size_t cacheLineSize = 64;
+
+			std::atomic<Table*> current;
+
+			// Readers count themselves in the counter of the epoch they entered
+			alignas(cacheLineSize) std::atomic<uint64_t> epoch{0};
+			alignas(cacheLineSize) mutable std::atomic<size_t> readers[2];
+
+			// Replaced tables and erased objects with the epoch they were retired in, writer only
+			std::vector<std::pair<uint64_t, std::unique_ptr<Table>>> retired;
+			std::vector<std::pair<uint64_t, std::shared_ptr<T>>> retiredValues;
+
+			// Marks erased slots, a free slot would cut the probe sequences running through it short
+			static T * Tombstone()
+			{
+				static char tombstone;
+				return reinterpret_cast<T*>(&tombstone);
+			}
+
+			static void Fill(Entry &entry, const SocketAddress &address, std::shared_ptr<T> value)
+			{
+				entry.address = address;
+				entry.value = std::move(value);
+				entry.pointer.store(entry.value.get(), std::memory_order_release);
+			}
+
+			// Rebuilds the table without tombstones, with room for count entries
+			void Rebuild(size_t count)
+			{
+				size_t capacity = minCapacity;
+
+				while (capacity < count * 2)
+					capacity <<= 1;
+
+				auto pTable = new Table(capacity);
+				const Table * pCurrent = current.load(std::memory_order_relaxed);
+
+				for (size_t i = 0; i <= pCurrent->mask; ++i)
+				{
+					const Entry &entry = pCurrent->entries[i];
+
+					if (entry.value)
+						Fill(pTable->entries[pTable->LocateFree(entry.address)], entry.address, entry.value);
+				}
+
+				pTable->count = pTable->used = pCurrent->count;
+
+				Publish(pTable);
+			}
+
+			void Publish(Table * pTable)
+			{
+				Table * pOld = current.exchange(pTable, std::memory_order_seq_cst);
+				retired.emplace_back(epoch.load(std::memory_order_seq_cst), std::unique_ptr<Table>(pOld));
+
+				Reclaim();
+			}
+
+			void Retire(std::shared_ptr<T> value)
+			{
+				retiredValues.emplace_back(epoch.load(std::memory_order_seq_cst), std::move(value));
+			}
+		public:
+			/*
+			* Read side critical section
+			* Objects found through it stay alive until it ends, even if the writer removes them meanwhile
+			*/
+			class Reader
+			{
+			private:
+				const AddressTable &table;
+				uint64_t readerEpoch = 0;
+				const Table * pTable = nullptr;
+			public:
+				explicit Reader(const AddressTable &addressTable)
+					: table(addressTable)
+				{
+					for (;;)
+					{
+						readerEpoch = table.epoch.load(std::memory_order_seq_cst);
+						table.readers[readerEpoch & 1].fetch_add(1, std::memory_order_seq_cst);
+
+						// The writer may have moved on before we were counted
+						if (table.epoch.load(std::memory_order_seq_cst) == readerEpoch)
+							break;
+
+						table.readers[readerEpoch & 1].fetch_sub(1, std::memory_order_seq_cst);
+					}
+
+					pTable = table.current.load(std::memory_order_acquire);
+				}
+
+				~Reader()
+				{
+					table.readers[readerEpoch & 1].fetch_sub(1, std::memory_order_release);
+				}
+
+				Reader(const Reader&) = delete;
+				Reader& operator=(const Reader&) = delete;
+
+				//! Looks up an address
+				/*!
+				\return nullptr if the address is not in the table
+				*/
+				T * Find(const SocketAddress &address) const
+				{
+					T * pValue = pTable->entries[pTable->Locate(address)].pointer.load(std::memory_order_acquire);
+
+					// Erased since it was located
+					return pValue == Tombstone() ? nullptr : pValue;
+				}
+			};
+
+			AddressTable()
+				: current(new Table(minCapacity))
+			{
+				readers[0].store(0, std::memory_order_relaxed);
+				readers[1].store(0, std::memory_order_relaxed);
+			}
+
+			~AddressTable()
+			{
+				delete current.load(std::memory_order_relaxed);
+			}
+
+			AddressTable(const AddressTable&) = delete;
+			AddressTable& operator=(const AddressTable&) = delete;
+
+			//! Writer only, looks up an address without entering a read section
+			/*!
+			\return An empty pointer if the address is not in the table, the reference is valid until the next change
+			*/
+			const std::shared_ptr<T> & Find(const SocketAddress &address) const
+			{
+				const Table * pTable = current.load(std::memory_order_relaxed);
+				return pTable->entries[pTable->Locate(address)].value;
+			}
+
+			//! Writer only, adds or replaces the object for an address
+			void Insert(const SocketAddress &address, std::shared_ptr<T> value)
+			{
+				Table * pTable = current.load(std::memory_order_relaxed);
+				Entry &entry = pTable->entries[pTable->Locate(address)];
+
+				if (entry.value)
+				{
+					// Readers see either the old or the new object, the old one lives until they are gone
+					T * pValue = value.get();
+					std::swap(entry.value, value);
+					entry.pointer.store(pValue, std::memory_order_release);
+
+					Retire(std::move(value));
+					Reclaim();
+					return;
+				}
+
+				// Keep the table at most half full, tombstones included
+				if ((pTable->used + 1) * 2 > pTable->mask + 1)
+				{
+					Rebuild(pTable->count + 1);
+					pTable = current.load(std::memory_order_relaxed);
+				}
+
+				Fill(pTable->entries[pTable->LocateFree(address)], address, std::move(value));
+
+				++pTable->count;
+				++pTable->used;
+			}
+
+			//! Writer only, removes an address
+			/*!
+			\return false if the address was not in the table
+			*/
+			bool Erase(const SocketAddress &address)
+			{
+				Table * pTable = current.load(std::memory_order_relaxed);
+				Entry &entry = pTable->entries[pTable->Locate(address)];
+
+				if (!entry.value)
+					return false;
+
+				// The slot stays taken, its address is never rewritten while readers may compare it
+				entry.pointer.store(Tombstone(), std::memory_order_release);
+				Retire(std::move(entry.value));
+
+				--pTable->count;
+
+				// Mostly tombstones, start over with a smaller table
+				if (pTable->used > pTable->count * 4 && pTable->used * 4 > pTable->mask + 1)
+					Rebuild(pTable->count);
+				else
+					Reclaim();
+
+				return true;
+			}
+
+			//! Writer only, removes every address
+			void Clear()
+			{
+				Table * pTable = current.load(std::memory_order_relaxed);
+
+				for (size_t i = 0; i <= pTable->mask; ++i)
+				{
+					if (pTable->entries[i].value)
+						Retire(std::move(pTable->entries[i].value));
+				}
+
+				Publish(new Table(minCapacity));
+			}
+
+			//! Writer only
+			size_t Size() const
+			{
+				return current.load(std::memory_order_relaxed)->count;
+			}
+
+			//! Writer only, frees the replaced tables no reader can see anymore
+			/*!
+			Never waits, tables still in use are kept for a later call
+			*/
+			void Reclaim()
+			{
+				const uint64_t currentEpoch = epoch.load(std::memory_order_seq_cst);
+
+				// Readers of the previous epoch are still inside
+				if (readers[(currentEpoch + 1) & 1].load(std::memory_order_seq_cst) != 0)
+					return;
+
+				// Everything retired before this epoch started is unreachable now
+				auto release = [currentEpoch](auto &retiredList)
+				{
+					size_t kept = 0;
+
+					for (auto &item : retiredList)
+					{
+						if (item.first < currentEpoch)
+							continue;
+
+						if (&retiredList[kept] != &item)
+							retiredList[kept] = std::move(item);
+
+						++kept;
+					}
+
+					retiredList.resize(kept);
+				};
+
+				release(retired);
+				release(retiredValues);
+
+				if (!retired.empty() || !retiredValues.empty())
+					epoch.store(currentEpoch + 1, std::memory_order_seq_cst);
+			}
+		};
+	};
+};
@@ -6,13 +6,37 @@
 
 #include "bitstream.h"
 
+#ifdef _WIN32
+#include <WinSock2.h>
+#else
+#include <arpa/inet.h>
+#endif
+
 #include <cstdint>
+#include <cstring>
 
 namespace knet
 {
 
 	using SequenceNumberType = int32_t;
 
+	/*
+	* Connection ids are assigned by the accepting peer and name a slot in its connection array
+	* The generation tells apart the connections which used the same slot, an id is never 0
+	*/
+	static constexpr uint32_t connectionSlotBits = 20;
+	static constexpr uint32_t connectionSlotMask = (1u << connectionSlotBits) - 1;
+
+	inline uint32_t MakeConnectionId(uint32_t slot, uint32_t generation)
+	{
+		return ((generation & 0xFFF) << connectionSlotBits) | (slot & connectionSlotMask);
+	}
+
+	inline uint32_t GetConnectionSlot(uint32_t connectionId)
+	{
+		return connectionId & connectionSlotMask;
+	}
+
 	class DatagramHeader
 	{
 	public:
@@ -20,8 +44,56 @@ namespace knet
 		bool isNACK;
 		bool isReliable = true;
 		bool isSplit = false;
+		bool hasConnectionId = false;
+		bool hasAck = false; // An ack block follows the header, ahead of the messages
+		bool isStream = false; // Carries one chunk of a stream
+		uint32_t connectionId = 0;
 		SequenceNumberType sequenceNumber = 0;
 
+		// Flags in the first byte, the bits are written from the most significant one
+		static constexpr uint8_t ackFlag = 0x80;
+		static constexpr uint8_t nackFlag = 0x40;
+		static constexpr uint8_t reliableFlag = 0x20;
+		static constexpr uint8_t connectionIdFlag = 0x08;
+
+		//! Reads the connection id of a serialized header without deserializing it
+		/*!
+		\return false if the datagram carries no connection id
+		*/
+		static bool PeekConnectionId(const char *pData, size_t length, uint32_t &connectionId)
+		{
+			if (length < 1 + sizeof(connectionId) || !(static_cast<uint8_t>(pData[0]) & connectionIdFlag))
+				return false;
+
+			memcpy(&connectionId, pData + 1, sizeof(connectionId));
+			connectionId = ntohl(connectionId);
+
+			return true;
+		}
+
+		//! Reads the sequence number of a serialized header without deserializing it
+		/*!
+		\return false if the datagram is no reliable data datagram, only those carry one
+		*/
+		static bool PeekSequenceNumber(const char *pData, size_t length, SequenceNumberType &sequenceNumber)
+		{
+			if (length < 1)
+				return false;
+
+			const uint8_t flags = static_cast<uint8_t>(pData[0]);
+
+			if ((flags & (ackFlag | nackFlag)) || !(flags & reliableFlag))
+				return false;
+
+			const size_t offset = 1 + ((flags & connectionIdFlag) ? sizeof(uint32_t) : 0);
+
+			if (length < offset + sizeof(sequenceNumber))
+				return false;
+
+			memcpy(&sequenceNumber, pData + offset, sizeof(sequenceNumber));
+
+			return true;
+		}
 
 		virtual void Serialize(BitStream & bitStream)
 		{
@@ -29,11 +101,18 @@ namespace knet
 			bitStream.Write(isNACK);
 			bitStream.Write(isReliable);
 			bitStream.Write(isSplit);
+			bitStream.Write(hasConnectionId);
+			bitStream.Write(hasAck);
+			bitStream.Write(isStream);
 
 			// Now fill to 1 byte to improve performance
 			// This can later be used for more information in the header
 			bitStream.AlignWriteToByteBoundary();
 
+			// Network byte order, the reuseport steering program reads it
+			if (hasConnectionId)
+				bitStream.Write(htonl(connectionId));
+
 			/* To save bandwith for ack/nack */
 			if (!isACK && !isNACK && isReliable)
 				bitStream.Write(sequenceNumber);
@@ -45,9 +124,18 @@ namespace knet
 			bitStream.Read(isNACK);
 			bitStream.Read(isReliable);
 			bitStream.Read(isSplit);
+			bitStream.Read(hasConnectionId);
+			bitStream.Read(hasAck);
+			bitStream.Read(isStream);
 
 			bitStream.AlignReadToByteBoundary();
 
+			if (hasConnectionId)
+			{
+				bitStream.Read(connectionId);
+				connectionId = ntohl(connectionId);
+			}
+
 			if (!isACK && !isNACK && isReliable)
 				bitStream.Read(sequenceNumber);
 		}
@@ -55,7 +143,7 @@ namespace knet
 		size_t GetSizeToSend()
 		{
 			// Meh hardcoded size
-			return 1 + ((!isACK && !isNACK && isReliable) ? sizeof(sequenceNumber) : 0);
+			return 1 + (hasConnectionId ? sizeof(connectionId) : 0) + ((!isACK && !isNACK && isReliable) ? sizeof(sequenceNumber) : 0);
 		}
 	};
 
@@ -6,6 +6,7 @@
 
 #include "datagram_header.h"
 #include "reliable_packet.h"
+#include "selective_ack.h"
 
 #include "helper_types.h"
 
@@ -19,6 +20,10 @@ namespace knet
 
 		std::vector<ReliablePacket> packets;
 
+		// Read from received datagrams which carried an ack block, the reliability layer writes it when sending
+		std::vector<internal::AckWindow::Range> ackRanges;
+		uint32_t ackDelay = 0;
+
 		void Serialize(BitStream & bitStream)
 		{
 			header.Serialize(bitStream);
@@ -31,24 +36,50 @@ namespace knet
 
 		void Deserialze(BitStream & bitStream)
 		{
-			auto bsSize = BytesToBits(bitStream.Size());
+			if (DeserializeHeader(bitStream))
+				DeserializeMessages(bitStream);
+		}
 
+		//! Reads the header and the ack block which came along, the messages stay unread
+		/*!
+		\return false if the ack block was malformed, the messages must not be read then
+		*/
+		bool DeserializeHeader(BitStream & bitStream)
+		{
 			header.Deserialize(bitStream);
 
+			if (header.hasAck && !header.isACK && !header.isNACK)
+			{
+				if (!internal::AckWindow::Read(bitStream, ackRanges) || !bitStream.Read(ackDelay))
+				{
+					ackRanges.clear();
+					return false;
+				}
+			}
+
+			return true;
+		}
+
+		//! Reads the messages following the header
+		void DeserializeMessages(BitStream & bitStream)
+		{
+			if (header.isACK || header.isNACK)
+				return;
+
+			auto bsSize = BytesToBits(bitStream.Size());
+
 			packets.reserve(5);
 
 			ReliablePacket packet;
 
-			if (!header.isACK && !header.isNACK)
+			while (bitStream.ReadOffset() < bsSize)
 			{
-				while (bitStream.ReadOffset() < bsSize)
-				{
-					packet.isSplit = header.isSplit;
+				packet.isSplit = header.isSplit;
+				packet.isStream = header.isStream;
 
-					packet.Deserialize(bitStream);
+				packet.Deserialize(bitStream);
 
-					packets.push_back(std::move(packet));
-				}
+				packets.push_back(std::move(packet));
 			}
 		}
 
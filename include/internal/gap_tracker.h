@@ -0,0 +1,161 @@
+// Copyright 2015 the kNet authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <utility>
+#include <vector>
+
+namespace knet
+{
+	namespace internal
+	{
+		/*
+		* Finds the reliable sequence numbers which did not arrive
+		* A gap is reported once datagrams at least reorderThreshold sequence numbers after it arrived,
+		* so datagrams which were only reordered on the way do not get resent
+		*/
+		class GapTracker
+		{
+		public:
+			using Range = std::pair<int32_t, int32_t>;
+		private:
+			// Missing ranges not reported yet, oldest first and without overlaps, a range may wrap past INT32_MAX
+			std::vector<Range> missing;
+			int32_t highest = -1;
+			uint32_t reorderThreshold = 3;
+
+			// Gaps which were never filled or reported are forgotten beyond this, the sender's timeout covers them
+			static constexpr size_t maxMissingRanges = 1024;
+
+			// Sequence numbers are 31 bit and wrap to 0
+			static constexpr uint32_t sequenceMask = static_cast<uint32_t>(std::numeric_limits<int32_t>::max());
+
+			static int32_t Next(int32_t sequenceNumber)
+			{
+				return static_cast<int32_t>((static_cast<uint32_t>(sequenceNumber) + 1) & sequenceMask);
+			}
+
+			static int32_t Previous(int32_t sequenceNumber)
+			{
+				return static_cast<int32_t>((static_cast<uint32_t>(sequenceNumber) - 1) & sequenceMask);
+			}
+
+			// Negative if to lies before from
+			static int64_t Offset(int32_t from, int32_t to)
+			{
+				const uint32_t distance = (static_cast<uint32_t>(to) - static_cast<uint32_t>(from)) & sequenceMask;
+				return distance > sequenceMask / 2 ? static_cast<int64_t>(distance) - (static_cast<int64_t>(sequenceMask) + 1) : distance;
+			}
+		public:
+			//! Sets how many sequence numbers later datagrams must be ahead of a gap to report it
+			/*!
+			\param[in] threshold 0 never reports gaps
+			*/
+			void SetReorderThreshold(uint32_t threshold)
+			{
+				reorderThreshold = threshold;
+			}
+
+			uint32_t GetReorderThreshold() const
+			{
+				return reorderThreshold;
+			}
+
+			void OnReceive(int32_t sequenceNumber)
+			{
+				if (sequenceNumber < 0)
+					return;
+
+				// Nothing arrived yet, the sender starts at 0
+				const int32_t expected = highest < 0 ? 0 : Next(highest);
+
+				if (highest < 0 || Offset(expected, sequenceNumber) >= 0)
+				{
+					// Ranges half the sequence space behind would look ahead of the new one
+					while (!missing.empty() && Offset(missing.front().first, sequenceNumber) <= 0)
+						missing.erase(missing.begin());
+
+					// A first datagram from before 0 leaves nothing to miss
+					if (Offset(expected, sequenceNumber) > 0)
+					{
+						const size_t limit = maxMissingRanges;
+
+						if (missing.size() >= limit)
+							missing.erase(missing.begin());
+
+						missing.emplace_back(expected, Previous(sequenceNumber));
+					}
+
+					highest = sequenceNumber;
+					return;
+				}
+
+				// Late or duplicate, it may fill a gap
+				auto range = std::lower_bound(missing.begin(), missing.end(), sequenceNumber, [](const Range &gap, int32_t value) {
+					return Offset(gap.second, value) > 0;
+				});
+
+				if (range == missing.end() || Offset(range->first, sequenceNumber) < 0)
+					return;
+
+				if (range->first == range->second)
+				{
+					missing.erase(range);
+				}
+				else if (range->first == sequenceNumber)
+				{
+					range->first = Next(range->first);
+				}
+				else if (range->second == sequenceNumber)
+				{
+					range->second = Previous(range->second);
+				}
+				else
+				{
+					Range upper{Next(sequenceNumber), range->second};
+					range->second = Previous(sequenceNumber);
+					missing.insert(range + 1, upper);
+				}
+			}
+
+			//! Moves the gaps which are far enough behind to the given ranges
+			/*!
+			\return The number of ranges added
+			*/
+			size_t TakeLost(std::vector<Range> &lost)
+			{
+				if (reorderThreshold == 0)
+					return 0;
+
+				size_t count = 0;
+
+				// Oldest first, so the reportable gaps are the first ones
+				while (count < missing.size() && Offset(missing[count].second, highest) >= reorderThreshold)
+				{
+					lost.push_back(missing[count]);
+					++count;
+				}
+
+				missing.erase(missing.begin(), missing.begin() + count);
+
+				return count;
+			}
+
+			size_t GetMissingRanges() const
+			{
+				return missing.size();
+			}
+
+			int32_t GetHighest() const
+			{
+				return highest;
+			}
+		};
+	};
+};
@@ -0,0 +1,152 @@
+// Copyright 2015 the kNet authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#pragma once
+
+#ifdef _WIN32
+#include <Windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+namespace knet
+{
+	namespace internal
+	{
+		/*
+		* Maps a file read only, the pages are only read when a stream sends them
+		*/
+		class MappedFile
+		{
+		private:
+			const char *data = nullptr;
+			uint64_t size = 0;
+
+#ifdef _WIN32
+			HANDLE file = INVALID_HANDLE_VALUE;
+			HANDLE mapping = nullptr;
+#endif
+		public:
+			MappedFile() = default;
+
+			MappedFile(const MappedFile &) = delete;
+			MappedFile & operator=(const MappedFile &) = delete;
+
+			~MappedFile()
+			{
+				Close();
+			}
+
+			//! Maps a file
+			/*!
+			\return false if it can not be read or is empty
+			*/
+			bool Open(const std::string &path)
+			{
+				Close();
+
+#ifdef _WIN32
+				file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+
+				if (file == INVALID_HANDLE_VALUE)
+					return false;
+
+				LARGE_INTEGER fileSize;
+
+				if (!GetFileSizeEx(file, &fileSize) || fileSize.QuadPart == 0)
+				{
+					Close();
+					return false;
+				}
+
+				mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+
+				if (!mapping)
+				{
+					Close();
+					return false;
+				}
+
+				data = static_cast<const char*>(MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0));
+				size = static_cast<uint64_t>(fileSize.QuadPart);
+#else
+				int fd = open(path.c_str(), O_RDONLY);
+
+				if (fd < 0)
+					return false;
+
+				struct stat info;
+
+				if (fstat(fd, &info) != 0 || info.st_size <= 0)
+				{
+					close(fd);
+					return false;
+				}
+
+				void *pMapping = mmap(nullptr, static_cast<size_t>(info.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+
+				// The mapping keeps the file open
+				close(fd);
+
+				if (pMapping == MAP_FAILED)
+					return false;
+
+				// Streams read it front to back
+				madvise(pMapping, static_cast<size_t>(info.st_size), MADV_SEQUENTIAL);
+
+				data = static_cast<const char*>(pMapping);
+				size = static_cast<uint64_t>(info.st_size);
+#endif
+
+				if (!data)
+				{
+					Close();
+					return false;
+				}
+
+				return true;
+			}
+
+			void Close()
+			{
+#ifdef _WIN32
+				if (data)
+					UnmapViewOfFile(data);
+
+				if (mapping)
+					CloseHandle(mapping);
+
+				if (file != INVALID_HANDLE_VALUE)
+					CloseHandle(file);
+
+				mapping = nullptr;
+				file = INVALID_HANDLE_VALUE;
+#else
+				if (data)
+					munmap(const_cast<char*>(data), static_cast<size_t>(size));
+#endif
+
+				data = nullptr;
+				size = 0;
+			}
+
+			const char * Data() const
+			{
+				return data;
+			}
+
+			uint64_t Size() const
+			{
+				return size;
+			}
+		};
+	};
+};
@@ -0,0 +1,118 @@
+// Copyright 2015 the kNet authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <cstddef>
+
+namespace knet
+{
+	namespace internal
+	{
+		/*
+		* Token bucket spreading datagrams out at a rate
+		* A datagram may leave while any token is left, the bucket then goes into debt so datagrams larger than the burst still pass
+		*/
+		class Pacer
+		{
+		public:
+			using Clock = std::chrono::steady_clock;
+		private:
+			double rate = 0.0; // Bytes per second, 0 does not pace
+			double burst = 0.0;
+			double tokens = 0.0;
+			Clock::time_point lastRefill;
+
+			void Refill(Clock::time_point now)
+			{
+				if (now <= lastRefill)
+					return;
+
+				tokens = std::min(burst, tokens + rate * std::chrono::duration<double>(now - lastRefill).count());
+				lastRefill = now;
+			}
+		public:
+			explicit Pacer(size_t burstBytes = 0)
+				: burst(static_cast<double>(burstBytes)),
+				tokens(static_cast<double>(burstBytes))
+			{
+			}
+
+			//! Sets the rate, tokens saved up so far are kept
+			/*!
+			\param[in] bytesPerSecond 0 lets everything through
+			*/
+			void SetRate(double bytesPerSecond, Clock::time_point now = Clock::now())
+			{
+				Refill(now);
+
+				if (rate == 0.0)
+					lastRefill = now;
+
+				rate = std::max(bytesPerSecond, 0.0);
+			}
+
+			double GetRate() const
+			{
+				return rate;
+			}
+
+			//! Sets the bytes which may leave at once after being idle
+			void SetBurst(size_t burstBytes)
+			{
+				burst = static_cast<double>(burstBytes);
+				tokens = std::min(tokens, burst);
+			}
+
+			size_t GetBurst() const
+			{
+				return static_cast<size_t>(burst);
+			}
+
+			bool IsPacing() const
+			{
+				return rate > 0.0;
+			}
+
+			bool CanSend(Clock::time_point now = Clock::now())
+			{
+				if (!IsPacing())
+					return true;
+
+				Refill(now);
+
+				return tokens > 0.0;
+			}
+
+			//! Takes the tokens of a datagram which left
+			void OnSend(size_t bytes, Clock::time_point now = Clock::now())
+			{
+				if (!IsPacing())
+					return;
+
+				Refill(now);
+
+				tokens -= static_cast<double>(bytes);
+			}
+
+			//! Gets when the next datagram may leave
+			/*!
+			\return now if it may leave right away
+			*/
+			Clock::time_point GetNextSendTime(Clock::time_point now = Clock::now())
+			{
+				if (!CanSend(now))
+				{
+					// Just past the point the debt is paid off
+					auto wait = std::chrono::duration<double>((1.0 - tokens) / rate);
+					return now + std::chrono::duration_cast<Clock::duration>(wait);
+				}
+
+				return now;
+			}
+		};
+	};
+};
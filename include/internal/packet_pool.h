@@ -0,0 +1,162 @@
+// Copyright 2015 the kNet authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+
+namespace knet
+{
+	namespace internal
+	{
+		/*
+		* Lock-free bounded pool of heap objects (Vyukov's bounded MPMC queue)
+		* Any thread may take and return, objects returned while the pool is full are deleted
+		* maxSlots must be a power of two, the usable capacity can be lowered at runtime
+		*/
+		template<typename T, size_t maxSlots = 16384>
+		class PacketPool
+		{
+			static_assert((maxSlots & (maxSlots - 1)) == 0, "maxSlots must be a power of two");
+		private:
+			struct Slot
+			{
+				std::atomic<size_t> sequence;
+				T * pObject;
+			};
+
+			static constexpr size_t cacheLineSize = 64;
+
+			std::unique_ptr<Slot[]> slots;
+
+			alignas(cacheLineSize) std::atomic<size_t> pushPosition{0};
+			alignas(cacheLineSize) std::atomic<size_t> popPosition{0};
+			alignas(cacheLineSize) std::atomic<size_t> pooled{0};
+			std::atomic<size_t> capacity{maxSlots};
+
+			bool Push(T * pObject)
+			{
+				size_t position = pushPosition.load(std::memory_order_relaxed);
+				Slot * pSlot = nullptr;
+
+				for (;;)
+				{
+					pSlot = &slots[position & (maxSlots - 1)];
+
+					size_t sequence = pSlot->sequence.load(std::memory_order_acquire);
+					intptr_t difference = static_cast<intptr_t>(sequence) - static_cast<intptr_t>(position);
+
+					if (difference == 0)
+					{
+						if (pushPosition.compare_exchange_weak(position, position + 1, std::memory_order_relaxed))
+							break;
+					}
+					else if (difference < 0)
+						return false;
+					else
+						position = pushPosition.load(std::memory_order_relaxed);
+				}
+
+				pSlot->pObject = pObject;
+				pSlot->sequence.store(position + 1, std::memory_order_release);
+
+				return true;
+			}
+
+			T * Pop()
+			{
+				size_t position = popPosition.load(std::memory_order_relaxed);
+				Slot * pSlot = nullptr;
+
+				for (;;)
+				{
+					pSlot = &slots[position & (maxSlots - 1)];
+
+					size_t sequence = pSlot->sequence.load(std::memory_order_acquire);
+					intptr_t difference = static_cast<intptr_t>(sequence) - static_cast<intptr_t>(position + 1);
+
+					if (difference == 0)
+					{
+						if (popPosition.compare_exchange_weak(position, position + 1, std::memory_order_relaxed))
+							break;
+					}
+					else if (difference < 0)
+						return nullptr;
+					else
+						position = popPosition.load(std::memory_order_relaxed);
+				}
+
+				T * pObject = pSlot->pObject;
+				pSlot->sequence.store(position + maxSlots, std::memory_order_release);
+
+				return pObject;
+			}
+		public:
+			explicit PacketPool(size_t initialCapacity = 4096)
+				: slots(new Slot[maxSlots])
+			{
+				SetCapacity(initialCapacity);
+
+				for (size_t i = 0; i < maxSlots; ++i)
+				{
+					slots[i].sequence.store(i, std::memory_order_relaxed);
+					slots[i].pObject = nullptr;
+				}
+			}
+
+			~PacketPool()
+			{
+				while (T * pObject = Pop())
+					delete pObject;
+			}
+
+			PacketPool(const PacketPool&) = delete;
+			PacketPool& operator=(const PacketPool&) = delete;
+
+			//! Takes a pooled object
+			/*!
+			\return a new object if the pool is empty
+			*/
+			T * Take()
+			{
+				if (T * pObject = Pop())
+				{
+					pooled.fetch_sub(1, std::memory_order_relaxed);
+					return pObject;
+				}
+
+				return new T();
+			}
+
+			//! Gives an object back to the pool, deletes it if the pool is at its capacity
+			void Return(T * pObject)
+			{
+				if (pooled.fetch_add(1, std::memory_order_relaxed) < capacity.load(std::memory_order_relaxed) && Push(pObject))
+					return;
+
+				pooled.fetch_sub(1, std::memory_order_relaxed);
+				delete pObject;
+			}
+
+			//! Limits the number of pooled objects, excess objects are deleted on return
+			void SetCapacity(size_t newCapacity)
+			{
+				capacity.store(newCapacity < maxSlots ? newCapacity : maxSlots, std::memory_order_relaxed);
+			}
+
+			size_t GetCapacity() const
+			{
+				return capacity.load(std::memory_order_relaxed);
+			}
+
+			size_t GetPooled() const
+			{
+				return pooled.load(std::memory_order_relaxed);
+			}
+		};
+	};
+};
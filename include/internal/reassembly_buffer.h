@@ -0,0 +1,236 @@
+// Copyright 2015 the kNet authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#pragma once
+
+#include "reliable_packet.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <limits>
+#include <memory>
+#include <unordered_map>
+#include <vector>
+
+namespace knet
+{
+	namespace internal
+	{
+		/*
+		* Puts split messages back together
+		* The first fragment to arrive allocates the whole message, every fragment is copied straight to its offset
+		* and marked in a bitmap, the finished buffer is handed out as the message without sorting or copying it again
+		* Messages which are not finished within the timeout or do not fit the memory limit are dropped
+		*/
+		class ReassemblyBuffer
+		{
+		public:
+			using Clock = std::chrono::steady_clock;
+
+			// ReliablePacket sizes are 16 bit
+			static constexpr size_t maxMessageSize = std::numeric_limits<uint16_t>::max();
+		private:
+			struct Message
+			{
+				std::unique_ptr<char[]> data;
+				uint32_t size = 0;
+				uint16_t fragmentSize = 0;
+				size_t fragments = 0;
+				size_t received = 0;
+				std::vector<uint64_t> arrived;
+
+				// Only the first fragment carries how the message is delivered
+				PacketReliability reliability = PacketReliability::RELIABLE;
+				OrderedInfo orderedInfo;
+				SequenceInfo sequenceInfo;
+
+				Clock::time_point started;
+			};
+
+			std::unordered_map<uint16_t, Message> messages;
+
+			size_t maxBytes = 4 * 1024 * 1024;
+			std::chrono::milliseconds timeout = std::chrono::milliseconds(10000);
+
+			size_t bytes = 0;
+			size_t dropped = 0;
+
+			void Drop(std::unordered_map<uint16_t, Message>::iterator message)
+			{
+				bytes -= message->second.size;
+				++dropped;
+
+				messages.erase(message);
+			}
+
+			static bool IsValid(const SplitInfo &splitInfo, size_t size)
+			{
+				if (splitInfo.messageSize == 0 || splitInfo.messageSize > maxMessageSize || splitInfo.fragmentSize == 0)
+					return false;
+
+				const size_t fragments = (splitInfo.messageSize + splitInfo.fragmentSize - 1) / splitInfo.fragmentSize;
+
+				if (splitInfo.index >= fragments)
+					return false;
+
+				const size_t offset = static_cast<size_t>(splitInfo.index) * splitInfo.fragmentSize;
+
+				return size == std::min<size_t>(splitInfo.fragmentSize, splitInfo.messageSize - offset);
+			}
+		public:
+			//! Sets the bytes partial messages of a connection may take
+			void SetMemoryLimit(size_t limit)
+			{
+				maxBytes = limit;
+			}
+
+			size_t GetMemoryLimit() const
+			{
+				return maxBytes;
+			}
+
+			//! Sets how long a message may take from its first fragment on
+			void SetTimeout(std::chrono::milliseconds reassemblyTimeout)
+			{
+				timeout = reassemblyTimeout;
+			}
+
+			std::chrono::milliseconds GetTimeout() const
+			{
+				return timeout;
+			}
+
+			//! Adds a received fragment
+			/*!
+			\param[out] complete The whole message once the last missing fragment arrived
+			\return true if the message is complete
+			*/
+			bool Add(ReliablePacket &fragment, ReliablePacket &complete, Clock::time_point now = Clock::now())
+			{
+				const auto &splitInfo = fragment.splitInfo;
+
+				if (!IsValid(splitInfo, fragment.Size()))
+					return false;
+
+				auto message = messages.find(splitInfo.packetIndex);
+
+				// The index was taken again by a new message, the old one can not be finished anymore
+				if (message != messages.end() && (message->second.size != splitInfo.messageSize || message->second.fragmentSize != splitInfo.fragmentSize))
+				{
+					Drop(message);
+					message = messages.end();
+				}
+
+				if (message == messages.end())
+				{
+					if (bytes + splitInfo.messageSize > maxBytes)
+						Expire(now);
+
+					if (bytes + splitInfo.messageSize > maxBytes)
+					{
+						++dropped;
+						return false;
+					}
+
+					Message newMessage;
+					newMessage.data = std::unique_ptr<char[]>{new char[splitInfo.messageSize]};
+					newMessage.size = splitInfo.messageSize;
+					newMessage.fragmentSize = splitInfo.fragmentSize;
+					newMessage.fragments = (splitInfo.messageSize + splitInfo.fragmentSize - 1) / splitInfo.fragmentSize;
+					newMessage.arrived.assign((newMessage.fragments + 63) / 64, 0);
+					newMessage.started = now;
+
+					bytes += newMessage.size;
+
+					message = messages.emplace(splitInfo.packetIndex, std::move(newMessage)).first;
+				}
+
+				auto &entry = message->second;
+				auto &word = entry.arrived[splitInfo.index / 64];
+				const uint64_t bit = uint64_t(1) << (splitInfo.index % 64);
+
+				// Resent fragments which arrived already
+				if (word & bit)
+					return false;
+
+				word |= bit;
+				++entry.received;
+
+				memcpy(entry.data.get() + static_cast<size_t>(splitInfo.index) * entry.fragmentSize, fragment.Data(), fragment.Size());
+
+				if (splitInfo.index == 0)
+				{
+					entry.reliability = fragment.reliability;
+					entry.orderedInfo = fragment.orderedInfo;
+					entry.sequenceInfo = fragment.sequenceInfo;
+				}
+
+				if (entry.received < entry.fragments)
+					return false;
+
+				complete = ReliablePacket{std::move(entry.data), entry.size};
+				complete.reliability = entry.reliability;
+				complete.orderedInfo = entry.orderedInfo;
+				complete.sequenceInfo = entry.sequenceInfo;
+
+				bytes -= entry.size;
+				messages.erase(message);
+
+				return true;
+			}
+
+			//! Drops the messages which took longer than the timeout
+			/*!
+			\return The number of messages dropped
+			*/
+			size_t Expire(Clock::time_point now = Clock::now())
+			{
+				size_t count = 0;
+
+				for (auto message = messages.begin(); message != messages.end();)
+				{
+					if (now - message->second.started < timeout)
+					{
+						++message;
+						continue;
+					}
+
+					bytes -= message->second.size;
+					++dropped;
+					++count;
+
+					message = messages.erase(message);
+				}
+
+				return count;
+			}
+
+			//! Gets the number of messages waiting for fragments
+			size_t Size() const
+			{
+				return messages.size();
+			}
+
+			bool Empty() const
+			{
+				return messages.empty();
+			}
+
+			//! Gets the bytes the waiting messages take
+			size_t GetBytes() const
+			{
+				return bytes;
+			}
+
+			//! Gets the number of messages which were dropped unfinished
+			size_t GetDropped() const
+			{
+				return dropped;
+			}
+		};
+	};
+};
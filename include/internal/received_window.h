@@ -0,0 +1,167 @@
+// Copyright 2015 the kNet authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <vector>
+
+namespace knet
+{
+	namespace internal
+	{
+		/*
+		* Remembers the reliable sequence numbers which arrived, a bitmap over the capacity sequence numbers up to the newest one
+		* Unlike the AckWindow, which forgets what it acknowledged, it keeps them so resent datagrams are recognized after their ack went out
+		* Bit sequenceNumber & (capacity - 1) stands for the sequence number, moving the newest one ahead clears the bits it passes
+		*/
+		class ReceivedWindow
+		{
+		public:
+			enum class AddResult
+			{
+				New,
+				Duplicate,
+				TooOld,		// Before the window, it can not be told whether it arrived already
+			};
+		private:
+			// Sequence numbers are 31 bit and wrap to 0
+			static constexpr uint32_t sequenceMask = static_cast<uint32_t>(std::numeric_limits<int32_t>::max());
+
+			std::vector<uint64_t> words;
+			size_t mask = 0;
+
+			int32_t highest = 0;
+			bool empty = true;
+
+			// Negative if to lies before from
+			static int64_t Offset(int32_t from, int32_t to)
+			{
+				const uint32_t distance = (static_cast<uint32_t>(to) - static_cast<uint32_t>(from)) & sequenceMask;
+				return distance > sequenceMask / 2 ? static_cast<int64_t>(distance) - (static_cast<int64_t>(sequenceMask) + 1) : distance;
+			}
+
+			bool Test(int32_t sequenceNumber) const
+			{
+				const size_t bit = static_cast<uint32_t>(sequenceNumber) & mask;
+				return (words[bit >> 6] >> (bit & 63)) & 1;
+			}
+
+			void Set(int32_t sequenceNumber)
+			{
+				const size_t bit = static_cast<uint32_t>(sequenceNumber) & mask;
+				words[bit >> 6] |= uint64_t(1) << (bit & 63);
+			}
+
+			void Clear(int32_t sequenceNumber)
+			{
+				const size_t bit = static_cast<uint32_t>(sequenceNumber) & mask;
+				words[bit >> 6] &= ~(uint64_t(1) << (bit & 63));
+			}
+		public:
+			explicit ReceivedWindow(size_t capacity = 1 << 16)
+			{
+				size_t size = 64;
+
+				while (size < capacity)
+					size <<= 1;
+
+				words.assign(size / 64, 0);
+				mask = size - 1;
+			}
+
+			//! Adds a received sequence number
+			/*!
+			\return Duplicate if it arrived already, TooOld if it lies before the window, nothing is recorded then
+			*/
+			AddResult Add(int32_t sequenceNumber)
+			{
+				if (empty)
+				{
+					highest = sequenceNumber;
+					empty = false;
+
+					Set(sequenceNumber);
+					return AddResult::New;
+				}
+
+				const int64_t offset = Offset(highest, sequenceNumber);
+
+				if (offset > 0)
+				{
+					// The bits between the old and the new newest one stood for sequence numbers a window ago
+					if (static_cast<uint64_t>(offset) >= Capacity())
+					{
+						std::fill(words.begin(), words.end(), 0);
+					}
+					else
+					{
+						for (int64_t i = 1; i < offset; ++i)
+							Clear(static_cast<int32_t>((static_cast<uint32_t>(highest) + static_cast<uint32_t>(i)) & sequenceMask));
+					}
+
+					highest = sequenceNumber;
+
+					Set(sequenceNumber);
+					return AddResult::New;
+				}
+
+				if (static_cast<uint64_t>(-offset) >= Capacity())
+					return AddResult::TooOld;
+
+				if (Test(sequenceNumber))
+					return AddResult::Duplicate;
+
+				Set(sequenceNumber);
+				return AddResult::New;
+			}
+
+			//! Checks whether a sequence number lies past the newest one which arrived, any does while none arrived
+			bool IsNewer(int32_t sequenceNumber) const
+			{
+				return empty || Offset(highest, sequenceNumber) > 0;
+			}
+
+			//! Checks whether a sequence number within the window arrived
+			bool Contains(int32_t sequenceNumber) const
+			{
+				if (empty)
+					return false;
+
+				const int64_t offset = Offset(highest, sequenceNumber);
+
+				if (offset > 0 || static_cast<uint64_t>(-offset) >= Capacity())
+					return false;
+
+				return Test(sequenceNumber);
+			}
+
+			void Reset()
+			{
+				std::fill(words.begin(), words.end(), 0);
+				highest = 0;
+				empty = true;
+			}
+
+			//! Gets the newest sequence number which arrived
+			int32_t GetHighest() const
+			{
+				return highest;
+			}
+
+			bool Empty() const
+			{
+				return empty;
+			}
+
+			size_t Capacity() const
+			{
+				return words.size() * 64;
+			}
+		};
+	};
+};
@@ -42,9 +42,26 @@ namespace knet
 
 	struct SplitInfo
 	{
+		uint32_t messageSize = 0; // Bytes of the whole message, every fragment carries it so the first to arrive sizes the buffer
 		uint16_t index;
 		uint16_t packetIndex;
+		uint16_t fragmentSize = 0; // Bytes of every fragment but the last, fragment index starts at index * fragmentSize
 		uint8_t isEnd = false;
+
+		// Bytes on the wire, the fields are written one by one without the struct's padding
+		static constexpr size_t serializedSize = sizeof(uint32_t) + 3 * sizeof(uint16_t) + sizeof(uint8_t);
+	};
+
+	// Where a chunk of a stream goes, see ReliabilityLayer::SendStream
+	struct StreamInfo
+	{
+		uint64_t size = 0; // Bytes of the whole stream
+		uint64_t offset = 0;
+		uint32_t id = 0;
+		uint16_t chunkSize = 0; // Bytes of every chunk but the last, chunk offset / chunkSize numbers it
+
+		// Bytes on the wire, the fields are written one by one without the struct's padding
+		static constexpr size_t serializedSize = 2 * sizeof(uint64_t) + sizeof(uint32_t) + sizeof(uint16_t);
 	};
 
 	using SequenceIndexType = uint16_t;
@@ -58,7 +75,7 @@ namespace knet
 	struct ReliablePacket
 	{
 	private:
-		std::unique_ptr<char> _data = nullptr;
+		std::unique_ptr<char[]> _data = nullptr;
 		uint16_t _dataLength = 0;
 
 	public:
@@ -76,6 +93,9 @@ namespace knet
 
 		bool isSplit = false;
 
+		StreamInfo streamInfo;
+		bool isStream = false;
+
 		ReliablePacket() = default;
 
 		const char * Data()
@@ -91,11 +111,17 @@ namespace knet
 		ReliablePacket(const char * data, ::size_t length)
 		{
 
-			_data = std::unique_ptr<char>{new char[length]};
+			_data = std::unique_ptr<char[]>{new char[length]};
 			memcpy(_data.get(), data, length);
 			_dataLength = static_cast<uint16_t>(length);
 		}
 
+		//! Takes over a buffer which was allocated with new char[length]
+		ReliablePacket(std::unique_ptr<char[]> &&data, ::size_t length)
+			: _data(std::move(data)), _dataLength(static_cast<uint16_t>(length))
+		{
+		}
+
 		ReliablePacket(ReliablePacket &&other)
 		{
 #if _WIN32 /* Visual Studio stable_sort calls self move assignment operator */
@@ -109,8 +135,12 @@ namespace knet
 			this->_dataLength = other._dataLength;
 			this->orderedInfo = other.orderedInfo;
 			this->splitInfo = other.splitInfo;
+			this->sequenceInfo = other.sequenceInfo;
 			this->sequenceNumber = other.sequenceNumber;
+			this->socketAddress = other.socketAddress;
 			this->isSplit = other.isSplit;
+			this->streamInfo = other.streamInfo;
+			this->isStream = other.isStream;
 
 			other._data = nullptr;
 		}
@@ -136,7 +166,18 @@ namespace knet
 
 			if (isSplit)
 			{
-				bitStream.Write(splitInfo);
+				bitStream.Write(splitInfo.messageSize);
+				bitStream.Write(splitInfo.index);
+				bitStream.Write(splitInfo.packetIndex);
+				bitStream.Write(splitInfo.fragmentSize);
+				bitStream.Write(splitInfo.isEnd);
+			}
+			else if (isStream)
+			{
+				bitStream.Write(streamInfo.size);
+				bitStream.Write(streamInfo.offset);
+				bitStream.Write(streamInfo.id);
+				bitStream.Write(streamInfo.chunkSize);
 			}
 
 			bitStream.Write(_dataLength);
@@ -159,12 +200,23 @@ namespace knet
 
 			if (isSplit)
 			{
-				bitStream.Read(splitInfo);
+				bitStream.Read(splitInfo.messageSize);
+				bitStream.Read(splitInfo.index);
+				bitStream.Read(splitInfo.packetIndex);
+				bitStream.Read(splitInfo.fragmentSize);
+				bitStream.Read(splitInfo.isEnd);
+			}
+			else if (isStream)
+			{
+				bitStream.Read(streamInfo.size);
+				bitStream.Read(streamInfo.offset);
+				bitStream.Read(streamInfo.id);
+				bitStream.Read(streamInfo.chunkSize);
 			}
 
 			bitStream.Read(_dataLength);
 
-			_data = std::unique_ptr<char>{new char[_dataLength]};
+			_data = std::unique_ptr<char[]>{new char[_dataLength]};
 
 			bitStream.Read(_data.get(), _dataLength);
 		}
@@ -175,6 +227,8 @@ namespace knet
 				+ (reliability == PacketReliability::RELIABLE_ORDERED ? sizeof(orderedInfo) : 0)
 				+ (reliability == PacketReliability::RELIABLE_SEQUENCED ? sizeof(sequenceInfo) : 0)
 				+ (reliability == PacketReliability::UNRELIABLE_SEQUENCED ? sizeof(sequenceInfo) : 0)
+				+ (isSplit ? SplitInfo::serializedSize : 0)
+				+ (isStream ? StreamInfo::serializedSize : 0)
 				+ sizeof(_dataLength) + _dataLength;
 		}
 
@@ -192,8 +246,12 @@ namespace knet
 			this->_dataLength = other._dataLength;
 			this->orderedInfo = other.orderedInfo;
 			this->splitInfo = other.splitInfo;
+			this->sequenceInfo = other.sequenceInfo;
 			this->sequenceNumber = other.sequenceNumber;
+			this->socketAddress = other.socketAddress;
 			this->isSplit = other.isSplit;
+			this->streamInfo = other.streamInfo;
+			this->isStream = other.isStream;
 
 			other._data = nullptr;
 			return *this;
@@ -0,0 +1,163 @@
+// Copyright 2015 the kNet authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <utility>
+#include <vector>
+
+namespace knet
+{
+	namespace internal
+	{
+		/*
+		* Holds back messages of one ordering channel until the ones before them arrived
+		* Messages are stored at index & (capacity - 1), indices count up and wrap at the range of IndexType
+		* Indices up to half the range ahead of the expected one are taken as new, the others as duplicates of delivered ones
+		* The slots are only allocated with the first message which has to wait and grow with the gap
+		*/
+		template<typename T, typename IndexType = uint16_t>
+		class ReorderWindow
+		{
+		public:
+			enum class InsertResult
+			{
+				Ready,		// The expected one, Deliver hands it out
+				Waiting,	// Stored until the ones before it arrived
+				Duplicate,	// Delivered or stored already, dropped
+			};
+
+			// Indices a window may span, half the index range so old and new ones can be told apart
+			static constexpr size_t maxCapacity = (static_cast<size_t>(std::numeric_limits<IndexType>::max()) + 1) / 2;
+		private:
+			struct Slot
+			{
+				T value;
+				bool used = false;
+			};
+
+			std::vector<Slot> slots;
+			size_t mask = 0;
+			size_t initialCapacity = 64;
+
+			IndexType expected = 0;
+			size_t count = 0;
+
+			static size_t Distance(IndexType from, IndexType to)
+			{
+				return static_cast<IndexType>(to - from);
+			}
+
+			void Grow(size_t span)
+			{
+				size_t capacity = slots.empty() ? initialCapacity : slots.size();
+
+				while (capacity < span)
+					capacity <<= 1;
+
+				std::vector<Slot> grown(capacity);
+				const size_t grownMask = capacity - 1;
+
+				// Everything stored lies within the old capacity after the expected index
+				for (size_t offset = 0; offset < slots.size() && count > 0; ++offset)
+				{
+					auto &slot = slots[(static_cast<size_t>(expected) + offset) & mask];
+
+					if (slot.used)
+						grown[(static_cast<size_t>(expected) + offset) & grownMask] = std::move(slot);
+				}
+
+				slots = std::move(grown);
+				mask = grownMask;
+			}
+		public:
+			explicit ReorderWindow(size_t capacity = 64)
+			{
+				while (initialCapacity < capacity && initialCapacity < maxCapacity)
+					initialCapacity <<= 1;
+			}
+
+			//! Adds a received message
+			/*!
+			A Ready message is stored as well, Deliver hands it out with the ones waiting behind it
+			*/
+			InsertResult Insert(IndexType index, T &&value)
+			{
+				const size_t distance = Distance(expected, index);
+
+				if (distance >= maxCapacity)
+					return InsertResult::Duplicate;
+
+				if (distance >= slots.size())
+					Grow(distance + 1);
+
+				auto &slot = slots[static_cast<size_t>(index) & mask];
+
+				if (slot.used)
+					return InsertResult::Duplicate;
+
+				slot.value = std::move(value);
+				slot.used = true;
+				++count;
+
+				return distance == 0 ? InsertResult::Ready : InsertResult::Waiting;
+			}
+
+			//! Calls func(message) for the expected message and every consecutive one after it
+			/*!
+			\return The number of messages delivered
+			*/
+			template<typename Func>
+			size_t Deliver(Func func)
+			{
+				size_t delivered = 0;
+
+				while (count > 0)
+				{
+					auto &slot = slots[static_cast<size_t>(expected) & mask];
+
+					if (!slot.used)
+						break;
+
+					T value = std::move(slot.value);
+					slot.value = T();
+					slot.used = false;
+
+					--count;
+					++expected;
+					++delivered;
+
+					func(value);
+				}
+
+				return delivered;
+			}
+
+			//! Gets the index of the next message to deliver
+			IndexType GetExpected() const
+			{
+				return expected;
+			}
+
+			//! Gets the number of messages held back
+			size_t Size() const
+			{
+				return count;
+			}
+
+			bool Empty() const
+			{
+				return count == 0;
+			}
+
+			size_t Capacity() const
+			{
+				return slots.size();
+			}
+		};
+	};
+};
@@ -0,0 +1,107 @@
+// Copyright 2015 the kNet authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+
+namespace knet
+{
+	namespace internal
+	{
+		/*
+		* Smoothed round trip time and retransmission timeout after RFC 6298
+		* Samples of retransmitted datagrams must not be added (Karn's rule), their ack may belong to any transmission
+		*/
+		class RttEstimator
+		{
+		public:
+			using Duration = std::chrono::nanoseconds;
+		private:
+			Duration smoothedRtt = Duration::zero();
+			Duration rttVariance = Duration::zero();
+			bool hasSample = false;
+
+			Duration initialTimeout = std::chrono::seconds(1);
+			Duration minTimeout = std::chrono::milliseconds(100);
+			Duration maxTimeout = std::chrono::seconds(10);
+
+			// Doublings of the timeout since the last sample
+			uint32_t backoff = 0;
+
+			static constexpr uint32_t maxBackoff = 6;
+		public:
+			//! Adds a round trip sample of a datagram which was sent once
+			void AddSample(Duration sample)
+			{
+				if (sample < Duration::zero())
+					sample = Duration::zero();
+
+				if (!hasSample)
+				{
+					smoothedRtt = sample;
+					rttVariance = sample / 2;
+					hasSample = true;
+				}
+				else
+				{
+					// alpha = 1/8, beta = 1/4
+					Duration error = smoothedRtt > sample ? smoothedRtt - sample : sample - smoothedRtt;
+
+					rttVariance = rttVariance + (error - rttVariance) / 4;
+					smoothedRtt = smoothedRtt + (sample - smoothedRtt) / 8;
+				}
+
+				// A fresh measurement ends any backoff
+				backoff = 0;
+			}
+
+			//! Doubles the timeout after a retransmission timed out
+			void Backoff()
+			{
+				if (backoff < maxBackoff)
+					++backoff;
+			}
+
+			//! Gets the retransmission timeout with the backoff applied
+			/*!
+			\param[in] ackDelay The longest the remote holds back acknowledgements, the timeout has to outlast it
+			*/
+			Duration GetTimeout(Duration ackDelay = Duration::zero()) const
+			{
+				const Duration clockGranularity = std::chrono::milliseconds(1);
+				Duration timeout = initialTimeout;
+
+				if (hasSample)
+					timeout = std::max(smoothedRtt + std::max(clockGranularity, 4 * rttVariance), minTimeout) + ackDelay;
+
+				return std::min(timeout * (1 << backoff), maxTimeout);
+			}
+
+			Duration GetSmoothedRtt() const
+			{
+				return smoothedRtt;
+			}
+
+			Duration GetRttVariance() const
+			{
+				return rttVariance;
+			}
+
+			bool HasSample() const
+			{
+				return hasSample;
+			}
+
+			//! Limits the timeout, the maximum also caps the backoff
+			void SetTimeoutBounds(Duration minimum, Duration maximum)
+			{
+				minTimeout = minimum;
+				maxTimeout = std::max(minimum, maximum);
+			}
+		};
+	};
+};
@@ -0,0 +1,455 @@
+// Copyright 2015 the kNet authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#pragma once
+
+#include "../bitstream.h"
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <utility>
+#include <vector>
+
+namespace knet
+{
+	namespace internal
+	{
+		/*
+		* Received reliable sequence numbers waiting for their ack, a bitmap over the window from the oldest to the newest one
+		*
+		* An ack block is written as
+		*	int32 base		the oldest acknowledged sequence number
+		*	varint span		sequence numbers covered, base + span - 1 is the newest acknowledged one
+		*	uint8 encoding
+		*	Bitmap:		(span + 7) / 8 bytes, bit i of byte i / 8 set if base + i is acknowledged
+		*	RunLength:	varints alternating the lengths of acknowledged and missing runs, starting and ending with an acknowledged one
+		* The writer takes whichever is smaller, bitmaps win under scattered loss and runs when little is missing
+		*/
+		class AckWindow
+		{
+		public:
+			using Range = std::pair<int32_t, int32_t>;
+
+			enum class Encoding : uint8_t
+			{
+				RunLength,
+				Bitmap,
+			};
+
+			// Sequence numbers one window may span, the caller has to send its acks before adding beyond it
+			static constexpr size_t maxCapacity = 1 << 16;
+		private:
+			static constexpr uint32_t sequenceMask = static_cast<uint32_t>(std::numeric_limits<int32_t>::max());
+
+			std::vector<uint64_t> words;
+			size_t mask = 0;
+
+			int32_t first = 0;
+			int32_t last = 0;
+			size_t count = 0;
+
+			// Lengths of the alternating runs, reused by every Write
+			std::vector<uint32_t> runs;
+
+			static uint32_t Distance(int32_t from, int32_t to)
+			{
+				return (static_cast<uint32_t>(to) - static_cast<uint32_t>(from)) & sequenceMask;
+			}
+
+			// Negative if to lies before from
+			static int64_t Offset(int32_t from, int32_t to)
+			{
+				const uint32_t distance = Distance(from, to);
+				return distance > sequenceMask / 2 ? static_cast<int64_t>(distance) - (static_cast<int64_t>(sequenceMask) + 1) : distance;
+			}
+
+			static int32_t Next(int32_t sequenceNumber, uint32_t offset = 1)
+			{
+				return static_cast<int32_t>((static_cast<uint32_t>(sequenceNumber) + offset) & sequenceMask);
+			}
+
+			bool Test(int32_t sequenceNumber) const
+			{
+				const size_t bit = static_cast<uint32_t>(sequenceNumber) & mask;
+				return (words[bit >> 6] >> (bit & 63)) & 1;
+			}
+
+			void Set(int32_t sequenceNumber, bool value)
+			{
+				const size_t bit = static_cast<uint32_t>(sequenceNumber) & mask;
+
+				if (value)
+					words[bit >> 6] |= uint64_t(1) << (bit & 63);
+				else
+					words[bit >> 6] &= ~(uint64_t(1) << (bit & 63));
+			}
+
+			size_t Capacity() const
+			{
+				return words.size() * 64;
+			}
+
+			void Grow(size_t span)
+			{
+				size_t capacity = Capacity();
+
+				while (capacity < span)
+					capacity <<= 1;
+
+				std::vector<uint64_t> old(capacity / 64, 0);
+				std::swap(old, words);
+
+				const size_t oldMask = mask;
+				mask = capacity - 1;
+
+				for (uint32_t offset = 0, size = Distance(first, last) + 1; offset < size; ++offset)
+				{
+					const size_t bit = (static_cast<uint32_t>(first) + offset) & oldMask;
+
+					if ((old[bit >> 6] >> (bit & 63)) & 1)
+						Set(Next(first, offset), true);
+				}
+			}
+
+			static size_t VarIntSize(uint32_t value)
+			{
+				size_t size = 1;
+
+				while (value >= 0x80)
+				{
+					value >>= 7;
+					++size;
+				}
+
+				return size;
+			}
+		public:
+			explicit AckWindow(size_t capacity = 1024)
+			{
+				capacity = std::max<size_t>(capacity, 64);
+
+				size_t size = 64;
+
+				while (size < capacity)
+					size <<= 1;
+
+				words.assign(size / 64, 0);
+				mask = size - 1;
+			}
+
+			//! Adds a received sequence number
+			/*!
+			\return false if the window would span more than maxCapacity, nothing was added then
+			*/
+			bool Add(int32_t sequenceNumber)
+			{
+				if (count == 0)
+				{
+					first = last = sequenceNumber;
+					Set(sequenceNumber, true);
+					count = 1;
+					return true;
+				}
+
+				const int64_t fromFirst = Offset(first, sequenceNumber);
+				const int64_t fromLast = Offset(last, sequenceNumber);
+
+				// Duplicates are acknowledged once
+				if (fromFirst >= 0 && fromLast <= 0 && Test(sequenceNumber))
+					return true;
+
+				const int32_t newFirst = fromFirst < 0 ? sequenceNumber : first;
+				const int32_t newLast = fromLast > 0 ? sequenceNumber : last;
+				const size_t span = static_cast<size_t>(Distance(newFirst, newLast)) + 1;
+
+				if (span > maxCapacity)
+					return false;
+
+				if (span > Capacity())
+					Grow(span);
+
+				first = newFirst;
+				last = newLast;
+
+				Set(sequenceNumber, true);
+				++count;
+
+				return true;
+			}
+
+			bool Empty() const
+			{
+				return count == 0;
+			}
+
+			size_t Size() const
+			{
+				return count;
+			}
+
+			//! Gets the newest sequence number waiting for its ack
+			int32_t GetLast() const
+			{
+				return last;
+			}
+
+			//! Checks whether a sequence number comes after another one, across the wrap to 0
+			static bool IsAfter(int32_t sequenceNumber, int32_t other)
+			{
+				return Offset(other, sequenceNumber) > 0;
+			}
+
+			//! Writes one ack block, from the oldest sequence number on as far as maxBytes allows
+			/*!
+			The written sequence numbers are removed
+			\param[out] newest The newest sequence number which was written
+			\return The number of sequence numbers written, 0 if the window was empty
+			*/
+			size_t Write(BitStream &bitStream, size_t maxBytes, int32_t &newest)
+			{
+				if (count == 0)
+					return 0;
+
+				// Alternating run lengths, acknowledged ones at even indices
+				runs.clear();
+
+				const uint32_t size = Distance(first, last) + 1;
+				bool acked = true;
+				uint32_t length = 0;
+
+				for (uint32_t offset = 0; offset < size; ++offset)
+				{
+					if (Test(Next(first, offset)) != acked)
+					{
+						runs.push_back(length);
+						acked = !acked;
+						length = 0;
+					}
+
+					++length;
+				}
+
+				runs.push_back(length);
+
+				// The longest prefix of whole acknowledged runs each encoding fits
+				const size_t fixedSize = sizeof(int32_t) + VarIntSize(size) + sizeof(uint8_t);
+				const size_t budget = maxBytes > fixedSize ? maxBytes - fixedSize : 0;
+
+				size_t runLengthRuns = 0;
+				size_t runLengthBytes = 0;
+				size_t bitmapRuns = 0;
+				uint32_t covered = 0;
+
+				for (size_t i = 0; i < runs.size(); ++i)
+				{
+					covered += runs[i];
+
+					// Only a prefix ending with an acknowledged run can be written
+					if (i % 2 != 0)
+					{
+						runLengthBytes += VarIntSize(runs[i]);
+						continue;
+					}
+
+					runLengthBytes += VarIntSize(runs[i]);
+
+					if (runLengthBytes <= budget)
+						runLengthRuns = i + 1;
+
+					if ((covered + 7) / 8 <= budget)
+						bitmapRuns = i + 1;
+				}
+
+				// Nothing fits, the budget is too small for even one run
+				if (runLengthRuns == 0 && bitmapRuns == 0)
+					return 0;
+
+				Encoding encoding = Encoding::RunLength;
+				size_t usedRuns = runLengthRuns;
+
+				if (bitmapRuns > runLengthRuns)
+				{
+					encoding = Encoding::Bitmap;
+					usedRuns = bitmapRuns;
+				}
+				else if (bitmapRuns == runLengthRuns)
+				{
+					uint32_t span = 0;
+					size_t bytes = 0;
+
+					for (size_t i = 0; i < usedRuns; ++i)
+					{
+						span += runs[i];
+						bytes += VarIntSize(runs[i]);
+					}
+
+					if ((span + 7) / 8 < bytes)
+						encoding = Encoding::Bitmap;
+				}
+
+				uint32_t span = 0;
+
+				for (size_t i = 0; i < usedRuns; ++i)
+					span += runs[i];
+
+				bitStream.Write<int32_t>(first);
+				WriteVarInt(bitStream, span);
+				bitStream.Write(static_cast<uint8_t>(encoding));
+
+				if (encoding == Encoding::Bitmap)
+				{
+					uint8_t byte = 0;
+
+					for (uint32_t offset = 0; offset < span; ++offset)
+					{
+						if (Test(Next(first, offset)))
+							byte |= static_cast<uint8_t>(1 << (offset & 7));
+
+						if ((offset & 7) == 7 || offset + 1 == span)
+						{
+							bitStream.Write(byte);
+							byte = 0;
+						}
+					}
+				}
+				else
+				{
+					for (size_t i = 0; i < usedRuns; ++i)
+						WriteVarInt(bitStream, runs[i]);
+				}
+
+				// Remove what was written, the window starts at the next pending one
+				size_t written = 0;
+
+				for (uint32_t offset = 0; offset < span; ++offset)
+				{
+					const int32_t sequenceNumber = Next(first, offset);
+
+					if (Test(sequenceNumber))
+					{
+						Set(sequenceNumber, false);
+						++written;
+					}
+				}
+
+				newest = Next(first, span - 1);
+				count -= written;
+
+				if (count > 0)
+				{
+					first = Next(first, span);
+
+					while (!Test(first))
+						first = Next(first);
+				}
+
+				return written;
+			}
+
+			//! Reads one ack block
+			/*!
+			\param[out] ranges The acknowledged ranges are appended
+			\return false if the block was malformed
+			*/
+			static bool Read(BitStream &bitStream, std::vector<Range> &ranges)
+			{
+				int32_t base = 0;
+				uint32_t span = 0;
+				uint8_t encoding = 0;
+
+				if (!bitStream.Read(base) || !ReadVarInt(bitStream, span) || !bitStream.Read(encoding))
+					return false;
+
+				if (base < 0 || span == 0 || span > maxCapacity)
+					return false;
+
+				if (encoding == static_cast<uint8_t>(Encoding::Bitmap))
+				{
+					bool inRange = false;
+					uint32_t rangeStart = 0;
+					uint8_t byte = 0;
+
+					for (uint32_t offset = 0; offset < span; ++offset)
+					{
+						if ((offset & 7) == 0 && !bitStream.Read(byte))
+							return false;
+
+						const bool acked = (byte >> (offset & 7)) & 1;
+
+						if (acked && !inRange)
+						{
+							rangeStart = offset;
+							inRange = true;
+						}
+						else if (!acked && inRange)
+						{
+							ranges.emplace_back(Next(base, rangeStart), Next(base, offset - 1));
+							inRange = false;
+						}
+					}
+
+					if (inRange)
+						ranges.emplace_back(Next(base, rangeStart), Next(base, span - 1));
+
+					return true;
+				}
+
+				if (encoding != static_cast<uint8_t>(Encoding::RunLength))
+					return false;
+
+				uint32_t offset = 0;
+				bool acked = true;
+
+				while (offset < span)
+				{
+					uint32_t length = 0;
+
+					if (!ReadVarInt(bitStream, length) || length == 0 || length > span - offset)
+						return false;
+
+					if (acked)
+						ranges.emplace_back(Next(base, offset), Next(base, offset + length - 1));
+
+					offset += length;
+					acked = !acked;
+				}
+
+				return true;
+			}
+
+			static void WriteVarInt(BitStream &bitStream, uint32_t value)
+			{
+				while (value >= 0x80)
+				{
+					bitStream.Write(static_cast<uint8_t>(value | 0x80));
+					value >>= 7;
+				}
+
+				bitStream.Write(static_cast<uint8_t>(value));
+			}
+
+			static bool ReadVarInt(BitStream &bitStream, uint32_t &value)
+			{
+				value = 0;
+
+				for (uint32_t shift = 0; shift < 35; shift += 7)
+				{
+					uint8_t byte = 0;
+
+					if (!bitStream.Read(byte))
+						return false;
+
+					value |= static_cast<uint32_t>(byte & 0x7F) << shift;
+
+					if ((byte & 0x80) == 0)
+						return true;
+				}
+
+				return false;
+			}
+		};
+	};
+};
@@ -0,0 +1,216 @@
+// Copyright 2015 the kNet authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <utility>
+#include <vector>
+
+namespace knet
+{
+	namespace internal
+	{
+		/*
+		* Entries keyed by consecutive sequence numbers, stored at sequence number & (capacity - 1)
+		* Sequence numbers count up to 2^31 - 1 and wrap to 0, entries must be inserted in that order
+		* Lookups and erases are O(1), the slots only grow when more sequence numbers than fit are outstanding
+		*/
+		template<typename T>
+		class SequenceRing
+		{
+		public:
+			static constexpr uint32_t sequenceMask = static_cast<uint32_t>(std::numeric_limits<int32_t>::max());
+		private:
+			struct Slot
+			{
+				T value;
+				int32_t sequenceNumber = 0;
+				bool used = false;
+			};
+
+			std::vector<Slot> slots;
+			size_t mask = 0;
+
+			// Oldest sequence number which may be used and the one after the newest
+			int32_t first = 0;
+			int32_t end = 0;
+			size_t count = 0;
+
+			static size_t RoundUp(size_t capacity)
+			{
+				size_t size = 1;
+
+				while (size < capacity)
+					size <<= 1;
+
+				return size;
+			}
+
+			uint32_t Span() const
+			{
+				return Distance(first, end);
+			}
+
+			void Grow(size_t capacity)
+			{
+				std::vector<Slot> grown(RoundUp(capacity));
+				const size_t grownMask = grown.size() - 1;
+
+				for (auto &slot : slots)
+				{
+					if (slot.used)
+						grown[static_cast<uint32_t>(slot.sequenceNumber) & grownMask] = std::move(slot);
+				}
+
+				slots = std::move(grown);
+				mask = grownMask;
+			}
+		public:
+			explicit SequenceRing(size_t capacity = 512)
+				: slots(RoundUp(capacity)), mask(slots.size() - 1)
+			{
+			}
+
+			//! Gets how far to is ahead of from, modulo the sequence number space
+			static uint32_t Distance(int32_t from, int32_t to)
+			{
+				return (static_cast<uint32_t>(to) - static_cast<uint32_t>(from)) & sequenceMask;
+			}
+
+			static int32_t Next(int32_t sequenceNumber, uint32_t offset = 1)
+			{
+				return static_cast<int32_t>((static_cast<uint32_t>(sequenceNumber) + offset) & sequenceMask);
+			}
+
+			//! Adds the entry of the next sequence number
+			/*!
+			The first entry of an empty ring may take any sequence number
+			\return The stored entry
+			*/
+			T& Insert(int32_t sequenceNumber, T &&value)
+			{
+				if (count == 0)
+					first = end = sequenceNumber;
+
+				// Room for everything up to the new one
+				if (Distance(first, sequenceNumber) >= slots.size())
+					Grow(static_cast<size_t>(Distance(first, sequenceNumber)) + 1);
+
+				auto &slot = slots[static_cast<uint32_t>(sequenceNumber) & mask];
+				slot.value = std::move(value);
+				slot.sequenceNumber = sequenceNumber;
+				slot.used = true;
+
+				++count;
+
+				if (Distance(first, sequenceNumber) >= Span())
+					end = Next(sequenceNumber);
+
+				return slot.value;
+			}
+
+			//! Gets the entry of a sequence number
+			/*!
+			\return nullptr if there is none
+			*/
+			T* Find(int32_t sequenceNumber)
+			{
+				if (count == 0 || Distance(first, sequenceNumber) >= Span())
+					return nullptr;
+
+				auto &slot = slots[static_cast<uint32_t>(sequenceNumber) & mask];
+
+				return slot.used && slot.sequenceNumber == sequenceNumber ? &slot.value : nullptr;
+			}
+
+			bool Erase(int32_t sequenceNumber)
+			{
+				if (!Find(sequenceNumber))
+					return false;
+
+				auto &slot = slots[static_cast<uint32_t>(sequenceNumber) & mask];
+				slot.value = T();
+				slot.used = false;
+
+				--count;
+
+				// The oldest outstanding entry moves up
+				while (count > 0 && !slots[static_cast<uint32_t>(first) & mask].used)
+					first = Next(first);
+
+				if (count == 0)
+					first = end;
+
+				return true;
+			}
+
+			//! Limits a range of sequence numbers to the ones which may have entries
+			/*!
+			Ranges reaching more than half the sequence number space behind the oldest entry are taken as lying before it
+			\return false if none of them may have one
+			*/
+			bool Clamp(int32_t &min, int32_t &max) const
+			{
+				if (count == 0)
+					return false;
+
+				const uint32_t half = sequenceMask / 2;
+				const uint32_t span = Span();
+
+				uint32_t low = Distance(first, min);
+				uint32_t high = Distance(first, max);
+
+				if (high > half || (low <= half && low > high))
+					return false;
+
+				if (low > half)
+					low = 0;
+
+				if (low >= span)
+					return false;
+
+				if (high >= span)
+					high = span - 1;
+
+				min = Next(first, low);
+				max = Next(first, high);
+
+				return true;
+			}
+
+			//! Calls func(sequenceNumber, entry) for each entry, oldest first, until it returns false
+			template<typename Func>
+			void ForEach(Func func)
+			{
+				const uint32_t span = Span();
+
+				for (uint32_t offset = 0; offset < span && count > 0; ++offset)
+				{
+					auto &slot = slots[(static_cast<uint32_t>(first) + offset) & mask];
+
+					if (slot.used && !func(slot.sequenceNumber, slot.value))
+						break;
+				}
+			}
+
+			size_t Size() const
+			{
+				return count;
+			}
+
+			bool Empty() const
+			{
+				return count == 0;
+			}
+
+			size_t Capacity() const
+			{
+				return slots.size();
+			}
+		};
+	};
+};
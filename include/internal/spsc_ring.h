@@ -0,0 +1,141 @@
+// Copyright 2015 the kNet authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <memory>
+
+namespace knet
+{
+	namespace internal
+	{
+		/*
+		* Bounded single producer single consumer ring
+		* The indices live on their own cache lines, each side keeps a cached copy of the other side's index
+		* so the shared lines are only touched when the cached view runs out
+		*/
+		template<typename T>
+		class SpscRing
+		{
+		private:
+			static constexpr size_t cacheLineSize = 64;
+
+			std::unique_ptr<T[]> slots;
+			size_t mask = 0;
+
+			// Written by the consumer
+			alignas(cacheLineSize) std::atomic<size_t> head{0};
+			size_t cachedTail = 0;
+
+			// Written by the producer
+			alignas(cacheLineSize) std::atomic<size_t> tail{0};
+			size_t cachedHead = 0;
+		public:
+			explicit SpscRing(size_t minCapacity = 1024)
+			{
+				Resize(minCapacity);
+			}
+
+			SpscRing(const SpscRing&) = delete;
+			SpscRing& operator=(const SpscRing&) = delete;
+
+			//! Reallocates the ring, rounded up to a power of two
+			/*!
+			Only safe while neither side is using the ring, queued items are dropped
+			*/
+			void Resize(size_t minCapacity)
+			{
+				size_t capacity = 1;
+
+				while (capacity < minCapacity)
+					capacity <<= 1;
+
+				slots.reset(new T[capacity]);
+				mask = capacity - 1;
+
+				head.store(0, std::memory_order_relaxed);
+				tail.store(0, std::memory_order_relaxed);
+				cachedHead = 0;
+				cachedTail = 0;
+			}
+
+			//! Producer only, pushes as many items as fit
+			/*!
+			\return The number of items pushed from the front of pItems
+			*/
+			size_t Push(const T * pItems, size_t count)
+			{
+				const size_t currentTail = tail.load(std::memory_order_relaxed);
+				size_t space = mask + 1 - (currentTail - cachedHead);
+
+				if (space < count)
+				{
+					cachedHead = head.load(std::memory_order_acquire);
+					space = mask + 1 - (currentTail - cachedHead);
+				}
+
+				if (count > space)
+					count = space;
+
+				for (size_t i = 0; i < count; ++i)
+					slots[(currentTail + i) & mask] = pItems[i];
+
+				tail.store(currentTail + count, std::memory_order_release);
+
+				return count;
+			}
+
+			bool Push(const T &item)
+			{
+				return Push(&item, 1) == 1;
+			}
+
+			//! Consumer only, pops up to maxCount items
+			/*!
+			\return The number of items written to pItems
+			*/
+			size_t Pop(T * pItems, size_t maxCount)
+			{
+				const size_t currentHead = head.load(std::memory_order_relaxed);
+				size_t available = cachedTail - currentHead;
+
+				if (available < maxCount)
+				{
+					cachedTail = tail.load(std::memory_order_acquire);
+					available = cachedTail - currentHead;
+				}
+
+				if (maxCount > available)
+					maxCount = available;
+
+				for (size_t i = 0; i < maxCount; ++i)
+					pItems[i] = slots[(currentHead + i) & mask];
+
+				head.store(currentHead + maxCount, std::memory_order_release);
+
+				return maxCount;
+			}
+
+			//! Number of queued items, exact only on the consumer side
+			size_t Size() const
+			{
+				// Head first, the tail can only have moved further since
+				const size_t currentHead = head.load(std::memory_order_acquire);
+				return tail.load(std::memory_order_acquire) - currentHead;
+			}
+
+			bool Empty() const
+			{
+				return Size() == 0;
+			}
+
+			size_t Capacity() const
+			{
+				return mask + 1;
+			}
+		};
+	};
+};
@@ -4,11 +4,14 @@
 
 #pragma once
 
+#include "internal/address_table.h"
 #include "internal/event_handler.h"
 
 #include "sockets/berkley_socket.h"
 #include "reliability_layer.h"
 
+#include <atomic>
+
 namespace knet
 {
 	// TODO: clean up
@@ -39,6 +42,24 @@ namespace knet
 		std::string password;
 		std::vector<EndPointInformation> localEndPoints;
 		bool isIncoming = false; // Allowed to accept incoming connections;
+		short addressFamily = AF_INET; // AF_INET6 binds dual-stack sockets reaching IPv4 and IPv6 remotes, an IPv6 local host always does
+		size_t receiveBatchSize = 1; // Datagrams the socket drains per receive call
+		size_t sendBatchSize = 1; // Datagrams staged per socket and flushed once at the end of Process
+		bool receiveOffload = false; // Linux only, receives coalesced UDP_GRO bursts and splits them without copying
+		size_t packetPoolCapacity = 4096; // Received packets kept for reuse, the pool is shared by every peer of the process and keeps the largest capacity any of them asked for
+		size_t receiveQueueCapacity = 1024; // Packets queued per system between receiving and Process
+		ReceiveOverflowPolicy receiveOverflowPolicy = ReceiveOverflowPolicy::Drop; // Wait falls back to Drop if Process runs the socket loop
+		SocketType socketType = SocketType::Berkley;
+		bool ownsEventLoop = true; // Event driven sockets only, false runs the socket loop inside Process
+		std::chrono::milliseconds maxWaitTime = std::chrono::milliseconds(10); // Longest Process waits for events when it runs the loop
+		size_t shardCount = 1; // Linux only, sockets sharing the port via SO_REUSEPORT, each with its own receive thread and systems
+		bool kernelTimestamps = false; // Linux only, Berkley and Epoll sockets, measures delays from kernel receive and transmit timestamps
+		CongestionControlType congestionControl = CongestionControlType::NewReno; // Of new connections, see SetCongestionControl
+		double pacingRate = 0.0; // Bytes per second per connection, 0 paces at the rate of the congestion control, see SetPacingRate
+		uint32_t reorderThreshold = 3; // Datagrams a missing one may be overtaken by before it is reported lost, 0 waits for the remote's timeout
+		std::chrono::milliseconds ackDelay = std::chrono::milliseconds(25); // Longest acks wait for a datagram to ride along with, see ReliabilityLayer::SetAckDelay
+		size_t reassemblyMemoryLimit = 4 * 1024 * 1024; // Bytes unfinished split messages of a connection may take, see ReliabilityLayer::SetReassemblyLimits
+		std::chrono::milliseconds reassemblyTimeout = std::chrono::milliseconds(10000); // Longest a split message may take to arrive
 	};
 
 	struct ConnectInformation
@@ -51,34 +72,80 @@ namespace knet
 	enum class PeerEvents : uint8_t
 	{
 		ConnectionAccepted,
-		Disconnected
+		Disconnected,
+		StreamChunk, // (SocketAddress remoteAddress, StreamId id, uint64_t offset, const char *data, size_t size), for streams without a sink
+		StreamReceived, // (SocketAddress remoteAddress, StreamId id, uint64_t size)
+		StreamSent, // (SocketAddress remoteAddress, StreamId id)
+		StreamAborted, // (SocketAddress remoteAddress, StreamId id, uint64_t size), a stream the remote sent stopped unfinished
+		StreamFailed // (SocketAddress remoteAddress, StreamId id), a stream we sent was not acknowledged
 	};
 
+	//! Picks the sink of a stream a remote started, nullptr hands its chunks out as StreamChunk events
+	using PeerStreamAcceptor = std::function<std::shared_ptr<IStreamSink>(const SocketAddress &remoteAddress, StreamId id, uint64_t size)>;
+
 	class Peer
 	{
 	private:
-		std::shared_ptr<knet::ISocket> _socket = nullptr;
-
 		struct System
 		{
 			knet::ReliabilityLayer reliabilityLayer;
 			bool isConnected = false;
 			bool isActive = true;
+			std::atomic<uint32_t> connectionId{0}; // Assigned by us, 0 if every slot was taken, read by the receiving thread
 			std::chrono::steady_clock::time_point lastPing = std::chrono::steady_clock::now();
+			std::chrono::steady_clock::time_point lastPingSent = std::chrono::steady_clock::now();
 		};
 
-		knet::ReliabilityLayer reliabilityLayer;
+		// One socket with its own receive thread and its own partition of the remote systems
+		// The reuseport steering program keeps sending a remote's datagrams to the same shard
+		struct Shard
+		{
+			std::shared_ptr<knet::ISocket> socket = nullptr;
+
+			// Handles the systems which have not established a connection yet
+			knet::ReliabilityLayer reliabilityLayer;
+
+			// Iterated by Process, only touched on its thread
+			std::vector<std::shared_ptr<System>> remoteSystems;
+
+			// The connected systems by address, read by the receiving thread without locking
+			internal::AddressTable<System> systemsByAddress;
 
-		std::vector<std::shared_ptr<System>> remoteSystems;
+			// Systems by connection id, the slot of an id is index * shard count + shard index
+			// A system is only put in a slot while it is in systemsByAddress, whose readers keep it alive
+			size_t index = 0;
+			size_t connectionSlotCount = 0;
+			std::unique_ptr<std::atomic<System*>[]> connectionSlots;
+			std::vector<uint16_t> slotGenerations;
+			std::vector<uint32_t> freeSlots;
+
+			bool reorderRemoteSystems = true;
+			uint32_t activeSystems = 0;
+		};
+
+		std::vector<std::unique_ptr<Shard>> shards;
 
 		std::mutex bufferMutex;
 		std::queue<knet::InternalRecvPacket*> bufferedPacketQueue;
 
 		uint32_t maxConnections = 5;
+		std::atomic<uint32_t> activeSystems{0};
 
 		bool isConnected = false;
-		bool reorderRemoteSystems = true;
-		uint32_t activeSystems = 0;
+		bool runEventLoop = false;
+		std::chrono::milliseconds maxWaitTime = std::chrono::milliseconds(10);
+		size_t receiveQueueCapacity = 1024;
+		ReceiveOverflowPolicy receiveOverflowPolicy = ReceiveOverflowPolicy::Drop;
+		CongestionControlType congestionControl = CongestionControlType::NewReno;
+		double pacingRate = 0.0;
+		uint32_t reorderThreshold = 3;
+		std::chrono::milliseconds ackDelay = std::chrono::milliseconds(25);
+		size_t reassemblyMemoryLimit = 4 * 1024 * 1024;
+		std::chrono::milliseconds reassemblyTimeout = std::chrono::milliseconds(10000);
+
+		// Set from any thread, copied by the shards for each new connection
+		std::mutex streamAcceptorMutex;
+		PeerStreamAcceptor streamAcceptor;
 
 
 		knet::internal::EventHandler<PeerEvents> _eventHandler;
@@ -101,15 +168,88 @@ namespace knet
 		void Stop();
 
 		void Process() noexcept;
+
+		//! Processes a single shard
+		/*!
+		Lets every shard run on its own thread, the peer events are then called from these threads
+		*/
+		void Process(size_t shardIndex) noexcept;
+
+		size_t GetShardCount() const noexcept;
+
+		//! Gets the smoothed round trip time to a connected remote, from acks and pings
+		/*!
+		\return Zero if the remote is unknown or was not measured yet
+		*/
+		std::chrono::nanoseconds GetRoundTripTime(const SocketAddress &remoteAddress) noexcept;
+
+		//! Selects the congestion control of one connection
+		/*!
+		Only from the thread processing the remote's shard
+		\return false if the remote is not connected
+		*/
+		bool SetCongestionControl(const SocketAddress &remoteAddress, CongestionControlType type) noexcept;
+
+		//! Sets the rate datagrams to one connection leave at
+		/*!
+		Only from the thread processing the remote's shard
+		\param[in] bytesPerSecond 0 paces at the rate of the congestion control
+		\return false if the remote is not connected
+		*/
+		bool SetPacingRate(const SocketAddress &remoteAddress, double bytesPerSecond) noexcept;
+
+		//! Sends a stream of bytes to a connected remote, see ReliabilityLayer::SendStream
+		/*!
+		Only from the thread processing the remote's shard
+		\return The id of the stream, 0 if the remote is not connected
+		*/
+		StreamId SendStream(const SocketAddress &remoteAddress, uint64_t size, StreamSource source) noexcept;
+
+		//! Sends a file to a connected remote, read through a memory mapping
+		/*!
+		Only from the thread processing the remote's shard
+		\return The id of the stream, 0 if the remote is not connected or the file can not be read
+		*/
+		StreamId SendFile(const SocketAddress &remoteAddress, const std::string &path) noexcept;
+
+		//! Gets how far a stream sent to a remote got
+		/*!
+		\return false if the remote is not connected or the stream is unknown or acknowledged
+		*/
+		bool GetSendProgress(const SocketAddress &remoteAddress, StreamId id, StreamProgress &progress) noexcept;
+
+		//! Sets who picks the sinks of streams remotes start, applies to the connections made afterwards
+		void SetStreamAcceptor(PeerStreamAcceptor acceptor) noexcept;
+
+		//! Gets the time the next ack, resend or ping is due
+		/*!
+		\return time_point::max() if there is nothing scheduled
+		*/
+		std::chrono::steady_clock::time_point GetNextWakeup() noexcept;
 	private:
+		void AddShard();
+		void AttachSocket(Shard &shard);
+
+		// Looks up the system a received packet belongs to, by its connection id or else by its address
+		System * FindSystem(Shard &shard, const internal::AddressTable<System>::Reader &reader, InternalRecvPacket *pPacket) noexcept;
+
+		void AssignConnectionId(Shard &shard, System &system);
+		void ReleaseConnectionId(Shard &shard, System &system);
+
+		// Returns true if the shard had nothing to do and did not wait for events
+		bool ProcessShard(Shard &shard, std::chrono::milliseconds maxWait) noexcept;
+		std::chrono::steady_clock::time_point GetNextWakeup(Shard &shard) noexcept;
+
 		/* Event handlers */
-		bool OnReceive(knet::InternalRecvPacket* pPacket) noexcept;
-		bool HandleDisconnect(knet::SocketAddress address, knet::DisconnectReason reason) noexcept;
-		bool HandleNewConnection(knet::InternalRecvPacket * pPacket) noexcept;
-		bool HandlePacket(knet::ReliablePacket &packet, knet::SocketAddress& remoteAddress) noexcept;
+		bool OnReceive(Shard &shard, knet::InternalRecvPacket* pPacket) noexcept;
+		bool OnReceiveBatch(Shard &shard, knet::InternalRecvPacket** ppPackets, size_t count) noexcept;
+		bool HandleDisconnect(Shard &shard, knet::SocketAddress address, knet::DisconnectReason reason) noexcept;
+		bool HandleNewConnection(Shard &shard, knet::InternalRecvPacket * pPacket) noexcept;
+		bool HandlePacket(Shard &shard, knet::ReliablePacket &packet, knet::SocketAddress& remoteAddress) noexcept;
+		bool HandleAddressChange(Shard &shard, knet::SocketAddress oldAddress, knet::SocketAddress newAddress) noexcept;
 
 
-		void SendInternalPing(const SocketAddress&);
+		void SendInternalPing(Shard &shard, System &system);
 	};
 
 };
@@ -10,10 +10,28 @@
 #include "internal/datagram_header.h"
 #include "internal/reliable_packet.h"
 #include "internal/datagram_packet.h"
+#include "internal/spsc_ring.h"
+#include "internal/rtt_estimator.h"
+#include "internal/pacer.h"
+#include "internal/gap_tracker.h"
+#include "internal/sequence_ring.h"
+#include "internal/selective_ack.h"
+#include "internal/reorder_window.h"
+#include "internal/reassembly_buffer.h"
+#include "internal/received_window.h"
+
+#include "internal/mapped_file.h"
+
+#include "congestion/icongestion_controller.h"
+
+#include "stream.h"
 
 // STL/CRT includes
+#include <atomic>
 #include <mutex>
 #include <queue>
+#include <deque>
+#include <map>
 #include <bitset>
 #include <unordered_map>
 #include <array>
@@ -26,12 +44,26 @@ namespace knet
 		DISCONNECTED,
 		HANDLE_PACKET,
 		NEW_CONNECTION,
+		ADDRESS_CHANGED, /* Called with (SocketAddress oldAddress, SocketAddress newAddress) after the remote moved */
+		STREAM_CHUNK, /* Called with (StreamId id, uint64_t offset, const char *data, size_t size) for streams without a sink */
+		STREAM_RECEIVED, /* Called with (StreamId id, uint64_t size) once every byte of a stream the remote sent arrived */
+		STREAM_SENT, /* Called with (StreamId id) once the remote acknowledged every byte of a stream */
+		STREAM_ABORTED, /* Called with (StreamId id, uint64_t size) when a stream the remote sent was dropped unfinished, no chunk came for the reassembly timeout */
+		STREAM_FAILED, /* Called with (StreamId id) instead of STREAM_SENT when the remote acknowledged no chunk of a stream for the reassembly timeout */
 		MAX_EVENTS,
 	};
 
+	// What the receive thread does when a layer's receive queue is full
+	enum class ReceiveOverflowPolicy : uint8_t
+	{
+		Drop, // Drops the newest packets, the remote resends the reliable ones
+		Wait, // Waits until Process makes room, only if Process runs on another thread than receiving
+	};
+
 	enum class DisconnectReason : uint8_t
 	{
 		TIMEOUT = 0,
+		REPLACED, // Another connection moved to the remote's address
 	};
 
 	enum class MessageID : uint8_t
@@ -53,12 +85,13 @@ namespace knet
 
 	public:
 
+		// Counts through all 2^31 values, the resend ring relies on that
 		decltype(sequenceNumber) GetSequenceNumber()
 		{
-			if (sequenceNumber >= std::numeric_limits<decltype(sequenceNumber)>::max())
-				sequenceNumber = 0;
+			auto current = sequenceNumber;
+			sequenceNumber = current == std::numeric_limits<decltype(sequenceNumber)>::max() ? 0 : current + 1;
 
-			return sequenceNumber++;
+			return current;
 		}
 
 		decltype(sequenceNumber) GetCurrentSequenceNumber()
@@ -86,7 +119,7 @@ namespace knet
 		/* Types/structs used internally in Reliability Layer */
 		struct RemoteSystem
 		{
-			std::weak_ptr<ISocket> _socket;
+			ISocket * _socket = nullptr;
 			SocketAddress address;
 
 			bool operator==(const RemoteSystem& system) const
@@ -108,56 +141,395 @@ namespace knet
 
 		internal::EventHandler<ReliabilityEvents> eventHandler;
 
-		using milliSecondsPoint = std::chrono::time_point<std::chrono::system_clock, std::chrono::milliseconds>;
+		using milliSecondsPoint = std::chrono::time_point<std::chrono::steady_clock, std::chrono::milliseconds>;
 
 		std::chrono::milliseconds _timeout = std::chrono::milliseconds(10000);
+
+		// Longest received reliable datagrams wait for a standalone ack, the remote is expected to use the same
+		std::chrono::milliseconds maxAckDelay = std::chrono::milliseconds(25);
 		milliSecondsPoint firstUnsentAck;
-		milliSecondsPoint lastReceiveFromRemote;
+		std::atomic<milliSecondsPoint> lastReceiveFromRemote;
+
+		// Filled by the receiving thread, drained by Process
+		internal::SpscRing<InternalRecvPacket*> receiveQueue;
+		ReceiveOverflowPolicy overflowPolicy = ReceiveOverflowPolicy::Drop;
+		std::atomic<uint64_t> droppedPackets{0};
+
+		// Moving average in nanoseconds from the kernel receiving a packet until Process handled it
+		std::atomic<int64_t> averageReceiveDelay{0};
 
-		std::mutex bufferMutex;
+		// Only used by Process
+		std::unordered_map<SocketAddress, RemoteSystem> remoteSystems;
 
-		std::queue<InternalRecvPacket*> bufferedPacketQueue;
+		// The id the remote puts on its datagrams to reach us and the one we put on ours, 0 if none
+		uint32_t localConnectionId = 0;
+		uint32_t remoteConnectionId = 0;
 
-		std::vector<RemoteSystem> remoteList;
-		std::vector<SequenceNumberType> acknowledgements;
-		std::vector<std::pair<milliSecondsPoint, std::unique_ptr<DatagramPacket>>> resendBuffer;
+		// Received reliable datagrams waiting for their ack
+		internal::AckWindow acknowledgements;
+
+		// Every reliable datagram which arrived recently, resent ones are acked again but their messages dropped
+		internal::ReceivedWindow receivedWindow;
+		size_t duplicateDatagrams = 0;
+
+		// The newest datagram waiting for our ack and when it arrived, the remote subtracts the wait from its sample
+		SequenceNumberType largestAcknowledgement = 0;
+		std::chrono::steady_clock::time_point largestAcknowledgementTime;
+
+		// Reliable datagrams which did not arrive, reported to the remote so it resends them before its timeout
+		internal::GapTracker gapTracker;
+		std::vector<internal::GapTracker::Range> nackRanges;
+
+		struct ResendEntry
+		{
+			std::chrono::steady_clock::time_point sendTime;
+			std::unique_ptr<DatagramPacket> packet;
+			uint32_t transmissions = 1; // Only datagrams sent once give round trip samples (Karn's rule)
+			size_t bytes = 0;
+			bool inFlight = true; // False once lost, until it is sent again
+			bool queued = false; // Held back by the pacer, its timer starts once it left
+			bool isFragment = false; // Counts against the split window until it is acknowledged
+			StreamId streamId = 0; // Carries a chunk of this stream, its bytes are acknowledged with it
+			size_t streamBytes = 0;
+
+			// Delivery state when it was sent, its ack yields the delivery rate since
+			uint64_t delivered = 0;
+			std::chrono::steady_clock::time_point deliveredTime;
+			bool appLimited = false;
+		};
+
+		// Unacknowledged reliable datagrams by sequence number, acks and nacks only touch the entries they name
+		internal::SequenceRing<ResendEntry> resendBuffer{512};
+
+		// Resend timers in the order they started, a record is stale once its entry was acked, lost or sent again
+		struct ResendTimer
+		{
+			std::chrono::steady_clock::time_point sendTime;
+			SequenceNumberType sequenceNumber = 0;
+		};
+
+		std::deque<ResendTimer> resendTimers;
+
+		// Entries which left the flight as lost, ProcessResend sends them again from here
+		std::deque<SequenceNumberType> lostDatagrams;
+
+		// Only used by Process, the published values can be read from any thread
+		internal::RttEstimator rttEstimator;
+		std::atomic<int64_t> smoothedRtt{0};
+		std::atomic<int64_t> rttVariance{0};
+
+		// Null sends without a window
+		std::unique_ptr<ICongestionController> congestionController;
+		size_t bytesInFlight = 0;
+		uint64_t totalDelivered = 0;
+		std::chrono::steady_clock::time_point lastDeliveredTime;
+		bool appLimited = true;
+
+		// Datagrams the pacer held back, they leave in order before anything else is sent
+		struct PacedDatagram
+		{
+			std::vector<char> data;
+			bool isReliable = false;
+			SequenceNumberType sequenceNumber = 0;
+		};
+
+		internal::Pacer pacer;
+		std::deque<PacedDatagram> pacedQueue;
+		double pacingRate = 0.0; // Set by SetPacingRate, 0 follows the congestion controller
 
 		std::array<OrderedIndexType, 255> orderingIndex;
 		std::array<SequenceIndexType, 255> sequencingIndex;
 		std::array<std::vector<ReliablePacket>, static_cast<std::size_t>(PacketPriority::IMMEDIATE)> sendBuffer;
-		std::array<std::vector<ReliablePacket>, 255> orderedPacketBuffer;
+		std::array<internal::ReorderWindow<ReliablePacket, OrderedIndexType>, 256> orderedPacketBuffer;
+
+		// Channels whose expected message arrived, only they are delivered from
+		std::vector<OrderedChannelType> readyOrderedChannels;
+		std::array<SequenceIndexType, 256> highestSequencedReadIndex; // One per OrderedChannelType value, the channel comes from the wire
+
+
+		internal::ReassemblyBuffer reassemblyBuffer;
+
+		// Split messages whose fragments are still to be sent, the cursor moves on with every fragment, see ProcessSplitSends
+		struct SplitMessage
+		{
+			ReliablePacket packet;
+			size_t offset = 0;
+			uint16_t nextIndex = 0;
+			uint16_t packetIndex = 0;
+			uint16_t fragmentSize = 0;
+		};
 
-		std::array<OrderedIndexType, 255> lastOrderedIndex;
-		std::array<SequenceIndexType, 255> highestSequencedReadIndex;
+		std::array<std::deque<SplitMessage>, static_cast<std::size_t>(PacketPriority::IMMEDIATE)> splitQueue;
+		size_t splitBytesPending = 0;
+		size_t fragmentBytesUnacked = 0;
+		size_t splitWindow = 256 * 1024; // Set by SetSplitWindow
 
+		// Streams we send, pulled a chunk at a time and kept until every chunk was acknowledged, see ProcessStreamSends
+		struct OutgoingStream
+		{
+			StreamSource source;
+			uint64_t size = 0;
+			uint64_t offset = 0;
+			uint64_t acknowledged = 0;
+			uint16_t chunkSize = 0;
+
+			// The chunk being filled, a source may hand it out in parts
+			std::unique_ptr<char[]> chunk;
+			size_t chunkFill = 0;
+			bool paused = false; // The source ran dry, it is asked again with the next Process
+			std::chrono::steady_clock::time_point lastProgress; // Last ack, or the send which followed a time without chunks in flight
+		};
+
+		std::map<StreamId, OutgoingStream> outgoingStreams;
+		StreamId nextStreamId = 1;
 
-		std::unordered_map<uint16_t, std::vector<ReliablePacket>> splitPacketBuffer;
+		// Streams the remote sends, only the chunks which arrived are tracked
+		struct IncomingStream
+		{
+			std::shared_ptr<IStreamSink> sink;
+			uint64_t size = 0;
+			uint64_t received = 0;
+			uint16_t chunkSize = 0;
+			std::vector<uint64_t> arrived;
+			std::chrono::steady_clock::time_point lastChunk; // Dropped once no chunk came for the reassembly timeout
+		};
+
+		std::unordered_map<StreamId, IncomingStream> incomingStreams;
+		std::deque<StreamId> finishedStreams; // Resent chunks of these are acked again and dropped
+		std::deque<StreamId> expiredStreams; // Chunks of these are refused, the remote gives up on them once they stay unacknowledged
+		size_t incomingStreamBytes = 0; // Taken by the bitmaps of incomingStreams, limited like split messages
+		StreamAcceptor streamAcceptor;
 	private:
 		/* Methods */
 		void SendACKs();
+		void SendNACKs();
+
+		// Writes an ack block and its delay, false if nothing fit into maxBytes
+		bool WriteAcks(BitStream &bitStream, size_t maxBytes);
+
+		// Serializes a datagram, waiting acks ride along if there is room for them
+		void SerializeDatagram(DatagramPacket *pDatagramPacket, BitStream &bitStream);
+
+		void HandleAcks(const std::vector<internal::AckWindow::Range> &ranges, uint32_t ackDelay, std::chrono::steady_clock::time_point arrivalTime);
 
 
-		bool ProcessPacket(InternalRecvPacket *pPacket, std::chrono::time_point<std::chrono::system_clock, std::chrono::milliseconds> &curTime);
+		bool ProcessPacket(InternalRecvPacket *pPacket, milliSecondsPoint &curTime);
 
 		void ProcessResend(milliSecondsPoint &curTime);
 		void ProcessOrderedPackets(milliSecondsPoint &curTime);
+		void BufferOrderedPacket(ReliablePacket &&packet);
 		void ProcessSend(milliSecondsPoint &curTime);
+		void ProcessPacedSends();
+
+		void SplitPacket(ReliablePacket & packet);
+		void ProcessSplitSends();
+
+		// Fragments leave while the flow window and the part of the congestion window left to other messages allow it
+		bool CanSendFragment() const;
+
+		void ProcessStreamSends();
+		bool HasStreamToSend() const;
+		// Checks a chunk before its datagram is acked and starts its stream, chunks which are refused are not acked
+		bool AdmitStreamChunk(ReliablePacket &packet, std::chrono::steady_clock::time_point now);
+		void HandleStreamChunk(ReliablePacket &packet, std::chrono::steady_clock::time_point now);
+		void ExpireIncomingStreams(std::chrono::steady_clock::time_point now);
+		// Gives up on streams the remote stopped acknowledging, it expired them on its side by then
+		void ExpireOutgoingStreams(std::chrono::steady_clock::time_point now);
+		void OnStreamChunkAcknowledged(StreamId id, size_t bytes);
+
+		void StampConnectionId(DatagramHeader &header) const;
+
+		// Checks if the packet carries the connection id the remote got from us
+		bool CarriesLocalConnectionId(InternalRecvPacket *pPacket) const;
+
+		// Follows the remote to a new address if the packet carries our connection id and is newer than anything received
+		bool MigrateRemote(InternalRecvPacket *pPacket);
+
+		// Tracks a sent reliable datagram until it is acknowledged
+		ResendEntry & AddToResendBuffer(DatagramPacket *pDatagramPacket, size_t bytes, bool isFragment = false);
+		bool HasCongestionWindow() const;
+
+		// Oldest resend timer which still runs or null, stale records in front of it are dropped
+		const ResendTimer *OldestResendTimer();
 
-		bool SplitPacket(ReliablePacket & packet, DatagramPacket ** pDatagramPacket);
+		// Whether an entry waits to be sent again, acked ones in front of it are dropped
+		bool HasLostDatagrams();
+
+		// Sends a serialized datagram or queues it until the pacer lets it leave, reliable ones must be in the resend buffer already
+		void SendDatagram(BitStream &bitStream, const DatagramPacket *pDatagramPacket);
+		bool CanSendPaced();
+
+		// Adds the round trip of a resent datagram unless it was sent more than once, returns zero then
+		std::chrono::nanoseconds SampleRtt(SequenceNumberType sequenceNumber, std::chrono::steady_clock::time_point ackTime);
+
+		// When the kernel received the packet, falls back to now for packets which were not received from a socket
+		static std::chrono::steady_clock::time_point GetArrivalTime(const InternalRecvPacket *pPacket);
 
 	public:
 		ReliabilityLayer();
 		ReliabilityLayer(std::weak_ptr<ISocket>);
 		virtual ~ReliabilityLayer();
 
-		void Send(const char *, size_t, PacketPriority = PacketPriority::MEDIUM, PacketReliability = PacketReliability::RELIABLE);
+		//! Queues a message, or sends it right away with PacketPriority::IMMEDIATE
+		/*!
+		\return false if the message is larger than ReassemblyBuffer::maxMessageSize, such payloads go through SendStream
+		*/
+		bool Send(const char *, size_t, PacketPriority = PacketPriority::MEDIUM, PacketReliability = PacketReliability::RELIABLE);
 
 		void Process();
 
+		//! Gets the time Process has work to do next
+		/*!
+		\return The earliest ack, resend or timeout deadline, now if packets are waiting and time_point::max() if idle
+		*/
+		std::chrono::steady_clock::time_point GetNextWakeup();
+
 		bool OnReceive(InternalRecvPacket *packet);
+		bool OnReceive(InternalRecvPacket **ppPackets, size_t count);
 
 		InternalRecvPacket* PopBufferedPacket();
 
+		//! Sets up the queue between the receiving thread and Process
+		/*!
+		Must be called before packets are received, queued packets are dropped
+		\param[in] capacity Packets the queue holds, rounded up to a power of two
+		\param[in] policy What happens to packets arriving while the queue is full
+		*/
+		void SetReceiveQueue(size_t capacity, ReceiveOverflowPolicy policy);
+
+		//! Gets the number of packets waiting for Process
+		size_t GetReceiveQueueDepth() const;
+
+		//! Gets the number of packets dropped because the receive queue was full
+		uint64_t GetDroppedPackets() const;
+
+		//! Gets the average time received packets waited until Process handled them
+		/*!
+		Measured from the kernel receive timestamp if the socket has them enabled, from the socket receive otherwise
+		*/
+		std::chrono::nanoseconds GetReceiveDelay() const;
+
+		//! Adds a round trip measured outside of the datagram acks, by pings for example
+		void AddRttSample(std::chrono::nanoseconds sample);
+
+		//! Gets the smoothed round trip time, thread safe
+		/*!
+		\return Zero until the first sample
+		*/
+		std::chrono::nanoseconds GetRoundTripTime() const;
+
+		//! Gets the round trip time variance, thread safe
+		std::chrono::nanoseconds GetRoundTripTimeVariance() const;
+
+		//! Gets the time after which an unacknowledged datagram is resent, with the backoff of timed out resends
+		/*!
+		Covers the delay the remote holds back its acks
+		*/
+		std::chrono::nanoseconds GetRetransmissionTimeout() const;
+
+		//! Selects the congestion control of this connection
+		/*!
+		Bytes already in flight stay accounted, the new controller starts from its initial window
+		*/
+		void SetCongestionControl(CongestionControlType type);
+
+		CongestionControlType GetCongestionControl() const;
+
+		//! Gets the active controller
+		/*!
+		\return nullptr for CongestionControlType::None
+		*/
+		const ICongestionController * GetCongestionController() const;
+
+		//! Gets the bytes of reliable datagrams sent but neither acknowledged nor lost
+		size_t GetBytesInFlight() const;
+
+		//! Sets the rate datagrams leave at
+		/*!
+		\param[in] bytesPerSecond 0 paces at the rate of the congestion controller, datagrams leave as they are sent without one
+		*/
+		void SetPacingRate(double bytesPerSecond);
+
+		//! Gets the rate datagrams currently leave at
+		/*!
+		\return Bytes per second, 0 if they are not paced
+		*/
+		double GetPacingRate() const;
+
+		//! Sets the bytes which may leave at once after the connection was idle
+		void SetPacingBurst(size_t bytes);
+
+		//! Gets the number of datagrams held back by the pacer
+		size_t GetPacedQueueSize() const;
+
+		//! Sets how far received datagrams must be ahead of a missing one before it is reported lost
+		/*!
+		\param[in] threshold In sequence numbers, 0 never reports losses and leaves them to the remote's timeout
+		*/
+		void SetReorderThreshold(uint32_t threshold);
+
+		uint32_t GetReorderThreshold() const;
+
+		//! Limits the messages waiting for their missing fragments
+		/*!
+		Messages which do not fit the memory or are not complete within the timeout are dropped
+		Streams the remote sends are limited the same way, by the bytes tracking their chunks and the time since their last chunk
+		Streams we send fail once none of their chunks was acknowledged for the timeout
+		\param[in] maxBytes Bytes all of them may take together
+		\param[in] timeout From the first fragment of a message on
+		*/
+		void SetReassemblyLimits(size_t maxBytes, std::chrono::milliseconds timeout);
+
+		//! Sets the bytes of fragments which may be unacknowledged
+		/*!
+		Large messages are sent a few fragments at a time, the rest of the window stays free for other messages
+		*/
+		void SetSplitWindow(size_t bytes);
+
+		size_t GetSplitWindow() const;
+
+		//! Gets the bytes of split messages which were not sent yet
+		size_t GetPendingSplitBytes() const;
+
+		//! Sends a stream of bytes, pulled from source as the connection has room for them
+		/*!
+		Only the chunks in flight are held in memory, the window and the pacer decide how fast the source is read
+		The chunks share the split window with the fragments of large messages
+		\param[in] size Bytes the source will provide
+		\return The id the remote gets the stream by, 0 if size is 0
+		*/
+		StreamId SendStream(uint64_t size, StreamSource source);
+
+		//! Sends a file as a stream, read through a memory mapping
+		/*!
+		\return 0 if the file can not be read or is empty
+		*/
+		StreamId SendFile(const std::string &path);
+
+		//! Sets who picks the sinks of streams the remote starts
+		/*!
+		Without one, or if it returns nullptr, the chunks are handed out as STREAM_CHUNK events
+		*/
+		void SetStreamAcceptor(StreamAcceptor acceptor);
+
+		//! Gets how far a stream we send got
+		/*!
+		\return false if it is unknown or every byte of it was acknowledged
+		*/
+		bool GetSendProgress(StreamId id, StreamProgress &progress) const;
+
+		//! Gets how much of a stream the remote sends arrived
+		/*!
+		\return false if it is unknown or complete
+		*/
+		bool GetReceiveProgress(StreamId id, StreamProgress &progress) const;
+
+		//! Gets the number of split messages which were dropped unfinished
+		size_t GetDroppedSplitMessages() const;
+
+		//! Gets the number of resent reliable datagrams which were dropped because they arrived already
+		size_t GetDuplicateDatagrams() const;
+
 		inline decltype(eventHandler) &GetEventHandler()
 		{
 			return eventHandler;
@@ -209,6 +581,32 @@ namespace knet
 		void SetRemoteAddress(SocketAddress &socketAddress);
 
 
+		//! Sets the connection id the remote uses to reach this layer
+		/*!
+		A packet from another address carrying it moves the connection there, after NAT rebinding for example
+		\param[in] connectionId The id, 0 if none was assigned
+		*/
+		void SetLocalConnectionId(uint32_t connectionId);
+
+		//! Sets the connection id put on every sent datagram
+		/*!
+		\param[in] connectionId The id the remote assigned to us, 0 sends none
+		*/
+		void SetRemoteConnectionId(uint32_t connectionId);
+
+		uint32_t GetRemoteConnectionId() const;
+
+
+		//! Sets the longest a received reliable datagram waits for its ack
+		/*!
+		Acks go out with the next datagram sent to the remote, a standalone ack is only sent if none was sent within the delay
+		Both sides should use the same, the retransmission timeout allows for the remote's delay
+		*/
+		void SetAckDelay(std::chrono::milliseconds delay);
+
+		std::chrono::milliseconds GetAckDelay() const;
+
+
 		//! Sets the timeout for the connections
 		/*!
 		\param[in] time The time in ms after a connection will be closed if no data was received
@@ -11,37 +11,149 @@
 #ifdef WIN32
 #include <WinSock2.h>
 #include <Windows.h>
+#else
+#include <sys/socket.h>
+#include <netinet/in.h>
 #endif
 
+#include <atomic>
 #include <thread>
+#include <mutex>
+#include <vector>
 
 namespace knet
 {
 
 	class BerkleySocket : public ISocket, public std::enable_shared_from_this<BerkleySocket>
 	{
-	private:
+	protected:
 		int m_Socket = 0;
+		int m_AddressFamily = AF_INET;
 		SocketAddress m_BoundAddress;
 
 		std::thread receiveThread;
 		bool bRecvThreadRunning = false;
+		bool endThread = false;
+		bool bReusePort = false;
+
+		// Datagrams staged until Flush, set by Bind and read by the io_uring path as well
+		size_t sendBatchSize = 1;
+
+		bool SendTo(const SocketAddress &remoteSystem, const char* pData, size_t length);
+
+		// Receives up to receiveBatchSize datagrams and dispatches them, returns the number received
+		size_t ReceiveBatch(bool bBlocking);
+
+		// Hands received packets to the RECEIVE_BATCH handlers or one by one to the RECEIVE handlers
+		void DispatchReceived(InternalRecvPacket** ppPackets, size_t count);
+
+		// Reads the transmit timestamps the kernel queued on the error queue, no-op without kernel timestamps
+		void DrainTransmitTimestamps();
+	private:
 		internal::EventHandler<SocketEvents> eventHandler;
 
-		void RecvFromLoop();
+		// Preallocated receive packets, the ones handed to the handlers are replaced after each batch
+		size_t receiveBatchSize = 1;
+		std::vector<InternalRecvPacket*> recvPackets;
+#ifdef __linux__
+		std::vector<mmsghdr> recvHeaders;
+		std::vector<iovec> recvVectors;
+		std::vector<sockaddr_storage> recvAddresses;
 
-		bool endThread = false;
+		// Blocks lent to the segments of coalesced bursts, the packets share them so they outlive the socket
+		class ReceiveBlocks : public IBufferOwner
+		{
+		private:
+			std::mutex blockMutex;
+			std::vector<std::unique_ptr<char[]>> blocks;
+			std::vector<uint32_t> references;
+			std::vector<uint32_t> freeBlocks;
+			size_t capacity;
+		public:
+			explicit ReceiveBlocks(size_t maxBlocks);
+
+			// Takes a free block, grows the pool if every block is referenced by queued packets
+			// Returns nullptr once the pool holds capacity blocks and none is free
+			char * Acquire(uint32_t &block);
+
+			// Lends the block to count packets, it is free again once all of them released it
+			void Lend(uint32_t block, uint32_t count);
+
+			virtual void ReleaseBuffer(uint32_t bufferId) final;
+		};
+
+		// Receive offload, every batch slot receives into a block which the split datagrams reference
+		bool bReceiveOffload = false;
+		std::shared_ptr<ReceiveBlocks> receiveBlocks;
+		std::vector<uint32_t> recvBlocks;
+		std::vector<char> recvControl;
+		std::vector<InternalRecvPacket*> recvSegments;
+
+		size_t ReceiveSegments(int received);
+
+		// Kernel timestamps, receive ones arrive with each datagram, transmit ones through the error queue
+		bool bKernelTimestamps = false;
+		size_t recvControlSize = 0;
+
+		// Send times by SOF_TIMESTAMPING_OPT_ID, the kernel numbers every sent message starting at 0
+		std::mutex timestampMutex;
+		uint32_t transmitCounter = 0;
+		std::vector<std::chrono::steady_clock::time_point> transmitTimes;
+
+		// Reads the segment size and the kernel receive time of a received message, keeps the passed values if absent
+		// Returns true if the message carried a kernel receive time
+		bool ParseReceiveControl(msghdr &message, size_t &segmentSize, std::chrono::steady_clock::time_point &kernelTimeStamp) const;
+		void RecordTransmit(std::chrono::steady_clock::time_point sendTime, size_t messages);
+#endif
+
+		// Delays measured from kernel timestamps, averages are moving averages in nanoseconds
+		std::atomic<uint64_t> timestampedReceives{0};
+		std::atomic<int64_t> averageReceiveDelay{0};
+		std::atomic<int64_t> maxReceiveDelay{0};
+		std::atomic<uint64_t> timestampedSends{0};
+		std::atomic<int64_t> averageSendDelay{0};
+		std::atomic<int64_t> maxSendDelay{0};
+
+		void RecordReceiveDelay(InternalRecvPacket &packet);
+
+		// Send batching, datagrams are staged here until Flush or until the batch is full
+		std::mutex sendMutex;
+		size_t stagedDatagrams = 0;
+		std::vector<char> stagedData;
+#ifdef __linux__
+		std::vector<mmsghdr> sendHeaders;
+		std::vector<iovec> sendVectors;
+		std::vector<sockaddr_storage> sendAddresses;
+		std::vector<socklen_t> sendAddressLengths;
+
+		// Generic segmentation offload, disabled again if the kernel refuses it
+		bool bSegmentationOffload = false;
+		std::vector<char> sendControl;
+
+		size_t CountSegments(size_t first) const;
+#endif
+
+		void FlushStaged();
+
+		void PrepareReceiveBuffers();
+		void RecvFromLoop();
 	public:
 		BerkleySocket();
 		virtual ~BerkleySocket();
 
-		virtual bool Send(const SocketAddress &remoteSystem, const char* pData, size_t length) final;
-		virtual bool Bind(const SocketBindArguments &bindArgs) final;
+		virtual bool Send(const SocketAddress &remoteSystem, const char* pData, size_t length) override;
+		virtual bool Bind(const SocketBindArguments &bindArgs) override;
+		virtual void Flush() override;
 
 		virtual const SocketType GetSocketType() const override;
 
-		virtual void StartReceiving() final;
-		virtual void StopReceiving(bool bWait = false) final;
+		virtual void StartReceiving() override;
+		virtual void StopReceiving(bool bWait = false) override;
+
+		virtual bool Poll(std::chrono::milliseconds maxWait) override;
+		virtual void ScheduleWakeup(std::chrono::steady_clock::time_point wakeupTime) override;
+
+		virtual SocketStatistics GetStatistics() const override;
 
 		virtual const SocketAddress& GetSocketAddress() const final;
 
@@ -0,0 +1,49 @@
+// Copyright 2015 the kNet authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#pragma once
+
+#include "berkley_socket.h"
+
+namespace knet
+{
+	/*
+	* Non-blocking socket driven by epoll readiness
+	* The event loop either runs on an internal thread or on the caller's thread via Poll
+	*/
+	class EpollSocket : public BerkleySocket
+	{
+	private:
+		int epollDescriptor = -1;
+		int wakeupDescriptor = -1; // eventfd
+		int timerDescriptor = -1; // timerfd
+
+		bool ownsEventLoop = true;
+
+		void EventLoop();
+		void Close();
+	public:
+		EpollSocket();
+		virtual ~EpollSocket();
+
+		virtual bool Bind(const SocketBindArguments &bindArgs) final;
+
+		virtual const SocketType GetSocketType() const final;
+
+		virtual void StartReceiving() final;
+		virtual void StopReceiving(bool bWait = false) final;
+
+		virtual bool Poll(std::chrono::milliseconds maxWait) final;
+		virtual void ScheduleWakeup(std::chrono::steady_clock::time_point wakeupTime) final;
+
+		//! Interrupts a running Poll from any thread
+		void Wakeup();
+
+		//! Gets the epoll descriptor
+		/*!
+		\return Descriptor which becomes readable when Poll has work, for callers integrating it in their own loop
+		*/
+		int GetEventDescriptor() const;
+	};
+};
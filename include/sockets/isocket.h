@@ -7,14 +7,18 @@
 #include "socket_address.h"
 
 #include "../internal/event_handler.h"
+#include "../internal/packet_pool.h"
 
 #ifdef WIN32
 #include <WinSock2.h>
 #include <Ws2def.h>
 #endif
 
+#include <algorithm>
 #include <memory>
+#include <mutex>
 #include <cstring>
+#include <chrono>
 /*
 	TODO: clean this file up
 */
@@ -27,19 +31,43 @@ namespace knet
 	{
 		unsigned short usPort = 0;
 		std::string szHostAddress = "";
-		short addressFamily = AF_INET;
+		short addressFamily = AF_INET; /* AF_INET6 binds a dual-stack socket, an IPv6 host address always does */
+		bool v6Only = false; /* IPv6 sockets only, refuses IPv4 remotes instead of accepting them as mapped addresses */
 		int socketType = SOCK_DGRAM;
 		int socketProtocol = 0;
+		size_t receiveBatchSize = 1; /* Datagrams drained per receive syscall, 1 disables batching */
+		size_t sendBatchSize = 1; /* Datagrams staged until Flush, 1 sends immediately */
+		bool ownsEventLoop = true; /* Event driven sockets only, false leaves running the loop to the caller via Poll */
+		bool receiveOffload = false; /* Linux only, enables UDP_GRO, coalesced bursts are received into shared blocks and split without copying */
+		bool segmentationOffload = true; /* Linux only, sends staged runs of equal sized datagrams to one remote as a single UDP_SEGMENT send */
+		size_t reusePortGroupSize = 0; /* Linux only, above 1 binds with SO_REUSEPORT and steers each remote to socket hash % size of the group */
+		bool kernelTimestamps = false; /* Linux only, Berkley and Epoll sockets, requests software SO_TIMESTAMPING receive and transmit timestamps */
+	};
+
+	struct SocketStatistics
+	{
+		// Time from the kernel receiving a datagram until the socket handed it out
+		uint64_t timestampedReceives = 0;
+		std::chrono::nanoseconds averageReceiveDelay{0};
+		std::chrono::nanoseconds maxReceiveDelay{0};
+
+		// Time from the send call until the kernel passed the datagram to the device, a segmented send counts once
+		uint64_t timestampedSends = 0;
+		std::chrono::nanoseconds averageSendDelay{0};
+		std::chrono::nanoseconds maxSendDelay{0};
 	};
 
 	enum class SocketType : uint8_t
 	{
 		Berkley,
+		Epoll, /* Linux only */
+		IoUring, /* Linux only, falls back to Berkley if the kernel lacks support */
 	};
 
 	enum class SocketEvents : uint8_t
 	{
 		RECEIVE,
+		RECEIVE_BATCH, /* Called once per batch with (InternalRecvPacket**, size_t) instead of RECEIVE */
 		MAX_EVENTS,
 	};
 
@@ -52,6 +80,19 @@ namespace knet
 #endif
 #pragma endregion
 
+	/*
+	* Owner of the receive buffers a socket lends to its packets
+	* The packets share the ownership, so the buffers stay valid after the socket closed until the last one came back
+	*/
+	class IBufferOwner
+	{
+	public:
+		virtual ~IBufferOwner() = default;
+
+		// Takes back a buffer lent to an InternalRecvPacket
+		virtual void ReleaseBuffer(uint32_t bufferId) = 0;
+	};
+
 	/*
 	* Interface for sockets
 	*/
@@ -61,6 +102,9 @@ namespace knet
 		virtual bool Send(const SocketAddress &remoteSystem, const char* pData, size_t length) = 0;
 		virtual bool Bind(const SocketBindArguments &bindArgs) = 0;
 
+		// Sends everything staged by Send, no-op when send batching is disabled
+		virtual void Flush() = 0;
+
 		virtual const SocketType GetSocketType() const = 0;
 
 		virtual const SocketAddress& GetSocketAddress() const = 0;
@@ -68,6 +112,16 @@ namespace knet
 		virtual void StartReceiving() = 0;
 		virtual void StopReceiving(bool bWait = false) = 0;
 
+		// Runs the socket event loop once on the calling thread, waits at most maxWait
+		// Returns false if the socket is not event driven, the caller has to pace itself then
+		virtual bool Poll(std::chrono::milliseconds maxWait) = 0;
+
+		// Makes Poll return at wakeupTime, time_point::max() cancels the wakeup
+		virtual void ScheduleWakeup(std::chrono::steady_clock::time_point wakeupTime) = 0;
+
+		// Queuing delays measured from kernel timestamps, empty unless they were enabled on bind
+		virtual SocketStatistics GetStatistics() const = 0;
+
 		virtual internal::EventHandler<SocketEvents>& GetEventHandler() = 0;
 	};
 
@@ -76,38 +130,111 @@ namespace knet
 	{
 	public:
 		char data[MAX_MTU_SIZE];
-		size_t bytesRead;
+		size_t bytesRead = 0;
 		SocketAddress remoteAddress;
 		std::chrono::steady_clock::time_point timeStamp;
-		std::weak_ptr<ISocket> _socket;
+		std::chrono::steady_clock::time_point kernelTimeStamp; // When the kernel received the datagram, equal to timeStamp without kernel timestamps
+		ISocket * _socket = nullptr; // The receiving socket, it outlives its packets
+
+		// The received bytes, either data or a buffer lent by bufferOwner which gets it back on release
+		char * buffer = data;
+		std::shared_ptr<IBufferOwner> bufferOwner;
+		uint32_t bufferId = 0;
+
+		// data is left uninitialized, only bytesRead bytes are ever valid
+		InternalRecvPacket() = default;
+
+		~InternalRecvPacket()
+		{
+			bytesRead = 0;
+
+			ReleaseBuffer();
+		}
 
-		InternalRecvPacket()
+		//! Takes a packet from the process wide pool
+		/*!
+		\return a new packet if the pool is empty
+		*/
+		static InternalRecvPacket * Acquire()
 		{
-			memset(data, 0, sizeof(data));
+			return GetPool().Take();
 		}
 
-		~InternalRecvPacket()
+		//! Returns the packet to the pool, use this instead of delete
+		void Release()
 		{
+			ReleaseBuffer();
+
 			bytesRead = 0;
+			_socket = nullptr;
+
+			GetPool().Return(this);
+		}
+
+		//! Limits how many released packets are kept for reuse, 0 deletes them right away
+		static void SetPoolCapacity(size_t capacity)
+		{
+			GetPool().SetCapacity(capacity);
+		}
+
+		//! Asks for room in the pool shared by the whole process, the largest request so far wins
+		static void ReservePoolCapacity(size_t capacity)
+		{
+			static std::mutex reserveMutex;
+			static size_t reserved = 0;
+
+			std::lock_guard<std::mutex> lock{reserveMutex};
+
+			reserved = std::max(reserved, capacity);
+			GetPool().SetCapacity(reserved);
+		}
+
+		static size_t GetPoolCapacity()
+		{
+			return GetPool().GetCapacity();
+		}
+
+		// Gives a lent buffer back
+		void ReleaseBuffer()
+		{
+			if (!bufferOwner)
+				return;
+
+			bufferOwner->ReleaseBuffer(bufferId);
+
+			bufferOwner.reset();
+			buffer = data;
 		}
 
 		InternalRecvPacket(const InternalRecvPacket &other) = delete;
 		InternalRecvPacket(InternalRecvPacket &&other)
 		{
-			memmove(this->data, other.data, sizeof(this->data));
-			this->bytesRead = other.bytesRead;
-			this->timeStamp = std::move(other.timeStamp);
-			this->remoteAddress = std::move(other.remoteAddress);
-			this->_socket = other._socket;
-
-			other.bytesRead = 0;
+			*this = std::move(other);
 		}
 
 		InternalRecvPacket& operator=(InternalRecvPacket &&other)
 		{
-			memmove(this->data, other.data, sizeof(this->data));
+			ReleaseBuffer();
+
+			if (other.bufferOwner)
+			{
+				// Take over the lent buffer
+				this->buffer = other.buffer;
+				this->bufferOwner = std::move(other.bufferOwner);
+				this->bufferId = other.bufferId;
+
+				other.buffer = other.data;
+			}
+			else
+			{
+				// Only the received bytes are worth copying
+				memcpy(this->data, other.data, other.bytesRead);
+				this->buffer = this->data;
+			}
+
 			this->bytesRead = other.bytesRead;
 			this->timeStamp = std::move(other.timeStamp);
+			this->kernelTimeStamp = std::move(other.kernelTimeStamp);
 			this->remoteAddress = std::move(other.remoteAddress);
 			this->_socket = other._socket;
 
@@ -115,5 +242,12 @@ namespace knet
 
 			return *this;
 		}
+	private:
+		// Never destroyed, packets may still be released while the process exits
+		static internal::PacketPool<InternalRecvPacket> & GetPool()
+		{
+			static auto pPool = new internal::PacketPool<InternalRecvPacket>();
+			return *pPool;
+		}
 	};
 };
@@ -6,29 +6,211 @@
 
 #ifdef _WIN32
 #include <WinSock2.h>
+#include <ws2tcpip.h>
 #else
+#include <arpa/inet.h>
 #include <netinet/in.h>
+#include <sys/socket.h>
 #endif
 
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <string>
+
 namespace knet
 {
+	/*
+	* IPv4 or IPv6 address with port in one canonical form
+	* IPv4 addresses are kept as IPv4-mapped IPv6 addresses (::ffff:a.b.c.d), so a remote received on a dual-stack socket
+	* equals the same remote received on an IPv4 socket and comparing or hashing never looks at the family
+	*/
 	class SocketAddress
 	{
+	private:
+		// The 16 address bytes in network byte order, compared as two words
+		uint64_t host[2] = {0, 0};
+		uint32_t scopeId = 0; // Interface of a link-local IPv6 address
+		uint16_t port = 0; // Network byte order
+
+		const uint8_t * Bytes() const
+		{
+			return reinterpret_cast<const uint8_t*>(host);
+		}
+
+		void SetMapped(const in_addr &address)
+		{
+			static const uint8_t mappedPrefix[12] = {0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0xff, 0xff};
+
+			uint8_t * pBytes = reinterpret_cast<uint8_t*>(host);
+			memcpy(pBytes, mappedPrefix, sizeof(mappedPrefix));
+			memcpy(pBytes + sizeof(mappedPrefix), &address, sizeof(address));
+
+			scopeId = 0;
+		}
+
+		static uint64_t Mix(uint64_t value)
+		{
+			value = (value ^ (value >> 30)) * 0xBF58476D1CE4E5B9ull;
+			value = (value ^ (value >> 27)) * 0x94D049BB133111EBull;
+			return value ^ (value >> 31);
+		}
 	public:
-		union// In6OrIn4
+		SocketAddress() = default;
+
+		SocketAddress(const sockaddr *pAddress, socklen_t length)
 		{
-#if _IPV6==1
-			struct sockaddr_storage sa_stor;
-			struct sockaddr_in6 addr6;
-#endif
+			FromSockAddr(pAddress, length);
+		}
+
+		//! Parses a numeric IPv4 or IPv6 host address
+		/*!
+		\return false if hostAddress is no valid address, the address is left unchanged then
+		*/
+		bool SetHost(const std::string &hostAddress)
+		{
+			in_addr address4;
+
+			if (inet_pton(AF_INET, hostAddress.c_str(), &address4) == 1)
+			{
+				SetMapped(address4);
+				return true;
+			}
+
+			in6_addr address6;
+
+			if (inet_pton(AF_INET6, hostAddress.c_str(), &address6) == 1)
+			{
+				memcpy(host, &address6, sizeof(host));
+				scopeId = 0;
+				return true;
+			}
+
+			return false;
+		}
+
+		void SetPort(uint16_t hostPort)
+		{
+			port = htons(hostPort);
+		}
+
+		uint16_t GetPort() const
+		{
+			return ntohs(port);
+		}
+
+		//! Takes the address from a sockaddr_in or sockaddr_in6
+		/*!
+		\return false for other families or a too short length, the address is left unchanged then
+		*/
+		bool FromSockAddr(const sockaddr *pAddress, socklen_t length)
+		{
+			if (pAddress->sa_family == AF_INET && length >= sizeof(sockaddr_in))
+			{
+				auto pAddress4 = reinterpret_cast<const sockaddr_in*>(pAddress);
+
+				SetMapped(pAddress4->sin_addr);
+				port = pAddress4->sin_port;
+				return true;
+			}
+
+			if (pAddress->sa_family == AF_INET6 && length >= sizeof(sockaddr_in6))
+			{
+				auto pAddress6 = reinterpret_cast<const sockaddr_in6*>(pAddress);
+
+				memcpy(host, &pAddress6->sin6_addr, sizeof(host));
+				scopeId = pAddress6->sin6_scope_id;
+				port = pAddress6->sin6_port;
+				return true;
+			}
 
-			struct sockaddr_in addr4;
-		} address;
+			return false;
+		}
+
+		//! Writes the address in the form a socket of the given family expects
+		/*!
+		IPv4 addresses are written mapped for IPv6 sockets, which needs the socket to be dual-stack
+		\return The length of the written address, 0 if the address can not be reached from an IPv4 socket
+		*/
+		socklen_t ToSockAddr(sockaddr_storage &storage, int family) const
+		{
+			memset(&storage, 0, sizeof(storage));
+
+			if (family == AF_INET)
+			{
+				if (!IsIPv4() && !IsUnspecified())
+					return 0;
+
+				auto &address4 = reinterpret_cast<sockaddr_in&>(storage);
+				address4.sin_family = AF_INET;
+				address4.sin_port = port;
+				memcpy(&address4.sin_addr, Bytes() + 12, sizeof(address4.sin_addr));
+
+				return sizeof(sockaddr_in);
+			}
+
+			auto &address6 = reinterpret_cast<sockaddr_in6&>(storage);
+			address6.sin6_family = AF_INET6;
+			address6.sin6_port = port;
+			address6.sin6_scope_id = scopeId;
+			memcpy(&address6.sin6_addr, host, sizeof(host));
+
+			return sizeof(sockaddr_in6);
+		}
+
+		bool IsIPv4() const
+		{
+			const uint8_t * pBytes = Bytes();
+			return host[0] == 0 && pBytes[8] == 0 && pBytes[9] == 0 && pBytes[10] == 0xff && pBytes[11] == 0xff;
+		}
+
+		//! Checks for :: or 0.0.0.0
+		bool IsUnspecified() const
+		{
+			const uint8_t * pBytes = Bytes();
+			return (host[0] == 0 && host[1] == 0) || (IsIPv4() && pBytes[12] == 0 && pBytes[13] == 0 && pBytes[14] == 0 && pBytes[15] == 0);
+		}
+
+		//! Formats the address as a.b.c.d:port or [v6]:port
+		std::string ToString() const
+		{
+			char text[INET6_ADDRSTRLEN] = {0};
 
-		bool operator== (const SocketAddress &cP1) const
+			if (IsIPv4())
+			{
+				inet_ntop(AF_INET, const_cast<uint8_t*>(Bytes() + 12), text, sizeof(text));
+				return std::string(text) + ":" + std::to_string(GetPort());
+			}
+
+			inet_ntop(AF_INET6, const_cast<uint64_t*>(host), text, sizeof(text));
+			return "[" + std::string(text) + "]:" + std::to_string(GetPort());
+		}
+
+		size_t Hash() const
+		{
+			return static_cast<size_t>(Mix(host[0] ^ Mix(host[1] ^ (static_cast<uint64_t>(scopeId) << 16) ^ port)));
+		}
+
+		bool operator== (const SocketAddress &other) const
+		{
+			return host[1] == other.host[1] && port == other.port && host[0] == other.host[0] && scopeId == other.scopeId;
+		}
+
+		bool operator!= (const SocketAddress &other) const
+		{
+			return !(*this == other);
+		}
+	};
+};
+
+namespace std
+{
+	template<>
+	struct hash<knet::SocketAddress>
+	{
+		size_t operator()(const knet::SocketAddress &address) const
 		{
-			return (address.addr4.sin_addr.s_addr == cP1.address.addr4.sin_addr.s_addr
-					&& address.addr4.sin_port == cP1.address.addr4.sin_port);
+			return address.Hash();
 		}
 	};
 };
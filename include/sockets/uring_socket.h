@@ -0,0 +1,130 @@
+// Copyright 2015 the kNet authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#pragma once
+
+#include "berkley_socket.h"
+
+#include <linux/io_uring.h>
+
+#include <atomic>
+
+namespace knet
+{
+	/*
+	* Socket built on io_uring
+	* Receives with a multishot recvmsg into a provided buffer ring, the buffers are lent to the packets without copying
+	* Sends are queued as sendmsg submissions and submitted together on Flush
+	* If the kernel lacks io_uring support it behaves like a BerkleySocket
+	*/
+	class UringSocket : public BerkleySocket
+	{
+	private:
+		struct SendSlot
+		{
+			msghdr message;
+			iovec vector;
+			sockaddr_in6 address;
+			char data[MAX_MTU_SIZE];
+		};
+
+		int ringDescriptor = -1;
+		unsigned int ringEntries = 0;
+		bool uringActive = false;
+		bool ownsEventLoop = true;
+
+		// Submission queue, shared by the loop and the sending thread
+		std::mutex submitMutex;
+		void * pSubmitRing = nullptr;
+		size_t submitRingSize = 0;
+		unsigned int * pSubmitHead = nullptr;
+		unsigned int * pSubmitTail = nullptr;
+		unsigned int * pSubmitMask = nullptr;
+		unsigned int * pSubmitArray = nullptr;
+		io_uring_sqe * pSubmitEntries = nullptr;
+		size_t submitEntriesSize = 0;
+		unsigned int pendingSubmissions = 0;
+
+		// Completion queue, only touched by the thread running the loop
+		void * pCompleteRing = nullptr;
+		size_t completeRingSize = 0;
+		unsigned int * pCompleteHead = nullptr;
+		unsigned int * pCompleteTail = nullptr;
+		unsigned int * pCompleteMask = nullptr;
+		io_uring_cqe * pCompleteEntries = nullptr;
+
+		// Provided receive buffers, lent to the packets which share them, so the mappings outlive the socket until the last one came back
+		class ReceiveBuffers : public IBufferOwner
+		{
+		public:
+			std::mutex bufferMutex;
+			UringSocket * pSocket = nullptr; // Cleared on Close, buffers given back afterwards are not provided again
+			io_uring_buf_ring * pBufferRing = nullptr;
+			size_t bufferRingSize = 0;
+			char * pReceiveBuffers = nullptr;
+			size_t receiveBuffersSize = 0;
+
+			explicit ReceiveBuffers(UringSocket * pOwner);
+			virtual ~ReceiveBuffers();
+
+			// Hands a buffer to the kernel, bufferMutex has to be held
+			void Provide(uint32_t bufferId);
+
+			virtual void ReleaseBuffer(uint32_t bufferId) final;
+		};
+
+		std::shared_ptr<ReceiveBuffers> receiveBuffers;
+		std::atomic<bool> bBuffersExhausted{false};
+		msghdr receiveMessage;
+		std::vector<InternalRecvPacket*> receivedPackets;
+
+		std::vector<SendSlot> sendSlots;
+		std::vector<uint32_t> freeSendSlots;
+
+		int wakeupDescriptor = -1; // eventfd
+		int timerDescriptor = -1; // timerfd
+		uint64_t wakeupValue = 0;
+		uint64_t timerValue = 0;
+
+		bool bReceiveArmed = false;
+		bool bWakeupArmed = false;
+		bool bTimerArmed = false;
+
+		bool SetupRing();
+		void Close();
+
+		io_uring_sqe * GetSubmitEntry();
+		void CommitSubmitEntry();
+		int Enter(unsigned int minComplete, unsigned int flags, std::chrono::milliseconds maxWait);
+
+		void Arm();
+		void Reap();
+
+		void EventLoop();
+	public:
+		UringSocket();
+		virtual ~UringSocket();
+
+		virtual bool Send(const SocketAddress &remoteSystem, const char* pData, size_t length) final;
+		virtual bool Bind(const SocketBindArguments &bindArgs) final;
+		virtual void Flush() final;
+
+		virtual const SocketType GetSocketType() const final;
+
+		virtual void StartReceiving() final;
+		virtual void StopReceiving(bool bWait = false) final;
+
+		virtual bool Poll(std::chrono::milliseconds maxWait) final;
+		virtual void ScheduleWakeup(std::chrono::steady_clock::time_point wakeupTime) final;
+
+		//! Interrupts a running Poll from any thread
+		void Wakeup();
+
+		//! Checks if io_uring is used
+		/*!
+		\return false if the kernel lacks support and the socket behaves like a BerkleySocket
+		*/
+		bool IsUringActive() const;
+	};
+};
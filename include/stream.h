@@ -0,0 +1,80 @@
+// Copyright 2015 the kNet authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <memory>
+
+namespace knet
+{
+	// Numbered per connection and direction from 1 on, 0 names no stream
+	using StreamId = uint32_t;
+
+	//! Fills buffer with the next bytes of a stream
+	/*!
+	Only called while the connection has room for more, a source is never asked for more than it can send
+	\return The bytes written, less than maxBytes pauses the stream until the next Process
+	*/
+	using StreamSource = std::function<size_t(char *buffer, size_t maxBytes)>;
+
+	/*
+	* Receives the bytes of a stream as they arrive, not necessarily in order
+	* Chunks go straight from the received datagram to the sink
+	*/
+	class IStreamSink
+	{
+	public:
+		virtual ~IStreamSink() = default;
+
+		virtual void Write(uint64_t offset, const char *data, size_t size) = 0;
+
+		//! Called once every byte arrived
+		virtual void Finish()
+		{
+		}
+
+		//! Called instead of Finish if the stream was dropped before every byte arrived
+		virtual void Abort()
+		{
+		}
+	};
+
+	// Writes a stream into memory the caller provides, chunks beyond it are dropped
+	class MemoryStreamSink : public IStreamSink
+	{
+	private:
+		char *buffer;
+		size_t capacity;
+	public:
+		MemoryStreamSink(char *pBuffer, size_t size)
+			: buffer(pBuffer), capacity(size)
+		{
+		}
+
+		void Write(uint64_t offset, const char *data, size_t size) override
+		{
+			if (offset > capacity || size > capacity - offset)
+				return;
+
+			memcpy(buffer + offset, data, size);
+		}
+	};
+
+	//! Picks the sink of a stream the remote started
+	/*!
+	\return nullptr to get the chunks as STREAM_CHUNK events instead
+	*/
+	using StreamAcceptor = std::function<std::shared_ptr<IStreamSink>(StreamId id, uint64_t size)>;
+
+	struct StreamProgress
+	{
+		uint64_t size = 0;
+		uint64_t transferred = 0; // Sent or received
+		uint64_t acknowledged = 0; // Sending only, transferred - acknowledged is what the connection still holds
+	};
+};
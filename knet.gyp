@@ -18,6 +18,8 @@
 				'src/peer.cpp',
 				'src/reliability_layer.cpp',
 				'src/sockets/berkley_socket.cpp',
+				'src/congestion/new_reno_controller.cpp',
+				'src/congestion/bbr_controller.cpp',
 
 				#Header Files, for VS
 
@@ -25,6 +27,12 @@
 				'include/network_helper_types.h',
 			],
 			'conditions': [
+				['OS=="linux"', {
+					'sources': [
+						'src/sockets/epoll_socket.cpp',
+						'src/sockets/uring_socket.cpp',
+					],
+				}],
 				['OS=="win"', {
 					'defines': [
 						'_WINSOCK_DEPRECATED_NO_WARNINGS',
@@ -55,7 +63,9 @@
 			'sources': [
 				'test/test.cpp',
 				'test/test_bitstream.cpp',
+				'test/test_congestion.cpp',
 				'test/test_connect.cpp',
+				'test/test_socket.cpp',
 			],
 			'conditions': [
 				['OS=="win"', {
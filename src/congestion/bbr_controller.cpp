@@ -0,0 +1,259 @@
+// Copyright 2015 the kNet authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include <congestion/bbr_controller.h>
+
+#include <algorithm>
+
+namespace knet
+{
+	static const double startupGain = 2.885; // 2 / ln(2)
+	static const double probeGains[] = {1.25, 0.75, 1.0, 1.0, 1.0, 1.0, 1.0, 1.0};
+	static const size_t initialWindowDatagrams = 10;
+	static const size_t minimumWindowDatagrams = 4;
+	static const std::chrono::seconds minRttWindow = std::chrono::seconds(10);
+	static const std::chrono::milliseconds probeRttDuration = std::chrono::milliseconds(200);
+
+	BbrController::BbrController(size_t maxDatagramSize)
+		: maxDatagramSize(maxDatagramSize),
+		pacingGain(startupGain),
+		congestionWindowGain(startupGain),
+		congestionWindow(initialWindowDatagrams * maxDatagramSize)
+	{
+		roundBandwidth.fill(0.0);
+	}
+
+	CongestionControlType BbrController::GetType() const
+	{
+		return CongestionControlType::Bbr;
+	}
+
+	void BbrController::OnPacketSent(std::chrono::steady_clock::time_point, size_t, size_t inFlight)
+	{
+		bytesInFlight = inFlight;
+	}
+
+	void BbrController::OnAck(const AckSample &sample)
+	{
+		bytesInFlight = sample.bytesInFlight;
+
+		UpdateRound(sample);
+		UpdateBandwidth(sample);
+		UpdateMinRtt(sample);
+		UpdateState(sample);
+		UpdateCongestionWindow(sample);
+	}
+
+	void BbrController::UpdateRound(const AckSample &sample)
+	{
+		roundStart = false;
+
+		if (sample.priorDelivered >= nextRoundDelivered)
+		{
+			nextRoundDelivered = sample.delivered;
+			++roundCount;
+			roundStart = true;
+
+			// The slot of the round which left the window
+			roundBandwidth[roundCount % bandwidthRounds] = 0.0;
+		}
+	}
+
+	void BbrController::UpdateBandwidth(const AckSample &sample)
+	{
+		if (sample.deliveryRate <= 0.0)
+			return;
+
+		// App limited samples only count if they show more than we knew, they can not be below the path's rate otherwise
+		if (sample.appLimited && sample.deliveryRate < bottleneckBandwidth)
+			return;
+
+		double &slot = roundBandwidth[roundCount % bandwidthRounds];
+		slot = std::max(slot, sample.deliveryRate);
+
+		bottleneckBandwidth = *std::max_element(roundBandwidth.begin(), roundBandwidth.end());
+	}
+
+	void BbrController::UpdateMinRtt(const AckSample &sample)
+	{
+		const bool expired = minRtt != std::chrono::nanoseconds::max() && sample.now > minRttStamp + minRttWindow;
+
+		if (sample.rtt.count() > 0 && (sample.rtt <= minRtt || expired))
+		{
+			minRtt = sample.rtt;
+			minRttStamp = sample.now;
+		}
+
+		// Measure the propagation delay again with an almost empty pipe
+		if (expired && state != State::ProbeRtt)
+		{
+			state = State::ProbeRtt;
+			pacingGain = 1.0;
+			congestionWindowGain = 1.0;
+			probeRttDone = std::chrono::steady_clock::time_point();
+			probeRttRoundDone = false;
+		}
+	}
+
+	void BbrController::UpdateState(const AckSample &sample)
+	{
+		// Startup ends once three rounds in a row did not grow the bandwidth by a quarter
+		if (!filledPipe && roundStart && !sample.appLimited)
+		{
+			if (bottleneckBandwidth >= fullBandwidth * 1.25)
+			{
+				fullBandwidth = bottleneckBandwidth;
+				fullBandwidthRounds = 0;
+			}
+			else if (++fullBandwidthRounds >= 3)
+			{
+				filledPipe = true;
+			}
+		}
+
+		switch (state)
+		{
+		case State::Startup:
+			if (filledPipe)
+			{
+				state = State::Drain;
+				pacingGain = 1.0 / startupGain;
+				congestionWindowGain = startupGain;
+			}
+			break;
+
+		case State::Drain:
+			if (bytesInFlight <= GetTargetWindow(1.0))
+			{
+				state = State::ProbeBandwidth;
+				cycleIndex = 0;
+				cycleStamp = sample.now;
+				pacingGain = probeGains[cycleIndex];
+				congestionWindowGain = 2.0;
+			}
+			break;
+
+		case State::ProbeBandwidth:
+			// Each gain lasts about one round trip
+			if (minRtt != std::chrono::nanoseconds::max() && sample.now - cycleStamp > minRtt)
+			{
+				cycleIndex = (cycleIndex + 1) % (sizeof(probeGains) / sizeof(probeGains[0]));
+				cycleStamp = sample.now;
+				pacingGain = probeGains[cycleIndex];
+			}
+			break;
+
+		case State::ProbeRtt:
+			if (probeRttDone == std::chrono::steady_clock::time_point())
+			{
+				// Wait until the pipe drained to the minimum window
+				if (bytesInFlight <= GetMinimumWindow())
+				{
+					probeRttDone = sample.now + probeRttDuration;
+					nextRoundDelivered = sample.delivered;
+				}
+			}
+			else
+			{
+				if (roundStart)
+					probeRttRoundDone = true;
+
+				if (probeRttRoundDone && sample.now >= probeRttDone)
+				{
+					minRttStamp = sample.now;
+
+					if (filledPipe)
+					{
+						state = State::ProbeBandwidth;
+						cycleIndex = 0;
+						cycleStamp = sample.now;
+						pacingGain = probeGains[cycleIndex];
+						congestionWindowGain = 2.0;
+					}
+					else
+					{
+						state = State::Startup;
+						pacingGain = startupGain;
+						congestionWindowGain = startupGain;
+					}
+				}
+			}
+			break;
+		}
+	}
+
+	void BbrController::UpdateCongestionWindow(const AckSample &sample)
+	{
+		timedOut = false;
+
+		if (state == State::ProbeRtt)
+		{
+			congestionWindow = GetMinimumWindow();
+			return;
+		}
+
+		const size_t target = GetTargetWindow(congestionWindowGain);
+
+		// Before the pipe is full the window only grows, by what got acked
+		if (filledPipe)
+			congestionWindow = std::min(congestionWindow + sample.ackedBytes, target);
+		else if (congestionWindow < target || bottleneckBandwidth == 0.0)
+			congestionWindow += sample.ackedBytes;
+
+		congestionWindow = std::max(congestionWindow, GetMinimumWindow());
+	}
+
+	size_t BbrController::GetTargetWindow(double gain) const
+	{
+		if (bottleneckBandwidth == 0.0 || minRtt == std::chrono::nanoseconds::max())
+			return initialWindowDatagrams * maxDatagramSize;
+
+		const double bandwidthDelayProduct = bottleneckBandwidth * std::chrono::duration<double>(minRtt).count();
+		return std::max(static_cast<size_t>(gain * bandwidthDelayProduct), GetMinimumWindow());
+	}
+
+	size_t BbrController::GetMinimumWindow() const
+	{
+		return minimumWindowDatagrams * maxDatagramSize;
+	}
+
+	void BbrController::OnLoss(std::chrono::steady_clock::time_point, size_t, std::chrono::steady_clock::time_point)
+	{
+		// The model already accounts for the bandwidth, a loss says little about it
+	}
+
+	void BbrController::OnRetransmissionTimeout(std::chrono::steady_clock::time_point)
+	{
+		// Everything in flight is considered lost, send little until acks arrive again
+		timedOut = true;
+	}
+
+	size_t BbrController::GetCongestionWindow() const
+	{
+		return timedOut ? maxDatagramSize : congestionWindow;
+	}
+
+	double BbrController::GetPacingRate() const
+	{
+		if (bottleneckBandwidth == 0.0)
+			return 0.0;
+
+		return pacingGain * bottleneckBandwidth;
+	}
+
+	BbrController::State BbrController::GetState() const
+	{
+		return state;
+	}
+
+	double BbrController::GetBottleneckBandwidth() const
+	{
+		return bottleneckBandwidth;
+	}
+
+	std::chrono::nanoseconds BbrController::GetMinRtt() const
+	{
+		return minRtt;
+	}
+};
@@ -0,0 +1,95 @@
+// Copyright 2015 the kNet authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include <congestion/new_reno_controller.h>
+
+#include <algorithm>
+#include <limits>
+
+namespace knet
+{
+	static const size_t initialWindowDatagrams = 10;
+	static const size_t minimumWindowDatagrams = 2;
+
+	NewRenoController::NewRenoController(size_t maxDatagramSize)
+		: maxDatagramSize(maxDatagramSize),
+		congestionWindow(initialWindowDatagrams * maxDatagramSize),
+		slowStartThreshold(std::numeric_limits<size_t>::max())
+	{
+	}
+
+	CongestionControlType NewRenoController::GetType() const
+	{
+		return CongestionControlType::NewReno;
+	}
+
+	void NewRenoController::OnPacketSent(std::chrono::steady_clock::time_point, size_t, size_t)
+	{
+	}
+
+	void NewRenoController::OnAck(const AckSample &sample)
+	{
+		if (sample.smoothedRtt.count() > 0)
+			smoothedRtt = sample.smoothedRtt;
+
+		// Acks of datagrams sent before the loss do not grow the window again
+		if (sample.newestSendTime <= recoveryStart)
+			return;
+
+		if (congestionWindow < slowStartThreshold)
+		{
+			congestionWindow += sample.ackedBytes;
+			return;
+		}
+
+		// One datagram per window acked
+		avoidanceBytes += sample.ackedBytes;
+
+		if (avoidanceBytes >= congestionWindow)
+		{
+			avoidanceBytes -= congestionWindow;
+			congestionWindow += maxDatagramSize;
+		}
+	}
+
+	void NewRenoController::OnLoss(std::chrono::steady_clock::time_point now, size_t, std::chrono::steady_clock::time_point lostSendTime)
+	{
+		if (lostSendTime <= recoveryStart)
+			return;
+
+		recoveryStart = now;
+		slowStartThreshold = std::max(congestionWindow / 2, minimumWindowDatagrams * maxDatagramSize);
+		congestionWindow = slowStartThreshold;
+		avoidanceBytes = 0;
+	}
+
+	void NewRenoController::OnRetransmissionTimeout(std::chrono::steady_clock::time_point now)
+	{
+		// Nothing got through for a whole timeout, start over with one datagram
+		recoveryStart = now;
+		slowStartThreshold = std::max(congestionWindow / 2, minimumWindowDatagrams * maxDatagramSize);
+		congestionWindow = maxDatagramSize;
+		avoidanceBytes = 0;
+	}
+
+	size_t NewRenoController::GetCongestionWindow() const
+	{
+		return congestionWindow;
+	}
+
+	double NewRenoController::GetPacingRate() const
+	{
+		if (smoothedRtt.count() == 0)
+			return 0.0;
+
+		// Like Linux, a little faster than the window so pacing never limits it
+		const double gain = congestionWindow < slowStartThreshold ? 2.0 : 1.25;
+		return gain * static_cast<double>(congestionWindow) / std::chrono::duration<double>(smoothedRtt).count();
+	}
+
+	size_t NewRenoController::GetSlowStartThreshold() const
+	{
+		return slowStartThreshold;
+	}
+};
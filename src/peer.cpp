@@ -6,6 +6,11 @@
 
 #include <bitstream.h>
 
+#ifdef __linux__
+#include <sockets/epoll_socket.h>
+#include <sockets/uring_socket.h>
+#endif
+
 #ifndef WIN32
 #include <sys/socket.h>
 #include <netinet/in.h>
@@ -15,38 +20,86 @@
 
 namespace knet
 {
+	static const std::chrono::milliseconds pingInterval = std::chrono::milliseconds(500);
+
+	static std::shared_ptr<ISocket> CreateSocket(SocketType socketType)
+	{
+		switch (socketType)
+		{
+#ifdef __linux__
+		case SocketType::Epoll:
+			return std::make_shared<EpollSocket>();
+		case SocketType::IoUring:
+			return std::make_shared<UringSocket>();
+#endif
+		default:
+			return std::make_shared<BerkleySocket>();
+		}
+	}
+
 	Peer::Peer() noexcept
 	{
 		// Create the local socket
-		_socket = std::make_shared<BerkleySocket>();
+		AddShard();
+	}
 
-		// Now connect our peer with the socket
-		_socket->GetEventHandler().AddEvent(SocketEvents::RECEIVE, this, &Peer::OnReceive, this);
+	Peer::~Peer() noexcept
+	{
+		for (auto &shard : shards)
+		{
+			shard->socket->GetEventHandler().RemoveEventsByOwner(this);
+			shard->reliabilityLayer.GetEventHandler().RemoveEventsByOwner(this);
 
-		// Now we want to handle the received packets in our reliabilityLayer
-		reliabilityLayer.GetEventHandler().AddEvent(ReliabilityEvents::HANDLE_PACKET, this,
-													&Peer::HandlePacket, this);
+			for (auto &system : shard->remoteSystems)
+			{
+				system->reliabilityLayer.GetEventHandler().RemoveEventsByOwner(this);
+			}
 
-		reliabilityLayer.GetEventHandler().AddEvent(ReliabilityEvents::NEW_CONNECTION, this,
-															&Peer::HandleNewConnection, this);
+			shard->remoteSystems.clear();
+			shard->systemsByAddress.Clear();
+		}
 	}
 
-	Peer::~Peer() noexcept
+	void Peer::AddShard()
 	{
-		_socket->GetEventHandler().RemoveEventsByOwner(this);
-		reliabilityLayer.GetEventHandler().RemoveEventsByOwner(this);
+		auto shard = std::make_unique<Shard>();
+		auto pShard = shard.get();
 
-		for(auto &system : remoteSystems)
-		{
-			system->reliabilityLayer.GetEventHandler().RemoveEventsByOwner(this);
-		}
+		pShard->index = shards.size();
 
-		remoteSystems.clear();
+		pShard->socket = std::make_shared<BerkleySocket>();
+		AttachSocket(*pShard);
+
+		// Now we want to handle the received packets in our reliabilityLayer
+		pShard->reliabilityLayer.GetEventHandler().AddEvent(ReliabilityEvents::HANDLE_PACKET, this, [this, pShard](ReliablePacket &packet, SocketAddress &remoteAddress) {
+			return HandlePacket(*pShard, packet, remoteAddress);
+		});
+
+		pShard->reliabilityLayer.GetEventHandler().AddEvent(ReliabilityEvents::NEW_CONNECTION, this, [this, pShard](InternalRecvPacket *pPacket) {
+			return HandleNewConnection(*pShard, pPacket);
+		});
+
+		shards.push_back(std::move(shard));
+	}
+
+	void Peer::AttachSocket(Shard &shard)
+	{
+		auto pShard = &shard;
+
+		// Now connect our peer with the socket
+		shard.socket->GetEventHandler().AddEvent(SocketEvents::RECEIVE_BATCH, this, [this, pShard](InternalRecvPacket **ppPackets, size_t count) {
+			return OnReceiveBatch(*pShard, ppPackets, count);
+		});
 	}
 
 	std::weak_ptr<knet::ISocket> Peer::GetSocket() noexcept
 	{
-		return _socket;
+		return shards.front()->socket;
+	}
+
+	size_t Peer::GetShardCount() const noexcept
+	{
+		return shards.size();
 	}
 
 	void Peer::Start(const StartupInformation& info) noexcept
@@ -55,11 +108,79 @@ namespace knet
 
 		bi.usPort = info.localEndPoints.at(0).port;
 		bi.szHostAddress = info.localEndPoints.at(0).host;
+		bi.addressFamily = info.addressFamily;
+
+		bi.receiveBatchSize = info.receiveBatchSize;
+		bi.sendBatchSize = info.sendBatchSize;
+		bi.receiveOffload = info.receiveOffload;
+		bi.kernelTimestamps = info.kernelTimestamps;
+		bi.ownsEventLoop = info.ownsEventLoop;
+
+		InternalRecvPacket::ReservePoolCapacity(info.packetPoolCapacity);
 
 		maxConnections = info.maxConnections;
+		runEventLoop = !info.ownsEventLoop;
+		maxWaitTime = info.maxWaitTime;
+
+		// Waiting for room would block the only thread that makes room
+		receiveQueueCapacity = info.receiveQueueCapacity;
+		receiveOverflowPolicy = runEventLoop ? ReceiveOverflowPolicy::Drop : info.receiveOverflowPolicy;
+
+		congestionControl = info.congestionControl;
+		pacingRate = info.pacingRate;
+		reorderThreshold = info.reorderThreshold;
+		ackDelay = info.ackDelay;
+		reassemblyMemoryLimit = info.reassemblyMemoryLimit;
+		reassemblyTimeout = info.reassemblyTimeout;
+
+		size_t shardCount = 1;
+#ifdef __linux__
+		shardCount = std::max<size_t>(info.shardCount, 1);
+#endif
+
+		if (shardCount > 1)
+			bi.reusePortGroupSize = shardCount;
+
+		while (shards.size() < shardCount)
+			AddShard();
+
+		// Every shard may end up with all connections, the steering only depends on the remotes
+		for (auto &shard : shards)
+		{
+			if (shard->connectionSlots)
+				continue;
+
+			shard->connectionSlotCount = std::min<size_t>(std::max<uint32_t>(maxConnections, 1), (connectionSlotMask + 1) / shardCount);
+			shard->connectionSlots.reset(new std::atomic<System*>[shard->connectionSlotCount]);
+			shard->slotGenerations.assign(shard->connectionSlotCount, 1);
+
+			for (size_t i = shard->connectionSlotCount; i > 0; --i)
+			{
+				shard->connectionSlots[i - 1].store(nullptr, std::memory_order_relaxed);
+				shard->freeSlots.push_back(static_cast<uint32_t>(i - 1));
+			}
+		}
 
-		_socket->Bind(bi);
-		_socket->StartReceiving();
+		// The sockets join the reuseport group in shard order, the steering program relies on that
+		for (auto &shard : shards)
+		{
+			if (info.socketType != shard->socket->GetSocketType())
+			{
+				shard->socket->GetEventHandler().RemoveEventsByOwner(this);
+
+				shard->socket = CreateSocket(info.socketType);
+				AttachSocket(*shard);
+			}
+
+			shard->reliabilityLayer.SetReceiveQueue(receiveQueueCapacity, receiveOverflowPolicy);
+
+			shard->socket->Bind(bi);
+			shard->socket->StartReceiving();
+
+			// An ephemeral port is picked by the first bind, the others have to join its group
+			if (bi.usPort == 0)
+				bi.usPort = shard->socket->GetSocketAddress().GetPort();
+		}
 	}
 
 
@@ -81,54 +202,216 @@ namespace knet
 		bitStream.Write<uint16_t>(sizeof(MessageID::CONNECTION_REQUEST));
 		bitStream.Write(MessageID::CONNECTION_REQUEST);
 
-		SocketAddress remoteAdd = { 0 };
+		SocketAddress remoteAdd;
 
-		memset(&remoteAdd.address.addr4, 0, sizeof(sockaddr_in));
-		remoteAdd.address.addr4.sin_port = htons(info.port);
+		// IPv4 or IPv6, the latter needs a peer started on an IPv6 socket
+		if (!remoteAdd.SetHost(info.host))
+			return;
 
-		remoteAdd.address.addr4.sin_addr.s_addr = inet_addr(info.host.c_str());
-		remoteAdd.address.addr4.sin_family = AF_INET;
+		remoteAdd.SetPort(info.port);
 
-		// Send the connection request to the remote
-		if (_socket)
-			_socket->Send(remoteAdd, bitStream.Data(), bitStream.Size());
+		// Send the connection request to the remote, every shard shares the port
+		auto &socket = shards.front()->socket;
+
+		if (socket)
+		{
+			socket->Send(remoteAdd, bitStream.Data(), bitStream.Size());
+			socket->Flush();
+		}
 	}
 
 	void Peer::Process() noexcept
 	{
-		reliabilityLayer.Process();
+		bool bIdle = true;
+
+		// A single shard may block in its poll, several have to share this thread
+		auto maxWait = shards.size() > 1 ? std::chrono::milliseconds(0) : maxWaitTime;
+
+		for (auto &shard : shards)
+			bIdle &= ProcessShard(*shard, maxWait);
+
+		// We have not active connections, so sleep a short amount of time
+		if (bIdle)
+			std::this_thread::sleep_for(std::chrono::milliseconds(10));
+	}
+
+	void Peer::Process(size_t shardIndex) noexcept
+	{
+		if (ProcessShard(*shards.at(shardIndex), maxWaitTime))
+			std::this_thread::sleep_for(std::chrono::milliseconds(10));
+	}
+
+	bool Peer::ProcessShard(Shard &shard, std::chrono::milliseconds maxWait) noexcept
+	{
+		bool bEventDriven = false;
+
+		auto &socket = shard.socket;
 
-		if (reorderRemoteSystems)
+		// Receiving happens on this thread, wait until a datagram arrives or the next work is due
+		if (runEventLoop)
 		{
-			std::sort(std::begin(remoteSystems), std::end(remoteSystems), [](const std::shared_ptr<System> &systemLeft, const std::shared_ptr<System> &) {
+			socket->ScheduleWakeup(GetNextWakeup(shard));
+			bEventDriven = socket->Poll(maxWait);
+		}
+
+		shard.reliabilityLayer.Process();
+
+		// Free the tables replaced since the last tick once the receiving thread let go of them
+		shard.systemsByAddress.Reclaim();
+
+		if (shard.reorderRemoteSystems)
+		{
+			std::sort(std::begin(shard.remoteSystems), std::end(shard.remoteSystems), [](const std::shared_ptr<System> &systemLeft, const std::shared_ptr<System> &) {
 				return systemLeft->isActive;
 			});
 
-			reorderRemoteSystems = false;
+			shard.reorderRemoteSystems = false;
 		}
 
-		if (activeSystems > 0)
+		if (shard.activeSystems > 0)
 		{
-			for (auto &peer : remoteSystems)
+			for (auto &peer : shard.remoteSystems)
 			{
 				// Break, the list is sorted
 				if (!peer->isActive)
 					break;
 
-				if (peer->lastPing + std::chrono::milliseconds(500) < std::chrono::steady_clock::now())
+				auto now = std::chrono::steady_clock::now();
+
+				if (peer->lastPing + pingInterval < now && peer->lastPingSent + pingInterval < now)
 				{
-					SendInternalPing(peer->reliabilityLayer.GetRemoteAddress());
+					SendInternalPing(shard, *peer);
+					peer->lastPingSent = now;
 				}
 
 				peer->reliabilityLayer.Process();
 			}
+
+			// Everything sent during this tick leaves in one batch
+			socket->Flush();
+
+			return false;
 		}
-		else
+
+		socket->Flush();
+
+		return !bEventDriven;
+	}
+
+	std::chrono::nanoseconds Peer::GetRoundTripTime(const SocketAddress &remoteAddress) noexcept
+	{
+		for (auto &shard : shards)
 		{
-			// We have not active connections, so sleep a short amount of time
-			std::this_thread::sleep_for(std::chrono::milliseconds(10));
+			internal::AddressTable<System>::Reader reader{shard->systemsByAddress};
+
+			if (auto pSystem = reader.Find(remoteAddress))
+				return pSystem->reliabilityLayer.GetRoundTripTime();
+		}
+
+		return std::chrono::nanoseconds::zero();
+	}
+
+	bool Peer::SetCongestionControl(const SocketAddress &remoteAddress, CongestionControlType type) noexcept
+	{
+		for (auto &shard : shards)
+		{
+			internal::AddressTable<System>::Reader reader{shard->systemsByAddress};
+
+			if (auto pSystem = reader.Find(remoteAddress))
+			{
+				pSystem->reliabilityLayer.SetCongestionControl(type);
+				return true;
+			}
+		}
+
+		return false;
+	}
+
+	bool Peer::SetPacingRate(const SocketAddress &remoteAddress, double bytesPerSecond) noexcept
+	{
+		for (auto &shard : shards)
+		{
+			internal::AddressTable<System>::Reader reader{shard->systemsByAddress};
+
+			if (auto pSystem = reader.Find(remoteAddress))
+			{
+				pSystem->reliabilityLayer.SetPacingRate(bytesPerSecond);
+				return true;
+			}
+		}
+
+		return false;
+	}
+
+	StreamId Peer::SendStream(const SocketAddress &remoteAddress, uint64_t size, StreamSource source) noexcept
+	{
+		for (auto &shard : shards)
+		{
+			internal::AddressTable<System>::Reader reader{shard->systemsByAddress};
+
+			if (auto pSystem = reader.Find(remoteAddress))
+				return pSystem->reliabilityLayer.SendStream(size, std::move(source));
+		}
+
+		return 0;
+	}
+
+	StreamId Peer::SendFile(const SocketAddress &remoteAddress, const std::string &path) noexcept
+	{
+		for (auto &shard : shards)
+		{
+			internal::AddressTable<System>::Reader reader{shard->systemsByAddress};
+
+			if (auto pSystem = reader.Find(remoteAddress))
+				return pSystem->reliabilityLayer.SendFile(path);
 		}
 
+		return 0;
+	}
+
+	bool Peer::GetSendProgress(const SocketAddress &remoteAddress, StreamId id, StreamProgress &progress) noexcept
+	{
+		for (auto &shard : shards)
+		{
+			internal::AddressTable<System>::Reader reader{shard->systemsByAddress};
+
+			if (auto pSystem = reader.Find(remoteAddress))
+				return pSystem->reliabilityLayer.GetSendProgress(id, progress);
+		}
+
+		return false;
+	}
+
+	void Peer::SetStreamAcceptor(PeerStreamAcceptor acceptor) noexcept
+	{
+		std::lock_guard<std::mutex> lock{streamAcceptorMutex};
+		streamAcceptor = std::move(acceptor);
+	}
+
+	std::chrono::steady_clock::time_point Peer::GetNextWakeup() noexcept
+	{
+		auto nextWakeup = std::chrono::steady_clock::time_point::max();
+
+		for (auto &shard : shards)
+			nextWakeup = std::min(nextWakeup, GetNextWakeup(*shard));
+
+		return nextWakeup;
+	}
+
+	std::chrono::steady_clock::time_point Peer::GetNextWakeup(Shard &shard) noexcept
+	{
+		auto nextWakeup = shard.reliabilityLayer.GetNextWakeup();
+
+		for (auto &peer : shard.remoteSystems)
+		{
+			if (!peer->isActive)
+				continue;
+
+			nextWakeup = std::min(nextWakeup, peer->reliabilityLayer.GetNextWakeup());
+			nextWakeup = std::min(nextWakeup, std::max(peer->lastPing, peer->lastPingSent) + pingInterval);
+		}
+
+		return nextWakeup;
 	}
 
 	//void Peer::Send(System &peer, const char * data, size_t len, bool im) noexcept
@@ -145,49 +428,169 @@ namespace knet
 
 #pragma region EventHandler stuff
 
-	bool Peer::OnReceive(InternalRecvPacket* pPacket) noexcept
+	bool Peer::OnReceive(Shard &shard, InternalRecvPacket* pPacket) noexcept
 	{
+		internal::AddressTable<System>::Reader reader{shard.systemsByAddress};
+
 		// If its a known system distribute the packet to the systems reliability layer
-		for (auto &system : remoteSystems)
+		if (auto pSystem = FindSystem(shard, reader, pPacket))
 		{
-			if (pPacket->remoteAddress == system->reliabilityLayer.GetRemoteAddress())
-			{
-				system->reliabilityLayer.OnReceive(pPacket);
-				return true;
-			}
+			pSystem->reliabilityLayer.OnReceive(pPacket);
+			return true;
 		}
 
 		// The system has not established a connetion yet, so we handle it with our own internal reliablity layer
 		// Is this idea/system crap?!
-		reliabilityLayer.OnReceive(pPacket);
+		shard.reliabilityLayer.OnReceive(pPacket);
 
 		return true;
 	}
 
-	bool Peer::HandleDisconnect(SocketAddress address, DisconnectReason reason) noexcept
+	bool Peer::OnReceiveBatch(Shard &shard, InternalRecvPacket** ppPackets, size_t count) noexcept
 	{
-		for (auto &system : remoteSystems)
+		// The found systems stay alive until the whole batch is queued
+		internal::AddressTable<System>::Reader reader{shard.systemsByAddress};
+
+		ReliabilityLayer *pRunLayer = nullptr;
+		size_t runStart = 0;
+
+		// Consecutive packets for the same system are queued with a single call
+		for (size_t i = 0; i < count; ++i)
 		{
-			if (address == system->reliabilityLayer.GetRemoteAddress())
+			ReliabilityLayer *pLayer = &shard.reliabilityLayer;
+
+			// Most bursts come from one remote, skip the lookup then
+			if (i > 0 && ppPackets[i]->remoteAddress == ppPackets[i - 1]->remoteAddress)
+				pLayer = pRunLayer;
+			else if (auto pSystem = FindSystem(shard, reader, ppPackets[i]))
+				pLayer = &pSystem->reliabilityLayer;
+
+			if (pLayer != pRunLayer)
 			{
-				system->isConnected = false;
-				system->isActive = false;
+				if (pRunLayer)
+					pRunLayer->OnReceive(ppPackets + runStart, i - runStart);
 
-				this->reorderRemoteSystems = true;
+				pRunLayer = pLayer;
+				runStart = i;
+			}
+		}
 
-				this->reliabilityLayer.RemoveRemote(address);
+		if (pRunLayer)
+			pRunLayer->OnReceive(ppPackets + runStart, count - runStart);
 
-				--activeSystems;
+		return true;
+	}
 
-				_eventHandler.Call(PeerEvents::Disconnected, system, reason);
+	Peer::System * Peer::FindSystem(Shard &shard, const internal::AddressTable<System>::Reader &reader, InternalRecvPacket *pPacket) noexcept
+	{
+		uint32_t connectionId = 0;
 
-				return true;
+		// The id we assigned still finds a system whose address changed
+		if (shard.connectionSlots && DatagramHeader::PeekConnectionId(pPacket->buffer, pPacket->bytesRead, connectionId))
+		{
+			const size_t slot = GetConnectionSlot(connectionId);
+			const size_t localSlot = slot / shards.size();
+
+			if (slot % shards.size() == shard.index && localSlot < shard.connectionSlotCount)
+			{
+				System *pSystem = shard.connectionSlots[localSlot].load(std::memory_order_acquire);
+
+				if (pSystem && pSystem->connectionId.load(std::memory_order_relaxed) == connectionId)
+					return pSystem;
 			}
 		}
-		return false;
+
+		return reader.Find(pPacket->remoteAddress);
+	}
+
+	void Peer::AssignConnectionId(Shard &shard, System &system)
+	{
+		if (shard.freeSlots.empty())
+			return;
+
+		uint32_t localSlot = shard.freeSlots.back();
+		shard.freeSlots.pop_back();
+
+		const uint32_t connectionId = MakeConnectionId(static_cast<uint32_t>(localSlot * shards.size() + shard.index), shard.slotGenerations[localSlot]);
+
+		system.connectionId.store(connectionId, std::memory_order_relaxed);
+		system.reliabilityLayer.SetLocalConnectionId(connectionId);
+
+		shard.connectionSlots[localSlot].store(&system, std::memory_order_release);
+	}
+
+	void Peer::ReleaseConnectionId(Shard &shard, System &system)
+	{
+		const uint32_t connectionId = system.connectionId.load(std::memory_order_relaxed);
+
+		if (connectionId == 0)
+			return;
+
+		uint32_t localSlot = static_cast<uint32_t>(GetConnectionSlot(connectionId) / shards.size());
+
+		shard.connectionSlots[localSlot].store(nullptr, std::memory_order_release);
+
+		// The next connection in this slot gets another id, 0 is never handed out
+		uint16_t &generation = shard.slotGenerations[localSlot];
+		generation = (generation + 1) & 0xFFF;
+
+		if (generation == 0)
+			generation = 1;
+
+		shard.freeSlots.push_back(localSlot);
+
+		system.connectionId.store(0, std::memory_order_relaxed);
+		system.reliabilityLayer.SetLocalConnectionId(0);
+	}
+
+	bool Peer::HandleDisconnect(Shard &shard, SocketAddress address, DisconnectReason reason) noexcept
+	{
+		auto system = shard.systemsByAddress.Find(address);
+
+		if (!system)
+			return false;
+
+		system->isConnected = false;
+		system->isActive = false;
+
+		shard.reorderRemoteSystems = true;
+
+		// New datagrams from the address go through the shard's layer again, as a new connection
+		// The slot is cleared first, a system must not be reachable through it after leaving the table
+		ReleaseConnectionId(shard, *system);
+		shard.systemsByAddress.Erase(address);
+		shard.reliabilityLayer.RemoveRemote(address);
+
+		--shard.activeSystems;
+		--activeSystems;
+
+		_eventHandler.Call(PeerEvents::Disconnected, system, reason);
+
+		return true;
+	}
+
+	bool Peer::HandleAddressChange(Shard &shard, SocketAddress oldAddress, SocketAddress newAddress) noexcept
+	{
+		auto system = shard.systemsByAddress.Find(oldAddress);
+
+		if (!system)
+			return false;
+
+		// The system left on the address can not be told apart from the moved one anymore
+		if (newAddress != oldAddress && shard.systemsByAddress.Find(newAddress))
+			HandleDisconnect(shard, newAddress, DisconnectReason::REPLACED);
+
+		// Still reachable through its connection id meanwhile
+		shard.systemsByAddress.Erase(oldAddress);
+		shard.systemsByAddress.Insert(newAddress, system);
+
+		// The shard's layer would otherwise keep taking the old address for a connected remote
+		shard.reliabilityLayer.RemoveRemote(oldAddress);
+
+		return true;
 	}
 
-	bool Peer::HandlePacket(ReliablePacket &packet, SocketAddress& remoteAddress) noexcept
+	bool Peer::HandlePacket(Shard &shard, ReliablePacket &packet, SocketAddress& remoteAddress) noexcept
 	{
 		auto pData = packet.Data();
 
@@ -203,24 +606,34 @@ namespace knet
 
 			dh.Serialize(bitStream);
 
+			// Tell the remote the id to put on its datagrams
+			auto system = shard.systemsByAddress.Find(remoteAddress);
+			uint32_t connectionId = system ? system->connectionId.load(std::memory_order_relaxed) : 0;
+
+			// Network byte order, like the id in the datagram header
 			bitStream.Write(PacketReliability::UNRELIABLE);
-			bitStream.Write<uint16_t>(sizeof(MessageID));
+			bitStream.Write<uint16_t>(sizeof(MessageID) + sizeof(connectionId));
 			bitStream.Write(MessageID::CONNECTION_ACCEPTED);
+			bitStream.Write(htonl(connectionId));
 
-			if (_socket)
-				_socket->Send(remoteAddress, bitStream.Data(), bitStream.Size());
+			if (shard.socket)
+				shard.socket->Send(remoteAddress, bitStream.Data(), bitStream.Size());
 		}
 		else if ((MessageID)pData[0] == MessageID::CONNECTION_ACCEPTED)
 		{
 			this->isConnected = true;
 
 			// Mark the remote as connected
-			for (auto &system : remoteSystems)
+			if (auto &system = shard.systemsByAddress.Find(remoteAddress))
 			{
-				if (remoteAddress == system->reliabilityLayer.GetRemoteAddress())
+				system->isConnected = true;
+
+				uint32_t connectionId = 0;
+
+				if (packet.Size() >= sizeof(MessageID) + sizeof(connectionId))
 				{
-					system->isConnected = true;
-					break;
+					memcpy(&connectionId, pData + sizeof(MessageID), sizeof(connectionId));
+					system->reliabilityLayer.SetRemoteConnectionId(ntohl(connectionId));
 				}
 			}
 
@@ -240,23 +653,44 @@ namespace knet
 			dh.isReliable = false;
 			dh.sequenceNumber = 0;
 
+			if (auto &system = shard.systemsByAddress.Find(remoteAddress))
+			{
+				dh.connectionId = system->reliabilityLayer.GetRemoteConnectionId();
+				dh.hasConnectionId = dh.connectionId != 0;
+			}
+
 			dh.Serialize(bitStream);
 
+			// Echo the send time, the remote measures its round trip with its own clock
+			int64_t sendTime = 0;
+			const bool hasSendTime = packet.Size() >= sizeof(MessageID) + sizeof(sendTime);
+
+			if (hasSendTime)
+				memcpy(&sendTime, pData + sizeof(MessageID), sizeof(sendTime));
+
 			bitStream.Write(PacketReliability::UNRELIABLE);
-			bitStream.Write<uint16_t>(sizeof(MessageID));
+			bitStream.Write<uint16_t>(sizeof(MessageID) + (hasSendTime ? sizeof(sendTime) : 0));
 			bitStream.Write(MessageID::INTERNAL_PING_RESPONSE);
 
-			if (_socket)
-				_socket->Send(remoteAddress, bitStream.Data(), bitStream.Size());
+			if (hasSendTime)
+				bitStream.Write(sendTime);
+
+			if (shard.socket)
+				shard.socket->Send(remoteAddress, bitStream.Data(), bitStream.Size());
 		}
 		else if ((MessageID)pData[0] == MessageID::INTERNAL_PING_RESPONSE)
 		{
-			for (auto &system : remoteSystems)
+			if (auto &system = shard.systemsByAddress.Find(remoteAddress))
 			{
-				if (remoteAddress == system->reliabilityLayer.GetRemoteAddress())
+				auto now = std::chrono::steady_clock::now();
+				int64_t sendTime = 0;
+
+				system->lastPing = now;
+
+				if (packet.Size() >= sizeof(MessageID) + sizeof(sendTime))
 				{
-					system->lastPing = std::chrono::steady_clock::now();
-					break;
+					memcpy(&sendTime, pData + sizeof(MessageID), sizeof(sendTime));
+					system->reliabilityLayer.AddRttSample(now.time_since_epoch() - std::chrono::nanoseconds(sendTime));
 				}
 			}
 		}
@@ -264,9 +698,16 @@ namespace knet
 		return false;
 	};
 
-	bool Peer::HandleNewConnection(InternalRecvPacket * pPacket) noexcept
+	bool Peer::HandleNewConnection(Shard &shard, InternalRecvPacket * pPacket) noexcept
 	{
-		if (remoteSystems.size() >= maxConnections)
+		// Reserve the connection before creating it, the shards accept concurrently
+		uint32_t active = activeSystems.load();
+
+		while (active < maxConnections && !activeSystems.compare_exchange_weak(active, active + 1))
+		{
+		}
+
+		if (active >= maxConnections)
 		{
 			/* We dont want to create a new system, so we have to build the packet manually :D */
 			BitStream bitStream{MAX_MTU_SIZE};
@@ -283,44 +724,106 @@ namespace knet
 			bitStream.Write<unsigned short>(sizeof(MessageID::CONNECTION_REFUSED));
 			bitStream.Write(MessageID::CONNECTION_REFUSED);
 
-			this->_socket->Send(pPacket->remoteAddress, bitStream.Data(), bitStream.Size());
+			shard.socket->Send(pPacket->remoteAddress, bitStream.Data(), bitStream.Size());
 			return false;
 		}
 
 		/* Clean up before a new connection is added */
-		remoteSystems.erase(std::remove_if(std::begin(remoteSystems), std::end(remoteSystems), [](const std::shared_ptr<System> &system) {
+		shard.remoteSystems.erase(std::remove_if(std::begin(shard.remoteSystems), std::end(shard.remoteSystems), [](const std::shared_ptr<System> &system) {
 			if (system->isActive)
 				return false;
 			else
 			{
 				return true;
 			}
-		}), std::end(remoteSystems));
+		}), std::end(shard.remoteSystems));
 
 
 		auto system = std::make_shared<System>();
 		system->reliabilityLayer.SetRemoteAddress(pPacket->remoteAddress);
-		system->reliabilityLayer.SetSocket(this->_socket);
+		system->reliabilityLayer.SetSocket(shard.socket);
+		system->reliabilityLayer.SetReceiveQueue(receiveQueueCapacity, receiveOverflowPolicy);
+		system->reliabilityLayer.SetCongestionControl(congestionControl);
+		system->reliabilityLayer.SetPacingRate(pacingRate);
+		system->reliabilityLayer.SetReorderThreshold(reorderThreshold);
+		system->reliabilityLayer.SetAckDelay(ackDelay);
+		system->reliabilityLayer.SetReassemblyLimits(reassemblyMemoryLimit, reassemblyTimeout);
 
 		// we want all handle events in our peer
-		system->reliabilityLayer.GetEventHandler().AddEvent(ReliabilityEvents::HANDLE_PACKET, this,
-															&Peer::HandlePacket, this);
+		auto pShard = &shard;
+
+		system->reliabilityLayer.GetEventHandler().AddEvent(ReliabilityEvents::HANDLE_PACKET, this, [this, pShard](ReliablePacket &packet, SocketAddress &remoteAddress) {
+			return HandlePacket(*pShard, packet, remoteAddress);
+		});
 
 		// This event is so fucking dumb
-		system->reliabilityLayer.GetEventHandler().AddEvent(ReliabilityEvents::DISCONNECTED, this,
-													&Peer::HandleDisconnect, this);
-		remoteSystems.push_back(system);
+		system->reliabilityLayer.GetEventHandler().AddEvent(ReliabilityEvents::DISCONNECTED, this, [this, pShard](SocketAddress address, DisconnectReason reason) {
+			return HandleDisconnect(*pShard, address, reason);
+		});
+
+		system->reliabilityLayer.GetEventHandler().AddEvent(ReliabilityEvents::ADDRESS_CHANGED, this, [this, pShard](SocketAddress oldAddress, SocketAddress newAddress) {
+			return HandleAddressChange(*pShard, oldAddress, newAddress);
+		});
+
+		// Streams report the address the remote has now, it may have moved since connecting
+		auto pSystem = system.get();
+
+		PeerStreamAcceptor acceptor;
+
+		{
+			std::lock_guard<std::mutex> lock{streamAcceptorMutex};
+			acceptor = streamAcceptor;
+		}
+
+		if (acceptor)
+		{
+			system->reliabilityLayer.SetStreamAcceptor([acceptor, pSystem](StreamId id, uint64_t size) {
+				return acceptor(pSystem->reliabilityLayer.GetRemoteAddress(), id, size);
+			});
+		}
+
+		system->reliabilityLayer.GetEventHandler().AddEvent(ReliabilityEvents::STREAM_CHUNK, this, [this, pSystem](StreamId id, uint64_t offset, const char *data, size_t size) {
+			_eventHandler.Call<SocketAddress, StreamId, uint64_t, const char *, size_t>(PeerEvents::StreamChunk, pSystem->reliabilityLayer.GetRemoteAddress(), id, offset, data, size);
+			return true;
+		});
+
+		system->reliabilityLayer.GetEventHandler().AddEvent(ReliabilityEvents::STREAM_RECEIVED, this, [this, pSystem](StreamId id, uint64_t size) {
+			_eventHandler.Call<SocketAddress, StreamId, uint64_t>(PeerEvents::StreamReceived, pSystem->reliabilityLayer.GetRemoteAddress(), id, size);
+			return true;
+		});
 
-		++activeSystems;
+		system->reliabilityLayer.GetEventHandler().AddEvent(ReliabilityEvents::STREAM_SENT, this, [this, pSystem](StreamId id) {
+			_eventHandler.Call<SocketAddress, StreamId>(PeerEvents::StreamSent, pSystem->reliabilityLayer.GetRemoteAddress(), id);
+			return true;
+		});
+
+		system->reliabilityLayer.GetEventHandler().AddEvent(ReliabilityEvents::STREAM_ABORTED, this, [this, pSystem](StreamId id, uint64_t size) {
+			_eventHandler.Call<SocketAddress, StreamId, uint64_t>(PeerEvents::StreamAborted, pSystem->reliabilityLayer.GetRemoteAddress(), id, size);
+			return true;
+		});
+
+		system->reliabilityLayer.GetEventHandler().AddEvent(ReliabilityEvents::STREAM_FAILED, this, [this, pSystem](StreamId id) {
+			_eventHandler.Call<SocketAddress, StreamId>(PeerEvents::StreamFailed, pSystem->reliabilityLayer.GetRemoteAddress(), id);
+			return true;
+		});
+
+		shard.remoteSystems.push_back(system);
+		shard.systemsByAddress.Insert(pPacket->remoteAddress, system);
+
+		// Only after the system is in the table, its readers are what keeps it alive
+		AssignConnectionId(shard, *system);
+
+		++shard.activeSystems;
 		return true;
 	};
 
 	void Peer::Stop()
 	{
-		_socket->StopReceiving(true);
+		for (auto &shard : shards)
+			shard->socket->StopReceiving(true);
 	}
 
-	void Peer::SendInternalPing(const SocketAddress& remoteAddress)
+	void Peer::SendInternalPing(Shard &shard, System &system)
 	{
 		BitStream bitStream{ MAX_MTU_SIZE };
 
@@ -330,14 +833,21 @@ namespace knet
 		dh.isReliable = false;
 		dh.sequenceNumber = 0;
 
+		// Pings have to find the remote after our address changed as well
+		dh.connectionId = system.reliabilityLayer.GetRemoteConnectionId();
+		dh.hasConnectionId = dh.connectionId != 0;
+
 		dh.Serialize(bitStream);
 
+		const int64_t sendTime = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+
 		bitStream.Write(PacketReliability::UNRELIABLE);
-		bitStream.Write<uint16_t>(sizeof(MessageID));
+		bitStream.Write<uint16_t>(sizeof(MessageID) + sizeof(sendTime));
 		bitStream.Write(MessageID::INTERNAL_PING);
+		bitStream.Write(sendTime);
 
-		if (_socket)
-			_socket->Send(remoteAddress, bitStream.Data(), bitStream.Size());
+		if (shard.socket)
+			shard.socket->Send(system.reliabilityLayer.GetRemoteAddress(), bitStream.Data(), bitStream.Size());
 	}
 
 #pragma endregion
@@ -4,21 +4,42 @@
 
 #include <reliability_layer.h>
 
+#include <congestion/bbr_controller.h>
+#include <congestion/new_reno_controller.h>
+
 namespace knet
 {
-	static const std::chrono::milliseconds resendTime = std::chrono::milliseconds(10000);
+	// Written as the ack delay by acks which do not acknowledge the newest datagram
+	static const uint32_t noAckDelay = std::numeric_limits<uint32_t>::max();
+
+	// Bytes a paced connection may send at once after being idle
+	static const size_t pacingBurst = 4 * MAX_MTU_SIZE;
+
+	// Room an ack block needs at least to ride along with messages, the base, the span, its encoding and a few bytes of it
+	static const size_t minPiggybackSize = 16;
+
+	// Streams the remote may send at once, and how large one may be, the chunks of others are dropped
+	static const size_t maxIncomingStreams = 64;
+	static const uint64_t maxStreamSize = uint64_t(16) * 1024 * 1024 * 1024;
+
+	// Smaller chunks would blow up the bitmap of a stream, ours fill a datagram, this caps one at maxStreamSize / minStreamChunkSize bits
+	static const uint16_t minStreamChunkSize = 512;
+
+	// Finished streams whose resent chunks are still recognized
+	static const size_t finishedStreamHistory = 64;
 
 	ReliabilityLayer::ReliabilityLayer()
 	{
 		firstUnsentAck = firstUnsentAck.min();
-		lastReceiveFromRemote = std::chrono::time_point_cast<std::chrono::milliseconds>(std::chrono::system_clock::now());
+		lastReceiveFromRemote.store(std::chrono::time_point_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now()));
 
-		std::fill(std::begin(lastOrderedIndex), std::end(lastOrderedIndex), 0);
 		std::fill(std::begin(orderingIndex), std::end(orderingIndex), 0);
 
 		highestSequencedReadIndex.fill(0);
 
-		resendBuffer.reserve(512);
+		pacer = internal::Pacer(pacingBurst);
+
+		SetCongestionControl(CongestionControlType::NewReno);
 	}
 
 	ReliabilityLayer::ReliabilityLayer(std::weak_ptr<ISocket> socket)
@@ -29,40 +50,82 @@ namespace knet
 
 	ReliabilityLayer::~ReliabilityLayer()
 	{
-
+		// Packets which were never processed may still hold a lent buffer
+		while (auto pPacket = PopBufferedPacket())
+			pPacket->Release();
 	}
 
 	bool ReliabilityLayer::OnReceive(InternalRecvPacket *packet)
+	{
+		return OnReceive(&packet, 1);
+	}
+
+	bool ReliabilityLayer::OnReceive(InternalRecvPacket **ppPackets, size_t count)
 	{
 		if (eventHandler)
 		{
-			eventHandler.Call(ReliabilityEvents::RECEIVE, packet);
+			for (size_t i = 0; i < count; ++i)
+				eventHandler.Call(ReliabilityEvents::RECEIVE, ppPackets[i]);
 		}
 
-		std::lock_guard<std::mutex> m{bufferMutex};
+		lastReceiveFromRemote.store(std::chrono::time_point_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now()), std::memory_order_relaxed);
+
+		size_t pushed = receiveQueue.Push(ppPackets, count);
 
-		lastReceiveFromRemote = std::chrono::time_point_cast<std::chrono::milliseconds>(std::chrono::system_clock::now());
+		// Let Process catch up, the kernel buffers whatever arrives meanwhile
+		while (pushed < count && overflowPolicy == ReceiveOverflowPolicy::Wait)
+		{
+			std::this_thread::yield();
+			pushed += receiveQueue.Push(ppPackets + pushed, count - pushed);
+		}
 
-		// Add packet to buffer
-		bufferedPacketQueue.push(packet);
+		if (pushed == count)
+			return true;
 
-		return true;
+		// The queue is full, drop the newest packets
+		for (size_t i = pushed; i < count; ++i)
+			ppPackets[i]->Release();
+
+		droppedPackets.fetch_add(count - pushed, std::memory_order_relaxed);
+
+		return false;
 	}
 
 	InternalRecvPacket* ReliabilityLayer::PopBufferedPacket()
 	{
-		std::lock_guard<std::mutex> m{bufferMutex};
+		InternalRecvPacket *packet = nullptr;
 
-		// Return nullptr if no packet in queue
-		if (bufferedPacketQueue.empty())
+		if (receiveQueue.Pop(&packet, 1) == 0)
 			return nullptr;
 
-		// Get next packet to process
-		InternalRecvPacket *packet = bufferedPacketQueue.front();
-		bufferedPacketQueue.pop();
 		return packet;
 	}
 
+	void ReliabilityLayer::SetReceiveQueue(size_t capacity, ReceiveOverflowPolicy policy)
+	{
+		// Packets still queued are lost with the old ring
+		while (auto pPacket = PopBufferedPacket())
+			pPacket->Release();
+
+		receiveQueue.Resize(capacity);
+		overflowPolicy = policy;
+	}
+
+	size_t ReliabilityLayer::GetReceiveQueueDepth() const
+	{
+		return receiveQueue.Size();
+	}
+
+	uint64_t ReliabilityLayer::GetDroppedPackets() const
+	{
+		return droppedPackets.load(std::memory_order_relaxed);
+	}
+
+	std::chrono::nanoseconds ReliabilityLayer::GetReceiveDelay() const
+	{
+		return std::chrono::nanoseconds(averageReceiveDelay.load(std::memory_order_relaxed));
+	}
+
 	void ReliabilityLayer::SetTimeout(const std::chrono::milliseconds &time)
 	{
 		_timeout = time;
@@ -73,8 +136,12 @@ namespace knet
 		return _timeout;
 	}
 
-	void ReliabilityLayer::Send(const char *data, size_t numberofBytesToSend, PacketPriority priority, PacketReliability reliability)
+	bool ReliabilityLayer::Send(const char *data, size_t numberofBytesToSend, PacketPriority priority, PacketReliability reliability)
 	{
+		// Message sizes are 16 bit, larger payloads go through SendStream
+		if (numberofBytesToSend > internal::ReassemblyBuffer::maxMessageSize)
+			return false;
+
 		if (priority == PacketPriority::IMMEDIATE)
 		{
 			BitStream bitStream{ numberofBytesToSend + 20};
@@ -84,6 +151,7 @@ namespace knet
 
 			pDatagramPacket->header.isACK = false;
 			pDatagramPacket->header.isNACK = false;
+			StampConnectionId(pDatagramPacket->header);
 
 			if (reliability == PacketReliability::RELIABLE
 				|| reliability == PacketReliability::RELIABLE_ORDERED
@@ -117,16 +185,24 @@ namespace knet
 
 			pDatagramPacket->packets.push_back(std::move(sendPacket));
 
-			pDatagramPacket->Serialize(bitStream);
+			SerializeDatagram(pDatagramPacket, bitStream);
 
 			if (pDatagramPacket->header.isReliable)
 			{
-				resendBuffer.push_back({std::chrono::time_point_cast<std::chrono::milliseconds>(std::chrono::system_clock::now()), std::unique_ptr<DatagramPacket>(pDatagramPacket)});
+				AddToResendBuffer(pDatagramPacket, bitStream.Size());
 			}
-			if (m_pSocket.lock())
-				m_pSocket.lock()->Send(m_RemoteSocketAddress, bitStream.Data(), bitStream.Size());
+			if (auto pSocket = m_pSocket.lock())
+			{
+				pSocket->Send(m_RemoteSocketAddress, bitStream.Data(), bitStream.Size());
 
-			return;
+				// A batching socket would hold it until the next Flush
+				pSocket->Flush();
+			}
+
+			// Not held back, but later datagrams wait for it
+			pacer.OnSend(bitStream.Size());
+
+			return true;
 		}
 		else
 		{
@@ -148,18 +224,18 @@ namespace knet
 
 			sendBuffer[sendPacket.priority].push_back(std::move(sendPacket));
 
-			return;
+			return true;
 		}
 	}
 
 	void ReliabilityLayer::Process()
 	{
-		auto curTime = std::chrono::time_point_cast<std::chrono::milliseconds>(std::chrono::system_clock::now());
+		auto curTime = std::chrono::time_point_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now());
 
 		if(m_pSocket.lock())
 		{
 			// Check for timeout
-			if(((curTime - lastReceiveFromRemote) >= _timeout))
+			if(((curTime - lastReceiveFromRemote.load(std::memory_order_relaxed)) >= _timeout))
 			{
 				// NOW send disconnect event so it will be removed in our peer
 				// The Peer which handles this event should stop listening for this socket by calling StopReceiving
@@ -170,125 +246,199 @@ namespace knet
 			}
 		}
 
-		if ((firstUnsentAck.min() == firstUnsentAck) && ((curTime - firstUnsentAck).count() >= 500))
+		if ((firstUnsentAck != firstUnsentAck.min()) && ((curTime - firstUnsentAck) >= maxAckDelay))
 			SendACKs();
 
 		// TODO: process all network and buffered stuff
-		InternalRecvPacket * pPacket = nullptr;
-		while ((pPacket = PopBufferedPacket()) != nullptr && pPacket != nullptr)
+		InternalRecvPacket * packets[64];
+		size_t count = 0;
+
+		while ((count = receiveQueue.Pop(packets, sizeof(packets) / sizeof(packets[0]))) > 0)
 		{
-			// TODO: handle return
-			ProcessPacket(pPacket, curTime);
+			auto processTime = std::chrono::steady_clock::now();
+
+			for (size_t i = 0; i < count; ++i)
+			{
+				auto delay = std::chrono::duration_cast<std::chrono::nanoseconds>(processTime - packets[i]->kernelTimeStamp).count();
+				auto average = averageReceiveDelay.load(std::memory_order_relaxed);
+
+				averageReceiveDelay.store(average == 0 ? delay : average + (delay - average) / 8, std::memory_order_relaxed);
 
-			// delete the packet after processing
-			delete pPacket;
-			pPacket = nullptr;
+				// TODO: handle return
+				ProcessPacket(packets[i], curTime);
+
+				// Give the packet back to the pool after processing
+				packets[i]->Release();
+			}
 		}
 
+		// Report losses right away, the remote only resends them when its timeout expires otherwise
+		SendNACKs();
+
 		ProcessOrderedPackets(curTime);
 
+		// Split messages whose fragments stopped coming
+		if (!reassemblyBuffer.Empty())
+			reassemblyBuffer.Expire();
+
+		// Streams whose chunks stopped coming or stopped being acknowledged
+		if (!incomingStreams.empty())
+			ExpireIncomingStreams(std::chrono::steady_clock::now());
+
+		if (!outgoingStreams.empty())
+			ExpireOutgoingStreams(std::chrono::steady_clock::now());
+
+		ProcessPacedSends();
+
 		ProcessResend(curTime);
 
 		ProcessSend(curTime);
+
+		// Fragments of large messages and chunks of streams take what is left after the other messages
+		ProcessSplitSends();
+		ProcessStreamSends();
 	}
 
-	void ReliabilityLayer::ProcessResend(milliSecondsPoint &curTime)
+	std::chrono::steady_clock::time_point ReliabilityLayer::GetNextWakeup()
 	{
-		BitStream bitStream{MAX_MTU_SIZE};
+		const auto now = std::chrono::steady_clock::now();
 
-		auto curResendTime = curTime - resendTime;
+		if (!receiveQueue.Empty())
+			return now;
 
-		/* I think it better to do it before sending the new packets because of stuff */
-		for (auto &resendPacket : resendBuffer)
+		std::chrono::steady_clock::time_point nextWakeup = std::chrono::steady_clock::time_point::max();
+
+		// New and lost datagrams leave once the window has room and the pacer has tokens, acks wake us up otherwise
+		const auto nextSend = pacer.GetNextSendTime(now);
+
+		if (!pacedQueue.empty())
+		{
+			nextWakeup = nextSend;
+		}
+		else if (HasCongestionWindow())
 		{
-			if(curResendTime > resendPacket.first)
+			for (auto &buffer : sendBuffer)
 			{
-				bitStream.Reset();
+				if (!buffer.empty())
+					nextWakeup = nextSend;
+			}
 
-				// Is it better to add the packet to the send buffer? could be useful for later congestion control
+			if ((splitBytesPending > 0 || HasStreamToSend()) && CanSendFragment())
+				nextWakeup = nextSend;
+		}
 
-				// Resend the packet
-				resendPacket.second->Serialize(bitStream);
+		if (firstUnsentAck != firstUnsentAck.min())
+			nextWakeup = std::min<std::chrono::steady_clock::time_point>(nextWakeup, firstUnsentAck + maxAckDelay);
 
-				if (m_pSocket.lock())
-					m_pSocket.lock()->Send(m_RemoteSocketAddress, bitStream.Data(), bitStream.Size());
+		const auto retransmissionTimeout = GetRetransmissionTimeout();
 
-				// set the time the packet was sent
-				resendPacket.first = curTime;
-			}
-		}
+		if (auto timer = OldestResendTimer())
+			nextWakeup = std::min(nextWakeup, timer->sendTime + retransmissionTimeout);
+
+		if (HasLostDatagrams() && HasCongestionWindow())
+			nextWakeup = std::min(nextWakeup, nextSend);
+
+		// The timeout is only checked with a socket, see Process
+		if (m_pSocket.lock())
+			nextWakeup = std::min<std::chrono::steady_clock::time_point>(nextWakeup, lastReceiveFromRemote.load(std::memory_order_relaxed) + _timeout);
+
+		return nextWakeup;
 	}
 
-	void ReliabilityLayer::ProcessOrderedPackets(milliSecondsPoint &)
+	void ReliabilityLayer::ProcessResend(milliSecondsPoint &)
 	{
-		int i = 0;
-		uint16_t lastIndex = 0;
-		uint8_t channel = 0;
+		BitStream bitStream{MAX_MTU_SIZE};
+
+		const auto now = std::chrono::steady_clock::now();
+		const auto curResendTime = now - GetRetransmissionTimeout();
+		bool timedOut = false;
 
-		for (auto & orderedPackets : orderedPacketBuffer)
+		// Timed out datagrams are lost, they leave the flight and wait for the window
+		while (auto timer = OldestResendTimer())
 		{
-			if (orderedPackets.size())
-			{
+			if (timer->sendTime > curResendTime)
+				break;
 
-				//DEBUG_LOG("Sort");
+			auto resendPacket = resendBuffer.Find(timer->sequenceNumber);
+			resendPacket->inFlight = false;
+			bytesInFlight -= resendPacket->bytes;
 
-				// Sort the packets but keep the relative position
-				std::stable_sort(orderedPackets.begin(), orderedPackets.end(), [](const ReliablePacket& packet, const ReliablePacket& packet_) -> bool
-				{
-					return (packet.sequenceNumber < packet_.sequenceNumber);
-				});
+			lostDatagrams.push_back(timer->sequenceNumber);
+			resendTimers.pop_front();
 
-				if (orderedPackets.size())
-				{
-					lastIndex = lastOrderedIndex[orderedPackets.begin()->orderedInfo.channel];
+			timedOut = true;
+		}
 
-					for (auto &packet : orderedPackets)
-					{
+		// One backoff per expiry, not per datagram which was part of it
+		if (timedOut)
+		{
+			rttEstimator.Backoff();
 
-						if (firstUnsentAck == firstUnsentAck.min())
-							firstUnsentAck = std::chrono::time_point_cast<std::chrono::milliseconds>(std::chrono::system_clock::now());
+			if (congestionController)
+				congestionController->OnRetransmissionTimeout(now);
+		}
 
-						if (lastIndex > packet.orderedInfo.index)
-						{
-							lastIndex = packet.orderedInfo.index;
+		bool resent = false;
 
-							if (eventHandler)
-							{
-								eventHandler.Call<ReliablePacket &, SocketAddress&>(ReliabilityEvents::HANDLE_PACKET, packet, packet.socketAddress);
-							}
+		/* I think it better to do it before sending the new packets because of stuff */
+		while (HasLostDatagrams())
+		{
+			// A timeout always lets one datagram through, the window may have collapsed below it
+			if (!HasCongestionWindow() && (resent || !timedOut))
+				break;
 
-							orderedPackets.erase(orderedPackets.begin());
+			if (!CanSendPaced())
+				break;
 
-							break;
+			const auto sequenceNumber = lostDatagrams.front();
+			auto resendPacket = resendBuffer.Find(sequenceNumber);
 
-						}
-						else if (packet.orderedInfo.index > 0 && packet.orderedInfo.index != (lastIndex + 1))
-						{
-							break;
-						}
-						else
-						{
-							lastIndex = packet.orderedInfo.index;
-							if (eventHandler)
-							{
-								eventHandler.Call<ReliablePacket &, SocketAddress&>(ReliabilityEvents::HANDLE_PACKET, packet, packet.socketAddress);
-							}
-						}
+			bitStream.Reset();
 
-						++i;
-						channel = packet.orderedInfo.channel;
-					}
-				}
+			// Resend the packet
+			SerializeDatagram(resendPacket->packet.get(), bitStream);
 
-				lastOrderedIndex[channel] = lastIndex;
+			if (m_pSocket.lock())
+				m_pSocket.lock()->Send(m_RemoteSocketAddress, bitStream.Data(), bitStream.Size());
 
-				if (i > 0)
-					orderedPackets.erase(orderedPackets.begin(), orderedPackets.begin() + i);
+			pacer.OnSend(bitStream.Size(), now);
 
-				i = 0;
-				lastIndex = 0;
-			}
+			// set the time the packet was sent
+			resendPacket->sendTime = now;
+			resendPacket->inFlight = true;
+			++resendPacket->transmissions;
+
+			resendTimers.push_back({now, sequenceNumber});
+			lostDatagrams.pop_front();
+
+			bytesInFlight += resendPacket->bytes;
+			resent = true;
+		}
+	}
+
+	void ReliabilityLayer::ProcessOrderedPackets(milliSecondsPoint &)
+	{
+		for (auto channel : readyOrderedChannels)
+		{
+			orderedPacketBuffer[channel].Deliver([this](ReliablePacket &packet) {
+				if (eventHandler)
+				{
+					eventHandler.Call<ReliablePacket &, SocketAddress&>(ReliabilityEvents::HANDLE_PACKET, packet, packet.socketAddress);
+				}
+			});
 		}
+
+		readyOrderedChannels.clear();
+	}
+
+	void ReliabilityLayer::BufferOrderedPacket(ReliablePacket &&packet)
+	{
+		const auto channel = packet.orderedInfo.channel;
+		const auto index = packet.orderedInfo.index;
+
+		// A message which is not the expected one waits for the gap to be filled, a duplicate is dropped
+		if (orderedPacketBuffer[channel].Insert(index, std::move(packet)) == internal::ReorderWindow<ReliablePacket, OrderedIndexType>::InsertResult::Ready)
+			readyOrderedChannels.push_back(channel);
 	}
 
 	void ReliabilityLayer::ProcessSend(milliSecondsPoint &curTime)
@@ -316,13 +466,14 @@ namespace knet
 			/* Setup Unrealiable datagram packet */
 			pUnrealiableDatagramPacket->header.isACK = false;
 			pUnrealiableDatagramPacket->header.isNACK = false;
+			StampConnectionId(pUnrealiableDatagramPacket->header);
 			pUnrealiableDatagramPacket->header.isReliable = false;
 
 			/* Setup Reliable datagram packet */
 			pReliableDatagramPacket->header.isACK = false;
 			pReliableDatagramPacket->header.isNACK = false;
+			StampConnectionId(pReliableDatagramPacket->header);
 			pReliableDatagramPacket->header.isReliable = true;
-			pReliableDatagramPacket->header.sequenceNumber = flowControlHelper.GetSequenceNumber();
 
 			DatagramPacket * pCurrentPacket = pReliableDatagramPacket;
 
@@ -357,17 +508,27 @@ namespace knet
 
 			uint32_t bufIndex[PacketPriority::IMMEDIATE] = {0};
 
+			// Reliable messages which found the window closed, they go back to the front of their buffer
+			std::array<std::vector<ReliablePacket>, static_cast<std::size_t>(PacketPriority::IMMEDIATE)> deferred;
+
 			for (int i = 0; i < 100; ++i)
 			{
+				// The rest waits for the pacer to send what it held back
+				if (!pacedQueue.empty())
+					break;
+
 				nextPriority = GetNextPriority();
 
-				for (PacketPriority prio = nextPriority; prio > PacketPriority::LOW; prio = (PacketPriority)(prio - 1))
+				// The scheduled priority has nothing left, take the most urgent one which has
+				if (sendBuffer[nextPriority].size() <= static_cast<size_t>(bufIndex[nextPriority]))
 				{
-					nextPriority = prio;
-
-					if (sendBuffer[prio].size() > static_cast<size_t>(bufIndex[prio]))
+					for (int prio = PacketPriority::HIGH; prio >= PacketPriority::LOW; --prio)
 					{
-						break;
+						if (sendBuffer[prio].size() > static_cast<size_t>(bufIndex[prio]))
+						{
+							nextPriority = static_cast<PacketPriority>(prio);
+							break;
+						}
 					}
 				}
 
@@ -384,6 +545,15 @@ namespace knet
 						|| packet.reliability == PacketReliability::RELIABLE_ORDERED
 						|| packet.reliability == PacketReliability::RELIABLE_SEQUENCED)
 					{
+						// Only reliable messages wait for acks to open the window again, unreliable ones keep flowing
+						if (!HasCongestionWindow())
+						{
+							// Deferred messages do not count against the messages sent per Process
+							deferred[nextPriority].push_back(std::move(packet));
+							--i;
+							continue;
+						}
+
 						pCurrentPacket = pReliableDatagramPacket;
 					}
 					else
@@ -395,31 +565,35 @@ namespace knet
 					// FIXME: clean this up
 					auto sendPacket = [&]()
 					{
-						pCurrentPacket->Serialize(bitStream);
-
-						if (m_pSocket.lock())
-							m_pSocket.lock()->Send(m_RemoteSocketAddress, bitStream.Data(), bitStream.Size());
+						// Sequence numbers are only taken by datagrams which are sent, the remote reports any gap as a loss
+						if (pCurrentPacket == pReliableDatagramPacket)
+							pCurrentPacket->header.sequenceNumber = flowControlHelper.GetSequenceNumber();
 
+						SerializeDatagram(pCurrentPacket, bitStream);
 
 						if (pCurrentPacket == pReliableDatagramPacket)
 						{
 							// Add the packet to the resend buffer
-							resendBuffer.push_back(std::move(std::make_pair(curTime, std::unique_ptr<DatagramPacket>(pCurrentPacket))));
+							AddToResendBuffer(pCurrentPacket, bitStream.Size());
+							SendDatagram(bitStream, pCurrentPacket);
 
 							pReliableDatagramPacket = new DatagramPacket();
 
 							pReliableDatagramPacket->header.isACK = false;
 							pReliableDatagramPacket->header.isNACK = false;
+							StampConnectionId(pReliableDatagramPacket->header);
 							pReliableDatagramPacket->header.isReliable = true;
-							pReliableDatagramPacket->header.sequenceNumber = flowControlHelper.GetSequenceNumber();
 						}
 						else
 						{
+							SendDatagram(bitStream, pCurrentPacket);
+
 							delete pUnrealiableDatagramPacket;
 							pUnrealiableDatagramPacket = new DatagramPacket();
 
 							pUnrealiableDatagramPacket->header.isACK = false;
 							pUnrealiableDatagramPacket->header.isNACK = false;
+							StampConnectionId(pUnrealiableDatagramPacket->header);
 							pUnrealiableDatagramPacket->header.isReliable = false;
 						}
 
@@ -445,8 +619,8 @@ namespace knet
 
 						if (packet.GetSizeToSend() >= MAX_MTU_SIZE - pCurrentPacket->header.GetSizeToSend())
 						{
-							// The packet is bigger than MAX_MTU_SIZE so we have to split it
-							SplitPacket(packet, &pReliableDatagramPacket);
+							// The packet is bigger than MAX_MTU_SIZE so we have to split it, its fragments leave with ProcessSplitSends
+							SplitPacket(packet);
 						}
 						else
 						{
@@ -479,14 +653,19 @@ namespace knet
 				{
 					sendBuffer[p].erase(sendBuffer[p].begin(), sendBuffer[p].begin() + (bufIndex[p]));
 				}
+
+				if (!deferred[p].empty())
+				{
+					sendBuffer[p].insert(sendBuffer[p].begin(), std::make_move_iterator(deferred[p].begin()), std::make_move_iterator(deferred[p].end()));
+				}
 			}
 
 
 			if (pUnrealiableDatagramPacket->packets.size())
 			{
 				bitStream.Reset();
-				pUnrealiableDatagramPacket->Serialize(bitStream);
-				m_pSocket.lock()->Send(m_RemoteSocketAddress, bitStream.Data(), bitStream.Size());
+				SerializeDatagram(pUnrealiableDatagramPacket, bitStream);
+				SendDatagram(bitStream, pUnrealiableDatagramPacket);
 
 				// Unrealiable packets are not needed anymore
 				delete pUnrealiableDatagramPacket;
@@ -500,11 +679,11 @@ namespace knet
 			{
 				bitStream.Reset();
 
-				pReliableDatagramPacket->Serialize(bitStream);
-
-				m_pSocket.lock()->Send(m_RemoteSocketAddress, bitStream.Data(), bitStream.Size());
+				pReliableDatagramPacket->header.sequenceNumber = flowControlHelper.GetSequenceNumber();
+				SerializeDatagram(pReliableDatagramPacket, bitStream);
 
-				resendBuffer.push_back({curTime, std::unique_ptr<DatagramPacket>(pReliableDatagramPacket)});
+				AddToResendBuffer(pReliableDatagramPacket, bitStream.Size());
+				SendDatagram(bitStream, pReliableDatagramPacket);
 			}
 			else
 			{
@@ -512,53 +691,244 @@ namespace knet
 			}
 
 		}
+
+		// Rate samples taken while we had less to send than the window allows do not show the path's bandwidth
+		appLimited = HasCongestionWindow() && splitBytesPending == 0 && !HasStreamToSend() && std::all_of(sendBuffer.begin(), sendBuffer.end(), [](const std::vector<ReliablePacket> &buffer) {
+			return buffer.empty();
+		});
 	}
 
-	void ReliabilityLayer::RemoveRemote(const SocketAddress& remoteAddress)
+	ReliabilityLayer::ResendEntry & ReliabilityLayer::AddToResendBuffer(DatagramPacket *pDatagramPacket, size_t bytes, bool isFragment)
+	{
+		const auto now = std::chrono::steady_clock::now();
+
+		// Delivery rates are measured from when the pipe last started filling
+		if (bytesInFlight == 0)
+			lastDeliveredTime = now;
+
+		ResendEntry entry;
+		entry.sendTime = now;
+		entry.packet.reset(pDatagramPacket);
+		entry.bytes = bytes;
+		entry.delivered = totalDelivered;
+		entry.deliveredTime = lastDeliveredTime;
+		entry.appLimited = appLimited;
+		entry.isFragment = isFragment;
+
+		if (isFragment)
+			fragmentBytesUnacked += bytes;
+
+		auto &inserted = resendBuffer.Insert(pDatagramPacket->header.sequenceNumber, std::move(entry));
+		resendTimers.push_back({now, pDatagramPacket->header.sequenceNumber});
+
+		bytesInFlight += bytes;
+
+		if (congestionController)
+			congestionController->OnPacketSent(now, bytes, bytesInFlight);
+
+		return inserted;
+	}
+
+	bool ReliabilityLayer::HasCongestionWindow() const
+	{
+		return !congestionController || bytesInFlight < congestionController->GetCongestionWindow();
+	}
+
+	const ReliabilityLayer::ResendTimer *ReliabilityLayer::OldestResendTimer()
 	{
-		for(const auto& remote : remoteList)
+		while (!resendTimers.empty())
 		{
-			if(remote.address == remoteAddress)
-			{
-				remoteList.erase(std::next(std::find(remoteList.rbegin(), remoteList.rend(), remote)).base());
-				remoteList.shrink_to_fit();
-				return;
-			}
+			const auto &timer = resendTimers.front();
+			auto entry = resendBuffer.Find(timer.sequenceNumber);
+
+			if (entry && entry->inFlight && !entry->queued && entry->sendTime == timer.sendTime)
+				return &timer;
+
+			resendTimers.pop_front();
+		}
+
+		return nullptr;
+	}
+
+	bool ReliabilityLayer::HasLostDatagrams()
+	{
+		while (!lostDatagrams.empty())
+		{
+			auto entry = resendBuffer.Find(lostDatagrams.front());
+
+			if (entry && !entry->inFlight)
+				return true;
+
+			lostDatagrams.pop_front();
+		}
+
+		return false;
+	}
+
+	bool ReliabilityLayer::CanSendPaced()
+	{
+		return pacedQueue.empty() && pacer.CanSend();
+	}
+
+	void ReliabilityLayer::SendDatagram(BitStream &bitStream, const DatagramPacket *pDatagramPacket)
+	{
+		if (CanSendPaced())
+		{
+			if (m_pSocket.lock())
+				m_pSocket.lock()->Send(m_RemoteSocketAddress, bitStream.Data(), bitStream.Size());
+
+			pacer.OnSend(bitStream.Size());
+			return;
+		}
+
+		PacedDatagram paced;
+		paced.data.assign(bitStream.Data(), bitStream.Data() + bitStream.Size());
+		paced.isReliable = pDatagramPacket->header.isReliable;
+		paced.sequenceNumber = pDatagramPacket->header.sequenceNumber;
+
+		// Its resend timer must not run while it waits
+		if (paced.isReliable)
+		{
+			if (auto entry = resendBuffer.Find(paced.sequenceNumber))
+				entry->queued = true;
 		}
+
+		pacedQueue.push_back(std::move(paced));
 	}
 
-	bool IsOlderOrderedPacket(SequenceNumberType newPacketOrderingIndex, SequenceNumberType waitingForPacketOrderingIndex)
+	void ReliabilityLayer::ProcessPacedSends()
 	{
-		SequenceNumberType maxRange = (SequenceNumberType) (const uint32_t) -1;
+		const auto now = std::chrono::steady_clock::now();
+
+		// The controller's rate follows its window and round trip, take it up every time
+		if (pacingRate > 0.0)
+			pacer.SetRate(pacingRate, now);
+		else
+			pacer.SetRate(congestionController ? congestionController->GetPacingRate() : 0.0, now);
 
-		if (waitingForPacketOrderingIndex > maxRange / 2)
+		while (!pacedQueue.empty() && pacer.CanSend(now))
 		{
-			if (newPacketOrderingIndex >= waitingForPacketOrderingIndex - maxRange / 2 + 1
-				&& newPacketOrderingIndex < waitingForPacketOrderingIndex)
+			auto &paced = pacedQueue.front();
+
+			if (m_pSocket.lock())
+				m_pSocket.lock()->Send(m_RemoteSocketAddress, paced.data.data(), paced.data.size());
+
+			pacer.OnSend(paced.data.size(), now);
+
+			if (paced.isReliable)
 			{
-				return true;
+				auto entry = resendBuffer.Find(paced.sequenceNumber);
+
+				if (entry && entry->queued)
+				{
+					entry->queued = false;
+					entry->sendTime = now;
+
+					resendTimers.push_back({now, paced.sequenceNumber});
+				}
 			}
+
+			pacedQueue.pop_front();
 		}
+	}
 
-		else
+	void ReliabilityLayer::RemoveRemote(const SocketAddress& remoteAddress)
+	{
+		remoteSystems.erase(remoteAddress);
+	}
+
+	// Sequencing indices are 16 bit and wrap, an index up to half the range behind the expected one is old
+	bool IsOlderOrderedPacket(SequenceIndexType newPacketOrderingIndex, SequenceIndexType waitingForPacketOrderingIndex)
+	{
+		const SequenceIndexType distance = static_cast<SequenceIndexType>(waitingForPacketOrderingIndex - newPacketOrderingIndex);
+
+		return distance != 0 && distance <= std::numeric_limits<SequenceIndexType>::max() / 2 + 1;
+	}
+
+	void ReliabilityLayer::HandleAcks(const std::vector<internal::AckWindow::Range> &ranges, uint32_t ackDelay, std::chrono::steady_clock::time_point arrivalTime)
+	{
+		AckSample sample;
+		sample.now = arrivalTime;
+
+		// The delay belongs to the newest datagram the remote acknowledged, the end of the last range, see WriteAcks
+		if (ackDelay != noAckDelay && !ranges.empty())
+			sample.rtt = SampleRtt(ranges.back().second, arrivalTime - std::chrono::microseconds(ackDelay));
+
+		// Only the acknowledged entries are visited, the newest one's delivery state gives the rate sample
+		bool hasAcked = false;
+		ResendEntry newest;
+
+		for (auto &range : ranges)
 		{
-			if (newPacketOrderingIndex >= (waitingForPacketOrderingIndex - (maxRange / 2 + 1))
-				|| newPacketOrderingIndex < waitingForPacketOrderingIndex)
+			SequenceNumberType sequenceNumber = range.first;
+			SequenceNumberType last = range.second;
+
+			if (!resendBuffer.Clamp(sequenceNumber, last))
+				continue;
+
+			for (;; sequenceNumber = resendBuffer.Next(sequenceNumber))
 			{
-				return true;
+				if (auto entry = resendBuffer.Find(sequenceNumber))
+				{
+					if (entry->inFlight)
+						bytesInFlight -= entry->bytes;
+
+					totalDelivered += entry->bytes;
+					sample.ackedBytes += entry->bytes;
+
+					if (!hasAcked || entry->sendTime > newest.sendTime)
+					{
+						newest.sendTime = entry->sendTime;
+						newest.delivered = entry->delivered;
+						newest.deliveredTime = entry->deliveredTime;
+						newest.appLimited = entry->appLimited;
+					}
+
+					if (entry->isFragment)
+						fragmentBytesUnacked -= entry->bytes;
+
+					if (entry->streamId != 0)
+						OnStreamChunkAcknowledged(entry->streamId, entry->streamBytes);
+
+					hasAcked = true;
+					resendBuffer.Erase(sequenceNumber);
+				}
+
+				if (sequenceNumber == last)
+					break;
 			}
 		}
-		// Old packet
-		return false;
+
+		if (hasAcked)
+		{
+			lastDeliveredTime = arrivalTime;
+
+			sample.bytesInFlight = bytesInFlight;
+			sample.newestSendTime = newest.sendTime;
+			sample.smoothedRtt = rttEstimator.GetSmoothedRtt();
+			sample.delivered = totalDelivered;
+			sample.priorDelivered = newest.delivered;
+			sample.appLimited = newest.appLimited;
+
+			auto interval = std::chrono::duration<double>(arrivalTime - newest.deliveredTime).count();
+
+			if (interval > 0.0)
+				sample.deliveryRate = static_cast<double>(totalDelivered - newest.delivered) / interval;
+
+			if (congestionController)
+				congestionController->OnAck(sample);
+		}
 	}
 
-	bool ReliabilityLayer::ProcessPacket(InternalRecvPacket *pPacket, std::chrono::time_point<std::chrono::system_clock, std::chrono::milliseconds> &curTime)
+	bool ReliabilityLayer::ProcessPacket(InternalRecvPacket *pPacket, milliSecondsPoint &curTime)
 	{
-		for (auto &remoteSystem : remoteList)
 		{
-			if (remoteSystem.address == pPacket->remoteAddress)
+			// Known remotes are looked up by their address, anything else is a new connection or a connection which moved
+			auto remoteSystem = remoteSystems.find(pPacket->remoteAddress);
+
+			if (remoteSystem != remoteSystems.end() || MigrateRemote(pPacket))
 			{
-				BitStream bitStream{(unsigned char*)pPacket->data, static_cast<size_t>(pPacket->bytesRead), true};
+				BitStream bitStream{(unsigned char*)pPacket->buffer, static_cast<size_t>(pPacket->bytesRead), true};
 
 				//DEBUG_LOG("Process %d bytes", pPacket->bytesRead);
 
@@ -566,45 +936,30 @@ namespace knet
 
 				// Handle Packet in Reliability Layer
 				DatagramPacket dPacket;
-				dPacket.Deserialze(bitStream);
+
+				// The messages are only read once the datagram is known to be new
+				const bool readMessages = dPacket.DeserializeHeader(bitStream);
 
 				if (dPacket.header.isACK)
 				{
 					// Handle ACK Packet
-					uint32_t count = 0;
-					bitStream.Read(count);
-
-					std::vector<std::pair<int32_t, int32_t>> ranges(count);
+					uint32_t ackDelay = 0;
 
-					int32_t max;
-					int32_t min;
+					std::vector<std::pair<int32_t, int32_t>> ranges;
 
-					for (uint32_t i = 0; i < count; ++i)
+					// A malformed ack acknowledges nothing
+					if (!internal::AckWindow::Read(bitStream, ranges) || !bitStream.Read(ackDelay))
 					{
-						bitStream.Read(min);
-						bitStream.Read(max);
+						ranges.clear();
+						ackDelay = noAckDelay;
+					}
 
 #if DEBUG_ACKS
-						DEBUG_LOG("Got ACK for %d %d on {%p}", min, max, this);
+					for (auto &range : ranges)
+						DEBUG_LOG("Got ACK for %d %d on {%p}", range.first, range.second, this);
 #endif
 
-						ranges.push_back({min, max});
-					}
-
-
-
-					resendBuffer.erase(std::remove_if(std::begin(resendBuffer), std::end(resendBuffer),
-					[&ranges](std::pair<milliSecondsPoint, std::unique_ptr<DatagramPacket>> &packet)
-					{
-						auto isInAckRange = [](decltype(ranges)& vecRange, int32_t sequenceNumber) {
-							return std::any_of(std::begin(vecRange), std::end(vecRange), [sequenceNumber](const auto &k) {
-								return (sequenceNumber >= k.first && sequenceNumber <= k.second);
-							});
-						};
-						return isInAckRange(ranges, packet.second->header.sequenceNumber);
-					}));
-
-					resendBuffer.shrink_to_fit();
+					HandleAcks(ranges, ackDelay, GetArrivalTime(pPacket));
 				}
 				else if (dPacket.header.isNACK)
 				{
@@ -612,15 +967,22 @@ namespace knet
 					uint32_t count = 0;
 					bitStream.Read(count);
 
-					std::vector<std::pair<int32_t, int32_t>> ranges(count);
+					// The count comes from the wire, no more ranges than the datagram holds
+					const size_t rangeSize = 2 * sizeof(SequenceNumberType);
+					const size_t remainingBytes = (BytesToBits(bitStream.Size()) - bitStream.ReadOffset()) / 8;
+
+					count = static_cast<uint32_t>(std::min<size_t>(count, remainingBytes / rangeSize));
+
+					std::vector<std::pair<int32_t, int32_t>> ranges;
+					ranges.reserve(count);
 
 					int32_t max;
 					int32_t min;
 
 					for (uint32_t i = 0; i < count; ++i)
 					{
-						bitStream.Read(min);
-						bitStream.Read(max);
+						if (!bitStream.Read(min) || !bitStream.Read(max))
+							break;
 
 #if DEBUG_ACKS
 						DEBUG_LOG("Got NACK for %d %d on {%p}", min, max, this);
@@ -630,119 +992,125 @@ namespace knet
 					}
 
 
-					auto size = resendBuffer.size();
+					size_t lostBytes = 0;
+					std::chrono::steady_clock::time_point lostSendTime;
 
-					for (size_t i = 0; i < size; ++i)
+					for (auto &range : ranges)
 					{
-						auto sequenceNumber = resendBuffer[i].second->header.sequenceNumber;
+						SequenceNumberType sequenceNumber = range.first;
+						SequenceNumberType last = range.second;
 
-						// Checks if the given sequence number is in range of the given acks
-						auto isInAckRange = [](decltype(ranges)& vecRange, int32_t sequenceNumber) {
-							return std::any_of(std::begin(vecRange), std::end(vecRange), [sequenceNumber](const auto &k) {
-								return (sequenceNumber >= k.first && sequenceNumber <= k.second);
-							});
-						};
+						if (!resendBuffer.Clamp(sequenceNumber, last))
+							continue;
 
-						if (isInAckRange(ranges, sequenceNumber))
+						for (;; sequenceNumber = resendBuffer.Next(sequenceNumber))
 						{
-							// TODO: handle congestion control
-							// TODO: dont sent the packet immediatly, its better to readd it to the send buffer!?
+							auto resendPacket = resendBuffer.Find(sequenceNumber);
 
-							// Resend packet
-							resendBuffer[i].second->Serialize(bitStream);
+							// Lost datagrams leave the flight, ProcessResend sends them again as the window allows
+							if (resendPacket && resendPacket->inFlight && !resendPacket->queued)
+							{
+								resendPacket->inFlight = false;
+								bytesInFlight -= resendPacket->bytes;
 
-							if (m_pSocket.lock())
-								m_pSocket.lock()->Send(m_RemoteSocketAddress, bitStream.Data(), bitStream.Size());
+								lostBytes += resendPacket->bytes;
+								lostSendTime = std::max(lostSendTime, resendPacket->sendTime);
 
-							// set the time the packet was sent
-							resendBuffer[i].first = curTime;
+								lostDatagrams.push_back(sequenceNumber);
+							}
 
-							bitStream.Reset();
+							if (sequenceNumber == last)
+								break;
 						}
 					}
+
+					if (lostBytes > 0 && congestionController)
+						congestionController->OnLoss(GetArrivalTime(pPacket), lostBytes, lostSendTime);
 				}
 				else
 				{
-					// Now process the packet
+					// Acks which came along with the messages
+					if (dPacket.header.hasAck)
+						HandleAcks(dPacket.ackRanges, dPacket.ackDelay, GetArrivalTime(pPacket));
 
-#if DEBUG_ACKS
-					for (auto i : acknowledgements)
-					{
-						if (dPacket.header.sequenceNumber == i)
-						{
-							DEBUG_LOG("Already in ACK list %d", i);
-							break;
-						}
-					}
-#endif
+					// Now process the packet
 
 					if (dPacket.header.isReliable)
-						acknowledgements.push_back(dPacket.header.sequenceNumber);
-
-					if (dPacket.header.isSplit)
 					{
-						auto &packet = dPacket.packets[0];
-
-						// handle split packets
-
-						// Check if its already in the map
-						if (splitPacketBuffer.find(packet.splitInfo.packetIndex) == splitPacketBuffer.end())
+						// A chunk which is refused is not acked, the remote resends it until its stream has room
+						// Resends of chunks which arrived already are acked again below without being read
+						if (dPacket.header.isStream && readMessages && !receivedWindow.Contains(dPacket.header.sequenceNumber))
 						{
-							splitPacketBuffer.emplace(packet.splitInfo.index, std::move(std::vector<ReliablePacket>{}));
-						}
+							dPacket.DeserializeMessages(bitStream);
 
-						if (packet.splitInfo.index == 0)
-						{
-							// Check if this index is already in use
-							if(splitPacketBuffer.at(packet.splitInfo.packetIndex).size() > 0)
+							if (dPacket.packets.empty() || !AdmitStreamChunk(dPacket.packets[0], GetArrivalTime(pPacket)))
 							{
-								// Handle already in use
-
+								// It is no gap, a nack would make the remote take the refusal for congestion, its timeout resends it
+								gapTracker.OnReceive(dPacket.header.sequenceNumber);
+								return true;
 							}
-							else
-								// first packet so it a new packet
-								splitPacketBuffer.at(packet.splitInfo.packetIndex).push_back(std::move(packet));
 						}
-						else
+
+						// The remote measures its round trip to the newest datagram, without the time its ack was held back
+						if (acknowledgements.Empty() || internal::AckWindow::IsAfter(dPacket.header.sequenceNumber, largestAcknowledgement))
 						{
-							splitPacketBuffer.at(packet.splitInfo.packetIndex).push_back(std::move(packet));
+							largestAcknowledgement = dPacket.header.sequenceNumber;
+							largestAcknowledgementTime = GetArrivalTime(pPacket);
 						}
 
-						if (packet.splitInfo.isEnd)
+						// The window is full, send what it has to make room
+						if (!acknowledgements.Add(dPacket.header.sequenceNumber))
 						{
-							//
-							BitStream bitStream2{MAX_MTU_SIZE};
+							SendACKs();
+							acknowledgements.Add(dPacket.header.sequenceNumber);
+						}
 
-							std::sort(splitPacketBuffer.at(packet.splitInfo.packetIndex).begin(), splitPacketBuffer.at(packet.splitInfo.packetIndex).end(),
-							[](const ReliablePacket &packet, const ReliablePacket &packet_)
-							{
-								return (packet.splitInfo.index < packet_.splitInfo.index);
-							});
+						if (firstUnsentAck == firstUnsentAck.min())
+							firstUnsentAck = std::chrono::time_point_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now());
 
-							for (auto &tPacket : splitPacketBuffer[packet.splitInfo.packetIndex])
-							{
-								bitStream2.Write(tPacket.Data(), tPacket.Size());
-							}
+						// A resend whose original arrived, its ack may have been lost so it is acked again
+						// Datagrams before the window are taken as new, dropping one which never arrived would lose it
+						if (receivedWindow.Add(dPacket.header.sequenceNumber) == internal::ReceivedWindow::AddResult::Duplicate)
+						{
+							++duplicateDatagrams;
+							return true;
+						}
+
+						gapTracker.OnReceive(dPacket.header.sequenceNumber);
+					}
 
-							ReliablePacket completePacket{ bitStream2.Data(), bitStream2.Size()};
+					// Stream chunks were read to admit them already
+					if (readMessages && dPacket.packets.empty() && !dPacket.header.isStream)
+						dPacket.DeserializeMessages(bitStream);
 
-							completePacket.orderedInfo = splitPacketBuffer[packet.splitInfo.packetIndex].begin()->orderedInfo;
-							completePacket.reliability = splitPacketBuffer[packet.splitInfo.packetIndex].begin()->reliability;
+					if (dPacket.header.isStream)
+					{
+						// Stream chunks go to their sink as they are, there is nothing to order or reassemble
+						if (!dPacket.packets.empty())
+							HandleStreamChunk(dPacket.packets[0], GetArrivalTime(pPacket));
+					}
+					else if (dPacket.header.isSplit && !dPacket.packets.empty())
+					{
+						auto &packet = dPacket.packets[0];
 
-							splitPacketBuffer.erase(packet.splitInfo.packetIndex);
+						// handle split packets
+						ReliablePacket completePacket;
 
+						if (reassemblyBuffer.Add(packet, completePacket, GetArrivalTime(pPacket)))
+						{
 							if (completePacket.reliability == PacketReliability::RELIABLE_ORDERED)
 							{
 								completePacket.sequenceNumber = dPacket.header.sequenceNumber;
 								completePacket.socketAddress = pPacket->remoteAddress;
 
-								orderedPacketBuffer[packet.orderedInfo.channel].push_back(std::move(completePacket));
+								BufferOrderedPacket(std::move(completePacket));
 							}
-							else if (packet.reliability == PacketReliability::RELIABLE_SEQUENCED || packet.reliability == PacketReliability::UNRELIABLE_SEQUENCED)
+							else if (completePacket.reliability == PacketReliability::RELIABLE_SEQUENCED || completePacket.reliability == PacketReliability::UNRELIABLE_SEQUENCED)
 							{
-								if (!IsOlderOrderedPacket(packet.sequenceInfo.index, highestSequencedReadIndex[packet.orderedInfo.channel]))
+								// The fragment which completed the message may be any of them, the first one carried the sequencing
+								if (!IsOlderOrderedPacket(completePacket.sequenceInfo.index, highestSequencedReadIndex[completePacket.sequenceInfo.channel]))
 								{
-									highestSequencedReadIndex[packet.orderedInfo.channel] = packet.sequenceInfo.index + (SequenceIndexType) 1;
+									highestSequencedReadIndex[completePacket.sequenceInfo.channel] = completePacket.sequenceInfo.index + (SequenceIndexType) 1;
 									eventHandler.Call<ReliablePacket &, SocketAddress&>(ReliabilityEvents::HANDLE_PACKET, completePacket, pPacket->remoteAddress);
 								}
 							}
@@ -757,25 +1125,18 @@ namespace knet
 						// Handle not split packet
 						for (auto &packet : dPacket.packets)
 						{
-							//
-							if (packet.reliability >= PacketReliability::RELIABLE)
-							{
-								if (firstUnsentAck == firstUnsentAck.min())
-									firstUnsentAck = std::chrono::time_point_cast<std::chrono::milliseconds>(std::chrono::system_clock::now());
-							}
-
 							if (packet.reliability == PacketReliability::RELIABLE_ORDERED)
 							{
 								packet.sequenceNumber = dPacket.header.sequenceNumber;
 								packet.socketAddress = pPacket->remoteAddress;
 
-								orderedPacketBuffer[packet.orderedInfo.channel].push_back(std::move(packet));
+								BufferOrderedPacket(std::move(packet));
 							}
 							else if (packet.reliability == PacketReliability::RELIABLE_SEQUENCED || packet.reliability == PacketReliability::UNRELIABLE_SEQUENCED)
 							{
-								if (!IsOlderOrderedPacket(packet.sequenceInfo.index, highestSequencedReadIndex[packet.orderedInfo.channel]))
+								if (!IsOlderOrderedPacket(packet.sequenceInfo.index, highestSequencedReadIndex[packet.sequenceInfo.channel]))
 								{
-									highestSequencedReadIndex[packet.orderedInfo.channel] = packet.sequenceInfo.index + (SequenceIndexType) 1;
+									highestSequencedReadIndex[packet.sequenceInfo.channel] = packet.sequenceInfo.index + (SequenceIndexType) 1;
 									eventHandler.Call<ReliablePacket &, SocketAddress&>(ReliabilityEvents::HANDLE_PACKET, packet, pPacket->remoteAddress);
 								}
 							}
@@ -791,6 +1152,9 @@ namespace knet
 			}
 		}
 
+		// Our id from an unknown address which did not move the connection, a replayed or late datagram
+		if (CarriesLocalConnectionId(pPacket))
+			return false;
 
 		// New connection
 		// Handle new connection event
@@ -807,7 +1171,7 @@ namespace knet
 
 		system._socket = pPacket->_socket;
 		system.address = pPacket->remoteAddress;
-		remoteList.push_back(std::move(system));
+		remoteSystems[pPacket->remoteAddress] = system;
 
 		// Now handle the packet
 
@@ -836,155 +1200,333 @@ namespace knet
 		m_RemoteSocketAddress = socketAddress;
 	}
 
-	void ReliabilityLayer::SendACKs()
+	void ReliabilityLayer::SetLocalConnectionId(uint32_t connectionId)
 	{
-		if (acknowledgements.size() == 0)
-			return;
+		localConnectionId = connectionId;
+	}
 
-		bool rerun = false;
+	void ReliabilityLayer::SetRemoteConnectionId(uint32_t connectionId)
+	{
+		remoteConnectionId = connectionId;
+	}
 
-		// This seems to cause a bug sometimes
-		// But only a this position, we do it below and everything works fine
-		// I still do not know why
-		// I have tested this on Windows with Visual Studio 2013 Visual C++ Compiler Nov 2013 (CTP) and there it seems to work fine,
-		// so it seems only broken on Linux/GCC
-		//acknowledgements.shrink_to_fit();
+	uint32_t ReliabilityLayer::GetRemoteConnectionId() const
+	{
+		return remoteConnectionId;
+	}
 
-#if 0
-		bool bnil = false;
-		for(auto i : acknowledgements)
-		{
-			if(i == 0)
-			{
-				bnil = true;
-				DEBUG_LOG("on {%p} contains 0", this);
-			}
-		}
-#endif
+	void ReliabilityLayer::StampConnectionId(DatagramHeader &header) const
+	{
+		header.hasConnectionId = remoteConnectionId != 0;
+		header.connectionId = remoteConnectionId;
+	}
+
+	bool ReliabilityLayer::CarriesLocalConnectionId(InternalRecvPacket *pPacket) const
+	{
+		uint32_t connectionId = 0;
+
+		return localConnectionId != 0 && DatagramHeader::PeekConnectionId(pPacket->buffer, pPacket->bytesRead, connectionId) && connectionId == localConnectionId;
+	}
+
+	bool ReliabilityLayer::MigrateRemote(InternalRecvPacket *pPacket)
+	{
+		// Connection ids are not authenticated, whoever knows one can move the connection
+		if (!CarriesLocalConnectionId(pPacket))
+			return false;
+
+		// A datagram replayed or delayed from an earlier path must not take the connection back there
+		SequenceNumberType sequenceNumber = 0;
+
+		if (!DatagramHeader::PeekSequenceNumber(pPacket->buffer, pPacket->bytesRead, sequenceNumber) || !receivedWindow.IsNewer(sequenceNumber))
+			return false;
+
+		SocketAddress oldAddress = m_RemoteSocketAddress;
+		auto remote = remoteSystems.find(oldAddress);
+
+		if (remote == remoteSystems.end())
+			return false;
+
+		RemoteSystem system = remote->second;
+		remoteSystems.erase(remote);
+
+		system.address = pPacket->remoteAddress;
+		remoteSystems[pPacket->remoteAddress] = system;
 
-		// Sort the unsorted vector so we can write the ranges
-		std::sort(acknowledgements.begin(), acknowledgements.end());
+		m_RemoteSocketAddress = pPacket->remoteAddress;
 
-#if 0
-		if(acknowledgements[0] == 1)
-			DEBUG_LOG("0 1 on {%p}", this);
+		eventHandler.Call(ReliabilityEvents::ADDRESS_CHANGED, oldAddress, m_RemoteSocketAddress);
+
+		return true;
+	}
+
+	std::chrono::nanoseconds ReliabilityLayer::SampleRtt(SequenceNumberType sequenceNumber, std::chrono::steady_clock::time_point ackTime)
+	{
+		auto resendPacket = resendBuffer.Find(sequenceNumber);
+
+		if (!resendPacket || resendPacket->transmissions != 1 || resendPacket->queued)
+			return std::chrono::nanoseconds::zero();
+
+		auto sample = std::max<std::chrono::nanoseconds>(ackTime - resendPacket->sendTime, std::chrono::nanoseconds(1));
+		AddRttSample(sample);
+
+		return sample;
+	}
+
+	std::chrono::steady_clock::time_point ReliabilityLayer::GetArrivalTime(const InternalRecvPacket *pPacket)
+	{
+		if (pPacket->kernelTimeStamp.time_since_epoch().count() == 0)
+			return std::chrono::steady_clock::now();
+
+		return pPacket->kernelTimeStamp;
+	}
+
+	void ReliabilityLayer::AddRttSample(std::chrono::nanoseconds sample)
+	{
+		rttEstimator.AddSample(sample);
+
+		smoothedRtt.store(rttEstimator.GetSmoothedRtt().count(), std::memory_order_relaxed);
+		rttVariance.store(rttEstimator.GetRttVariance().count(), std::memory_order_relaxed);
+	}
+
+	std::chrono::nanoseconds ReliabilityLayer::GetRoundTripTime() const
+	{
+		return std::chrono::nanoseconds(smoothedRtt.load(std::memory_order_relaxed));
+	}
+
+	std::chrono::nanoseconds ReliabilityLayer::GetRoundTripTimeVariance() const
+	{
+		return std::chrono::nanoseconds(rttVariance.load(std::memory_order_relaxed));
+	}
 
-		for(auto i : acknowledgements)
+	void ReliabilityLayer::SetCongestionControl(CongestionControlType type)
+	{
+		switch (type)
 		{
-			if(i == 0)
-			{
-				bnil = true;
-				DEBUG_LOG("double check on {%p} contains 0", this);
-			}
+		case CongestionControlType::NewReno:
+			congestionController.reset(new NewRenoController(MAX_MTU_SIZE));
+			break;
+		case CongestionControlType::Bbr:
+			congestionController.reset(new BbrController(MAX_MTU_SIZE));
+			break;
+		default:
+			congestionController.reset();
+			break;
 		}
-#endif
+	}
 
-		BitStream bitStream{MAX_MTU_SIZE};
+	CongestionControlType ReliabilityLayer::GetCongestionControl() const
+	{
+		return congestionController ? congestionController->GetType() : CongestionControlType::None;
+	}
 
-		int32_t min = -1;
-		int32_t max = 0;
-		size_t writtenTo = 0;
-		size_t writeCount = 0;
+	const ICongestionController * ReliabilityLayer::GetCongestionController() const
+	{
+		return congestionController.get();
+	}
 
-		// Now write the range stuff to the bitstream
-		for (size_t i = 0; i < acknowledgements.size(); ++i)
-		{
-			if ((i+1 < acknowledgements.size()) && acknowledgements[i] == (acknowledgements[i + 1] - 1))
-			{ /* (Next-1) equals current, so its a range */
+	size_t ReliabilityLayer::GetBytesInFlight() const
+	{
+		return bytesInFlight;
+	}
 
-				if (min == -1)
-					min = acknowledgements[i];
+	void ReliabilityLayer::SetPacingRate(double bytesPerSecond)
+	{
+		pacingRate = std::max(bytesPerSecond, 0.0);
+	}
 
-				max = acknowledgements[i];
-			}
-			else if (min == -1)
-			{ /* Not a range just a single value,
-			  because previous was not in row */
+	double ReliabilityLayer::GetPacingRate() const
+	{
+		return pacer.GetRate();
+	}
+
+	void ReliabilityLayer::SetPacingBurst(size_t bytes)
+	{
+		pacer.SetBurst(bytes);
+	}
+
+	size_t ReliabilityLayer::GetPacedQueueSize() const
+	{
+		return pacedQueue.size();
+	}
+
+	void ReliabilityLayer::SetReorderThreshold(uint32_t threshold)
+	{
+		gapTracker.SetReorderThreshold(threshold);
+	}
+
+	uint32_t ReliabilityLayer::GetReorderThreshold() const
+	{
+		return gapTracker.GetReorderThreshold();
+	}
+
+	void ReliabilityLayer::SetReassemblyLimits(size_t maxBytes, std::chrono::milliseconds timeout)
+	{
+		reassemblyBuffer.SetMemoryLimit(maxBytes);
+		reassemblyBuffer.SetTimeout(timeout);
+	}
+
+	void ReliabilityLayer::SetSplitWindow(size_t bytes)
+	{
+		splitWindow = bytes;
+	}
+
+	size_t ReliabilityLayer::GetSplitWindow() const
+	{
+		return splitWindow;
+	}
+
+	size_t ReliabilityLayer::GetPendingSplitBytes() const
+	{
+		return splitBytesPending;
+	}
+
+	size_t ReliabilityLayer::GetDroppedSplitMessages() const
+	{
+		return reassemblyBuffer.GetDropped();
+	}
+
+	size_t ReliabilityLayer::GetDuplicateDatagrams() const
+	{
+		return duplicateDatagrams;
+	}
+
+	std::chrono::nanoseconds ReliabilityLayer::GetRetransmissionTimeout() const
+	{
+		return rttEstimator.GetTimeout(maxAckDelay);
+	}
+
+	void ReliabilityLayer::SendNACKs()
+	{
+		if (gapTracker.TakeLost(nackRanges) == 0)
+			return;
+
+		DatagramHeader dh;
+		dh.isACK = false;
+		dh.isNACK = true;
+		StampConnectionId(dh);
+
+		// As many ranges as fit into one datagram, the rest goes into the next
+		const size_t rangeSize = 2 * sizeof(SequenceNumberType);
+		const size_t maxRanges = (MAX_MTU_SIZE - dh.GetSizeToSend() - sizeof(uint32_t)) / rangeSize;
+
+		for (size_t offset = 0; offset < nackRanges.size(); offset += maxRanges)
+		{
+			const size_t count = std::min(maxRanges, nackRanges.size() - offset);
 
-				min = acknowledgements[i];
-				max = acknowledgements[i];
+			BitStream bitStream{dh.GetSizeToSend() + sizeof(uint32_t) + count * rangeSize};
 
+			dh.Serialize(bitStream);
+			bitStream.Write(static_cast<uint32_t>(count));
+
+			for (size_t i = offset; i < offset + count; ++i)
+			{
 #if DEBUG_ACKS
-				DEBUG_LOG("Send acks for %d %d", min, max);
+				DEBUG_LOG("Send NACK for %d %d", nackRanges[i].first, nackRanges[i].second);
 #endif
 
-				bitStream.Write<SequenceNumberType>(min);
-				bitStream.Write<SequenceNumberType>(max);
+				bitStream.Write<SequenceNumberType>(nackRanges[i].first);
+				bitStream.Write<SequenceNumberType>(nackRanges[i].second);
+			}
 
-				// Track the index we have written to
-				writtenTo = i;
-				writeCount++;
+			if (m_pSocket.lock())
+				m_pSocket.lock()->Send(m_RemoteSocketAddress, bitStream.Data(), bitStream.Size());
+		}
 
-				min = -1;
-			}
-			else
-			{
-				// First diff at next so write max to current and write info to bitStream
-				max = acknowledgements[i];
+		nackRanges.clear();
+	}
+
+	bool ReliabilityLayer::WriteAcks(BitStream &bitStream, size_t maxBytes)
+	{
+		if (maxBytes <= sizeof(uint32_t))
+			return false;
+
+		SequenceNumberType newest = 0;
+
+		if (acknowledgements.Write(bitStream, maxBytes - sizeof(uint32_t), newest) == 0)
+			return false;
 
 #if DEBUG_ACKS
-				DEBUG_LOG("Send acks for %d %d", min, max);
+		DEBUG_LOG("Send acks up to %d", newest);
 #endif
 
-				bitStream.Write<SequenceNumberType>(min);
-				bitStream.Write<SequenceNumberType>(max);
+		// Only the ack with the largest sequence number carries the delay, the others give no sample
+		uint32_t ackDelay = noAckDelay;
+
+		if (newest == largestAcknowledgement)
+		{
+			auto delay = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - largestAcknowledgementTime);
+			ackDelay = static_cast<uint32_t>(std::min<int64_t>(std::max<int64_t>(delay.count(), 0), noAckDelay - 1));
+		}
 
-				// Track the index we have written to, so we can remove the sent acks from the acknowledegements list
-				writtenTo = i;
-				writeCount++;
+		// write how long the newest acknowledged datagram waited for this ack
+		bitStream.Write(ackDelay);
 
-				min = -1;
-			}
+		// Everything went out, the standalone ack timer starts again with the next datagram
+		if (acknowledgements.Empty())
+			firstUnsentAck = firstUnsentAck.min();
 
-			// If we have exceeded max packet size mark rerun to true,
-			// So we will send all acks
-			// Is this a good idea or should we mark it to rerun on next process?!
-			if (bitStream.Size() >= 1300)
-			{
-				rerun = true;
-				break;
-			}
+		return true;
+	}
+
+	void ReliabilityLayer::SerializeDatagram(DatagramPacket *pDatagramPacket, BitStream &bitStream)
+	{
+		auto &header = pDatagramPacket->header;
+		const size_t size = pDatagramPacket->GetSizeToSend();
+
+		// Datagrams held back by the pacer would carry a stale ack delay
+		if (acknowledgements.Empty() || header.isACK || header.isNACK || size + minPiggybackSize > MAX_MTU_SIZE || !CanSendPaced())
+		{
+			header.hasAck = false;
+			pDatagramPacket->Serialize(bitStream);
+			return;
 		}
 
-		// Remove all acknowledgements we have written from the vector
-		acknowledgements.erase(acknowledgements.begin(), acknowledgements.begin() + writtenTo+1);
+		header.hasAck = true;
+		header.Serialize(bitStream);
+
+		WriteAcks(bitStream, MAX_MTU_SIZE - size);
+
+		for (auto &packet : pDatagramPacket->packets)
+			packet.Serialize(bitStream);
+
+		// A resend must not repeat acks which went out already
+		header.hasAck = false;
+	}
 
+	void ReliabilityLayer::SendACKs()
+	{
 		// Setup the datagram header for the ack packet
 		DatagramHeader dh;
 		dh.isACK = true;
 		dh.isNACK = false;
+		StampConnectionId(dh);
 
-		BitStream ackBS{bitStream.Size() + dh.GetSizeToSend()};
-
-		// Serialize the datagram header
-		dh.Serialize(ackBS);
-
-		// write the count of ack ranges which have been written
-		ackBS.Write(writeCount);
+		// One block per datagram, a window which does not fit goes out in several
+		while (!acknowledgements.Empty())
+		{
+			BitStream ackBS{MAX_MTU_SIZE};
 
-		// Write the bitstream with the ack ranges to the bitstream we have to send
-		ackBS.Write(bitStream.Data(), bitStream.Size());
+			// Serialize the datagram header
+			dh.Serialize(ackBS);
 
-		//
-		if (m_pSocket.lock())
-			m_pSocket.lock()->Send(m_RemoteSocketAddress, ackBS.Data(), ackBS.Size());
+			if (!WriteAcks(ackBS, MAX_MTU_SIZE - dh.GetSizeToSend()))
+				break;
 
-		// Check if we have to rerun the SendACKs if we exceeded the max size we can sent in one packet
-		if (rerun)
-		{
-			// we dont reset the firstUnsent ack here so it will immediatly rerun on the next process
-			SendACKs();
+			if (m_pSocket.lock())
+				m_pSocket.lock()->Send(m_RemoteSocketAddress, ackBS.Data(), ackBS.Size());
 		}
-		else /* Now shrink the vector so it will not take much memory */
-		{
 
-			// Reset the firstUnsentAck to 0
-			firstUnsentAck = firstUnsentAck.min();
+		firstUnsentAck = firstUnsentAck.min();
+	}
 
-			// Only shrink when its really big
-			if(acknowledgements.capacity() > 65535)
-				acknowledgements.shrink_to_fit();
-		}
+	void ReliabilityLayer::SetAckDelay(std::chrono::milliseconds delay)
+	{
+		maxAckDelay = delay;
+	}
+
+	std::chrono::milliseconds ReliabilityLayer::GetAckDelay() const
+	{
+		return maxAckDelay;
 	}
 
 	void ReliabilityLayer::SetOrderingChannel(OrderedChannelType ucChannel)
@@ -997,167 +1539,474 @@ namespace knet
 		return orderingChannel;
 	}
 
-	bool ReliabilityLayer::SplitPacket(ReliablePacket &packet, DatagramPacket ** ppDatagramPacket)
+	void ReliabilityLayer::SplitPacket(ReliablePacket &packet)
+	{
+		// The remote's connection id may only be known once the fragments leave
+		DatagramHeader header;
+		header.isACK = false;
+		header.isNACK = false;
+		header.isReliable = true;
+		header.isSplit = true;
+		header.hasConnectionId = true;
+
+		// Room for the data of a fragment next to the datagram header and the largest message header
+		const size_t messageOverhead = sizeof(PacketReliability) + std::max(sizeof(OrderedInfo), sizeof(SequenceInfo)) + SplitInfo::serializedSize + sizeof(uint16_t);
+
+		// Only the message is copied, its fragments are cut from it as they leave
+		SplitMessage message;
+		message.fragmentSize = static_cast<uint16_t>(MAX_MTU_SIZE - header.GetSizeToSend() - messageOverhead);
+		message.packetIndex = flowControlHelper.GetSplitPacketIndex();
+		message.packet = std::move(packet);
+
+		splitBytesPending += message.packet.Size();
+		splitQueue[message.packet.priority].push_back(std::move(message));
+	}
+
+	bool ReliabilityLayer::CanSendFragment() const
 	{
-		auto curTime = std::chrono::time_point_cast<std::chrono::milliseconds>(std::chrono::system_clock::now());
+		if (fragmentBytesUnacked >= splitWindow)
+			return false;
 
-		// Save the original packet which was given as a param
-		//
-		auto pDatagramPacket = *ppDatagramPacket;
+		if (!congestionController)
+			return true;
 
-		// Split the data in multiple packets
-		std::vector<ReliablePacket> splitPackets;
-		splitPackets.reserve(packet.Size() / (MAX_MTU_SIZE - pDatagramPacket->header.GetSizeToSend() - 20) + 1);
+		// A quarter of the congestion window stays free for the messages which are not split
+		const size_t window = congestionController->GetCongestionWindow();
 
-		size_t dataOffset = static_cast<size_t>((MAX_MTU_SIZE - pDatagramPacket->header.GetSizeToSend() - 20) + 1);
+		return bytesInFlight < window - window / 4;
+	}
 
-		uint16_t splitIndex = 0;
+	void ReliabilityLayer::ProcessSplitSends()
+	{
+		if (splitBytesPending == 0)
+			return;
 
-		uint16_t splitPacketNumber = flowControlHelper.GetSplitPacketIndex();
+		BitStream bitStream{MAX_MTU_SIZE};
 
-		for (size_t chunkSize = (MAX_MTU_SIZE - pDatagramPacket->header.GetSizeToSend() - 20) + 1; dataOffset < packet.Size();)
+		// The most urgent messages first, each message is sent from the front of its queue on
+		for (int prio = PacketPriority::HIGH; prio >= PacketPriority::LOW; --prio)
 		{
+			auto &queue = splitQueue[prio];
 
-			ReliablePacket tmpPacket(packet.Data() + dataOffset - chunkSize, chunkSize);
+			while (!queue.empty())
+			{
+				if (!CanSendFragment() || !CanSendPaced())
+					return;
 
-			// Set up packet
-			// We need index to merge them together on the remote side
-			//
-			// It works similar to the ordered stuff
+				auto &message = queue.front();
+				const size_t size = std::min<size_t>(message.fragmentSize, message.packet.Size() - message.offset);
 
-			tmpPacket.splitInfo.index = splitIndex++;
-			tmpPacket.splitInfo.packetIndex = splitPacketNumber;
-			tmpPacket.isSplit = true;
+				ReliablePacket fragment(message.packet.Data() + message.offset, size);
 
-			if (tmpPacket.splitInfo.index == 0)
-			{
-				tmpPacket.reliability = packet.reliability;
-				tmpPacket.orderedInfo = packet.orderedInfo;
-			}
+				// Every fragment tells the remote the size of the whole message and where it goes
+				fragment.isSplit = true;
+				fragment.splitInfo.messageSize = message.packet.Size();
+				fragment.splitInfo.index = message.nextIndex++;
+				fragment.splitInfo.packetIndex = message.packetIndex;
+				fragment.splitInfo.fragmentSize = message.fragmentSize;
+				fragment.splitInfo.isEnd = message.offset + size == message.packet.Size();
+
+				// In case of Ordered packets only the first packet need the ordered info
+				// This reduces the overhead
+				if (fragment.splitInfo.index == 0)
+				{
+					fragment.reliability = message.packet.reliability;
+					fragment.orderedInfo = message.packet.orderedInfo;
+					fragment.sequenceInfo = message.packet.sequenceInfo;
+				}
+				else
+				{
+					fragment.reliability = PacketReliability::RELIABLE;
+				}
 
-			// In case of Ordered packets only the first packet need the ordered info
-			// This reduces the overhead
+				auto pSplitDatagramPacket = new DatagramPacket();
 
-			if (tmpPacket.splitInfo.index > 0)
-				tmpPacket.reliability = PacketReliability::RELIABLE;
+				pSplitDatagramPacket->header.isACK = false;
+				pSplitDatagramPacket->header.isNACK = false;
+				StampConnectionId(pSplitDatagramPacket->header);
+				pSplitDatagramPacket->header.isReliable = true;
+				pSplitDatagramPacket->header.isSplit = true;
+				pSplitDatagramPacket->header.sequenceNumber = flowControlHelper.GetSequenceNumber();
+				pSplitDatagramPacket->packets.push_back(std::move(fragment));
 
-			splitPackets.push_back(std::move(tmpPacket));
+				bitStream.Reset();
+				SerializeDatagram(pSplitDatagramPacket, bitStream);
 
-			if (packet.Size() - (dataOffset) > (MAX_MTU_SIZE - pDatagramPacket->header.GetSizeToSend() - 20) + 1)
-			{
-				// increase the offset by the size of the next chunk
-				dataOffset += chunkSize;
+				AddToResendBuffer(pSplitDatagramPacket, bitStream.Size(), true);
+				SendDatagram(bitStream, pSplitDatagramPacket);
+
+				message.offset += size;
+				splitBytesPending -= size;
 
-				// and recalculate the chunk size
-				chunkSize = MAX_MTU_SIZE - pDatagramPacket->header.GetSizeToSend() - 20 + 1;
+				if (message.offset == message.packet.Size())
+					queue.pop_front();
 			}
-			else
-			{
-				chunkSize = packet.Size() - dataOffset;
-				dataOffset += chunkSize;
+		}
+	}
 
-				ReliablePacket tmpPacket2(packet.Data() + dataOffset - chunkSize, chunkSize);
+	StreamId ReliabilityLayer::SendStream(uint64_t size, StreamSource source)
+	{
+		if (size == 0 || !source)
+			return 0;
 
-				// Set up packet
-				// We need index to merge them together on the remote side
-				//
-				// It works similar to the ordered stuff
+		// The remote's connection id may only be known once the chunks leave
+		DatagramHeader header;
+		header.isACK = false;
+		header.isNACK = false;
+		header.isReliable = true;
+		header.isStream = true;
+		header.hasConnectionId = true;
 
-				tmpPacket2.isSplit = true;
-				tmpPacket2.splitInfo.index = splitIndex++;
-				tmpPacket2.splitInfo.packetIndex = splitPacketNumber;
+		const size_t messageOverhead = sizeof(PacketReliability) + StreamInfo::serializedSize + sizeof(uint16_t);
 
+		OutgoingStream stream;
+		stream.source = std::move(source);
+		stream.size = size;
+		stream.chunkSize = static_cast<uint16_t>(MAX_MTU_SIZE - header.GetSizeToSend() - messageOverhead);
 
-				// In case of Ordered packets only the first packet need the ordered info
-				// This reduces the overhead
+		const StreamId id = nextStreamId;
 
-				if (tmpPacket2.splitInfo.index > 0)
-					tmpPacket2.reliability = PacketReliability::RELIABLE;
+		if (++nextStreamId == 0)
+			nextStreamId = 1;
 
-				splitPackets.push_back(std::move(tmpPacket2));
-			}
-		}
+		outgoingStreams.emplace(id, std::move(stream));
 
-		if (dataOffset != packet.Size())
-		{
-			ReliablePacket tmpPacket(packet.Data() + dataOffset, packet.Size() - dataOffset);
+		return id;
+	}
 
-			tmpPacket.isSplit = true;
-			tmpPacket.splitInfo.index = splitIndex++;
-			tmpPacket.splitInfo.packetIndex = splitPacketNumber;
+	StreamId ReliabilityLayer::SendFile(const std::string &path)
+	{
+		auto file = std::make_shared<internal::MappedFile>();
 
-			if (tmpPacket.splitInfo.index > 0)
-				tmpPacket.reliability = PacketReliability::RELIABLE;
+		if (!file->Open(path))
+			return 0;
 
-			splitPackets.push_back(std::move(tmpPacket));
-		}
+		uint64_t position = 0;
 
-		splitPackets.back().splitInfo.isEnd = true;
+		// The mapping lives as long as the stream
+		return SendStream(file->Size(), [file, position](char *buffer, size_t maxBytes) mutable {
+			const size_t size = static_cast<size_t>(std::min<uint64_t>(maxBytes, file->Size() - position));
 
-		// Now we have the data split in multiple packets
-		// We can now send the packets
-		// Each packet will get it´s own Datagram Packet
+			memcpy(buffer, file->Data() + position, size);
+			position += size;
 
-		DatagramPacket * pSplitDatagramPacket = nullptr;
+			return size;
+		});
+	}
 
-		// Just in case
-		if (pDatagramPacket->packets.size())
-		{
-			pSplitDatagramPacket = new DatagramPacket();
+	void ReliabilityLayer::SetStreamAcceptor(StreamAcceptor acceptor)
+	{
+		streamAcceptor = std::move(acceptor);
+	}
 
-			pSplitDatagramPacket->header.isACK = false;
-			pSplitDatagramPacket->header.isNACK = false;
-			pSplitDatagramPacket->header.isReliable = true;
-			pSplitDatagramPacket->header.isSplit = true;
-			pSplitDatagramPacket->header.sequenceNumber = flowControlHelper.GetSequenceNumber();
-		}
-		else
-		{
-			// Use the reliable packet data
+	bool ReliabilityLayer::GetSendProgress(StreamId id, StreamProgress &progress) const
+	{
+		auto stream = outgoingStreams.find(id);
+
+		if (stream == outgoingStreams.end())
+			return false;
+
+		progress.size = stream->second.size;
+		progress.transferred = stream->second.offset;
+		progress.acknowledged = stream->second.acknowledged;
 
-			pSplitDatagramPacket = pDatagramPacket;
-			pSplitDatagramPacket->header.isSplit = true;
-			pDatagramPacket = nullptr;
+		return true;
+	}
+
+	bool ReliabilityLayer::GetReceiveProgress(StreamId id, StreamProgress &progress) const
+	{
+		auto stream = incomingStreams.find(id);
+
+		if (stream == incomingStreams.end())
+			return false;
+
+		progress.size = stream->second.size;
+		progress.transferred = stream->second.received;
+		progress.acknowledged = 0;
+
+		return true;
+	}
+
+	bool ReliabilityLayer::HasStreamToSend() const
+	{
+		for (auto &stream : outgoingStreams)
+		{
+			if (stream.second.offset < stream.second.size && !stream.second.paused)
+				return true;
 		}
 
+		return false;
+	}
+
+	void ReliabilityLayer::ProcessStreamSends()
+	{
+		if (outgoingStreams.empty())
+			return;
+
 		BitStream bitStream{MAX_MTU_SIZE};
 
-		// FIXME: return the split packets, we will handle them somewhere else
-		// TODO: dont send them all together
-		for (auto &splitPacket : splitPackets)
+		// The oldest streams first, a paused one lets the next go ahead
+		for (auto &entry : outgoingStreams)
 		{
-			// Add the packet to the datagram packet
-			pSplitDatagramPacket->packets.push_back(std::move(splitPacket));
+			auto &stream = entry.second;
+			stream.paused = false;
 
-			// Now send the packet
+			while (stream.offset < stream.size)
+			{
+				if (!CanSendFragment() || !CanSendPaced())
+					return;
 
-			pSplitDatagramPacket->Serialize(bitStream);
+				const size_t length = static_cast<size_t>(std::min<uint64_t>(stream.chunkSize, stream.size - stream.offset));
 
-			if (m_pSocket.lock())
-				m_pSocket.lock()->Send(m_RemoteSocketAddress, bitStream.Data(), bitStream.Size());
+				if (!stream.chunk)
+				{
+					stream.chunk = std::unique_ptr<char[]>{new char[length]};
+					stream.chunkFill = 0;
+				}
 
-			// Reset the bitstream so we can use it in the next iteration
+				while (stream.chunkFill < length)
+				{
+					const size_t written = stream.source(stream.chunk.get() + stream.chunkFill, length - stream.chunkFill);
 
-			bitStream.Reset();
+					if (written == 0)
+						break;
 
-			// Push the sent packet to the resend buffer
-			resendBuffer.push_back({curTime, std::unique_ptr<DatagramPacket>(pSplitDatagramPacket)});
+					stream.chunkFill += std::min(written, length - stream.chunkFill);
+				}
 
-			// Create a new datagram packet and set all the flags (split)
-			pSplitDatagramPacket = new DatagramPacket();
+				if (stream.chunkFill < length)
+				{
+					stream.paused = true;
+					break;
+				}
+
+				// The filled buffer becomes the message, it is not copied again
+				ReliablePacket chunk{std::move(stream.chunk), length};
+				chunk.reliability = PacketReliability::RELIABLE;
+				chunk.isStream = true;
+				chunk.streamInfo.size = stream.size;
+				chunk.streamInfo.offset = stream.offset;
+				chunk.streamInfo.id = entry.first;
+				chunk.streamInfo.chunkSize = stream.chunkSize;
+
+				auto pStreamDatagramPacket = new DatagramPacket();
+
+				pStreamDatagramPacket->header.isACK = false;
+				pStreamDatagramPacket->header.isNACK = false;
+				StampConnectionId(pStreamDatagramPacket->header);
+				pStreamDatagramPacket->header.isReliable = true;
+				pStreamDatagramPacket->header.isStream = true;
+				pStreamDatagramPacket->header.sequenceNumber = flowControlHelper.GetSequenceNumber();
+				pStreamDatagramPacket->packets.push_back(std::move(chunk));
+
+				bitStream.Reset();
+				SerializeDatagram(pStreamDatagramPacket, bitStream);
 
-			pSplitDatagramPacket->header.isACK = false;
-			pSplitDatagramPacket->header.isNACK = false;
-			pSplitDatagramPacket->header.isReliable = true;
-			pSplitDatagramPacket->header.isSplit = true;
-			pSplitDatagramPacket->header.sequenceNumber = flowControlHelper.GetSequenceNumber();
+				auto &resendEntry = AddToResendBuffer(pStreamDatagramPacket, bitStream.Size(), true);
+				resendEntry.streamId = entry.first;
+				resendEntry.streamBytes = length;
+
+				SendDatagram(bitStream, pStreamDatagramPacket);
+
+				// The time without acks starts with the first chunk in flight
+				if (stream.offset == stream.acknowledged)
+					stream.lastProgress = std::chrono::steady_clock::now();
+
+				stream.offset += length;
+				stream.chunkFill = 0;
+			}
 		}
+	}
+
+	void ReliabilityLayer::OnStreamChunkAcknowledged(StreamId id, size_t bytes)
+	{
+		auto stream = outgoingStreams.find(id);
+
+		if (stream == outgoingStreams.end())
+			return;
+
+		stream->second.acknowledged += bytes;
+		stream->second.lastProgress = std::chrono::steady_clock::now();
+
+		if (stream->second.acknowledged < stream->second.size)
+			return;
 
-		pSplitDatagramPacket->header.isSplit = false;
+		outgoingStreams.erase(stream);
 
-		// Assing the next created datagram packet so the given packet can be used | ah fuck i dont know how to explain this better
-		*ppDatagramPacket = pSplitDatagramPacket;
+		if (eventHandler)
+			eventHandler.Call<StreamId>(ReliabilityEvents::STREAM_SENT, id);
+	}
+
+	bool ReliabilityLayer::AdmitStreamChunk(ReliablePacket &packet, std::chrono::steady_clock::time_point now)
+	{
+		const auto &info = packet.streamInfo;
+
+		if (info.id == 0 || info.size == 0 || info.size > maxStreamSize || info.chunkSize < minStreamChunkSize || info.offset >= info.size || info.offset % info.chunkSize != 0)
+			return false;
+
+		if (packet.Size() != std::min<uint64_t>(info.chunkSize, info.size - info.offset))
+			return false;
+
+		// Resent chunks of a finished stream are acked again and dropped
+		if (std::find(finishedStreams.begin(), finishedStreams.end(), info.id) != finishedStreams.end())
+			return true;
+
+		// Acking the rest of an expired one would make the remote believe it arrived
+		if (std::find(expiredStreams.begin(), expiredStreams.end(), info.id) != expiredStreams.end())
+			return false;
+
+		auto stream = incomingStreams.find(info.id);
+
+		if (stream != incomingStreams.end())
+			return stream->second.size == info.size && stream->second.chunkSize == info.chunkSize;
+
+		if (incomingStreams.size() >= maxIncomingStreams)
+			return false;
+
+		const size_t words = static_cast<size_t>((info.size + info.chunkSize - 1) / info.chunkSize + 63) / 64;
+		const size_t bytes = words * sizeof(uint64_t);
+
+		if (incomingStreamBytes + bytes > reassemblyBuffer.GetMemoryLimit())
+			return false;
+
+		IncomingStream incoming;
+		incoming.size = info.size;
+		incoming.chunkSize = info.chunkSize;
+		incoming.arrived.assign(words, 0);
+		incoming.lastChunk = now;
+
+		if (streamAcceptor)
+			incoming.sink = streamAcceptor(info.id, info.size);
+
+		incomingStreams.emplace(info.id, std::move(incoming));
+		incomingStreamBytes += bytes;
 
 		return true;
-	};
+	}
+
+	void ReliabilityLayer::HandleStreamChunk(ReliablePacket &packet, std::chrono::steady_clock::time_point now)
+	{
+		const auto &info = packet.streamInfo;
+
+		// Only chunks of finished streams got past AdmitStreamChunk without one
+		auto stream = incomingStreams.find(info.id);
+
+		if (stream == incomingStreams.end())
+			return;
+
+		auto &incoming = stream->second;
+		const uint64_t index = info.offset / info.chunkSize;
+		auto &word = incoming.arrived[static_cast<size_t>(index / 64)];
+		const uint64_t bit = uint64_t(1) << (index % 64);
+
+		// Resent chunks which arrived already
+		if (word & bit)
+			return;
+
+		word |= bit;
+		incoming.received += packet.Size();
+		incoming.lastChunk = now;
+
+		if (incoming.sink)
+			incoming.sink->Write(info.offset, packet.Data(), packet.Size());
+		else if (eventHandler)
+			eventHandler.Call<StreamId, uint64_t, const char *, size_t>(ReliabilityEvents::STREAM_CHUNK, info.id, info.offset, packet.Data(), packet.Size());
+
+		if (incoming.received < incoming.size)
+			return;
+
+		const StreamId id = info.id;
+		const uint64_t size = incoming.size;
+
+		if (incoming.sink)
+			incoming.sink->Finish();
+
+		incomingStreamBytes -= incoming.arrived.size() * sizeof(uint64_t);
+		incomingStreams.erase(stream);
+
+		finishedStreams.push_back(id);
+
+		if (finishedStreams.size() > finishedStreamHistory)
+			finishedStreams.pop_front();
+
+		if (eventHandler)
+			eventHandler.Call<StreamId, uint64_t>(ReliabilityEvents::STREAM_RECEIVED, id, size);
+	}
+
+	void ReliabilityLayer::ExpireIncomingStreams(std::chrono::steady_clock::time_point now)
+	{
+		const auto timeout = reassemblyBuffer.GetTimeout();
+
+		for (auto stream = incomingStreams.begin(); stream != incomingStreams.end();)
+		{
+			if (now - stream->second.lastChunk < timeout)
+			{
+				++stream;
+				continue;
+			}
+
+			// The rest of it is refused, its slot is free for new ones
+			const StreamId id = stream->first;
+			const uint64_t size = stream->second.size;
+			auto sink = std::move(stream->second.sink);
+
+			expiredStreams.push_back(id);
+
+			if (expiredStreams.size() > finishedStreamHistory)
+				expiredStreams.pop_front();
+
+			incomingStreamBytes -= stream->second.arrived.size() * sizeof(uint64_t);
+			stream = incomingStreams.erase(stream);
+
+			if (sink)
+				sink->Abort();
+
+			if (eventHandler)
+				eventHandler.Call<StreamId, uint64_t>(ReliabilityEvents::STREAM_ABORTED, id, size);
+		}
+	}
+
+	void ReliabilityLayer::ExpireOutgoingStreams(std::chrono::steady_clock::time_point now)
+	{
+		const auto timeout = reassemblyBuffer.GetTimeout();
+
+		for (auto stream = outgoingStreams.begin(); stream != outgoingStreams.end();)
+		{
+			// Only chunks in flight wait for an ack
+			if (stream->second.acknowledged == stream->second.offset || now - stream->second.lastProgress < timeout)
+			{
+				++stream;
+				continue;
+			}
+
+			const StreamId id = stream->first;
+			stream = outgoingStreams.erase(stream);
+
+			// Its chunks are not sent again, the remote refuses them
+			std::vector<SequenceNumberType> chunks;
+
+			resendBuffer.ForEach([&](SequenceNumberType sequenceNumber, ResendEntry &entry) {
+				if (entry.streamId == id)
+					chunks.push_back(sequenceNumber);
+
+				return true;
+			});
+
+			for (auto sequenceNumber : chunks)
+			{
+				auto entry = resendBuffer.Find(sequenceNumber);
+
+				if (entry->inFlight)
+					bytesInFlight -= entry->bytes;
+
+				if (entry->isFragment)
+					fragmentBytesUnacked -= entry->bytes;
+
+				resendBuffer.Erase(sequenceNumber);
+			}
+
+			if (eventHandler)
+				eventHandler.Call<StreamId>(ReliabilityEvents::STREAM_FAILED, id);
+		}
+	}
 };
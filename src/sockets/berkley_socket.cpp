@@ -4,10 +4,15 @@
 
 #include <sockets/berkley_socket.h>
 
+#include <internal/datagram_header.h>
+
+#include <cerrno>
 #include <thread>
+#include <vector>
 
 #ifndef _WIN32
 #include <fcntl.h>
+#include <sys/uio.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
@@ -16,12 +21,112 @@
 #include <ws2tcpip.h>
 #endif
 
+#ifdef __linux__
+#include <linux/errqueue.h>
+#include <linux/filter.h>
+#include <linux/net_tstamp.h>
+#include <netinet/udp.h>
+#endif
+
 namespace knet
 {
 #ifdef _WIN32
 	WSADATA wsaData;
 #endif
 
+#ifdef __linux__
+	static constexpr size_t receiveBlockSize = 65536; // Largest coalesced burst UDP_GRO hands out
+	static constexpr size_t receiveBlocksPerSlot = 8; // Blocks the pool may grow to per batch slot, bursts are copied beyond that
+	static constexpr size_t transmitTimeSlots = 1024; // Sends awaiting their transmit timestamp, older ones are forgotten
+
+	// Software timestamps are taken from the realtime clock, map them onto the steady clock packets use
+	static std::chrono::steady_clock::time_point ToSteadyTime(const timespec &kernelTime)
+	{
+		auto steadyNow = std::chrono::steady_clock::now();
+		auto systemNow = std::chrono::system_clock::now();
+
+		auto kernelPoint = std::chrono::system_clock::time_point(std::chrono::duration_cast<std::chrono::system_clock::duration>(std::chrono::seconds(kernelTime.tv_sec) + std::chrono::nanoseconds(kernelTime.tv_nsec)));
+		auto age = std::chrono::duration_cast<std::chrono::steady_clock::duration>(systemNow - kernelPoint);
+
+		// The realtime clock may have been stepped, never report a time in the future
+		if (age.count() < 0)
+			age = age.zero();
+
+		return steadyNow - age;
+	}
+
+	// Steers every datagram of a remote to the same socket of a SO_REUSEPORT group
+	// The classic BPF program returns (hash of source address and port) % groupSize, the index of the socket in bind order
+	// IPv6 datagrams are expected without extension headers, others still land on a fixed but arbitrary socket
+	// A datagram with a connection id returns its slot % groupSize instead, so a remote keeps its shard when its address changes
+	static bool AttachReusePortSteering(int socket, size_t groupSize)
+	{
+		sock_filter code[] =
+		{
+			// Datagrams carrying a connection id go to the shard owning its slot, A = slot
+			BPF_STMT(BPF_LD | BPF_B | BPF_ABS, 0),
+			BPF_JUMP(BPF_JMP | BPF_JSET | BPF_K, DatagramHeader::connectionIdFlag, 0, 3),
+			BPF_STMT(BPF_LD | BPF_W | BPF_ABS, 1),
+			BPF_STMT(BPF_ALU | BPF_AND | BPF_K, connectionSlotMask),
+			BPF_JUMP(BPF_JMP | BPF_JA, 26, 0, 0),
+
+			// A = IP version
+			BPF_STMT(BPF_LD | BPF_B | BPF_ABS, static_cast<uint32_t>(SKF_NET_OFF)),
+			BPF_STMT(BPF_ALU | BPF_RSH | BPF_K, 4),
+			BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 6, 5, 0),
+
+			// IPv4, M[0] = source address, X = IP header length, A = UDP source port
+			BPF_STMT(BPF_LD | BPF_W | BPF_ABS, static_cast<uint32_t>(SKF_NET_OFF + 12)),
+			BPF_STMT(BPF_ST, 0),
+			BPF_STMT(BPF_LDX | BPF_B | BPF_MSH, static_cast<uint32_t>(SKF_NET_OFF)),
+			BPF_STMT(BPF_LD | BPF_H | BPF_IND, static_cast<uint32_t>(SKF_NET_OFF)),
+			BPF_JUMP(BPF_JMP | BPF_JA, 12, 0, 0),
+
+			// IPv6, M[0] = xor of the source address words, A = UDP source port
+			BPF_STMT(BPF_LD | BPF_W | BPF_ABS, static_cast<uint32_t>(SKF_NET_OFF + 8)),
+			BPF_STMT(BPF_MISC | BPF_TAX, 0),
+			BPF_STMT(BPF_LD | BPF_W | BPF_ABS, static_cast<uint32_t>(SKF_NET_OFF + 12)),
+			BPF_STMT(BPF_ALU | BPF_XOR | BPF_X, 0),
+			BPF_STMT(BPF_MISC | BPF_TAX, 0),
+			BPF_STMT(BPF_LD | BPF_W | BPF_ABS, static_cast<uint32_t>(SKF_NET_OFF + 16)),
+			BPF_STMT(BPF_ALU | BPF_XOR | BPF_X, 0),
+			BPF_STMT(BPF_MISC | BPF_TAX, 0),
+			BPF_STMT(BPF_LD | BPF_W | BPF_ABS, static_cast<uint32_t>(SKF_NET_OFF + 20)),
+			BPF_STMT(BPF_ALU | BPF_XOR | BPF_X, 0),
+			BPF_STMT(BPF_ST, 0),
+			BPF_STMT(BPF_LD | BPF_H | BPF_ABS, static_cast<uint32_t>(SKF_NET_OFF + 40)),
+
+			// A = (A + M[0]) * golden ratio, A ^= A >> 16
+			BPF_STMT(BPF_LDX | BPF_MEM, 0),
+			BPF_STMT(BPF_ALU | BPF_ADD | BPF_X, 0),
+			BPF_STMT(BPF_ALU | BPF_MUL | BPF_K, 0x9E3779B1),
+			BPF_STMT(BPF_MISC | BPF_TAX, 0),
+			BPF_STMT(BPF_ALU | BPF_RSH | BPF_K, 16),
+			BPF_STMT(BPF_ALU | BPF_XOR | BPF_X, 0),
+			BPF_STMT(BPF_ALU | BPF_MOD | BPF_K, static_cast<uint32_t>(groupSize)),
+			BPF_STMT(BPF_RET | BPF_A, 0),
+		};
+
+		sock_fprog program;
+		program.len = sizeof(code) / sizeof(code[0]);
+		program.filter = code;
+
+		return setsockopt(socket, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &program, sizeof(program)) == 0;
+	}
+#endif
+
+	static void RecordDelay(std::atomic<int64_t> &average, std::atomic<int64_t> &maximum, std::chrono::nanoseconds delay)
+	{
+		// Only one thread records each kind of delay, readers just need a consistent value
+		int64_t value = delay.count() < 0 ? 0 : static_cast<int64_t>(delay.count());
+		int64_t current = average.load(std::memory_order_relaxed);
+
+		average.store(current == 0 ? value : current + (value - current) / 8, std::memory_order_relaxed);
+
+		if (value > maximum.load(std::memory_order_relaxed))
+			maximum.store(value, std::memory_order_relaxed);
+	}
+
 	BerkleySocket::BerkleySocket()
 	{
 // NOTE: this will later be moved so dont care atm
@@ -33,6 +138,10 @@ namespace knet
 	BerkleySocket::~BerkleySocket()
 	{
 		endThread = true;
+
+		for (auto packet : recvPackets)
+			packet->Release();
+
 #ifdef _WIN32
 		WSACleanup();
 #endif
@@ -40,10 +149,191 @@ namespace knet
 
 	bool BerkleySocket::Send(const SocketAddress &remoteSystem, const char* pData, size_t length)
 	{
+		if (sendBatchSize <= 1)
+			return SendTo(remoteSystem, pData, length);
+
+		std::lock_guard<std::mutex> lock{sendMutex};
+
+		// Oversized datagrams do not fit a slot, keep the order and send them directly
+		if (length > MAX_MTU_SIZE)
+		{
+			FlushStaged();
+			return SendTo(remoteSystem, pData, length);
+		}
+
+		if (stagedDatagrams == sendBatchSize)
+			FlushStaged();
+
+#ifdef __linux__
+		sendAddressLengths[stagedDatagrams] = remoteSystem.ToSockAddr(sendAddresses[stagedDatagrams], m_AddressFamily);
+
+		// An IPv6 remote can not be reached from an IPv4 socket
+		if (sendAddressLengths[stagedDatagrams] == 0)
+			return false;
+#endif
+
+		char * pSlot = stagedData.data() + stagedDatagrams * MAX_MTU_SIZE;
+		memcpy(pSlot, pData, length);
+
+#ifdef __linux__
+		sendVectors[stagedDatagrams].iov_base = pSlot;
+		sendVectors[stagedDatagrams].iov_len = length;
+#endif
+
+		++stagedDatagrams;
+
+		return true;
+	}
+
+	void BerkleySocket::Flush()
+	{
+		if (sendBatchSize > 1)
+		{
+			std::lock_guard<std::mutex> lock{sendMutex};
+			FlushStaged();
+		}
+
+		DrainTransmitTimestamps();
+	}
+
+	void BerkleySocket::FlushStaged()
+	{
+#ifdef __linux__
+		size_t sent = 0;
+
+		while (sent < stagedDatagrams)
+		{
+			// Build the messages, with offload a run of datagrams becomes one message the kernel segments
+			size_t messages = 0;
+
+			for (size_t index = sent; index < stagedDatagrams; ++messages)
+			{
+				size_t segments = bSegmentationOffload ? CountSegments(index) : 1;
+
+				msghdr &message = sendHeaders[messages].msg_hdr;
+				message.msg_name = &sendAddresses[index];
+				message.msg_namelen = sendAddressLengths[index];
+				message.msg_iov = &sendVectors[index];
+				message.msg_iovlen = segments;
+				message.msg_control = nullptr;
+				message.msg_controllen = 0;
+
+				if (segments > 1)
+				{
+					message.msg_control = sendControl.data() + messages * CMSG_SPACE(sizeof(uint16_t));
+					message.msg_controllen = CMSG_SPACE(sizeof(uint16_t));
+
+					cmsghdr *pControl = CMSG_FIRSTHDR(&message);
+					pControl->cmsg_level = SOL_UDP;
+					pControl->cmsg_type = UDP_SEGMENT;
+					pControl->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+
+					uint16_t segmentSize = static_cast<uint16_t>(sendVectors[index].iov_len);
+					memcpy(CMSG_DATA(pControl), &segmentSize, sizeof(segmentSize));
+				}
+
+				index += segments;
+			}
+
+			int ret = 0;
+
+			if (bKernelTimestamps)
+			{
+				// The kernel numbers the messages in send order, keep concurrent SendTo calls out
+				std::lock_guard<std::mutex> lock{timestampMutex};
+
+				auto sendTime = std::chrono::steady_clock::now();
+				ret = sendmmsg(m_Socket, sendHeaders.data(), static_cast<unsigned int>(messages), 0);
+
+				if (ret > 0)
+					RecordTransmit(sendTime, static_cast<size_t>(ret));
+			}
+			else
+				ret = sendmmsg(m_Socket, sendHeaders.data(), static_cast<unsigned int>(messages), 0);
+
+			if (ret <= 0)
+			{
+				// No offload support for this route or kernel, send the same datagrams again one by one
+				if (sendHeaders[0].msg_hdr.msg_controllen > 0 && (errno == EIO || errno == EINVAL || errno == ENOPROTOOPT))
+				{
+					bSegmentationOffload = false;
+					continue;
+				}
+
+				// Drop the datagram the kernel refused, the reliability layer resends what matters
+				ret = 1;
+			}
+
+			for (int i = 0; i < ret; ++i)
+				sent += sendHeaders[i].msg_hdr.msg_iovlen;
+		}
+#endif
+
+		stagedDatagrams = 0;
+	}
+
+#ifdef __linux__
+	void BerkleySocket::RecordTransmit(std::chrono::steady_clock::time_point sendTime, size_t messages)
+	{
+		for (size_t i = 0; i < messages; ++i)
+			transmitTimes[transmitCounter++ % transmitTimeSlots] = sendTime;
+	}
+
+	size_t BerkleySocket::CountSegments(size_t first) const
+	{
+		static constexpr size_t maxSegments = 64; // UDP_MAX_SEGMENTS
+		static constexpr size_t maxSegmentedBytes = 65507; // Largest IPv4 UDP payload
+
+		const sockaddr_storage &remote = sendAddresses[first];
+		const socklen_t remoteLength = sendAddressLengths[first];
+		const size_t segmentSize = sendVectors[first].iov_len;
+
+		size_t segments = 1;
+		size_t bytes = segmentSize;
+
+		for (size_t i = first + 1; i < stagedDatagrams && segments < maxSegments; ++i)
+		{
+			const size_t length = sendVectors[i].iov_len;
+
+			// The addresses were written by ToSockAddr with their padding cleared
+			if (sendAddressLengths[i] != remoteLength || memcmp(&sendAddresses[i], &remote, remoteLength) != 0)
+				break;
+
+			if (length > segmentSize || bytes + length > maxSegmentedBytes)
+				break;
+
+			++segments;
+			bytes += length;
+
+			// Only the last segment may be shorter
+			if (length < segmentSize)
+				break;
+		}
+
+		return segments;
+	}
+#endif
+
+	bool BerkleySocket::SendTo(const SocketAddress &remoteSystem, const char* pData, size_t length)
+	{
+		sockaddr_storage remote;
+		socklen_t remoteLength = remoteSystem.ToSockAddr(remote, m_AddressFamily);
+
+		if (remoteLength == 0)
+			return false;
+
+#ifdef __linux__
+		std::unique_lock<std::mutex> timestampLock{timestampMutex, std::defer_lock};
+		auto sendTime = std::chrono::steady_clock::now();
+
+		if (bKernelTimestamps)
+			timestampLock.lock();
+#endif
+
 		int sentLen = 0;
 		do
 		{
-			sentLen = sendto(m_Socket, pData, static_cast<int>(length), 0, (const sockaddr*)&remoteSystem.address.addr4, static_cast<int>(sizeof(remoteSystem.address.addr4)));
+			sentLen = sendto(m_Socket, pData, static_cast<int>(length), 0, (const sockaddr*)&remote, remoteLength);
 			if (sentLen <= -1)
 			{
 #ifdef _WIN32
@@ -59,30 +349,69 @@ namespace knet
 		}
 		while (sentLen == 0);
 
+#ifdef __linux__
+		if (bKernelTimestamps && sentLen > 0)
+			RecordTransmit(sendTime, 1);
+#endif
+
 		return true;
 	}
 
 	bool BerkleySocket::Bind(const SocketBindArguments &bindArgs)
 	{
-		// TODO: add IPv6 support
-
-
-		memset(&m_BoundAddress.address.addr4, 0, sizeof(sockaddr_in));
-		m_BoundAddress.address.addr4.sin_port = htons(bindArgs.usPort);
+		m_BoundAddress = SocketAddress();
+		m_AddressFamily = bindArgs.addressFamily == AF_INET6 ? AF_INET6 : AF_INET;
 
 		if (!bindArgs.szHostAddress.empty())
 		{
-			m_BoundAddress.address.addr4.sin_addr.s_addr = inet_addr(bindArgs.szHostAddress.c_str());
+			if (!m_BoundAddress.SetHost(bindArgs.szHostAddress))
+				return false;
+
+			// IPv6 hosts need an IPv6 socket, IPv4 hosts are bound mapped on one
+			if (!m_BoundAddress.IsIPv4())
+				m_AddressFamily = AF_INET6;
 		}
-		else
+
+		m_BoundAddress.SetPort(bindArgs.usPort);
+
+		receiveBatchSize = std::max<size_t>(bindArgs.receiveBatchSize, 1);
+#ifdef __linux__
+		receiveBatchSize = std::min<size_t>(receiveBatchSize, UIO_MAXIOV);
+#else
+		// No recvmmsg, always receive one datagram per call
+		receiveBatchSize = 1;
+#endif
+
+#ifdef __linux__
+		sendBatchSize = std::min<size_t>(std::max<size_t>(bindArgs.sendBatchSize, 1), UIO_MAXIOV);
+
+		if (sendBatchSize > 1)
 		{
-			m_BoundAddress.address.addr4.sin_addr.s_addr = INADDR_ANY;
-		}
+			stagedData.resize(sendBatchSize * MAX_MTU_SIZE);
+			sendHeaders.resize(sendBatchSize);
+			sendVectors.resize(sendBatchSize);
+			sendAddresses.resize(sendBatchSize);
+			sendAddressLengths.resize(sendBatchSize);
+
+			sendControl.resize(sendBatchSize * CMSG_SPACE(sizeof(uint16_t)));
 
-		m_BoundAddress.address.addr4.sin_family = bindArgs.addressFamily;
+			// The headers are filled in by FlushStaged
+			memset(sendHeaders.data(), 0, sizeof(mmsghdr) * sendBatchSize);
+		}
+#else
+		// No sendmmsg, always send directly
+		sendBatchSize = 1;
+#endif
 
 		// Setup the socket
-		m_Socket = static_cast<int>(socket(bindArgs.addressFamily, bindArgs.socketType, bindArgs.socketProtocol));
+		m_Socket = static_cast<int>(socket(m_AddressFamily, bindArgs.socketType, bindArgs.socketProtocol));
+
+		if (m_AddressFamily == AF_INET6)
+		{
+			// Dual-stack unless asked otherwise, the system default differs between platforms
+			int v6Only = bindArgs.v6Only ? 1 : 0;
+			setsockopt(m_Socket, IPPROTO_IPV6, IPV6_V6ONLY, (const char*)&v6Only, sizeof(v6Only));
+		}
 
 
 		// TODO: set initial socket options
@@ -93,6 +422,48 @@ namespace knet
 		sock_opt = 1024 * 16; // 16 KB
 		setsockopt(m_Socket, SOL_SOCKET, SO_SNDBUF, (const char*)&sock_opt, sizeof(sock_opt));
 
+#ifdef __linux__
+		if (bindArgs.reusePortGroupSize > 1)
+		{
+			sock_opt = 1;
+			setsockopt(m_Socket, SOL_SOCKET, SO_REUSEPORT, (const char*)&sock_opt, sizeof(sock_opt));
+		}
+
+		bReusePort = bindArgs.reusePortGroupSize > 1;
+
+		bReceiveOffload = false;
+
+		if (bindArgs.receiveOffload)
+		{
+			sock_opt = 1;
+			bReceiveOffload = setsockopt(m_Socket, SOL_UDP, UDP_GRO, (const char*)&sock_opt, sizeof(sock_opt)) == 0;
+		}
+
+		bKernelTimestamps = false;
+
+		if (bindArgs.kernelTimestamps)
+		{
+			// Only software timestamps, hardware ones need the device configured through SIOCSHWTSTAMP
+			sock_opt = SOF_TIMESTAMPING_RX_SOFTWARE | SOF_TIMESTAMPING_TX_SOFTWARE | SOF_TIMESTAMPING_SOFTWARE | SOF_TIMESTAMPING_OPT_ID | SOF_TIMESTAMPING_OPT_TSONLY;
+			bKernelTimestamps = setsockopt(m_Socket, SOL_SOCKET, SO_TIMESTAMPING, (const char*)&sock_opt, sizeof(sock_opt)) == 0;
+
+			transmitCounter = 0;
+			transmitTimes.assign(transmitTimeSlots, std::chrono::steady_clock::time_point());
+		}
+
+		// Probe for UDP_SEGMENT, only staged datagrams can be coalesced
+		if (sendBatchSize > 1 && bindArgs.segmentationOffload)
+		{
+			int segmentSize = 0;
+			socklen_t optionLength = sizeof(segmentSize);
+
+			bSegmentationOffload = getsockopt(m_Socket, SOL_UDP, UDP_SEGMENT, &segmentSize, &optionLength) == 0;
+		}
+#endif
+
+		// Every platform receives into these, the offload and timestamp flags above decide their layout
+		PrepareReceiveBuffers();
+
 #if 0 // Actually this makes it slower, because of CPU Bound crap fucking threads are taking to much cpu - I will work on that later
 #ifdef WIN32
 	u_long iMode = 1;
@@ -105,7 +476,10 @@ namespace knet
 #endif
 
 		// Bind the socket to the address in bindArgs
-		int ret = bind(m_Socket, (struct sockaddr *)&m_BoundAddress.address.addr4, sizeof(m_BoundAddress.address.addr4));
+		sockaddr_storage bindAddress;
+		socklen_t bindAddressLength = m_BoundAddress.ToSockAddr(bindAddress, m_AddressFamily);
+
+		int ret = bind(m_Socket, (struct sockaddr *)&bindAddress, bindAddressLength);
 
 		if (ret <= -1)
 		{
@@ -123,17 +497,27 @@ namespace knet
 			return false;
 		}
 
-		sockaddr_in sa;
-		memset(&sa, 0, sizeof(sockaddr_in));
+#ifdef __linux__
+		// The program belongs to the whole group, attaching it before bind would put the socket into a group of its own
+		// If attaching fails the kernel's own hash still keeps a remote on one socket
+		if (bindArgs.reusePortGroupSize > 1)
+			AttachReusePortSteering(m_Socket, bindArgs.reusePortGroupSize);
+#endif
+
+		sockaddr_storage sa;
+		memset(&sa, 0, sizeof(sa));
 		socklen_t len = sizeof(sa);
 
 		getsockname(m_Socket, (sockaddr*)&sa, &len);
-		m_BoundAddress.address.addr4.sin_port = sa.sin_port;
-		m_BoundAddress.address.addr4.sin_addr.s_addr = sa.sin_addr.s_addr;
+		m_BoundAddress.FromSockAddr((sockaddr*)&sa, len);
 
-		if (m_BoundAddress.address.addr4.sin_addr.s_addr == INADDR_ANY)
+		// Bound to every interface, reach ourself through loopback
+		if (m_BoundAddress.IsUnspecified())
 		{
-			m_BoundAddress.address.addr4.sin_addr.s_addr = inet_addr("127.0.0.1");
+			uint16_t port = m_BoundAddress.GetPort();
+
+			m_BoundAddress.SetHost(m_AddressFamily == AF_INET6 ? "::1" : "127.0.0.1");
+			m_BoundAddress.SetPort(port);
 		}
 
 		return true;
@@ -144,67 +528,399 @@ namespace knet
 		return SocketType::Berkley;
 	}
 
-	void BerkleySocket::RecvFromLoop()
+	void BerkleySocket::DispatchReceived(InternalRecvPacket** ppPackets, size_t count)
 	{
-		InternalRecvPacket * packet = new InternalRecvPacket();
+		if (eventHandler(SocketEvents::RECEIVE_BATCH))
+		{
+			eventHandler.Call(SocketEvents::RECEIVE_BATCH, ppPackets, count);
+		}
+		else if (eventHandler(SocketEvents::RECEIVE))
+		{
+			for (size_t i = 0; i < count; ++i)
+				eventHandler.Call(SocketEvents::RECEIVE, ppPackets[i]);
+		}
+		else
+		{
+			for (size_t i = 0; i < count; ++i)
+				ppPackets[i]->Release();
+		}
+	}
 
-		while (endThread == false)
+	void BerkleySocket::PrepareReceiveBuffers()
+	{
+		for (auto packet : recvPackets)
+			packet->Release();
+
+		recvPackets.clear();
+
+#ifdef __linux__
+		// Everything recvmmsg needs is set up once, only the handed out packets are replaced
+		recvHeaders.resize(receiveBatchSize);
+		recvVectors.resize(receiveBatchSize);
+		recvAddresses.resize(receiveBatchSize);
+
+		memset(recvHeaders.data(), 0, sizeof(mmsghdr) * receiveBatchSize);
+
+		recvControlSize = 0;
+
+		if (bReceiveOffload)
+		{
+			// Packets still queued keep the blocks of an earlier pool alive
+			receiveBlocks = std::make_shared<ReceiveBlocks>(receiveBatchSize * receiveBlocksPerSlot);
+			recvBlocks.resize(receiveBatchSize);
+			recvControlSize += CMSG_SPACE(sizeof(int));
+		}
+
+		if (bKernelTimestamps)
+			recvControlSize += CMSG_SPACE(sizeof(scm_timestamping));
+
+		recvControl.resize(receiveBatchSize * recvControlSize);
+
+		// Coalesced bursts are received into blocks, their packets are only taken when they are split
+		if (!bReceiveOffload)
+			recvPackets.resize(receiveBatchSize);
+#else
+		recvPackets.resize(receiveBatchSize);
+#endif
+
+		for (size_t i = 0; i < receiveBatchSize; ++i)
 		{
-			const auto recvFromBlocking = [](int _socket, InternalRecvPacket &packet) -> bool
+#ifdef __linux__
+			if (bReceiveOffload)
 			{
-				sockaddr_in sa;
-				socklen_t sockLen = sizeof(sa);
+				recvVectors[i].iov_base = receiveBlocks->Acquire(recvBlocks[i]);
+				recvVectors[i].iov_len = receiveBlockSize;
+			}
+			else
+			{
+				recvPackets[i] = InternalRecvPacket::Acquire();
+				recvVectors[i].iov_base = recvPackets[i]->data;
+				recvVectors[i].iov_len = sizeof(recvPackets[i]->data);
+			}
 
-				memset(&sa, 0, sizeof(sockaddr_in));
-				const int flag = 0;
+			recvHeaders[i].msg_hdr.msg_name = &recvAddresses[i];
+			recvHeaders[i].msg_hdr.msg_iov = &recvVectors[i];
+			recvHeaders[i].msg_hdr.msg_iovlen = 1;
+#else
+			recvPackets[i] = InternalRecvPacket::Acquire();
+#endif
+		}
+	}
 
-				sa.sin_family = AF_INET;
-				sa.sin_port = 0;
+#ifdef __linux__
+	BerkleySocket::ReceiveBlocks::ReceiveBlocks(size_t maxBlocks) : capacity(maxBlocks)
+	{
+	}
 
-				int recvLen = recvfrom(_socket, packet.data, sizeof(packet.data), flag, (sockaddr*)&sa, (socklen_t*)&sockLen);
+	char * BerkleySocket::ReceiveBlocks::Acquire(uint32_t &block)
+	{
+		std::lock_guard<std::mutex> lock{blockMutex};
 
-				if (recvLen <= 0)
-				{
-#ifdef WIN32
-					int errCode = WSAGetLastError();
+		if (freeBlocks.empty())
+		{
+			// Queued packets hold on to too many blocks already
+			if (blocks.size() >= capacity)
+				return nullptr;
 
-					LPSTR errString = NULL;
+			// All blocks are referenced by queued packets, grow the pool
+			blocks.emplace_back(new char[receiveBlockSize]);
+			references.push_back(0);
 
-					FormatMessageA(FORMAT_MESSAGE_ALLOCATE_BUFFER | FORMAT_MESSAGE_FROM_SYSTEM, 0, errCode, 0, (LPSTR) &errString, 0, 0);
+			block = static_cast<uint32_t>(blocks.size() - 1);
+			return blocks.back().get();
+		}
 
-					LocalFree(errString);
-#endif
-					return false;
-				}
+		block = freeBlocks.back();
+		freeBlocks.pop_back();
 
-				packet.remoteAddress.address.addr4.sin_family = sa.sin_family;
-				packet.remoteAddress.address.addr4.sin_port = sa.sin_port;
-				packet.remoteAddress.address.addr4.sin_addr.s_addr = sa.sin_addr.s_addr;
-				packet.bytesRead = static_cast<size_t>(recvLen);
-				packet.timeStamp = std::chrono::steady_clock::now();
+		return blocks[block].get();
+	}
+
+	void BerkleySocket::ReceiveBlocks::Lend(uint32_t block, uint32_t count)
+	{
+		std::lock_guard<std::mutex> lock{blockMutex};
+		references[block] = count;
+	}
+
+	void BerkleySocket::ReceiveBlocks::ReleaseBuffer(uint32_t bufferId)
+	{
+		std::lock_guard<std::mutex> lock{blockMutex};
+
+		if (bufferId < references.size() && --references[bufferId] == 0)
+			freeBlocks.push_back(bufferId);
+	}
+
+	size_t BerkleySocket::ReceiveSegments(int received)
+	{
+		auto timeStamp = std::chrono::steady_clock::now();
 
-				return true;
-			};
+		recvSegments.clear();
 
+		for (int i = 0; i < received; ++i)
+		{
+			msghdr &message = recvHeaders[i].msg_hdr;
+			size_t length = static_cast<size_t>(recvHeaders[i].msg_len);
+			size_t segmentSize = length;
+			auto kernelTimeStamp = timeStamp;
+
+			// A coalesced burst carries the size of its segments, only the last one may be shorter
+			const bool timestamped = ParseReceiveControl(message, segmentSize, kernelTimeStamp);
+
+			if (length == 0 || segmentSize > MAX_MTU_SIZE)
+				continue;
+
+			const uint32_t block = recvBlocks[i];
+			const size_t segments = (length + segmentSize - 1) / segmentSize;
+
+			char * pBlock = static_cast<char*>(recvVectors[i].iov_base);
 
+			// The block goes to the segments if the slot gets a fresh one, otherwise the segments are copied out
+			uint32_t nextBlock = 0;
+			char * pNextBlock = receiveBlocks->Acquire(nextBlock);
 
-			// TODO: handle return
-			if (recvFromBlocking(m_Socket, *packet))
+			if (pNextBlock)
+				receiveBlocks->Lend(block, static_cast<uint32_t>(segments));
+
+			for (size_t offset = 0; offset < length; offset += segmentSize)
 			{
-				packet->_socket = shared_from_this();
+				auto pPacket = InternalRecvPacket::Acquire();
+
+				pPacket->bytesRead = std::min(segmentSize, length - offset);
 
-				if (eventHandler)
+				if (pNextBlock)
 				{
-					eventHandler.Call(SocketEvents::RECEIVE, packet);
+					pPacket->buffer = pBlock + offset;
+					pPacket->bufferOwner = receiveBlocks;
+					pPacket->bufferId = block;
 				}
 				else
-					delete packet;
+				{
+					memcpy(pPacket->data, pBlock + offset, pPacket->bytesRead);
+				}
+
+				pPacket->remoteAddress.FromSockAddr((sockaddr*)&recvAddresses[i], message.msg_namelen);
+				pPacket->timeStamp = timeStamp;
+				pPacket->kernelTimeStamp = kernelTimeStamp;
+				pPacket->_socket = this;
 
-				packet = new InternalRecvPacket();
+				if (timestamped)
+					RecordReceiveDelay(*pPacket);
+
+				recvSegments.push_back(pPacket);
 			}
-			else
-				std::this_thread::yield();
 
+			if (pNextBlock)
+			{
+				recvBlocks[i] = nextBlock;
+				recvVectors[i].iov_base = pNextBlock;
+			}
+		}
+
+		if (!recvSegments.empty())
+			DispatchReceived(recvSegments.data(), recvSegments.size());
+
+		return recvSegments.size();
+	}
+
+	bool BerkleySocket::ParseReceiveControl(msghdr &message, size_t &segmentSize, std::chrono::steady_clock::time_point &kernelTimeStamp) const
+	{
+		bool timestamped = false;
+
+		for (cmsghdr *pControl = CMSG_FIRSTHDR(&message); pControl; pControl = CMSG_NXTHDR(&message, pControl))
+		{
+			if (pControl->cmsg_level == SOL_UDP && pControl->cmsg_type == UDP_GRO)
+			{
+				int size = 0;
+				memcpy(&size, CMSG_DATA(pControl), sizeof(size));
+
+				if (size > 0)
+					segmentSize = static_cast<size_t>(size);
+			}
+			else if (pControl->cmsg_level == SOL_SOCKET && pControl->cmsg_type == SCM_TIMESTAMPING)
+			{
+				// The software timestamp is the first one, the others are hardware timestamps
+				scm_timestamping timestamps;
+				memcpy(&timestamps, CMSG_DATA(pControl), sizeof(timestamps));
+
+				if (timestamps.ts[0].tv_sec != 0 || timestamps.ts[0].tv_nsec != 0)
+				{
+					kernelTimeStamp = std::min(ToSteadyTime(timestamps.ts[0]), kernelTimeStamp);
+					timestamped = true;
+				}
+			}
+		}
+
+		return timestamped;
+	}
+#endif
+
+	void BerkleySocket::RecordReceiveDelay(InternalRecvPacket &packet)
+	{
+		// A kernel clock slightly ahead of ours still counts, as a delay of zero
+		timestampedReceives.fetch_add(1, std::memory_order_relaxed);
+		RecordDelay(averageReceiveDelay, maxReceiveDelay, packet.timeStamp - packet.kernelTimeStamp);
+	}
+
+	void BerkleySocket::DrainTransmitTimestamps()
+	{
+#ifdef __linux__
+		if (!bKernelTimestamps)
+			return;
+
+		// OPT_TSONLY leaves out the payload, the timestamp and the extended error are all there is
+		char control[CMSG_SPACE(sizeof(scm_timestamping)) + CMSG_SPACE(sizeof(sock_extended_err) + sizeof(sockaddr_in6))];
+
+		for (;;)
+		{
+			msghdr message;
+			memset(&message, 0, sizeof(message));
+			message.msg_control = control;
+			message.msg_controllen = sizeof(control);
+
+			if (recvmsg(m_Socket, &message, MSG_ERRQUEUE | MSG_DONTWAIT) < 0)
+				break;
+
+			timespec kernelTime = {0, 0};
+			sock_extended_err error;
+			bool bHasError = false;
+
+			for (cmsghdr *pControl = CMSG_FIRSTHDR(&message); pControl; pControl = CMSG_NXTHDR(&message, pControl))
+			{
+				if (pControl->cmsg_level == SOL_SOCKET && pControl->cmsg_type == SCM_TIMESTAMPING)
+				{
+					scm_timestamping timestamps;
+					memcpy(&timestamps, CMSG_DATA(pControl), sizeof(timestamps));
+					kernelTime = timestamps.ts[0];
+				}
+				else if ((pControl->cmsg_level == SOL_IP && pControl->cmsg_type == IP_RECVERR) || (pControl->cmsg_level == SOL_IPV6 && pControl->cmsg_type == IPV6_RECVERR))
+				{
+					memcpy(&error, CMSG_DATA(pControl), sizeof(error));
+					bHasError = true;
+				}
+			}
+
+			if (!bHasError || error.ee_origin != SO_EE_ORIGIN_TIMESTAMPING || error.ee_info != SCM_TSTAMP_SND)
+				continue;
+
+			if (kernelTime.tv_sec == 0 && kernelTime.tv_nsec == 0)
+				continue;
+
+			auto transmitTime = ToSteadyTime(kernelTime);
+
+			std::lock_guard<std::mutex> lock{timestampMutex};
+
+			// Too old, its slot was reused already
+			if (transmitCounter - error.ee_data > transmitTimeSlots)
+				continue;
+
+			timestampedSends.fetch_add(1, std::memory_order_relaxed);
+			RecordDelay(averageSendDelay, maxSendDelay, transmitTime - transmitTimes[error.ee_data % transmitTimeSlots]);
+		}
+#endif
+	}
+
+	size_t BerkleySocket::ReceiveBatch(bool bBlocking)
+	{
+#ifdef __linux__
+		const unsigned int batchSize = static_cast<unsigned int>(recvHeaders.size());
+
+		for (unsigned int i = 0; i < batchSize; ++i)
+		{
+			recvHeaders[i].msg_hdr.msg_namelen = sizeof(sockaddr_storage);
+
+			if (recvControlSize > 0)
+			{
+				recvHeaders[i].msg_hdr.msg_control = recvControl.data() + i * recvControlSize;
+				recvHeaders[i].msg_hdr.msg_controllen = recvControlSize;
+			}
+		}
+
+		// Blocking only waits for the first datagram, then takes whatever else is already queued
+		int received = recvmmsg(m_Socket, recvHeaders.data(), batchSize, bBlocking ? MSG_WAITFORONE : MSG_DONTWAIT, nullptr);
+
+		if (received <= 0)
+			return 0;
+
+		if (bReceiveOffload)
+			return ReceiveSegments(received);
+
+		auto timeStamp = std::chrono::steady_clock::now();
+
+		for (int i = 0; i < received; ++i)
+		{
+			auto &packet = *recvPackets[i];
+
+			packet.remoteAddress.FromSockAddr((sockaddr*)&recvAddresses[i], recvHeaders[i].msg_hdr.msg_namelen);
+			packet.bytesRead = static_cast<size_t>(recvHeaders[i].msg_len);
+			packet.timeStamp = timeStamp;
+			packet.kernelTimeStamp = timeStamp;
+			packet._socket = this;
+
+			if (bKernelTimestamps)
+			{
+				size_t segmentSize = packet.bytesRead;
+
+				if (ParseReceiveControl(recvHeaders[i].msg_hdr, segmentSize, packet.kernelTimeStamp))
+					RecordReceiveDelay(packet);
+			}
+		}
+
+		DispatchReceived(recvPackets.data(), static_cast<size_t>(received));
+
+		// The dispatched packets are owned by the handlers now
+		for (int i = 0; i < received; ++i)
+		{
+			recvPackets[i] = InternalRecvPacket::Acquire();
+			recvVectors[i].iov_base = recvPackets[i]->data;
+		}
+
+		return static_cast<size_t>(received);
+#else
+		auto &packet = *recvPackets[0];
+
+		sockaddr_storage sa;
+		socklen_t sockLen = sizeof(sa);
+
+		memset(&sa, 0, sizeof(sa));
+		const int flag = 0;
+
+		int recvLen = recvfrom(m_Socket, packet.data, sizeof(packet.data), flag, (sockaddr*)&sa, (socklen_t*)&sockLen);
+
+		if (recvLen <= 0)
+		{
+#ifdef WIN32
+			int errCode = WSAGetLastError();
+
+			LPSTR errString = NULL;
+
+			FormatMessageA(FORMAT_MESSAGE_ALLOCATE_BUFFER | FORMAT_MESSAGE_FROM_SYSTEM, 0, errCode, 0, (LPSTR) &errString, 0, 0);
+
+			LocalFree(errString);
+#endif
+			return 0;
+		}
+
+		packet.remoteAddress.FromSockAddr((sockaddr*)&sa, sockLen);
+		packet.bytesRead = static_cast<size_t>(recvLen);
+		packet.timeStamp = std::chrono::steady_clock::now();
+		packet.kernelTimeStamp = packet.timeStamp;
+		packet._socket = this;
+
+		DispatchReceived(recvPackets.data(), 1);
+
+		recvPackets[0] = InternalRecvPacket::Acquire();
+
+		return 1;
+#endif
+	}
+
+	void BerkleySocket::RecvFromLoop()
+	{
+		while (endThread == false)
+		{
+			// TODO: handle errors
+			if (ReceiveBatch(true) == 0)
+				std::this_thread::yield();
 		}
 
 		bRecvThreadRunning = false;
@@ -228,20 +944,58 @@ namespace knet
 	{
 		endThread = true;
 
+#ifdef __linux__
+		// A package to ourself may be steered to another socket of the group, shutting down wakes the blocked receive instead
+		if (bReusePort)
+		{
+			shutdown(m_Socket, SHUT_RD);
+
+			while (bWait && bRecvThreadRunning)
+				std::this_thread::sleep_for(std::chrono::milliseconds(1));
+
+			return;
+		}
+#endif
+
 		// Send a package to ourself so the receive loop is processes after endThread was set to true
 		unsigned long zero = 0;
-		Send(m_BoundAddress, (char*)&zero, sizeof(zero));
+		SendTo(m_BoundAddress, (char*)&zero, sizeof(zero));
 
 		if (bWait)
 		{
 			while (bRecvThreadRunning)
 			{
-				Send(m_BoundAddress, (char*)&zero, sizeof(zero));
+				SendTo(m_BoundAddress, (char*)&zero, sizeof(zero));
 				std::this_thread::sleep_for(std::chrono::milliseconds(100));
 			}
 		}
 	}
 
+	bool BerkleySocket::Poll(std::chrono::milliseconds)
+	{
+		// The receive thread does the work
+		return false;
+	}
+
+	void BerkleySocket::ScheduleWakeup(std::chrono::steady_clock::time_point)
+	{
+	}
+
+	SocketStatistics BerkleySocket::GetStatistics() const
+	{
+		SocketStatistics statistics;
+
+		statistics.timestampedReceives = timestampedReceives.load(std::memory_order_relaxed);
+		statistics.averageReceiveDelay = std::chrono::nanoseconds(averageReceiveDelay.load(std::memory_order_relaxed));
+		statistics.maxReceiveDelay = std::chrono::nanoseconds(maxReceiveDelay.load(std::memory_order_relaxed));
+
+		statistics.timestampedSends = timestampedSends.load(std::memory_order_relaxed);
+		statistics.averageSendDelay = std::chrono::nanoseconds(averageSendDelay.load(std::memory_order_relaxed));
+		statistics.maxSendDelay = std::chrono::nanoseconds(maxSendDelay.load(std::memory_order_relaxed));
+
+		return statistics;
+	}
+
 	const SocketAddress& BerkleySocket::GetSocketAddress() const
 	{
 		return m_BoundAddress;
@@ -0,0 +1,197 @@
+// Copyright 2015 the kNet authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include <sockets/epoll_socket.h>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+
+namespace knet
+{
+	EpollSocket::EpollSocket()
+	{
+	}
+
+	EpollSocket::~EpollSocket()
+	{
+		StopReceiving(true);
+		Close();
+	}
+
+	void EpollSocket::Close()
+	{
+		for (auto descriptor : { epollDescriptor, wakeupDescriptor, timerDescriptor })
+		{
+			if (descriptor != -1)
+				close(descriptor);
+		}
+
+		epollDescriptor = -1;
+		wakeupDescriptor = -1;
+		timerDescriptor = -1;
+	}
+
+	bool EpollSocket::Bind(const SocketBindArguments &bindArgs)
+	{
+		if (!BerkleySocket::Bind(bindArgs))
+			return false;
+
+		ownsEventLoop = bindArgs.ownsEventLoop;
+
+		// Readiness tells us when to read, so the socket must never block
+		int flags = fcntl(m_Socket, F_GETFL, 0);
+		fcntl(m_Socket, F_SETFL, flags | O_NONBLOCK);
+
+		Close();
+
+		epollDescriptor = epoll_create1(EPOLL_CLOEXEC);
+		wakeupDescriptor = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+		timerDescriptor = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+
+		if (epollDescriptor == -1 || wakeupDescriptor == -1 || timerDescriptor == -1)
+		{
+			Close();
+			return false;
+		}
+
+		for (auto descriptor : { m_Socket, wakeupDescriptor, timerDescriptor })
+		{
+			epoll_event event;
+			memset(&event, 0, sizeof(event));
+			event.events = EPOLLIN;
+			event.data.fd = descriptor;
+
+			if (epoll_ctl(epollDescriptor, EPOLL_CTL_ADD, descriptor, &event) == -1)
+			{
+				Close();
+				return false;
+			}
+		}
+
+		return true;
+	}
+
+	const SocketType EpollSocket::GetSocketType() const
+	{
+		return SocketType::Epoll;
+	}
+
+	bool EpollSocket::Poll(std::chrono::milliseconds maxWait)
+	{
+		if (epollDescriptor == -1)
+			return false;
+
+		epoll_event events[3];
+
+		int eventCount = epoll_wait(epollDescriptor, events, 3, maxWait.count() < 0 ? -1 : static_cast<int>(maxWait.count()));
+
+		for (int i = 0; i < eventCount; ++i)
+		{
+			if (events[i].data.fd == m_Socket)
+			{
+				// Queued transmit timestamps keep the socket in error state until they are read
+				if (events[i].events & EPOLLERR)
+					DrainTransmitTimestamps();
+
+				// Drain until the kernel queue is empty, level triggered so nothing is lost if we stop early
+				while (endThread == false && ReceiveBatch(false) > 0)
+				{
+				}
+			}
+			else
+			{
+				// Wakeup or timer, both just need to be consumed
+				uint64_t value = 0;
+				if (read(events[i].data.fd, &value, sizeof(value)) != sizeof(value))
+					continue;
+			}
+		}
+
+		return true;
+	}
+
+	void EpollSocket::ScheduleWakeup(std::chrono::steady_clock::time_point wakeupTime)
+	{
+		if (timerDescriptor == -1)
+			return;
+
+		itimerspec timerSpec;
+		memset(&timerSpec, 0, sizeof(timerSpec));
+
+		if (wakeupTime != std::chrono::steady_clock::time_point::max())
+		{
+			// steady_clock is CLOCK_MONOTONIC, so the time point can be used as absolute timer value
+			auto nanoseconds = std::chrono::duration_cast<std::chrono::nanoseconds>(wakeupTime.time_since_epoch()).count();
+
+			// A zero value would disarm the timer, a past one fires immediately
+			if (nanoseconds <= 0)
+				nanoseconds = 1;
+
+			timerSpec.it_value.tv_sec = static_cast<time_t>(nanoseconds / 1000000000);
+			timerSpec.it_value.tv_nsec = static_cast<long>(nanoseconds % 1000000000);
+		}
+
+		timerfd_settime(timerDescriptor, TFD_TIMER_ABSTIME, &timerSpec, nullptr);
+	}
+
+	void EpollSocket::Wakeup()
+	{
+		if (wakeupDescriptor == -1)
+			return;
+
+		uint64_t value = 1;
+		if (write(wakeupDescriptor, &value, sizeof(value)) != sizeof(value))
+			return;
+	}
+
+	int EpollSocket::GetEventDescriptor() const
+	{
+		return epollDescriptor;
+	}
+
+	void EpollSocket::EventLoop()
+	{
+		while (endThread == false)
+		{
+			Poll(std::chrono::milliseconds(-1));
+		}
+
+		bRecvThreadRunning = false;
+	}
+
+	void EpollSocket::StartReceiving()
+	{
+		if (bRecvThreadRunning)
+			return;
+
+		endThread = false;
+
+		// The caller runs the loop through Poll
+		if (!ownsEventLoop)
+			return;
+
+		bRecvThreadRunning = true;
+
+		receiveThread = std::thread(&EpollSocket::EventLoop, this);
+	}
+
+	void EpollSocket::StopReceiving(bool bWait)
+	{
+		endThread = true;
+
+		// No need to send a datagram to ourself, the eventfd interrupts epoll_wait
+		Wakeup();
+
+		if (receiveThread.joinable())
+		{
+			if (bWait)
+				receiveThread.join();
+			else
+				receiveThread.detach();
+		}
+	}
+};
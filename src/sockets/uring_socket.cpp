@@ -0,0 +1,663 @@
+// Copyright 2015 the kNet authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include <sockets/uring_socket.h>
+
+#include <cerrno>
+
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+
+namespace knet
+{
+	static constexpr unsigned int ringSize = 256;
+	static constexpr uint32_t receiveBufferCount = 1024; // Power of two, required by the buffer ring
+	static constexpr size_t receiveBufferSize = 2048; // recvmsg header, address and one datagram
+	static constexpr uint16_t receiveBufferGroup = 0;
+
+	static_assert(sizeof(io_uring_recvmsg_out) + sizeof(sockaddr_in6) + MAX_MTU_SIZE <= receiveBufferSize, "receive buffers are too small");
+
+	// The upper bits of the user data tell the completions apart, the lower ones carry the send slot
+	enum class Completion : uint64_t
+	{
+		Receive = 1,
+		Wakeup,
+		Timer,
+		Send,
+	};
+
+	static inline uint64_t MakeUserData(Completion completion, uint32_t index = 0)
+	{
+		return (static_cast<uint64_t>(completion) << 32) | index;
+	}
+
+	UringSocket::UringSocket()
+	{
+		memset(&receiveMessage, 0, sizeof(receiveMessage));
+	}
+
+	UringSocket::~UringSocket()
+	{
+		StopReceiving(true);
+		Close();
+	}
+
+	bool UringSocket::Bind(const SocketBindArguments &bindArgs)
+	{
+		// Coalesced bursts would not fit the provided buffers, the multishot receive reserves no room for timestamps
+		SocketBindArguments berkleyArgs = bindArgs;
+		berkleyArgs.receiveOffload = false;
+		berkleyArgs.kernelTimestamps = false;
+
+		if (!BerkleySocket::Bind(berkleyArgs))
+			return false;
+
+		ownsEventLoop = bindArgs.ownsEventLoop;
+
+		Close();
+
+		uringActive = SetupRing();
+
+		// Keep working as a plain BerkleySocket
+		if (!uringActive)
+			Close();
+
+		return true;
+	}
+
+	bool UringSocket::SetupRing()
+	{
+		io_uring_params params;
+		memset(&params, 0, sizeof(params));
+
+		ringDescriptor = static_cast<int>(syscall(__NR_io_uring_setup, ringSize, &params));
+
+		if (ringDescriptor < 0)
+		{
+			ringDescriptor = -1;
+			return false;
+		}
+
+		ringEntries = params.sq_entries;
+
+		submitRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+		completeRingSize = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+
+		if (params.features & IORING_FEAT_SINGLE_MMAP)
+			submitRingSize = completeRingSize = std::max(submitRingSize, completeRingSize);
+
+		pSubmitRing = mmap(nullptr, submitRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringDescriptor, IORING_OFF_SQ_RING);
+
+		if (pSubmitRing == MAP_FAILED)
+		{
+			pSubmitRing = nullptr;
+			return false;
+		}
+
+		if (params.features & IORING_FEAT_SINGLE_MMAP)
+		{
+			pCompleteRing = pSubmitRing;
+		}
+		else
+		{
+			pCompleteRing = mmap(nullptr, completeRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringDescriptor, IORING_OFF_CQ_RING);
+
+			if (pCompleteRing == MAP_FAILED)
+			{
+				pCompleteRing = nullptr;
+				return false;
+			}
+		}
+
+		submitEntriesSize = params.sq_entries * sizeof(io_uring_sqe);
+		pSubmitEntries = static_cast<io_uring_sqe*>(mmap(nullptr, submitEntriesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringDescriptor, IORING_OFF_SQES));
+
+		if (pSubmitEntries == MAP_FAILED)
+		{
+			pSubmitEntries = nullptr;
+			return false;
+		}
+
+		auto pSubmit = static_cast<char*>(pSubmitRing);
+		pSubmitHead = reinterpret_cast<unsigned int*>(pSubmit + params.sq_off.head);
+		pSubmitTail = reinterpret_cast<unsigned int*>(pSubmit + params.sq_off.tail);
+		pSubmitMask = reinterpret_cast<unsigned int*>(pSubmit + params.sq_off.ring_mask);
+		pSubmitArray = reinterpret_cast<unsigned int*>(pSubmit + params.sq_off.array);
+
+		auto pComplete = static_cast<char*>(pCompleteRing);
+		pCompleteHead = reinterpret_cast<unsigned int*>(pComplete + params.cq_off.head);
+		pCompleteTail = reinterpret_cast<unsigned int*>(pComplete + params.cq_off.tail);
+		pCompleteMask = reinterpret_cast<unsigned int*>(pComplete + params.cq_off.ring_mask);
+		pCompleteEntries = reinterpret_cast<io_uring_cqe*>(pComplete + params.cq_off.cqes);
+
+		receiveBuffers = std::make_shared<ReceiveBuffers>(this);
+
+		// The buffer ring has to be page aligned, mmap takes care of that
+		receiveBuffers->bufferRingSize = receiveBufferCount * sizeof(io_uring_buf);
+		void * pRing = mmap(nullptr, receiveBuffers->bufferRingSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+		if (pRing == MAP_FAILED)
+			return false;
+
+		receiveBuffers->pBufferRing = static_cast<io_uring_buf_ring*>(pRing);
+		memset(receiveBuffers->pBufferRing, 0, receiveBuffers->bufferRingSize);
+
+		receiveBuffers->receiveBuffersSize = receiveBufferCount * receiveBufferSize;
+		void * pBuffers = mmap(nullptr, receiveBuffers->receiveBuffersSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+		if (pBuffers == MAP_FAILED)
+			return false;
+
+		receiveBuffers->pReceiveBuffers = static_cast<char*>(pBuffers);
+
+		io_uring_buf_reg bufferRegistration;
+		memset(&bufferRegistration, 0, sizeof(bufferRegistration));
+		bufferRegistration.ring_addr = reinterpret_cast<uint64_t>(receiveBuffers->pBufferRing);
+		bufferRegistration.ring_entries = receiveBufferCount;
+		bufferRegistration.bgid = receiveBufferGroup;
+
+		// Provided buffer rings need Linux 5.19
+		if (syscall(__NR_io_uring_register, ringDescriptor, IORING_REGISTER_PBUF_RING, &bufferRegistration, 1) < 0)
+			return false;
+
+		{
+			std::lock_guard<std::mutex> lock{receiveBuffers->bufferMutex};
+
+			for (uint32_t i = 0; i < receiveBufferCount; ++i)
+				receiveBuffers->Provide(i);
+		}
+
+		// Multishot recvmsg only uses the name and control lengths of this template
+		receiveMessage.msg_namelen = sizeof(sockaddr_in6);
+		receiveMessage.msg_controllen = 0;
+
+		wakeupDescriptor = eventfd(0, EFD_CLOEXEC);
+		timerDescriptor = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+
+		if (wakeupDescriptor == -1 || timerDescriptor == -1)
+			return false;
+
+		sendSlots.resize(ringEntries);
+		freeSendSlots.clear();
+
+		for (uint32_t i = 0; i < ringEntries; ++i)
+			freeSendSlots.push_back(ringEntries - 1 - i);
+
+		receivedPackets.reserve(receiveBufferCount);
+
+		bReceiveArmed = false;
+		bWakeupArmed = false;
+		bTimerArmed = false;
+
+		return true;
+	}
+
+	void UringSocket::Close()
+	{
+		// Closing the ring cancels everything still in flight
+		if (ringDescriptor != -1)
+			close(ringDescriptor);
+
+		ringDescriptor = -1;
+		uringActive = false;
+
+		if (pSubmitEntries)
+			munmap(pSubmitEntries, submitEntriesSize);
+
+		if (pCompleteRing && pCompleteRing != pSubmitRing)
+			munmap(pCompleteRing, completeRingSize);
+
+		if (pSubmitRing)
+			munmap(pSubmitRing, submitRingSize);
+
+		pSubmitEntries = nullptr;
+		pCompleteRing = nullptr;
+		pSubmitRing = nullptr;
+		pendingSubmissions = 0;
+
+		if (receiveBuffers)
+		{
+			// Packets still holding buffers keep the mappings, the last one to give its buffer back unmaps them
+			std::lock_guard<std::mutex> lock{receiveBuffers->bufferMutex};
+			receiveBuffers->pSocket = nullptr;
+		}
+
+		receiveBuffers.reset();
+
+		for (auto descriptor : { wakeupDescriptor, timerDescriptor })
+		{
+			if (descriptor != -1)
+				close(descriptor);
+		}
+
+		wakeupDescriptor = -1;
+		timerDescriptor = -1;
+	}
+
+	io_uring_sqe * UringSocket::GetSubmitEntry()
+	{
+		unsigned int tail = *pSubmitTail;
+		unsigned int head = __atomic_load_n(pSubmitHead, __ATOMIC_ACQUIRE);
+
+		if (tail - head >= ringEntries)
+			return nullptr;
+
+		unsigned int index = tail & *pSubmitMask;
+
+		io_uring_sqe * pEntry = &pSubmitEntries[index];
+		memset(pEntry, 0, sizeof(io_uring_sqe));
+
+		pSubmitArray[index] = index;
+
+		return pEntry;
+	}
+
+	void UringSocket::CommitSubmitEntry()
+	{
+		__atomic_store_n(pSubmitTail, *pSubmitTail + 1, __ATOMIC_RELEASE);
+		++pendingSubmissions;
+	}
+
+	int UringSocket::Enter(unsigned int minComplete, unsigned int flags, std::chrono::milliseconds maxWait)
+	{
+		unsigned int toSubmit = 0;
+
+		{
+			std::lock_guard<std::mutex> lock{submitMutex};
+			toSubmit = pendingSubmissions;
+			pendingSubmissions = 0;
+		}
+
+		if ((flags & IORING_ENTER_GETEVENTS) && maxWait.count() >= 0)
+		{
+			__kernel_timespec timeout;
+			timeout.tv_sec = maxWait.count() / 1000;
+			timeout.tv_nsec = (maxWait.count() % 1000) * 1000000;
+
+			io_uring_getevents_arg waitArgument;
+			memset(&waitArgument, 0, sizeof(waitArgument));
+			waitArgument.ts = reinterpret_cast<uint64_t>(&timeout);
+
+			return static_cast<int>(syscall(__NR_io_uring_enter, ringDescriptor, toSubmit, minComplete, flags | IORING_ENTER_EXT_ARG, &waitArgument, sizeof(waitArgument)));
+		}
+
+		return static_cast<int>(syscall(__NR_io_uring_enter, ringDescriptor, toSubmit, minComplete, flags, nullptr, 0));
+	}
+
+	UringSocket::ReceiveBuffers::ReceiveBuffers(UringSocket * pOwner) : pSocket(pOwner)
+	{
+	}
+
+	UringSocket::ReceiveBuffers::~ReceiveBuffers()
+	{
+		if (pBufferRing)
+			munmap(pBufferRing, bufferRingSize);
+
+		if (pReceiveBuffers)
+			munmap(pReceiveBuffers, receiveBuffersSize);
+	}
+
+	void UringSocket::ReceiveBuffers::Provide(uint32_t bufferId)
+	{
+		// Only the kernel reads the ring, bufferMutex serializes our side
+		uint16_t tail = pBufferRing->tail;
+
+		// The uapi flexible array member is misplaced when compiled as C++, the ring starts with the first buffer
+		io_uring_buf * pBuffer = reinterpret_cast<io_uring_buf*>(pBufferRing) + (tail & (receiveBufferCount - 1));
+		pBuffer->addr = reinterpret_cast<uint64_t>(pReceiveBuffers + bufferId * receiveBufferSize);
+		pBuffer->len = static_cast<uint32_t>(receiveBufferSize);
+		pBuffer->bid = static_cast<uint16_t>(bufferId);
+
+		__atomic_store_n(&pBufferRing->tail, static_cast<uint16_t>(tail + 1), __ATOMIC_RELEASE);
+	}
+
+	void UringSocket::ReceiveBuffers::ReleaseBuffer(uint32_t bufferId)
+	{
+		std::lock_guard<std::mutex> lock{bufferMutex};
+
+		// The ring is gone, the buffer just waits to be unmapped
+		if (!pSocket)
+			return;
+
+		Provide(bufferId);
+
+		// The multishot receive stopped because we ran dry, let the loop arm it again
+		// Close clears pSocket under the lock, so the socket is still alive here
+		if (pSocket->bBuffersExhausted.exchange(false))
+			pSocket->Wakeup();
+	}
+
+	void UringSocket::Arm()
+	{
+		std::lock_guard<std::mutex> lock{submitMutex};
+
+		if (!bReceiveArmed && !endThread)
+		{
+			if (auto pEntry = GetSubmitEntry())
+			{
+				pEntry->opcode = IORING_OP_RECVMSG;
+				pEntry->fd = m_Socket;
+				pEntry->addr = reinterpret_cast<uint64_t>(&receiveMessage);
+				pEntry->len = 1;
+				pEntry->flags = IOSQE_BUFFER_SELECT;
+				pEntry->buf_group = receiveBufferGroup;
+				pEntry->ioprio = IORING_RECV_MULTISHOT;
+				pEntry->user_data = MakeUserData(Completion::Receive);
+
+				CommitSubmitEntry();
+				bReceiveArmed = true;
+			}
+		}
+
+		if (!bWakeupArmed)
+		{
+			if (auto pEntry = GetSubmitEntry())
+			{
+				pEntry->opcode = IORING_OP_READ;
+				pEntry->fd = wakeupDescriptor;
+				pEntry->addr = reinterpret_cast<uint64_t>(&wakeupValue);
+				pEntry->len = sizeof(wakeupValue);
+				pEntry->user_data = MakeUserData(Completion::Wakeup);
+
+				CommitSubmitEntry();
+				bWakeupArmed = true;
+			}
+		}
+
+		if (!bTimerArmed)
+		{
+			if (auto pEntry = GetSubmitEntry())
+			{
+				pEntry->opcode = IORING_OP_READ;
+				pEntry->fd = timerDescriptor;
+				pEntry->addr = reinterpret_cast<uint64_t>(&timerValue);
+				pEntry->len = sizeof(timerValue);
+				pEntry->user_data = MakeUserData(Completion::Timer);
+
+				CommitSubmitEntry();
+				bTimerArmed = true;
+			}
+		}
+	}
+
+	void UringSocket::Reap()
+	{
+		unsigned int head = *pCompleteHead;
+		const unsigned int tail = __atomic_load_n(pCompleteTail, __ATOMIC_ACQUIRE);
+
+		if (head == tail)
+			return;
+
+		auto timeStamp = std::chrono::steady_clock::now();
+
+		for (; head != tail; ++head)
+		{
+			const io_uring_cqe &entry = pCompleteEntries[head & *pCompleteMask];
+
+			switch (static_cast<Completion>(entry.user_data >> 32))
+			{
+			case Completion::Receive:
+			{
+				if (!(entry.flags & IORING_CQE_F_MORE))
+				{
+					bReceiveArmed = false;
+
+					if (entry.res == -ENOBUFS)
+						bBuffersExhausted = true;
+				}
+
+				if (entry.res < 0 || !(entry.flags & IORING_CQE_F_BUFFER))
+					break;
+
+				uint32_t bufferId = entry.flags >> IORING_CQE_BUFFER_SHIFT;
+				char * pBuffer = receiveBuffers->pReceiveBuffers + bufferId * receiveBufferSize;
+
+				auto pOut = reinterpret_cast<io_uring_recvmsg_out*>(pBuffer);
+
+				if ((pOut->flags & MSG_TRUNC) || pOut->namelen > sizeof(sockaddr_in6))
+				{
+					std::lock_guard<std::mutex> lock{receiveBuffers->bufferMutex};
+					receiveBuffers->Provide(bufferId);
+					break;
+				}
+
+				auto pAddress = reinterpret_cast<sockaddr*>(pBuffer + sizeof(io_uring_recvmsg_out));
+
+				auto pPacket = InternalRecvPacket::Acquire();
+
+				// Lend the buffer, it comes back through ReleaseBuffer once the packet is released
+				pPacket->buffer = pBuffer + sizeof(io_uring_recvmsg_out) + receiveMessage.msg_namelen + receiveMessage.msg_controllen;
+				pPacket->bufferOwner = receiveBuffers;
+				pPacket->bufferId = bufferId;
+				pPacket->bytesRead = pOut->payloadlen;
+				pPacket->remoteAddress.FromSockAddr(pAddress, pOut->namelen);
+				pPacket->timeStamp = timeStamp;
+				pPacket->kernelTimeStamp = timeStamp;
+				pPacket->_socket = this;
+
+				receivedPackets.push_back(pPacket);
+				break;
+			}
+			case Completion::Wakeup:
+				bWakeupArmed = false;
+				break;
+			case Completion::Timer:
+				bTimerArmed = false;
+				break;
+			case Completion::Send:
+			{
+				std::lock_guard<std::mutex> lock{submitMutex};
+				freeSendSlots.push_back(static_cast<uint32_t>(entry.user_data & 0xFFFFFFFF));
+				break;
+			}
+			default:
+				break;
+			}
+		}
+
+		__atomic_store_n(pCompleteHead, head, __ATOMIC_RELEASE);
+
+		if (!receivedPackets.empty())
+		{
+			DispatchReceived(receivedPackets.data(), receivedPackets.size());
+			receivedPackets.clear();
+		}
+	}
+
+	bool UringSocket::Send(const SocketAddress &remoteSystem, const char* pData, size_t length)
+	{
+		if (!uringActive)
+			return BerkleySocket::Send(remoteSystem, pData, length);
+
+		sockaddr_storage remote;
+		socklen_t remoteLength = remoteSystem.ToSockAddr(remote, m_AddressFamily);
+
+		// An IPv6 remote can not be reached from an IPv4 socket
+		if (remoteLength == 0)
+			return false;
+
+		std::lock_guard<std::mutex> lock{submitMutex};
+
+		auto submitPending = [this]()
+		{
+			syscall(__NR_io_uring_enter, ringDescriptor, pendingSubmissions, 0, 0, nullptr, 0);
+			pendingSubmissions = 0;
+		};
+
+		io_uring_sqe * pEntry = nullptr;
+
+		if (length <= MAX_MTU_SIZE && !freeSendSlots.empty())
+		{
+			pEntry = GetSubmitEntry();
+
+			if (!pEntry)
+			{
+				submitPending();
+				pEntry = GetSubmitEntry();
+			}
+		}
+
+		// Oversized datagram or every slot is still in flight
+		if (!pEntry)
+		{
+			submitPending();
+			return SendTo(remoteSystem, pData, length);
+		}
+
+		uint32_t slotIndex = freeSendSlots.back();
+		freeSendSlots.pop_back();
+
+		SendSlot &slot = sendSlots[slotIndex];
+		memcpy(slot.data, pData, length);
+
+		memcpy(&slot.address, &remote, remoteLength);
+		slot.vector.iov_base = slot.data;
+		slot.vector.iov_len = length;
+
+		memset(&slot.message, 0, sizeof(slot.message));
+		slot.message.msg_name = &slot.address;
+		slot.message.msg_namelen = remoteLength;
+		slot.message.msg_iov = &slot.vector;
+		slot.message.msg_iovlen = 1;
+
+		pEntry->opcode = IORING_OP_SENDMSG;
+		pEntry->fd = m_Socket;
+		pEntry->addr = reinterpret_cast<uint64_t>(&slot.message);
+		pEntry->len = 1;
+		pEntry->user_data = MakeUserData(Completion::Send, slotIndex);
+
+		CommitSubmitEntry();
+
+		if (sendBatchSize <= 1)
+			submitPending();
+
+		return true;
+	}
+
+	void UringSocket::Flush()
+	{
+		if (!uringActive)
+			return BerkleySocket::Flush();
+
+		std::lock_guard<std::mutex> lock{submitMutex};
+
+		if (pendingSubmissions > 0)
+		{
+			syscall(__NR_io_uring_enter, ringDescriptor, pendingSubmissions, 0, 0, nullptr, 0);
+			pendingSubmissions = 0;
+		}
+	}
+
+	const SocketType UringSocket::GetSocketType() const
+	{
+		return SocketType::IoUring;
+	}
+
+	bool UringSocket::Poll(std::chrono::milliseconds maxWait)
+	{
+		if (!uringActive)
+			return false;
+
+		Arm();
+
+		// In case the buffers came back before the loop noticed it ran dry
+		if (bBuffersExhausted && (maxWait.count() < 0 || maxWait > std::chrono::milliseconds(1)))
+			maxWait = std::chrono::milliseconds(1);
+
+		Enter(1, IORING_ENTER_GETEVENTS, maxWait);
+
+		Reap();
+
+		return true;
+	}
+
+	void UringSocket::ScheduleWakeup(std::chrono::steady_clock::time_point wakeupTime)
+	{
+		if (timerDescriptor == -1)
+			return;
+
+		itimerspec timerSpec;
+		memset(&timerSpec, 0, sizeof(timerSpec));
+
+		if (wakeupTime != std::chrono::steady_clock::time_point::max())
+		{
+			// steady_clock is CLOCK_MONOTONIC, so the time point can be used as absolute timer value
+			auto nanoseconds = std::chrono::duration_cast<std::chrono::nanoseconds>(wakeupTime.time_since_epoch()).count();
+
+			// A zero value would disarm the timer, a past one fires immediately
+			if (nanoseconds <= 0)
+				nanoseconds = 1;
+
+			timerSpec.it_value.tv_sec = static_cast<time_t>(nanoseconds / 1000000000);
+			timerSpec.it_value.tv_nsec = static_cast<long>(nanoseconds % 1000000000);
+		}
+
+		timerfd_settime(timerDescriptor, TFD_TIMER_ABSTIME, &timerSpec, nullptr);
+	}
+
+	void UringSocket::Wakeup()
+	{
+		if (wakeupDescriptor == -1)
+			return;
+
+		uint64_t value = 1;
+		if (write(wakeupDescriptor, &value, sizeof(value)) != sizeof(value))
+			return;
+	}
+
+	bool UringSocket::IsUringActive() const
+	{
+		return uringActive;
+	}
+
+	void UringSocket::EventLoop()
+	{
+		while (endThread == false)
+		{
+			Poll(std::chrono::milliseconds(-1));
+		}
+
+		bRecvThreadRunning = false;
+	}
+
+	void UringSocket::StartReceiving()
+	{
+		if (!uringActive)
+			return BerkleySocket::StartReceiving();
+
+		if (bRecvThreadRunning)
+			return;
+
+		endThread = false;
+
+		// The caller runs the loop through Poll
+		if (!ownsEventLoop)
+			return;
+
+		bRecvThreadRunning = true;
+
+		receiveThread = std::thread(&UringSocket::EventLoop, this);
+	}
+
+	void UringSocket::StopReceiving(bool bWait)
+	{
+		if (!uringActive)
+			return BerkleySocket::StopReceiving(bWait);
+
+		endThread = true;
+
+		Wakeup();
+
+		if (receiveThread.joinable())
+		{
+			if (bWait)
+				receiveThread.join();
+			else
+				receiveThread.detach();
+		}
+	}
+};
@@ -0,0 +1,381 @@
+// Copyright 2015 the kNet authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include <gtest/gtest.h>
+
+#include <congestion/bbr_controller.h>
+#include <congestion/new_reno_controller.h>
+#include <internal/pacer.h>
+#include <internal/selective_ack.h>
+#include <reliability_layer.h>
+
+#include <atomic>
+#include <cstring>
+#include <thread>
+#include <vector>
+
+using namespace std::chrono;
+
+static const size_t datagramSize = 1000;
+
+static knet::AckSample MakeAck(steady_clock::time_point now, size_t ackedBytes, steady_clock::time_point sendTime)
+{
+	knet::AckSample sample;
+	sample.now = now;
+	sample.ackedBytes = ackedBytes;
+	sample.newestSendTime = sendTime;
+	sample.smoothedRtt = milliseconds(50);
+	return sample;
+}
+
+TEST(CongestionTests, NewReno)
+{
+	knet::NewRenoController controller{datagramSize};
+	auto now = steady_clock::now();
+
+	EXPECT_EQ(10 * datagramSize, controller.GetCongestionWindow());
+
+	// Slow start grows by what was acked
+	controller.OnAck(MakeAck(now, 4 * datagramSize, now));
+	EXPECT_EQ(14 * datagramSize, controller.GetCongestionWindow());
+
+	// A loss halves the window once, later losses of the same window are ignored
+	controller.OnLoss(now + milliseconds(10), datagramSize, now);
+	EXPECT_EQ(7 * datagramSize, controller.GetCongestionWindow());
+	EXPECT_EQ(7 * datagramSize, controller.GetSlowStartThreshold());
+
+	controller.OnLoss(now + milliseconds(20), datagramSize, now + milliseconds(5));
+	EXPECT_EQ(7 * datagramSize, controller.GetCongestionWindow());
+
+	// Acks of datagrams sent before the recovery do not grow it
+	controller.OnAck(MakeAck(now + milliseconds(30), datagramSize, now + milliseconds(5)));
+	EXPECT_EQ(7 * datagramSize, controller.GetCongestionWindow());
+
+	// Congestion avoidance adds a datagram per window
+	controller.OnAck(MakeAck(now + milliseconds(40), 7 * datagramSize, now + milliseconds(15)));
+	EXPECT_EQ(8 * datagramSize, controller.GetCongestionWindow());
+	EXPECT_GT(controller.GetPacingRate(), 0.0);
+
+	// A timeout starts over with one datagram
+	controller.OnRetransmissionTimeout(now + seconds(1));
+	EXPECT_EQ(datagramSize, controller.GetCongestionWindow());
+	EXPECT_EQ(4 * datagramSize, controller.GetSlowStartThreshold());
+}
+
+TEST(CongestionTests, Bbr)
+{
+	knet::BbrController controller{datagramSize};
+	auto now = steady_clock::now();
+
+	EXPECT_EQ(knet::BbrController::State::Startup, controller.GetState());
+	EXPECT_EQ(0.0, controller.GetPacingRate());
+
+	// A path of 1 MB/s with 20 ms round trips, one window per round
+	const double bandwidth = 1000000.0;
+	const size_t perRound = 20 * datagramSize;
+	uint64_t delivered = 0;
+
+	for (int round = 0; round < 12; ++round)
+	{
+		knet::AckSample sample = MakeAck(now, perRound, now - milliseconds(20));
+		sample.rtt = milliseconds(20);
+		sample.priorDelivered = delivered;
+		delivered += perRound;
+		sample.delivered = delivered;
+		sample.deliveryRate = bandwidth;
+		sample.bytesInFlight = 0;
+
+		controller.OnAck(sample);
+		now += milliseconds(20);
+	}
+
+	// The bandwidth stopped growing, startup is over and about two BDPs may be in flight
+	EXPECT_EQ(knet::BbrController::State::ProbeBandwidth, controller.GetState());
+	EXPECT_DOUBLE_EQ(bandwidth, controller.GetBottleneckBandwidth());
+	EXPECT_EQ(nanoseconds(milliseconds(20)), controller.GetMinRtt());
+	EXPECT_LE(controller.GetCongestionWindow(), static_cast<size_t>(2 * bandwidth * 0.02));
+	EXPECT_GE(controller.GetPacingRate(), 0.75 * bandwidth);
+	EXPECT_LE(controller.GetPacingRate(), 1.25 * bandwidth);
+
+	// Losses leave the model alone, a timeout limits the window until the next ack
+	auto window = controller.GetCongestionWindow();
+	controller.OnLoss(now, datagramSize, now);
+	EXPECT_EQ(window, controller.GetCongestionWindow());
+
+	controller.OnRetransmissionTimeout(now);
+	EXPECT_EQ(datagramSize, controller.GetCongestionWindow());
+}
+
+TEST(CongestionTests, WindowLimitsReliableSends)
+{
+	auto socket = std::make_shared<knet::BerkleySocket>();
+
+	knet::SocketBindArguments bindArgs;
+	bindArgs.usPort = 6582;
+	bindArgs.szHostAddress = "127.0.0.1";
+
+	ASSERT_TRUE(socket->Bind(bindArgs));
+
+	// Nobody listens there, the datagrams only have to leave
+	knet::SocketAddress remote;
+	remote.SetHost("127.0.0.1");
+	remote.SetPort(6583);
+
+	knet::ReliabilityLayer layer{socket};
+	layer.SetRemoteAddress(remote);
+
+	const char payload[datagramSize] = {0};
+
+	for (int i = 0; i < 200; ++i)
+		layer.Send(payload, sizeof(payload));
+
+	layer.Process();
+
+	auto window = layer.GetCongestionController()->GetCongestionWindow();
+	auto inFlight = layer.GetBytesInFlight();
+
+	EXPECT_GT(inFlight, 0u);
+	EXPECT_LE(inFlight, window + knet::MAX_MTU_SIZE);
+
+	// Acking everything opens the window, slow start doubles it
+	knet::BitStream bitStream{64};
+
+	knet::DatagramHeader dh;
+	dh.isACK = true;
+	dh.isNACK = false;
+	dh.Serialize(bitStream);
+
+	knet::internal::AckWindow acks;
+	knet::SequenceNumberType newest = 0;
+
+	for (knet::SequenceNumberType sequenceNumber = 0; sequenceNumber <= 1000; ++sequenceNumber)
+		acks.Add(sequenceNumber);
+
+	acks.Write(bitStream, knet::MAX_MTU_SIZE, newest);
+	bitStream.Write<uint32_t>(0);
+
+	auto pPacket = knet::InternalRecvPacket::Acquire();
+	memcpy(pPacket->buffer, bitStream.Data(), bitStream.Size());
+	pPacket->bytesRead = bitStream.Size();
+	pPacket->remoteAddress = remote;
+
+	layer.OnReceive(pPacket);
+	layer.Process();
+
+	EXPECT_EQ(window + inFlight, layer.GetCongestionController()->GetCongestionWindow());
+	EXPECT_GT(layer.GetBytesInFlight(), inFlight);
+
+	// Without a controller only the per Process limit applies
+	knet::ReliabilityLayer unlimited{socket};
+	unlimited.SetRemoteAddress(remote);
+	unlimited.SetCongestionControl(knet::CongestionControlType::None);
+
+	for (int i = 0; i < 200; ++i)
+		unlimited.Send(payload, sizeof(payload));
+
+	unlimited.Process();
+
+	EXPECT_EQ(nullptr, unlimited.GetCongestionController());
+	EXPECT_GE(unlimited.GetBytesInFlight(), 100 * datagramSize);
+}
+
+TEST(CongestionTests, WindowLetsUnreliableSendsThrough)
+{
+	auto receiver = std::make_shared<knet::BerkleySocket>();
+	auto socket = std::make_shared<knet::BerkleySocket>();
+
+	knet::SocketBindArguments bindArgs;
+	bindArgs.usPort = 6615;
+	bindArgs.szHostAddress = "127.0.0.1";
+
+	ASSERT_TRUE(receiver->Bind(bindArgs));
+
+	bindArgs.usPort = 6616;
+
+	ASSERT_TRUE(socket->Bind(bindArgs));
+
+	std::atomic<size_t> unreliableDatagrams{0};
+
+	receiver->GetEventHandler().AddEvent(knet::SocketEvents::RECEIVE, nullptr, [&](knet::InternalRecvPacket* pPacket) {
+		const uint8_t flags = pPacket->bytesRead > 0 ? static_cast<uint8_t>(pPacket->buffer[0]) : 0;
+
+		if (!(flags & (knet::DatagramHeader::ackFlag | knet::DatagramHeader::nackFlag | knet::DatagramHeader::reliableFlag)))
+			++unreliableDatagrams;
+
+		pPacket->Release();
+		return true;
+	});
+
+	receiver->StartReceiving();
+
+	knet::SocketAddress remote = receiver->GetSocketAddress();
+
+	knet::ReliabilityLayer layer{socket};
+	layer.SetRemoteAddress(remote);
+
+	const char payload[datagramSize] = {0};
+
+	for (int i = 0; i < 200; ++i)
+		layer.Send(payload, sizeof(payload));
+
+	layer.Process();
+
+	auto inFlight = layer.GetBytesInFlight();
+
+	ASSERT_GE(inFlight, layer.GetCongestionController()->GetCongestionWindow());
+
+	// The full window only holds back reliable messages
+	layer.Send(payload, sizeof(payload), knet::PacketPriority::MEDIUM, knet::PacketReliability::UNRELIABLE);
+
+	// The pacer may still hold back part of the window
+	auto start = steady_clock::now();
+
+	while (unreliableDatagrams == 0 && steady_clock::now() < start + seconds(5))
+	{
+		layer.Process();
+		std::this_thread::sleep_for(milliseconds(1));
+	}
+
+	EXPECT_EQ(1u, unreliableDatagrams.load());
+	EXPECT_EQ(inFlight, layer.GetBytesInFlight());
+
+	receiver->StopReceiving(true);
+	receiver->GetEventHandler().RemoveEventsByOwner(nullptr);
+}
+
+TEST(CongestionTests, Pacer)
+{
+	auto now = steady_clock::now();
+
+	knet::internal::Pacer pacer{2 * datagramSize};
+
+	// Without a rate nothing is held back
+	EXPECT_FALSE(pacer.IsPacing());
+	EXPECT_EQ(now, pacer.GetNextSendTime(now));
+
+	pacer.SetRate(100000.0, now);
+
+	// The burst leaves at once, the debt of the last datagram is paid off after its time on the wire
+	pacer.OnSend(datagramSize, now);
+	EXPECT_TRUE(pacer.CanSend(now));
+	pacer.OnSend(datagramSize + 500, now);
+	EXPECT_FALSE(pacer.CanSend(now));
+
+	auto next = pacer.GetNextSendTime(now);
+	EXPECT_GT(next, now + milliseconds(4));
+	EXPECT_LT(next, now + milliseconds(6));
+
+	EXPECT_FALSE(pacer.CanSend(now + milliseconds(4)));
+	EXPECT_TRUE(pacer.CanSend(next));
+
+	// Idle time only saves up the burst
+	EXPECT_TRUE(pacer.CanSend(now + seconds(10)));
+	pacer.OnSend(2 * datagramSize, now + seconds(10));
+	EXPECT_FALSE(pacer.CanSend(now + seconds(10)));
+}
+
+TEST(CongestionTests, PacingSpreadsSplitPackets)
+{
+	auto socket = std::make_shared<knet::BerkleySocket>();
+
+	knet::SocketBindArguments bindArgs;
+	bindArgs.usPort = 6584;
+	bindArgs.szHostAddress = "127.0.0.1";
+
+	ASSERT_TRUE(socket->Bind(bindArgs));
+
+	knet::SocketAddress remote;
+	remote.SetHost("127.0.0.1");
+	remote.SetPort(6585);
+
+	knet::ReliabilityLayer layer{socket};
+	layer.SetRemoteAddress(remote);
+	layer.SetCongestionControl(knet::CongestionControlType::None);
+	layer.SetPacingRate(100000.0);
+	layer.SetPacingBurst(knet::MAX_MTU_SIZE);
+
+	// Split into about 14 fragments, one goes out per 15 ms
+	std::vector<char> payload(20000);
+	layer.Send(payload.data(), payload.size());
+
+	auto before = steady_clock::now();
+	layer.Process();
+
+	EXPECT_DOUBLE_EQ(100000.0, layer.GetPacingRate());
+
+	// The fragments wait in their message until the pacer lets them go, nothing piles up behind it
+	auto pending = layer.GetPendingSplitBytes();
+	EXPECT_GT(pending, payload.size() - 2 * knet::MAX_MTU_SIZE);
+	EXPECT_EQ(0u, layer.GetPacedQueueSize());
+	EXPECT_LE(layer.GetBytesInFlight(), 2 * knet::MAX_MTU_SIZE);
+
+	auto wakeup = layer.GetNextWakeup();
+	EXPECT_GT(wakeup, before);
+	EXPECT_LT(wakeup, before + milliseconds(50));
+
+	std::this_thread::sleep_until(wakeup);
+	layer.Process();
+
+	EXPECT_LT(layer.GetPendingSplitBytes(), pending);
+
+	// Unpaced everything leaves with the next Process
+	layer.SetPacingRate(0.0);
+	layer.Process();
+
+	EXPECT_EQ(0u, layer.GetPendingSplitBytes());
+	EXPECT_GE(layer.GetBytesInFlight(), payload.size());
+}
+
+TEST(CongestionTests, SplitMessagesLeaveRoomForOthers)
+{
+	auto socket = std::make_shared<knet::BerkleySocket>();
+
+	knet::SocketBindArguments bindArgs;
+	bindArgs.usPort = 6595;
+	bindArgs.szHostAddress = "127.0.0.1";
+
+	ASSERT_TRUE(socket->Bind(bindArgs));
+
+	// Nobody listens there, the datagrams only have to leave
+	knet::SocketAddress remote;
+	remote.SetHost("127.0.0.1");
+	remote.SetPort(6596);
+
+	knet::ReliabilityLayer layer{socket};
+	layer.SetRemoteAddress(remote);
+
+	// A bulk transfer only takes part of the congestion window
+	std::vector<char> bulk(60000);
+	layer.Send(bulk.data(), bulk.size(), knet::PacketPriority::LOW);
+	layer.Process();
+
+	auto window = layer.GetCongestionController()->GetCongestionWindow();
+	auto inFlight = layer.GetBytesInFlight();
+
+	EXPECT_GT(inFlight, 0u);
+	EXPECT_LE(inFlight, window - window / 4 + knet::MAX_MTU_SIZE);
+	EXPECT_GT(layer.GetPendingSplitBytes(), 0u);
+
+	// Messages sent afterwards still get out past it
+	const char payload[datagramSize] = {0};
+	layer.Send(payload, sizeof(payload), knet::PacketPriority::HIGH);
+	layer.Process();
+
+	// Only the new message left, the fragments still wait for acks
+	EXPECT_GT(layer.GetBytesInFlight(), inFlight + datagramSize);
+	EXPECT_LT(layer.GetBytesInFlight(), inFlight + datagramSize + 64);
+
+	// The split window limits the fragments without acks as well
+	knet::ReliabilityLayer limited{socket};
+	limited.SetRemoteAddress(remote);
+	limited.SetCongestionControl(knet::CongestionControlType::None);
+	limited.SetSplitWindow(10 * datagramSize);
+
+	limited.Send(bulk.data(), bulk.size());
+	limited.Process();
+
+	EXPECT_EQ(10 * datagramSize, limited.GetSplitWindow());
+	EXPECT_LE(limited.GetBytesInFlight(), 10 * datagramSize + knet::MAX_MTU_SIZE);
+	EXPECT_GT(limited.GetPendingSplitBytes(), bulk.size() / 2);
+}
@@ -115,3 +115,264 @@ TEST(ConnectTests, StayAliveConnection)
 	client->Stop();
 	server->Stop();
 }
+
+#ifdef __linux__
+static void ConnectWithSocketType(unsigned short usPort, knet::SocketType socketType, bool ownsEventLoop)
+{
+	auto server = std::make_unique<knet::Peer>();
+	auto client = std::make_unique<knet::Peer>();
+
+	knet::StartupInformation startInfo;
+	knet::EndPointInformation endPoint;
+	endPoint.port = usPort;
+	endPoint.host = "0.0.0.0";
+	startInfo.localEndPoints.push_back(endPoint);
+	startInfo.isIncoming = true;
+	startInfo.socketType = socketType;
+	startInfo.ownsEventLoop = ownsEventLoop;
+
+	server->Start(startInfo);
+
+	startInfo.localEndPoints.at(0).port = usPort + 1;
+	startInfo.isIncoming = false;
+
+	client->Start(startInfo);
+
+	EXPECT_EQ(socketType, client->GetSocket().lock()->GetSocketType());
+
+	knet::ConnectInformation connectInfo;
+	connectInfo.host = "127.0.0.1";
+	connectInfo.port = usPort;
+
+	client->Connect(connectInfo);
+
+	bool connected = false;
+	bool connectAttempTimedOut = false;
+
+	auto start = std::chrono::system_clock::now();
+
+	client->GetEventHandler().AddEvent(knet::PeerEvents::ConnectionAccepted, nullptr, [&]() {
+		connected = true;
+		return true;
+	});
+
+	while (!connected && !connectAttempTimedOut)
+	{
+		client->Process();
+		server->Process();
+		if (std::chrono::system_clock::now() > start + std::chrono::seconds(10))
+			connectAttempTimedOut = true;
+	}
+
+	EXPECT_TRUE(connected);
+	EXPECT_FALSE(connectAttempTimedOut);
+
+	client->Stop();
+	server->Stop();
+}
+
+TEST(ConnectTests, EpollConnect)
+{
+	ConnectWithSocketType(6541, knet::SocketType::Epoll, true);
+}
+
+TEST(ConnectTests, EpollCallerOwnedLoopConnect)
+{
+	ConnectWithSocketType(6543, knet::SocketType::Epoll, false);
+}
+
+TEST(ConnectTests, IoUringConnect)
+{
+	ConnectWithSocketType(6545, knet::SocketType::IoUring, true);
+}
+
+TEST(ConnectTests, IoUringCallerOwnedLoopConnect)
+{
+	ConnectWithSocketType(6547, knet::SocketType::IoUring, false);
+}
+
+TEST(ConnectTests, IPv6Connect)
+{
+	auto usPort = static_cast<unsigned short>(6580);
+	auto server = std::make_unique<knet::Peer>();
+	auto client = std::make_unique<knet::Peer>();
+
+	knet::StartupInformation startInfo;
+	knet::EndPointInformation endPoint;
+	endPoint.port = usPort;
+	endPoint.host = "::";
+	startInfo.localEndPoints.push_back(endPoint);
+	startInfo.isIncoming = true;
+
+	server->Start(startInfo);
+
+	startInfo.localEndPoints.at(0).port = usPort + 1;
+	startInfo.localEndPoints.at(0).host = "::1";
+	startInfo.isIncoming = false;
+
+	client->Start(startInfo);
+
+	knet::ConnectInformation connectInfo;
+	connectInfo.host = "::1";
+	connectInfo.port = usPort;
+
+	client->Connect(connectInfo);
+
+	bool connected = false;
+	bool connectAttempTimedOut = false;
+
+	auto start = std::chrono::system_clock::now();
+
+	client->GetEventHandler().AddEvent(knet::PeerEvents::ConnectionAccepted, nullptr, [&]() {
+		connected = true;
+		return true;
+	});
+
+	while (!connected && !connectAttempTimedOut)
+	{
+		client->Process();
+		server->Process();
+		if (std::chrono::system_clock::now() > start + std::chrono::seconds(10))
+			connectAttempTimedOut = true;
+	}
+
+	EXPECT_TRUE(connected);
+	EXPECT_FALSE(connectAttempTimedOut);
+
+	client->Stop();
+	server->Stop();
+}
+
+TEST(ConnectTests, ShardedConnect)
+{
+	const unsigned short usPort = 6560;
+	const size_t clientCount = 4;
+
+	auto server = std::make_unique<knet::Peer>();
+
+	knet::StartupInformation startInfo;
+	knet::EndPointInformation endPoint;
+	endPoint.port = usPort;
+	endPoint.host = "0.0.0.0";
+	startInfo.localEndPoints.push_back(endPoint);
+	startInfo.isIncoming = true;
+	startInfo.maxConnections = clientCount;
+	startInfo.shardCount = 4;
+
+	server->Start(startInfo);
+
+	EXPECT_EQ(4u, server->GetShardCount());
+
+	startInfo.isIncoming = false;
+	startInfo.shardCount = 1;
+
+	std::vector<std::unique_ptr<knet::Peer>> clients;
+	size_t connected = 0;
+
+	knet::ConnectInformation connectInfo;
+	connectInfo.host = "127.0.0.1";
+	connectInfo.port = usPort;
+
+	for (size_t i = 0; i < clientCount; ++i)
+	{
+		auto client = std::make_unique<knet::Peer>();
+
+		startInfo.localEndPoints.at(0).port = static_cast<unsigned short>(usPort + 1 + i);
+		client->Start(startInfo);
+
+		client->GetEventHandler().AddEvent(knet::PeerEvents::ConnectionAccepted, nullptr, [&]() {
+			++connected;
+			return true;
+		});
+
+		client->Connect(connectInfo);
+		clients.push_back(std::move(client));
+	}
+
+	auto start = std::chrono::system_clock::now();
+
+	while (connected < clientCount && std::chrono::system_clock::now() < start + std::chrono::seconds(10))
+	{
+		for (auto &client : clients)
+			client->Process();
+
+		// Each shard can run on its own thread, here they share one
+		for (size_t i = 0; i < server->GetShardCount(); ++i)
+			server->Process(i);
+	}
+
+	EXPECT_EQ(clientCount, connected);
+
+	for (auto &client : clients)
+		client->Stop();
+
+	server->Stop();
+}
+
+TEST(ConnectTests, ShardedEphemeralPort)
+{
+	const size_t clientCount = 4;
+
+	auto server = std::make_unique<knet::Peer>();
+
+	knet::StartupInformation startInfo;
+	knet::EndPointInformation endPoint;
+	endPoint.port = 0;
+	endPoint.host = "127.0.0.1";
+	startInfo.localEndPoints.push_back(endPoint);
+	startInfo.isIncoming = true;
+	startInfo.maxConnections = 2;
+	startInfo.shardCount = 4;
+
+	server->Start(startInfo);
+
+	// Every shard has to join the group of the port the first one got
+	const unsigned short usPort = server->GetSocket().lock()->GetSocketAddress().GetPort();
+	ASSERT_NE(0, usPort);
+
+	startInfo.isIncoming = false;
+	startInfo.shardCount = 1;
+
+	std::vector<std::unique_ptr<knet::Peer>> clients;
+	size_t connected = 0;
+
+	knet::ConnectInformation connectInfo;
+	connectInfo.host = "127.0.0.1";
+	connectInfo.port = usPort;
+
+	for (size_t i = 0; i < clientCount; ++i)
+	{
+		auto client = std::make_unique<knet::Peer>();
+
+		startInfo.localEndPoints.at(0).port = static_cast<unsigned short>(6607 + i);
+		client->Start(startInfo);
+
+		client->GetEventHandler().AddEvent(knet::PeerEvents::ConnectionAccepted, nullptr, [&]() {
+			++connected;
+			return true;
+		});
+
+		client->Connect(connectInfo);
+		clients.push_back(std::move(client));
+	}
+
+	// The limit holds across the shards, the other clients are refused
+	auto start = std::chrono::system_clock::now();
+
+	while (std::chrono::system_clock::now() < start + std::chrono::milliseconds(500))
+	{
+		for (auto &client : clients)
+			client->Process();
+
+		for (size_t i = 0; i < server->GetShardCount(); ++i)
+			server->Process(i);
+	}
+
+	EXPECT_EQ(startInfo.maxConnections, static_cast<int>(connected));
+
+	for (auto &client : clients)
+		client->Stop();
+
+	server->Stop();
+}
+#endif
@@ -0,0 +1,2732 @@
+// Copyright 2015 the kNet authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include <gtest/gtest.h>
+
+#include <sockets/berkley_socket.h>
+#include <sockets/uring_socket.h>
+#include <reliability_layer.h>
+#include <internal/address_table.h>
+#include <internal/datagram_header.h>
+#include <internal/rtt_estimator.h>
+#include <internal/gap_tracker.h>
+#include <internal/sequence_ring.h>
+#include <internal/selective_ack.h>
+#include <internal/reorder_window.h>
+#include <internal/reassembly_buffer.h>
+#include <internal/received_window.h>
+
+#include <algorithm>
+#include <limits>
+#include <atomic>
+#include <mutex>
+#include <set>
+#include <cstdio>
+#include <fstream>
+
+TEST(SocketTests, BatchedReceive)
+{
+	auto receiver = std::make_shared<knet::BerkleySocket>();
+	auto sender = std::make_shared<knet::BerkleySocket>();
+
+	knet::SocketBindArguments bindArgs;
+	bindArgs.usPort = 6531;
+	bindArgs.szHostAddress = "127.0.0.1";
+	bindArgs.receiveBatchSize = 16;
+
+	ASSERT_TRUE(receiver->Bind(bindArgs));
+
+	bindArgs.usPort = 6532;
+	bindArgs.receiveBatchSize = 1;
+
+	ASSERT_TRUE(sender->Bind(bindArgs));
+
+	std::atomic<size_t> receivedPackets{0};
+	std::atomic<size_t> receivedBytes{0};
+
+	receiver->GetEventHandler().AddEvent(knet::SocketEvents::RECEIVE_BATCH, nullptr, [&](knet::InternalRecvPacket** ppPackets, size_t count) {
+		for (size_t i = 0; i < count; ++i)
+		{
+			receivedBytes += ppPackets[i]->bytesRead;
+			ppPackets[i]->Release();
+		}
+
+		receivedPackets += count;
+		return true;
+	});
+
+	receiver->StartReceiving();
+
+	const char payload[64] = {0};
+
+	for (int i = 0; i < 100; ++i)
+		sender->Send(receiver->GetSocketAddress(), payload, sizeof(payload));
+
+	auto start = std::chrono::system_clock::now();
+
+	while (receivedPackets < 100 && std::chrono::system_clock::now() < start + std::chrono::seconds(5))
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+
+	EXPECT_EQ(100u, receivedPackets.load());
+	EXPECT_EQ(100u * sizeof(payload), receivedBytes.load());
+
+	receiver->StopReceiving(true);
+	receiver->GetEventHandler().RemoveEventsByOwner(nullptr);
+}
+
+TEST(SocketTests, BatchedSend)
+{
+	auto receiver = std::make_shared<knet::BerkleySocket>();
+	auto sender = std::make_shared<knet::BerkleySocket>();
+
+	knet::SocketBindArguments bindArgs;
+	bindArgs.usPort = 6533;
+	bindArgs.szHostAddress = "127.0.0.1";
+
+	ASSERT_TRUE(receiver->Bind(bindArgs));
+
+	bindArgs.usPort = 6534;
+	bindArgs.sendBatchSize = 32;
+
+	ASSERT_TRUE(sender->Bind(bindArgs));
+
+	std::atomic<size_t> receivedPackets{0};
+
+	receiver->GetEventHandler().AddEvent(knet::SocketEvents::RECEIVE, nullptr, [&](knet::InternalRecvPacket* pPacket) {
+		pPacket->Release();
+		++receivedPackets;
+		return true;
+	});
+
+	receiver->StartReceiving();
+
+	const char payload[64] = {0};
+
+	// 100 datagrams fill three batches, the rest stays staged until Flush
+	for (int i = 0; i < 100; ++i)
+		sender->Send(receiver->GetSocketAddress(), payload, sizeof(payload));
+
+	auto start = std::chrono::system_clock::now();
+
+	while (receivedPackets < 96 && std::chrono::system_clock::now() < start + std::chrono::seconds(5))
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+
+	EXPECT_EQ(96u, receivedPackets.load());
+
+	sender->Flush();
+
+	while (receivedPackets < 100 && std::chrono::system_clock::now() < start + std::chrono::seconds(5))
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+
+	EXPECT_EQ(100u, receivedPackets.load());
+
+	// IMMEDIATE messages do not wait for the next Flush
+	auto receiverAddress = receiver->GetSocketAddress();
+
+	knet::ReliabilityLayer layer{sender};
+	layer.SetRemoteAddress(receiverAddress);
+	layer.Send(payload, sizeof(payload), knet::PacketPriority::IMMEDIATE, knet::PacketReliability::UNRELIABLE);
+
+	while (receivedPackets < 101 && std::chrono::system_clock::now() < start + std::chrono::seconds(5))
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+
+	EXPECT_EQ(101u, receivedPackets.load());
+
+	receiver->StopReceiving(true);
+	receiver->GetEventHandler().RemoveEventsByOwner(nullptr);
+}
+
+TEST(SocketTests, PacketPool)
+{
+	knet::internal::PacketPool<knet::InternalRecvPacket, 4> pool{2};
+
+	auto pFirst = pool.Take();
+	auto pSecond = pool.Take();
+	auto pThird = pool.Take();
+
+	pool.Return(pFirst);
+	pool.Return(pSecond);
+
+	// Above the capacity the packet is deleted
+	pool.Return(pThird);
+
+	EXPECT_EQ(2u, pool.GetPooled());
+
+	auto pReused = pool.Take();
+	EXPECT_TRUE(pReused == pFirst || pReused == pSecond);
+	EXPECT_EQ(1u, pool.GetPooled());
+
+	pool.SetCapacity(0);
+	pool.Return(pReused);
+
+	EXPECT_EQ(1u, pool.GetPooled());
+}
+
+TEST(SocketTests, SharedPoolCapacity)
+{
+	// Every peer asks for room when it starts, a smaller request must not shrink the pool for the others
+	knet::InternalRecvPacket::ReservePoolCapacity(64);
+
+	const size_t capacity = knet::InternalRecvPacket::GetPoolCapacity();
+	EXPECT_LE(64u, capacity);
+
+	knet::InternalRecvPacket::ReservePoolCapacity(0);
+	EXPECT_EQ(capacity, knet::InternalRecvPacket::GetPoolCapacity());
+}
+
+TEST(SocketTests, SpscRing)
+{
+	knet::internal::SpscRing<size_t> ring{64};
+
+	const size_t total = 100000;
+
+	std::thread producer([&]() {
+		size_t next = 0;
+
+		while (next < total)
+		{
+			size_t batch[16];
+			size_t count = std::min<size_t>(16, total - next);
+
+			for (size_t i = 0; i < count; ++i)
+				batch[i] = next + i;
+
+			next += ring.Push(batch, count);
+		}
+	});
+
+	size_t expected = 0;
+	bool inOrder = true;
+
+	while (expected < total)
+	{
+		size_t batch[32];
+		size_t count = ring.Pop(batch, 32);
+
+		for (size_t i = 0; i < count; ++i)
+			inOrder &= batch[i] == expected++;
+	}
+
+	producer.join();
+
+	EXPECT_TRUE(inOrder);
+	EXPECT_TRUE(ring.Empty());
+}
+
+TEST(SocketTests, AddressTable)
+{
+	knet::internal::AddressTable<size_t> table;
+
+	auto makeAddress = [](size_t index) {
+		knet::SocketAddress address;
+		address.SetHost("10.0." + std::to_string(index / 256) + "." + std::to_string(index % 256));
+		address.SetPort(static_cast<uint16_t>(5000 + index % 7));
+		return address;
+	};
+
+	knet::SocketAddress stable;
+	stable.SetHost("::1");
+	stable.SetPort(7000);
+	table.Insert(stable, std::make_shared<size_t>(7000));
+
+	std::atomic<bool> stop{false};
+	std::atomic<size_t> misses{0};
+
+	// Lookups keep running while the writer replaces the table
+	std::thread reader([&]() {
+		while (!stop)
+		{
+			knet::internal::AddressTable<size_t>::Reader read{table};
+
+			size_t * pValue = read.Find(stable);
+
+			if (!pValue || *pValue != 7000)
+				++misses;
+		}
+	});
+
+	const size_t total = 2000;
+
+	for (size_t i = 0; i < total; ++i)
+		table.Insert(makeAddress(i), std::make_shared<size_t>(i));
+
+	std::weak_ptr<size_t> erased = table.Find(makeAddress(0));
+
+	for (size_t i = 0; i < total; i += 2)
+		EXPECT_TRUE(table.Erase(makeAddress(i)));
+
+	EXPECT_FALSE(table.Erase(makeAddress(0)));
+
+	stop = true;
+	reader.join();
+
+	EXPECT_EQ(0u, misses.load());
+	EXPECT_EQ(total / 2 + 1, table.Size());
+
+	for (size_t i = 0; i < total; ++i)
+	{
+		auto &value = table.Find(makeAddress(i));
+
+		if (i % 2 == 0)
+			EXPECT_FALSE(value);
+		else
+			EXPECT_TRUE(value && *value == i);
+	}
+
+	// Erased slots are left as tombstones, the addresses probing past them have to stay reachable
+	for (size_t i = 0; i < total; i += 2)
+		table.Insert(makeAddress(i), std::make_shared<size_t>(i + total));
+
+	EXPECT_EQ(total + 1, table.Size());
+
+	{
+		knet::internal::AddressTable<size_t>::Reader read{table};
+
+		for (size_t i = 0; i < total; ++i)
+		{
+			size_t * pValue = read.Find(makeAddress(i));
+			EXPECT_TRUE(pValue && *pValue == (i % 2 == 0 ? i + total : i));
+		}
+	}
+
+	// Without readers the replaced tables and the erased objects go away
+	table.Reclaim();
+	table.Reclaim();
+
+	EXPECT_TRUE(erased.expired());
+}
+
+TEST(SocketTests, ReceiveQueueOverflow)
+{
+	knet::ReliabilityLayer layer;
+	layer.SetReceiveQueue(4, knet::ReceiveOverflowPolicy::Drop);
+
+	knet::InternalRecvPacket * packets[6];
+
+	for (auto &pPacket : packets)
+		pPacket = knet::InternalRecvPacket::Acquire();
+
+	EXPECT_FALSE(layer.OnReceive(packets, 6));
+
+	EXPECT_EQ(4u, layer.GetReceiveQueueDepth());
+	EXPECT_EQ(2u, layer.GetDroppedPackets());
+
+	while (auto pPacket = layer.PopBufferedPacket())
+		pPacket->Release();
+
+	EXPECT_EQ(0u, layer.GetReceiveQueueDepth());
+}
+
+TEST(SocketTests, SocketAddress)
+{
+	knet::SocketAddress address4;
+	ASSERT_TRUE(address4.SetHost("127.0.0.1"));
+	address4.SetPort(6000);
+
+	// The same remote seen by a dual-stack socket
+	knet::SocketAddress mapped;
+	ASSERT_TRUE(mapped.SetHost("::ffff:127.0.0.1"));
+	mapped.SetPort(6000);
+
+	EXPECT_TRUE(address4.IsIPv4());
+	EXPECT_TRUE(address4 == mapped);
+	EXPECT_EQ(address4.Hash(), mapped.Hash());
+	EXPECT_EQ("127.0.0.1:6000", mapped.ToString());
+
+	knet::SocketAddress address6;
+	ASSERT_TRUE(address6.SetHost("2001:db8::1"));
+	address6.SetPort(6000);
+
+	EXPECT_FALSE(address6.IsIPv4());
+	EXPECT_TRUE(address6 != address4);
+	EXPECT_EQ("[2001:db8::1]:6000", address6.ToString());
+
+	mapped.SetPort(6001);
+	EXPECT_TRUE(address4 != mapped);
+
+	EXPECT_FALSE(address6.SetHost("not an address"));
+	EXPECT_EQ("[2001:db8::1]:6000", address6.ToString());
+
+	// Round trip through the socket forms, IPv6 has no IPv4 form
+	sockaddr_storage storage;
+	ASSERT_EQ(sizeof(sockaddr_in), address4.ToSockAddr(storage, AF_INET));
+	EXPECT_TRUE(knet::SocketAddress(reinterpret_cast<sockaddr*>(&storage), sizeof(sockaddr_in)) == address4);
+
+	ASSERT_EQ(sizeof(sockaddr_in6), address4.ToSockAddr(storage, AF_INET6));
+	EXPECT_TRUE(knet::SocketAddress(reinterpret_cast<sockaddr*>(&storage), sizeof(sockaddr_in6)) == address4);
+
+	EXPECT_EQ(0u, address6.ToSockAddr(storage, AF_INET));
+}
+
+#ifdef __linux__
+TEST(SocketTests, SegmentedSend)
+{
+	auto receiver = std::make_shared<knet::BerkleySocket>();
+	auto sender = std::make_shared<knet::BerkleySocket>();
+
+	knet::SocketBindArguments bindArgs;
+	bindArgs.usPort = 6570;
+	bindArgs.szHostAddress = "127.0.0.1";
+
+	ASSERT_TRUE(receiver->Bind(bindArgs));
+
+	bindArgs.usPort = 6571;
+	bindArgs.sendBatchSize = 64;
+
+	ASSERT_TRUE(sender->Bind(bindArgs));
+
+	std::mutex receivedMutex;
+	std::vector<std::pair<size_t, char>> received;
+
+	receiver->GetEventHandler().AddEvent(knet::SocketEvents::RECEIVE, nullptr, [&](knet::InternalRecvPacket* pPacket) {
+		std::lock_guard<std::mutex> lock{receivedMutex};
+		received.emplace_back(pPacket->bytesRead, pPacket->buffer[pPacket->bytesRead - 1]);
+		pPacket->Release();
+		return true;
+	});
+
+	receiver->StartReceiving();
+
+	// Runs of equal sizes with a shorter tail, the segments have to arrive as the original datagrams
+	std::vector<size_t> sizes;
+
+	for (int i = 0; i < 40; ++i)
+		sizes.push_back(1000);
+
+	sizes.push_back(300);
+	sizes.push_back(1200);
+	sizes.push_back(1200);
+
+	for (size_t i = 0; i < sizes.size(); ++i)
+	{
+		std::vector<char> payload(sizes[i], static_cast<char>(i));
+		sender->Send(receiver->GetSocketAddress(), payload.data(), payload.size());
+	}
+
+	sender->Flush();
+
+	auto start = std::chrono::system_clock::now();
+
+	while (std::chrono::system_clock::now() < start + std::chrono::seconds(5))
+	{
+		{
+			std::lock_guard<std::mutex> lock{receivedMutex};
+
+			if (received.size() >= sizes.size())
+				break;
+		}
+
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+	}
+
+	decltype(received) datagrams;
+
+	{
+		std::lock_guard<std::mutex> lock{receivedMutex};
+		datagrams = received;
+	}
+
+	// Stopping sends a wakeup datagram to the receiver, it must not be counted
+	receiver->StopReceiving(true);
+	receiver->GetEventHandler().RemoveEventsByOwner(nullptr);
+
+	ASSERT_EQ(sizes.size(), datagrams.size());
+
+	for (size_t i = 0; i < sizes.size(); ++i)
+	{
+		EXPECT_EQ(sizes[i], datagrams[i].first);
+		EXPECT_EQ(static_cast<char>(i), datagrams[i].second);
+	}
+}
+
+TEST(SocketTests, OffloadedReceive)
+{
+	auto receiver = std::make_shared<knet::BerkleySocket>();
+	auto sender = std::make_shared<knet::BerkleySocket>();
+
+	knet::SocketBindArguments bindArgs;
+	bindArgs.usPort = 6572;
+	bindArgs.szHostAddress = "127.0.0.1";
+	bindArgs.receiveBatchSize = 8;
+	bindArgs.receiveOffload = true;
+
+	ASSERT_TRUE(receiver->Bind(bindArgs));
+
+	bindArgs.usPort = 6573;
+	bindArgs.receiveBatchSize = 1;
+	bindArgs.receiveOffload = false;
+	bindArgs.sendBatchSize = 64;
+
+	ASSERT_TRUE(sender->Bind(bindArgs));
+
+	std::mutex receivedMutex;
+	std::vector<std::vector<char>> received;
+
+	receiver->GetEventHandler().AddEvent(knet::SocketEvents::RECEIVE_BATCH, nullptr, [&](knet::InternalRecvPacket** ppPackets, size_t count) {
+		std::lock_guard<std::mutex> lock{receivedMutex};
+
+		for (size_t i = 0; i < count; ++i)
+		{
+			received.emplace_back(ppPackets[i]->buffer, ppPackets[i]->buffer + ppPackets[i]->bytesRead);
+			ppPackets[i]->Release();
+		}
+
+		return true;
+	});
+
+	receiver->StartReceiving();
+
+	// Segmented sends arrive coalesced on loopback, the receiver has to split them again
+	std::vector<size_t> sizes;
+
+	for (int i = 0; i < 30; ++i)
+		sizes.push_back(1200);
+
+	sizes.push_back(100);
+	sizes.push_back(700);
+
+	for (size_t i = 0; i < sizes.size(); ++i)
+	{
+		std::vector<char> payload(sizes[i], static_cast<char>(i));
+		sender->Send(receiver->GetSocketAddress(), payload.data(), payload.size());
+	}
+
+	sender->Flush();
+
+	auto start = std::chrono::system_clock::now();
+
+	while (std::chrono::system_clock::now() < start + std::chrono::seconds(5))
+	{
+		{
+			std::lock_guard<std::mutex> lock{receivedMutex};
+
+			if (received.size() >= sizes.size())
+				break;
+		}
+
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+	}
+
+	decltype(received) datagrams;
+
+	{
+		std::lock_guard<std::mutex> lock{receivedMutex};
+		datagrams = received;
+	}
+
+	receiver->StopReceiving(true);
+	receiver->GetEventHandler().RemoveEventsByOwner(nullptr);
+
+	ASSERT_EQ(sizes.size(), datagrams.size());
+
+	for (size_t i = 0; i < sizes.size(); ++i)
+	{
+		EXPECT_EQ(sizes[i], datagrams[i].size());
+		EXPECT_EQ(std::vector<char>(sizes[i], static_cast<char>(i)), datagrams[i]);
+	}
+}
+
+TEST(SocketTests, OffloadedReceivePoolLimit)
+{
+	auto receiver = std::make_shared<knet::BerkleySocket>();
+	auto sender = std::make_shared<knet::BerkleySocket>();
+
+	knet::SocketBindArguments bindArgs;
+	bindArgs.usPort = 6611;
+	bindArgs.szHostAddress = "127.0.0.1";
+	bindArgs.receiveOffload = true;
+
+	ASSERT_TRUE(receiver->Bind(bindArgs));
+
+	bindArgs.usPort = 6612;
+	bindArgs.receiveOffload = false;
+	bindArgs.sendBatchSize = 64;
+
+	ASSERT_TRUE(sender->Bind(bindArgs));
+
+	std::mutex receivedMutex;
+	std::vector<knet::InternalRecvPacket*> received;
+
+	receiver->GetEventHandler().AddEvent(knet::SocketEvents::RECEIVE_BATCH, nullptr, [&](knet::InternalRecvPacket** ppPackets, size_t count) {
+		std::lock_guard<std::mutex> lock{receivedMutex};
+		received.insert(received.end(), ppPackets, ppPackets + count);
+		return true;
+	});
+
+	receiver->StartReceiving();
+
+	// Nothing is released, so the receiver runs out of blocks and has to copy the later bursts
+	const size_t bursts = 32;
+	const size_t burstSize = 4;
+
+	for (size_t i = 0; i < bursts; ++i)
+	{
+		for (size_t j = 0; j < burstSize; ++j)
+		{
+			std::vector<char> payload(1000, static_cast<char>(i));
+			sender->Send(receiver->GetSocketAddress(), payload.data(), payload.size());
+		}
+
+		sender->Flush();
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+	}
+
+	auto start = std::chrono::system_clock::now();
+
+	while (std::chrono::system_clock::now() < start + std::chrono::seconds(5))
+	{
+		{
+			std::lock_guard<std::mutex> lock{receivedMutex};
+
+			if (received.size() >= bursts * burstSize)
+				break;
+		}
+
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+	}
+
+	receiver->StopReceiving(true);
+	receiver->GetEventHandler().RemoveEventsByOwner(nullptr);
+
+	ASSERT_LE(bursts * burstSize, received.size());
+
+	std::set<uint32_t> lentBlocks;
+
+	for (size_t i = 0; i < received.size(); ++i)
+	{
+		if (i < bursts * burstSize)
+			EXPECT_EQ(std::vector<char>(1000, static_cast<char>(i / burstSize)), std::vector<char>(received[i]->buffer, received[i]->buffer + received[i]->bytesRead));
+
+		if (received[i]->bufferOwner)
+			lentBlocks.insert(received[i]->bufferId);
+
+		received[i]->Release();
+	}
+
+	// A batch of one may grow to eight blocks, one of them stays with the receive slot
+	EXPECT_GT(8u, lentBlocks.size());
+}
+
+TEST(SocketTests, LentBuffersOutliveSocket)
+{
+	auto sender = std::make_shared<knet::BerkleySocket>();
+
+	knet::SocketBindArguments bindArgs;
+	bindArgs.usPort = 6604;
+	bindArgs.szHostAddress = "127.0.0.1";
+	bindArgs.sendBatchSize = 16;
+
+	ASSERT_TRUE(sender->Bind(bindArgs));
+
+	auto receiveAndClose = [&](std::shared_ptr<knet::BerkleySocket> receiver, unsigned short port)
+	{
+		bindArgs.usPort = port;
+		bindArgs.sendBatchSize = 1;
+		bindArgs.receiveBatchSize = 8;
+		bindArgs.receiveOffload = true;
+
+		ASSERT_TRUE(receiver->Bind(bindArgs));
+
+		std::mutex receivedMutex;
+		std::vector<knet::InternalRecvPacket*> received;
+
+		receiver->GetEventHandler().AddEvent(knet::SocketEvents::RECEIVE_BATCH, nullptr, [&](knet::InternalRecvPacket** ppPackets, size_t count) {
+			std::lock_guard<std::mutex> lock{receivedMutex};
+			received.insert(received.end(), ppPackets, ppPackets + count);
+			return true;
+		});
+
+		receiver->StartReceiving();
+
+		for (int i = 0; i < 16; ++i)
+		{
+			std::vector<char> payload(1000, static_cast<char>(i));
+			sender->Send(receiver->GetSocketAddress(), payload.data(), payload.size());
+		}
+
+		sender->Flush();
+
+		auto start = std::chrono::system_clock::now();
+
+		while (std::chrono::system_clock::now() < start + std::chrono::seconds(5))
+		{
+			{
+				std::lock_guard<std::mutex> lock{receivedMutex};
+
+				if (received.size() >= 16)
+					break;
+			}
+
+			std::this_thread::sleep_for(std::chrono::milliseconds(1));
+		}
+
+		receiver->StopReceiving(true);
+		receiver->GetEventHandler().RemoveEventsByOwner(nullptr);
+
+		// The packets keep the buffers they were lent, stopping may have woken the receiver with one more datagram
+		receiver.reset();
+
+		ASSERT_LE(16u, received.size());
+
+		for (size_t i = 0; i < received.size(); ++i)
+		{
+			if (i < 16)
+				EXPECT_EQ(std::vector<char>(1000, static_cast<char>(i)), std::vector<char>(received[i]->buffer, received[i]->buffer + received[i]->bytesRead));
+
+			received[i]->Release();
+		}
+	};
+
+	receiveAndClose(std::make_shared<knet::BerkleySocket>(), 6605);
+
+	// Falls back to a BerkleySocket without io_uring support
+	receiveAndClose(std::make_shared<knet::UringSocket>(), 6606);
+}
+
+TEST(SocketTests, ReusePortSteering)
+{
+	const size_t groupSize = 4;
+	const size_t senderCount = 8;
+
+	std::vector<std::shared_ptr<knet::BerkleySocket>> receivers;
+	std::atomic<size_t> receivedPackets{0};
+
+	// receivedBy[sender][receiver]
+	std::atomic<size_t> receivedBy[senderCount][groupSize] = {};
+
+	knet::SocketBindArguments bindArgs;
+	bindArgs.usPort = 6550;
+	bindArgs.szHostAddress = "127.0.0.1";
+	bindArgs.reusePortGroupSize = groupSize;
+
+	for (size_t i = 0; i < groupSize; ++i)
+	{
+		auto receiver = std::make_shared<knet::BerkleySocket>();
+		ASSERT_TRUE(receiver->Bind(bindArgs));
+
+		receiver->GetEventHandler().AddEvent(knet::SocketEvents::RECEIVE, nullptr, [&, i](knet::InternalRecvPacket* pPacket) {
+			++receivedBy[static_cast<uint8_t>(pPacket->buffer[0]) % senderCount][i];
+			++receivedPackets;
+			pPacket->Release();
+			return true;
+		});
+
+		receiver->StartReceiving();
+		receivers.push_back(receiver);
+	}
+
+	std::vector<std::shared_ptr<knet::BerkleySocket>> senders;
+
+	bindArgs.reusePortGroupSize = 0;
+
+	for (size_t i = 0; i < senderCount; ++i)
+	{
+		auto sender = std::make_shared<knet::BerkleySocket>();
+		bindArgs.usPort = static_cast<unsigned short>(6551 + i);
+		ASSERT_TRUE(sender->Bind(bindArgs));
+		senders.push_back(sender);
+	}
+
+	for (int round = 0; round < 10; ++round)
+	{
+		for (size_t i = 0; i < senderCount; ++i)
+		{
+			char payload[32] = {static_cast<char>(i)};
+			senders[i]->Send(receivers[0]->GetSocketAddress(), payload, sizeof(payload));
+		}
+	}
+
+	auto start = std::chrono::system_clock::now();
+
+	while (receivedPackets < 10 * senderCount && std::chrono::system_clock::now() < start + std::chrono::seconds(5))
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+
+	EXPECT_EQ(10 * senderCount, receivedPackets.load());
+
+	// Every sender sticks to a single socket of the group
+	for (size_t i = 0; i < senderCount; ++i)
+	{
+		size_t receivingSockets = 0;
+
+		for (size_t j = 0; j < groupSize; ++j)
+		{
+			if (receivedBy[i][j] > 0)
+				++receivingSockets;
+		}
+
+		EXPECT_EQ(1u, receivingSockets);
+	}
+
+	for (auto &receiver : receivers)
+	{
+		receiver->StopReceiving(true);
+		receiver->GetEventHandler().RemoveEventsByOwner(nullptr);
+	}
+}
+
+TEST(SocketTests, KernelTimestamps)
+{
+	auto receiver = std::make_shared<knet::BerkleySocket>();
+	auto sender = std::make_shared<knet::BerkleySocket>();
+
+	knet::SocketBindArguments bindArgs;
+	bindArgs.usPort = 6574;
+	bindArgs.szHostAddress = "127.0.0.1";
+	bindArgs.receiveBatchSize = 8;
+	bindArgs.kernelTimestamps = true;
+
+	ASSERT_TRUE(receiver->Bind(bindArgs));
+
+	bindArgs.usPort = 6575;
+	bindArgs.sendBatchSize = 8;
+	bindArgs.segmentationOffload = false; // One transmit timestamp per datagram
+
+	ASSERT_TRUE(sender->Bind(bindArgs));
+
+	std::atomic<size_t> receivedPackets{0};
+	std::atomic<size_t> orderedTimeStamps{0};
+
+	receiver->GetEventHandler().AddEvent(knet::SocketEvents::RECEIVE_BATCH, nullptr, [&](knet::InternalRecvPacket** ppPackets, size_t count) {
+		for (size_t i = 0; i < count; ++i)
+		{
+			if (ppPackets[i]->kernelTimeStamp <= ppPackets[i]->timeStamp)
+				++orderedTimeStamps;
+
+			ppPackets[i]->Release();
+		}
+
+		receivedPackets += count;
+		return true;
+	});
+
+	receiver->StartReceiving();
+
+	// The kernel turns timestamping on from a work queue, datagrams arriving before that carry none
+	std::this_thread::sleep_for(std::chrono::milliseconds(50));
+
+	const char payload[64] = {0};
+
+	for (int i = 0; i < 32; ++i)
+		sender->Send(receiver->GetSocketAddress(), payload, sizeof(payload));
+
+	sender->Flush();
+
+	auto start = std::chrono::system_clock::now();
+
+	// Flush also collects the transmit timestamps
+	while ((receivedPackets < 32 || sender->GetStatistics().timestampedSends < 32) && std::chrono::system_clock::now() < start + std::chrono::seconds(5))
+	{
+		sender->Flush();
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+	}
+
+	size_t received = receivedPackets.load();
+	size_t ordered = orderedTimeStamps.load();
+	auto receiverStatistics = receiver->GetStatistics();
+	auto senderStatistics = sender->GetStatistics();
+
+	receiver->StopReceiving(true);
+	receiver->GetEventHandler().RemoveEventsByOwner(nullptr);
+
+	EXPECT_EQ(32u, received);
+	EXPECT_EQ(received, ordered);
+
+	EXPECT_GE(receiverStatistics.timestampedReceives, 32u);
+	EXPECT_GE(receiverStatistics.maxReceiveDelay, receiverStatistics.averageReceiveDelay);
+
+	EXPECT_EQ(32u, senderStatistics.timestampedSends);
+	EXPECT_GE(senderStatistics.maxSendDelay, senderStatistics.averageSendDelay);
+}
+
+TEST(SocketTests, DualStackReceive)
+{
+	auto receiver = std::make_shared<knet::BerkleySocket>();
+	auto sender4 = std::make_shared<knet::BerkleySocket>();
+	auto sender6 = std::make_shared<knet::BerkleySocket>();
+
+	knet::SocketBindArguments bindArgs;
+	bindArgs.usPort = 6576;
+	bindArgs.addressFamily = AF_INET6;
+	bindArgs.receiveBatchSize = 8;
+
+	ASSERT_TRUE(receiver->Bind(bindArgs));
+
+	bindArgs.usPort = 6577;
+	bindArgs.addressFamily = AF_INET;
+	bindArgs.szHostAddress = "127.0.0.1";
+
+	ASSERT_TRUE(sender4->Bind(bindArgs));
+
+	bindArgs.usPort = 6578;
+	bindArgs.szHostAddress = "::1";
+
+	ASSERT_TRUE(sender6->Bind(bindArgs));
+
+	std::mutex receivedMutex;
+	std::vector<knet::SocketAddress> received;
+
+	receiver->GetEventHandler().AddEvent(knet::SocketEvents::RECEIVE, nullptr, [&](knet::InternalRecvPacket* pPacket) {
+		std::lock_guard<std::mutex> lock{receivedMutex};
+		received.push_back(pPacket->remoteAddress);
+		pPacket->Release();
+		return true;
+	});
+
+	receiver->StartReceiving();
+
+	knet::SocketAddress target4;
+	target4.SetHost("127.0.0.1");
+	target4.SetPort(6576);
+
+	knet::SocketAddress target6;
+	target6.SetHost("::1");
+	target6.SetPort(6576);
+
+	const char payload[16] = {0};
+
+	EXPECT_TRUE(sender4->Send(target4, payload, sizeof(payload)));
+	EXPECT_TRUE(sender6->Send(target6, payload, sizeof(payload)));
+
+	// An IPv4 socket can not reach an IPv6 remote
+	EXPECT_FALSE(sender4->Send(target6, payload, sizeof(payload)));
+
+	auto start = std::chrono::system_clock::now();
+
+	while (std::chrono::system_clock::now() < start + std::chrono::seconds(5))
+	{
+		{
+			std::lock_guard<std::mutex> lock{receivedMutex};
+
+			if (received.size() >= 2)
+				break;
+		}
+
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+	}
+
+	decltype(received) remotes;
+
+	{
+		std::lock_guard<std::mutex> lock{receivedMutex};
+		remotes = received;
+	}
+
+	receiver->StopReceiving(true);
+	receiver->GetEventHandler().RemoveEventsByOwner(nullptr);
+
+	ASSERT_EQ(2u, remotes.size());
+
+	// The IPv4 sender arrives mapped and still equals its own IPv4 address
+	EXPECT_TRUE(std::find(remotes.begin(), remotes.end(), sender4->GetSocketAddress()) != remotes.end());
+	EXPECT_TRUE(std::find(remotes.begin(), remotes.end(), sender6->GetSocketAddress()) != remotes.end());
+}
+#endif
+
+static knet::InternalRecvPacket * MakeReliableDatagram(const knet::SocketAddress &from, knet::SequenceNumberType sequenceNumber, int orderedIndex = -1, uint32_t connectionId = 0)
+{
+	char payload[8] = {0};
+	memcpy(payload, &orderedIndex, sizeof(orderedIndex));
+
+	knet::DatagramPacket datagram;
+	datagram.header.isACK = false;
+	datagram.header.isNACK = false;
+	datagram.header.isReliable = true;
+	datagram.header.sequenceNumber = sequenceNumber;
+	datagram.header.hasConnectionId = connectionId != 0;
+	datagram.header.connectionId = connectionId;
+
+	knet::ReliablePacket packet{payload, sizeof(payload)};
+	packet.reliability = knet::PacketReliability::RELIABLE;
+
+	if (orderedIndex >= 0)
+	{
+		packet.reliability = knet::PacketReliability::RELIABLE_ORDERED;
+		packet.orderedInfo.index = static_cast<knet::OrderedIndexType>(orderedIndex);
+		packet.orderedInfo.channel = 0;
+	}
+
+	datagram.packets.push_back(std::move(packet));
+
+	knet::BitStream bitStream{knet::MAX_MTU_SIZE};
+	datagram.Serialize(bitStream);
+
+	auto pPacket = knet::InternalRecvPacket::Acquire();
+	memcpy(pPacket->buffer, bitStream.Data(), bitStream.Size());
+	pPacket->bytesRead = bitStream.Size();
+	pPacket->remoteAddress = from;
+
+	return pPacket;
+}
+
+static knet::InternalRecvPacket * MakeAckDatagram(const knet::SocketAddress &from, uint32_t connectionId)
+{
+	knet::BitStream bitStream{ 64 };
+
+	knet::DatagramHeader dh;
+	dh.isACK = true;
+	dh.isNACK = false;
+	dh.isReliable = false;
+	dh.hasConnectionId = connectionId != 0;
+	dh.connectionId = connectionId;
+	dh.Serialize(bitStream);
+
+	// Acknowledges a datagram which was never sent
+	knet::internal::AckWindow acks;
+	knet::SequenceNumberType newest = 0;
+	acks.Add(0);
+	acks.Write(bitStream, knet::MAX_MTU_SIZE, newest);
+	bitStream.Write<uint32_t>(std::numeric_limits<uint32_t>::max()); // No ack delay
+
+	auto pPacket = knet::InternalRecvPacket::Acquire();
+	memcpy(pPacket->buffer, bitStream.Data(), bitStream.Size());
+	pPacket->bytesRead = bitStream.Size();
+	pPacket->remoteAddress = from;
+
+	return pPacket;
+}
+
+TEST(SocketTests, ConnectionMigration)
+{
+	const uint32_t connectionId = knet::MakeConnectionId(5, 3);
+
+	knet::SocketAddress first, second, third;
+	first.SetHost("127.0.0.1");
+	first.SetPort(40000);
+	second.SetHost("127.0.0.1");
+	second.SetPort(40001);
+	third.SetHost("::1");
+	third.SetPort(40002);
+
+	// The steering program and the peer read the id without deserializing
+	auto pPacket = MakeAckDatagram(second, connectionId);
+	uint32_t peeked = 0;
+	EXPECT_TRUE(knet::DatagramHeader::PeekConnectionId(pPacket->buffer, pPacket->bytesRead, peeked));
+	EXPECT_EQ(connectionId, peeked);
+	EXPECT_EQ(5u, knet::GetConnectionSlot(peeked));
+	pPacket->Release();
+
+	knet::ReliabilityLayer layer;
+	layer.SetRemoteAddress(first);
+	layer.SetLocalConnectionId(connectionId);
+
+	std::vector<std::pair<knet::SocketAddress, knet::SocketAddress>> changes;
+
+	layer.GetEventHandler().AddEvent(knet::ReliabilityEvents::ADDRESS_CHANGED, &changes, [&changes](knet::SocketAddress oldAddress, knet::SocketAddress newAddress) {
+		changes.emplace_back(oldAddress, newAddress);
+		return true;
+	});
+
+	layer.OnReceive(MakeAckDatagram(first, 0));
+	layer.Process();
+	EXPECT_TRUE(changes.empty());
+
+	layer.OnReceive(MakeReliableDatagram(first, 5));
+	layer.Process();
+
+	// Only a datagram newer than everything received moves the remote, a replayed one or an ack does not
+	layer.OnReceive(MakeReliableDatagram(second, 3, -1, connectionId));
+	layer.OnReceive(MakeReliableDatagram(second, 5, -1, connectionId));
+	layer.OnReceive(MakeAckDatagram(second, connectionId));
+	layer.Process();
+
+	EXPECT_TRUE(changes.empty());
+	EXPECT_EQ(first, layer.GetRemoteAddress());
+
+	// The known id moves the remote to its new address
+	auto pMoved = MakeReliableDatagram(second, 6, -1, connectionId);
+	knet::SequenceNumberType peekedSequence = 0;
+	EXPECT_TRUE(knet::DatagramHeader::PeekSequenceNumber(pMoved->buffer, pMoved->bytesRead, peekedSequence));
+	EXPECT_EQ(6, peekedSequence);
+
+	layer.OnReceive(pMoved);
+	layer.Process();
+
+	ASSERT_EQ(1u, changes.size());
+	EXPECT_EQ(first, changes[0].first);
+	EXPECT_EQ(second, changes[0].second);
+	EXPECT_EQ(second, layer.GetRemoteAddress());
+
+	// Another id does not
+	layer.OnReceive(MakeReliableDatagram(third, 7, -1, knet::MakeConnectionId(5, 4)));
+	layer.Process();
+
+	EXPECT_EQ(1u, changes.size());
+	EXPECT_EQ(second, layer.GetRemoteAddress());
+}
+
+TEST(SocketTests, RttEstimator)
+{
+	using namespace std::chrono;
+
+	knet::internal::RttEstimator estimator;
+
+	// No sample yet, the initial timeout
+	EXPECT_FALSE(estimator.HasSample());
+	EXPECT_EQ(nanoseconds(seconds(1)), estimator.GetTimeout());
+
+	estimator.AddSample(milliseconds(100));
+	EXPECT_EQ(nanoseconds(milliseconds(100)), estimator.GetSmoothedRtt());
+	EXPECT_EQ(nanoseconds(milliseconds(50)), estimator.GetRttVariance());
+	EXPECT_EQ(nanoseconds(milliseconds(300)), estimator.GetTimeout());
+	EXPECT_EQ(nanoseconds(milliseconds(800)), estimator.GetTimeout(milliseconds(500)));
+
+	// srtt += (sample - srtt) / 8, rttvar += (|srtt - sample| - rttvar) / 4
+	estimator.AddSample(milliseconds(180));
+	EXPECT_EQ(nanoseconds(milliseconds(110)), estimator.GetSmoothedRtt());
+	EXPECT_EQ(nanoseconds(microseconds(57500)), estimator.GetRttVariance());
+
+	// Each timeout doubles until the maximum, a new sample resets it
+	auto timeout = estimator.GetTimeout();
+	estimator.Backoff();
+	EXPECT_EQ(2 * timeout, estimator.GetTimeout());
+	estimator.Backoff();
+	EXPECT_EQ(4 * timeout, estimator.GetTimeout());
+
+	for (int i = 0; i < 10; ++i)
+		estimator.Backoff();
+
+	EXPECT_EQ(nanoseconds(seconds(10)), estimator.GetTimeout());
+
+	estimator.AddSample(milliseconds(110));
+	EXPECT_EQ(nanoseconds(microseconds(282500)), estimator.GetTimeout());
+
+	// Tiny round trips stay above the minimum
+	knet::internal::RttEstimator loopback;
+	loopback.AddSample(microseconds(50));
+	EXPECT_EQ(nanoseconds(milliseconds(100)), loopback.GetTimeout());
+}
+
+TEST(SocketTests, GapTracker)
+{
+	knet::internal::GapTracker tracker;
+	std::vector<knet::internal::GapTracker::Range> lost;
+
+	for (int32_t sequenceNumber : {0, 1, 3, 4, 8})
+		tracker.OnReceive(sequenceNumber);
+
+	// 2 was overtaken by enough datagrams, 5 to 7 may still be on their way
+	EXPECT_EQ(1u, tracker.TakeLost(lost));
+	ASSERT_EQ(1u, lost.size());
+	EXPECT_EQ(2, lost[0].first);
+	EXPECT_EQ(2, lost[0].second);
+
+	// A late datagram splits its gap, reported gaps are not reported again
+	tracker.OnReceive(6);
+	tracker.OnReceive(11);
+
+	lost.clear();
+	EXPECT_EQ(2u, tracker.TakeLost(lost));
+	ASSERT_EQ(2u, lost.size());
+	EXPECT_EQ(5, lost[0].first);
+	EXPECT_EQ(5, lost[0].second);
+	EXPECT_EQ(7, lost[1].first);
+	EXPECT_EQ(7, lost[1].second);
+
+	// Filled gaps are never reported
+	tracker.OnReceive(9);
+	tracker.OnReceive(10);
+	tracker.OnReceive(20);
+	tracker.OnReceive(23);
+
+	lost.clear();
+	EXPECT_EQ(1u, tracker.TakeLost(lost));
+	EXPECT_EQ(12, lost[0].first);
+	EXPECT_EQ(19, lost[0].second);
+	EXPECT_EQ(1u, tracker.GetMissingRanges());
+
+	tracker.SetReorderThreshold(0);
+	tracker.OnReceive(30);
+	lost.clear();
+	EXPECT_EQ(0u, tracker.TakeLost(lost));
+
+	// Gaps across the wrap to 0 are found and filled like any other
+	const int32_t last = std::numeric_limits<int32_t>::max();
+
+	knet::internal::GapTracker wrapping;
+
+	for (int32_t sequenceNumber : {last - 3, last - 2, 1, 2, 3, 4})
+		wrapping.OnReceive(sequenceNumber);
+
+	EXPECT_EQ(4, wrapping.GetHighest());
+	EXPECT_EQ(1u, wrapping.GetMissingRanges());
+
+	wrapping.OnReceive(last);
+
+	lost.clear();
+	EXPECT_EQ(2u, wrapping.TakeLost(lost));
+	ASSERT_EQ(2u, lost.size());
+	EXPECT_EQ(last - 1, lost[0].first);
+	EXPECT_EQ(last - 1, lost[0].second);
+	EXPECT_EQ(0, lost[1].first);
+	EXPECT_EQ(0, lost[1].second);
+}
+
+TEST(SocketTests, SelectiveAck)
+{
+	using Ranges = std::vector<knet::internal::AckWindow::Range>;
+
+	auto roundTrip = [](knet::internal::AckWindow &window, size_t maxBytes, Ranges &ranges, size_t &bytes) {
+		knet::BitStream bitStream{knet::MAX_MTU_SIZE};
+		knet::SequenceNumberType newest = 0;
+
+		size_t written = window.Write(bitStream, maxBytes, newest);
+		bytes = bitStream.Size();
+
+		knet::BitStream reader{reinterpret_cast<unsigned char*>(bitStream.Data()), bitStream.Size(), true};
+		EXPECT_TRUE(knet::internal::AckWindow::Read(reader, ranges));
+
+		return written;
+	};
+
+	// Every third datagram lost, a bitmap of 300 bits beats 100 ranges
+	knet::internal::AckWindow scattered;
+
+	for (int32_t sequenceNumber = 1000; sequenceNumber < 1300; ++sequenceNumber)
+	{
+		if (sequenceNumber % 3 != 0)
+			EXPECT_TRUE(scattered.Add(sequenceNumber));
+	}
+
+	// Duplicates are only acknowledged once
+	EXPECT_TRUE(scattered.Add(1001));
+	EXPECT_EQ(200u, scattered.Size());
+
+	Ranges ranges;
+	size_t bytes = 0;
+
+	EXPECT_EQ(200u, roundTrip(scattered, knet::MAX_MTU_SIZE, ranges, bytes));
+	EXPECT_TRUE(scattered.Empty());
+	EXPECT_LT(bytes, 50u);
+
+	ASSERT_EQ(100u, ranges.size());
+	EXPECT_EQ(1000, ranges[0].first);
+	EXPECT_EQ(1001, ranges[0].second);
+	EXPECT_EQ(1297, ranges.back().first);
+	EXPECT_EQ(1298, ranges.back().second);
+
+	// A long run with a single hole, in any order, takes a few run lengths
+	knet::internal::AckWindow runs;
+
+	for (int32_t sequenceNumber = 5000; sequenceNumber >= 0; --sequenceNumber)
+	{
+		if (sequenceNumber != 2500)
+			EXPECT_TRUE(runs.Add(sequenceNumber));
+	}
+
+	ranges.clear();
+	EXPECT_EQ(5000u, roundTrip(runs, knet::MAX_MTU_SIZE, ranges, bytes));
+	EXPECT_LT(bytes, 16u);
+	EXPECT_EQ((Ranges{{0, 2499}, {2501, 5000}}), ranges);
+
+	// Too little room for everything, the rest stays for the next ack
+	knet::internal::AckWindow split;
+
+	for (int32_t sequenceNumber = 0; sequenceNumber < 200; sequenceNumber += 2)
+		split.Add(sequenceNumber);
+
+	ranges.clear();
+	size_t first = roundTrip(split, 16, ranges, bytes);
+	EXPECT_GT(first, 0u);
+	EXPECT_LT(first, 100u);
+	EXPECT_LE(bytes, 16u);
+	EXPECT_EQ(first, ranges.size());
+	EXPECT_EQ(100u - first, split.Size());
+
+	ranges.clear();
+	while (!split.Empty())
+		roundTrip(split, 16, ranges, bytes);
+
+	EXPECT_EQ(100u - first, ranges.size());
+	EXPECT_EQ(198, ranges.back().first);
+
+	// Wrapping around the sequence number space
+	knet::internal::AckWindow wrapping;
+	const int32_t last = std::numeric_limits<int32_t>::max();
+
+	wrapping.Add(1);
+	wrapping.Add(last);
+	wrapping.Add(0);
+
+	ranges.clear();
+	EXPECT_EQ(3u, roundTrip(wrapping, knet::MAX_MTU_SIZE, ranges, bytes));
+	ASSERT_EQ(1u, ranges.size());
+	EXPECT_EQ(last, ranges[0].first);
+	EXPECT_EQ(1, ranges[0].second);
+
+	// More than a window apart
+	EXPECT_TRUE(wrapping.Add(0));
+	EXPECT_FALSE(wrapping.Add(static_cast<int32_t>(knet::internal::AckWindow::maxCapacity)));
+
+	EXPECT_TRUE(knet::internal::AckWindow::IsAfter(0, last));
+	EXPECT_FALSE(knet::internal::AckWindow::IsAfter(last, 0));
+	EXPECT_FALSE(knet::internal::AckWindow::IsAfter(1, 1));
+}
+
+TEST(SocketTests, SequenceRing)
+{
+	knet::internal::SequenceRing<int> ring{4};
+
+	for (int32_t sequenceNumber = 10; sequenceNumber < 16; ++sequenceNumber)
+		ring.Insert(sequenceNumber, sequenceNumber * 2);
+
+	// Six outstanding entries grew it
+	EXPECT_EQ(6u, ring.Size());
+	EXPECT_EQ(8u, ring.Capacity());
+	ASSERT_NE(nullptr, ring.Find(12));
+	EXPECT_EQ(24, *ring.Find(12));
+	EXPECT_EQ(nullptr, ring.Find(9));
+	EXPECT_EQ(nullptr, ring.Find(16));
+
+	// Erasing out of order keeps the others, the oldest moves up once it is gone
+	EXPECT_TRUE(ring.Erase(12));
+	EXPECT_FALSE(ring.Erase(12));
+	EXPECT_TRUE(ring.Erase(10));
+	EXPECT_EQ(4u, ring.Size());
+
+	int32_t min = 0;
+	int32_t max = 100;
+	ASSERT_TRUE(ring.Clamp(min, max));
+	EXPECT_EQ(11, min);
+	EXPECT_EQ(15, max);
+
+	min = 20;
+	max = 30;
+	EXPECT_FALSE(ring.Clamp(min, max));
+
+	std::vector<int32_t> visited;
+	ring.ForEach([&visited](int32_t sequenceNumber, int &) {
+		visited.push_back(sequenceNumber);
+		return true;
+	});
+	EXPECT_EQ((std::vector<int32_t>{11, 13, 14, 15}), visited);
+
+	// Wrapping around the sequence number space
+	knet::internal::SequenceRing<int> wrapping{4};
+	const int32_t last = std::numeric_limits<int32_t>::max();
+
+	wrapping.Insert(last - 1, 1);
+	wrapping.Insert(last, 2);
+	wrapping.Insert(0, 3);
+	wrapping.Insert(1, 4);
+
+	EXPECT_EQ(4u, wrapping.Capacity());
+	EXPECT_EQ(3, *wrapping.Find(0));
+
+	min = last;
+	max = 0;
+	ASSERT_TRUE(wrapping.Clamp(min, max));
+	EXPECT_EQ(last, min);
+	EXPECT_EQ(0, max);
+
+	EXPECT_TRUE(wrapping.Erase(last - 1));
+	EXPECT_TRUE(wrapping.Erase(last));
+	EXPECT_EQ(4, *wrapping.Find(1));
+	EXPECT_EQ(nullptr, wrapping.Find(last));
+}
+
+// A negative ordered index sends a RELIABLE message, otherwise a RELIABLE_ORDERED one on channel 0 which carries its index
+TEST(SocketTests, NackOnGap)
+{
+	auto socket = std::make_shared<knet::BerkleySocket>();
+	auto remoteSocket = std::make_shared<knet::BerkleySocket>();
+
+	knet::SocketBindArguments bindArgs;
+	bindArgs.usPort = 6586;
+	bindArgs.szHostAddress = "127.0.0.1";
+
+	ASSERT_TRUE(socket->Bind(bindArgs));
+
+	bindArgs.usPort = 6587;
+
+	ASSERT_TRUE(remoteSocket->Bind(bindArgs));
+
+	std::mutex receivedMutex;
+	std::vector<std::vector<char>> received;
+
+	remoteSocket->GetEventHandler().AddEvent(knet::SocketEvents::RECEIVE, nullptr, [&](knet::InternalRecvPacket* pPacket) {
+		std::lock_guard<std::mutex> lock{receivedMutex};
+		received.emplace_back(pPacket->buffer, pPacket->buffer + pPacket->bytesRead);
+		pPacket->Release();
+		return true;
+	});
+
+	remoteSocket->StartReceiving();
+
+	auto remote = remoteSocket->GetSocketAddress();
+
+	knet::ReliabilityLayer layer{socket};
+	layer.SetRemoteAddress(remote);
+
+	// 3 got lost, 4 to 6 overtake it
+	for (knet::SequenceNumberType sequenceNumber : {0, 1, 2, 4, 5, 6})
+		layer.OnReceive(MakeReliableDatagram(remote, sequenceNumber));
+
+	layer.Process();
+
+	auto start = std::chrono::system_clock::now();
+	std::vector<std::pair<int32_t, int32_t>> nacked;
+
+	while (nacked.empty() && std::chrono::system_clock::now() < start + std::chrono::seconds(5))
+	{
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+
+		std::lock_guard<std::mutex> lock{receivedMutex};
+
+		for (auto &datagram : received)
+		{
+			knet::BitStream bitStream{reinterpret_cast<unsigned char*>(datagram.data()), datagram.size(), true};
+
+			knet::DatagramHeader dh;
+			dh.Deserialize(bitStream);
+
+			if (!dh.isNACK)
+				continue;
+
+			uint32_t count = 0;
+			bitStream.Read(count);
+
+			for (uint32_t i = 0; i < count; ++i)
+			{
+				int32_t min = 0;
+				int32_t max = 0;
+				bitStream.Read(min);
+				bitStream.Read(max);
+				nacked.emplace_back(min, max);
+			}
+		}
+	}
+
+	remoteSocket->StopReceiving(true);
+	remoteSocket->GetEventHandler().RemoveEventsByOwner(nullptr);
+
+	ASSERT_EQ(1u, nacked.size());
+	EXPECT_EQ(3, nacked[0].first);
+	EXPECT_EQ(3, nacked[0].second);
+}
+
+TEST(SocketTests, ForgedNackCount)
+{
+	knet::SocketAddress remote;
+	remote.SetHost("127.0.0.1");
+	remote.SetPort(6619);
+
+	knet::ReliabilityLayer layer;
+	layer.SetRemoteAddress(remote);
+
+	knet::BitStream bitStream{64};
+
+	knet::DatagramHeader dh;
+	dh.isACK = false;
+	dh.isNACK = true;
+	dh.isReliable = false;
+	dh.Serialize(bitStream);
+
+	// Claims four billion ranges but carries one, only what the datagram holds is read
+	bitStream.Write<uint32_t>(std::numeric_limits<uint32_t>::max());
+	bitStream.Write<int32_t>(0);
+	bitStream.Write<int32_t>(0);
+
+	auto pPacket = knet::InternalRecvPacket::Acquire();
+	memcpy(pPacket->buffer, bitStream.Data(), bitStream.Size());
+	pPacket->bytesRead = bitStream.Size();
+	pPacket->remoteAddress = remote;
+
+	layer.OnReceive(pPacket);
+	layer.Process();
+
+	EXPECT_EQ(0u, layer.GetBytesInFlight());
+}
+
+// A nacked datagram is sent again on the next Process, its resend timer starts over
+TEST(SocketTests, NackedDatagramResent)
+{
+	auto socket = std::make_shared<knet::BerkleySocket>();
+	auto remoteSocket = std::make_shared<knet::BerkleySocket>();
+
+	knet::SocketBindArguments bindArgs;
+	bindArgs.usPort = 6622;
+	bindArgs.szHostAddress = "127.0.0.1";
+
+	ASSERT_TRUE(socket->Bind(bindArgs));
+
+	bindArgs.usPort = 6623;
+
+	ASSERT_TRUE(remoteSocket->Bind(bindArgs));
+
+	std::mutex receivedMutex;
+	std::vector<knet::SequenceNumberType> received;
+
+	remoteSocket->GetEventHandler().AddEvent(knet::SocketEvents::RECEIVE, nullptr, [&](knet::InternalRecvPacket* pPacket) {
+		knet::BitStream bitStream{reinterpret_cast<unsigned char*>(pPacket->buffer), pPacket->bytesRead, true};
+
+		knet::DatagramHeader dh;
+		dh.Deserialize(bitStream);
+
+		if (!dh.isACK && !dh.isNACK && dh.isReliable)
+		{
+			std::lock_guard<std::mutex> lock{receivedMutex};
+			received.push_back(dh.sequenceNumber);
+		}
+
+		pPacket->Release();
+		return true;
+	});
+
+	remoteSocket->StartReceiving();
+
+	auto remote = remoteSocket->GetSocketAddress();
+
+	knet::ReliabilityLayer layer{socket};
+	layer.SetRemoteAddress(remote);
+
+	const char payload[16] = {0};
+	ASSERT_TRUE(layer.Send(payload, sizeof(payload), knet::PacketPriority::IMMEDIATE));
+	layer.Process();
+
+	auto waitForDatagrams = [&](size_t count) {
+		auto start = std::chrono::system_clock::now();
+
+		while (std::chrono::system_clock::now() < start + std::chrono::seconds(5))
+		{
+			{
+				std::lock_guard<std::mutex> lock{receivedMutex};
+
+				if (received.size() >= count)
+					return true;
+			}
+
+			std::this_thread::sleep_for(std::chrono::milliseconds(1));
+		}
+
+		return false;
+	};
+
+	ASSERT_TRUE(waitForDatagrams(1));
+
+	knet::SequenceNumberType sent = 0;
+	{
+		std::lock_guard<std::mutex> lock{receivedMutex};
+		sent = received[0];
+	}
+
+	const auto bytesInFlight = layer.GetBytesInFlight();
+	EXPECT_GT(bytesInFlight, 0u);
+
+	// Nothing is lost yet, the layer only wakes up for the resend timer
+	EXPECT_GT(layer.GetNextWakeup(), std::chrono::steady_clock::now());
+
+	knet::BitStream bitStream{64};
+
+	knet::DatagramHeader dh;
+	dh.isACK = false;
+	dh.isNACK = true;
+	dh.isReliable = false;
+	dh.Serialize(bitStream);
+
+	bitStream.Write<uint32_t>(1);
+	bitStream.Write<int32_t>(sent);
+	bitStream.Write<int32_t>(sent);
+
+	auto pPacket = knet::InternalRecvPacket::Acquire();
+	memcpy(pPacket->buffer, bitStream.Data(), bitStream.Size());
+	pPacket->bytesRead = bitStream.Size();
+	pPacket->remoteAddress = remote;
+	pPacket->kernelTimeStamp = std::chrono::steady_clock::now();
+
+	layer.OnReceive(pPacket);
+	layer.Process();
+
+	ASSERT_TRUE(waitForDatagrams(2));
+
+	remoteSocket->StopReceiving(true);
+	remoteSocket->GetEventHandler().RemoveEventsByOwner(nullptr);
+
+	EXPECT_EQ(sent, received[1]);
+	EXPECT_EQ(bytesInFlight, layer.GetBytesInFlight());
+	EXPECT_GT(layer.GetNextWakeup(), std::chrono::steady_clock::now());
+}
+
+TEST(SocketTests, PiggybackedAcks)
+{
+	auto socket = std::make_shared<knet::BerkleySocket>();
+	auto remoteSocket = std::make_shared<knet::BerkleySocket>();
+
+	knet::SocketBindArguments bindArgs;
+	bindArgs.usPort = 6588;
+	bindArgs.szHostAddress = "127.0.0.1";
+
+	ASSERT_TRUE(socket->Bind(bindArgs));
+
+	bindArgs.usPort = 6589;
+
+	ASSERT_TRUE(remoteSocket->Bind(bindArgs));
+
+	std::mutex receivedMutex;
+	std::vector<std::vector<char>> received;
+
+	remoteSocket->GetEventHandler().AddEvent(knet::SocketEvents::RECEIVE, nullptr, [&](knet::InternalRecvPacket* pPacket) {
+		std::lock_guard<std::mutex> lock{receivedMutex};
+		received.emplace_back(pPacket->buffer, pPacket->buffer + pPacket->bytesRead);
+		pPacket->Release();
+		return true;
+	});
+
+	remoteSocket->StartReceiving();
+
+	auto remote = remoteSocket->GetSocketAddress();
+
+	knet::ReliabilityLayer layer{socket};
+	layer.SetRemoteAddress(remote);
+	layer.SetAckDelay(std::chrono::milliseconds(1000));
+
+	EXPECT_EQ(std::chrono::milliseconds(1000), layer.GetAckDelay());
+
+	for (knet::SequenceNumberType sequenceNumber : {0, 1, 2})
+		layer.OnReceive(MakeReliableDatagram(remote, sequenceNumber));
+
+	layer.Process();
+
+	// The acks wait for the reply instead of going out on their own
+	const char payload[16] = {0};
+	layer.Send(payload, sizeof(payload), knet::PacketPriority::MEDIUM, knet::PacketReliability::UNRELIABLE);
+	layer.Process();
+
+	auto start = std::chrono::system_clock::now();
+
+	while (std::chrono::system_clock::now() < start + std::chrono::seconds(5))
+	{
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+
+		std::lock_guard<std::mutex> lock{receivedMutex};
+
+		if (!received.empty())
+			break;
+	}
+
+	// Give a standalone ack the chance to show up as well
+	std::this_thread::sleep_for(std::chrono::milliseconds(50));
+
+	// Stopping wakes the receive thread with a datagram to itself
+	std::vector<std::vector<char>> datagrams;
+
+	{
+		std::lock_guard<std::mutex> lock{receivedMutex};
+		datagrams = received;
+	}
+
+	remoteSocket->StopReceiving(true);
+	remoteSocket->GetEventHandler().RemoveEventsByOwner(nullptr);
+
+	ASSERT_EQ(1u, datagrams.size());
+
+	knet::BitStream bitStream{reinterpret_cast<unsigned char*>(datagrams[0].data()), datagrams[0].size(), true};
+
+	knet::DatagramPacket datagram;
+	datagram.Deserialze(bitStream);
+
+	EXPECT_FALSE(datagram.header.isACK);
+	EXPECT_TRUE(datagram.header.hasAck);
+	ASSERT_EQ(1u, datagram.ackRanges.size());
+	EXPECT_EQ(0, datagram.ackRanges[0].first);
+	EXPECT_EQ(2, datagram.ackRanges[0].second);
+	EXPECT_NE(std::numeric_limits<uint32_t>::max(), datagram.ackDelay);
+	ASSERT_EQ(1u, datagram.packets.size());
+	EXPECT_EQ(sizeof(payload), datagram.packets[0].Size());
+}
+
+TEST(SocketTests, ReorderWindow)
+{
+	using Window = knet::internal::ReorderWindow<int>;
+
+	Window window;
+	std::vector<int> delivered;
+
+	auto deliver = [&](int &value) { delivered.push_back(value); };
+
+	// Nothing is allocated until a message arrives
+	EXPECT_EQ(0u, window.Capacity());
+
+	EXPECT_EQ(Window::InsertResult::Waiting, window.Insert(2, 2));
+	EXPECT_EQ(Window::InsertResult::Waiting, window.Insert(1, 1));
+	EXPECT_EQ(0u, window.Deliver(deliver));
+
+	EXPECT_EQ(Window::InsertResult::Ready, window.Insert(0, 0));
+	EXPECT_EQ(Window::InsertResult::Duplicate, window.Insert(0, 0));
+	EXPECT_EQ(3u, window.Deliver(deliver));
+	EXPECT_EQ(std::vector<int>({0, 1, 2}), delivered);
+	EXPECT_EQ(3, window.GetExpected());
+
+	// Delivered ones and ones more than half the index range ahead are duplicates
+	EXPECT_EQ(Window::InsertResult::Duplicate, window.Insert(1, 1));
+	EXPECT_EQ(Window::InsertResult::Duplicate, window.Insert(3 + 32768, 0));
+
+	// A large gap grows the slots, the waiting messages keep their place
+	EXPECT_EQ(Window::InsertResult::Waiting, window.Insert(5, 5));
+	EXPECT_EQ(Window::InsertResult::Waiting, window.Insert(1000, 1000));
+	EXPECT_GE(window.Capacity(), 998u);
+	EXPECT_EQ(2u, window.Size());
+
+	delivered.clear();
+
+	for (int index = 3; index < 1000; ++index)
+	{
+		if (index != 5)
+			window.Insert(static_cast<uint16_t>(index), std::move(index));
+	}
+
+	EXPECT_EQ(998u, window.Deliver(deliver));
+	EXPECT_EQ(3, delivered.front());
+	EXPECT_EQ(1000, delivered.back());
+	EXPECT_TRUE(std::is_sorted(delivered.begin(), delivered.end()));
+	EXPECT_TRUE(window.Empty());
+
+	// The indices wrap around
+	for (int index = 1001; index <= 65535; ++index)
+	{
+		EXPECT_EQ(Window::InsertResult::Ready, window.Insert(static_cast<uint16_t>(index), std::move(index)));
+		window.Deliver(deliver);
+	}
+
+	delivered.clear();
+
+	EXPECT_EQ(Window::InsertResult::Waiting, window.Insert(1, 1));
+	EXPECT_EQ(Window::InsertResult::Duplicate, window.Insert(65535, 65535));
+	EXPECT_EQ(Window::InsertResult::Ready, window.Insert(0, 0));
+	EXPECT_EQ(2u, window.Deliver(deliver));
+	EXPECT_EQ(std::vector<int>({0, 1}), delivered);
+}
+
+TEST(SocketTests, OrderedDelivery)
+{
+	auto socket = std::make_shared<knet::BerkleySocket>();
+
+	knet::SocketBindArguments bindArgs;
+	bindArgs.usPort = 6590;
+	bindArgs.szHostAddress = "127.0.0.1";
+
+	ASSERT_TRUE(socket->Bind(bindArgs));
+
+	// Nobody listens there, only the acks go out
+	knet::SocketAddress remote;
+	remote.SetHost("127.0.0.1");
+	remote.SetPort(6591);
+
+	knet::ReliabilityLayer layer{socket};
+	layer.SetRemoteAddress(remote);
+
+	std::vector<int> delivered;
+
+	layer.GetEventHandler().AddEvent(knet::ReliabilityEvents::HANDLE_PACKET, nullptr, [&](knet::ReliablePacket &packet, knet::SocketAddress &) {
+		int index = 0;
+		memcpy(&index, packet.Data(), sizeof(index));
+		delivered.push_back(index);
+		return true;
+	});
+
+	// The datagram carrying message 1 got resent, 2 and 3 overtook it and 2 arrived twice
+	layer.OnReceive(MakeReliableDatagram(remote, 0, 0));
+	layer.OnReceive(MakeReliableDatagram(remote, 2, 2));
+	layer.OnReceive(MakeReliableDatagram(remote, 3, 3));
+	layer.OnReceive(MakeReliableDatagram(remote, 4, 2));
+	layer.Process();
+
+	EXPECT_EQ(std::vector<int>({0}), delivered);
+
+	layer.OnReceive(MakeReliableDatagram(remote, 5, 1));
+	layer.Process();
+
+	EXPECT_EQ(std::vector<int>({0, 1, 2, 3}), delivered);
+
+	layer.GetEventHandler().RemoveEventsByOwner(nullptr);
+}
+
+static knet::ReliablePacket MakeFragment(const std::vector<char> &message, uint16_t packetIndex, uint16_t fragmentSize, uint16_t index)
+{
+	const size_t offset = static_cast<size_t>(index) * fragmentSize;
+
+	knet::ReliablePacket fragment{message.data() + offset, std::min<size_t>(fragmentSize, message.size() - offset)};
+	fragment.isSplit = true;
+	fragment.reliability = index == 0 ? knet::PacketReliability::RELIABLE_ORDERED : knet::PacketReliability::RELIABLE;
+	fragment.orderedInfo.index = 7;
+	fragment.orderedInfo.channel = 2;
+	fragment.splitInfo.messageSize = static_cast<uint32_t>(message.size());
+	fragment.splitInfo.index = index;
+	fragment.splitInfo.packetIndex = packetIndex;
+	fragment.splitInfo.fragmentSize = fragmentSize;
+
+	return fragment;
+}
+
+TEST(SocketTests, SequencedChannels)
+{
+	auto socket = std::make_shared<knet::BerkleySocket>();
+
+	knet::SocketBindArguments bindArgs;
+	bindArgs.usPort = 6620;
+	bindArgs.szHostAddress = "127.0.0.1";
+
+	ASSERT_TRUE(socket->Bind(bindArgs));
+
+	// Nobody listens there, only the acks go out
+	knet::SocketAddress remote;
+	remote.SetHost("127.0.0.1");
+	remote.SetPort(6621);
+
+	knet::ReliabilityLayer layer{socket};
+	layer.SetRemoteAddress(remote);
+
+	std::vector<size_t> delivered;
+
+	layer.GetEventHandler().AddEvent(knet::ReliabilityEvents::HANDLE_PACKET, nullptr, [&](knet::ReliablePacket &packet, knet::SocketAddress &) {
+		delivered.push_back(packet.Size());
+		return true;
+	});
+
+	auto receive = [&](knet::DatagramPacket &datagram) {
+		knet::BitStream bitStream{knet::MAX_MTU_SIZE};
+		datagram.Serialize(bitStream);
+
+		auto pPacket = knet::InternalRecvPacket::Acquire();
+		memcpy(pPacket->buffer, bitStream.Data(), bitStream.Size());
+		pPacket->bytesRead = bitStream.Size();
+		pPacket->remoteAddress = remote;
+
+		layer.OnReceive(pPacket);
+		layer.Process();
+	};
+
+	auto sendSequenced = [&](knet::OrderedChannelType channel, knet::SequenceIndexType index, size_t size) {
+		std::vector<char> payload(size);
+
+		knet::DatagramPacket datagram;
+		datagram.header.isACK = false;
+		datagram.header.isNACK = false;
+		datagram.header.isReliable = false;
+
+		knet::ReliablePacket packet{payload.data(), payload.size()};
+		packet.reliability = knet::PacketReliability::UNRELIABLE_SEQUENCED;
+		packet.sequenceInfo.index = index;
+		packet.sequenceInfo.channel = channel;
+		datagram.packets.push_back(std::move(packet));
+
+		receive(datagram);
+	};
+
+	// Every channel has its own sequence, an old index on one does not hide a new one on another
+	sendSequenced(1, 5, 10);
+	sendSequenced(2, 0, 20);
+	sendSequenced(1, 3, 30);
+	sendSequenced(255, 0, 40);
+
+	EXPECT_EQ(std::vector<size_t>({10, 20, 40}), delivered);
+
+	// A split message is filtered by the channel its first fragment carried
+	std::vector<char> message(3000);
+
+	for (uint16_t index = 0; index < 3; ++index)
+	{
+		knet::DatagramPacket datagram;
+		datagram.header.isACK = false;
+		datagram.header.isNACK = false;
+		datagram.header.isReliable = true;
+		datagram.header.isSplit = true;
+		datagram.header.sequenceNumber = index;
+
+		auto fragment = MakeFragment(message, 1, 1200, index);
+
+		if (index == 0)
+		{
+			fragment.reliability = knet::PacketReliability::RELIABLE_SEQUENCED;
+			fragment.sequenceInfo.index = 1;
+			fragment.sequenceInfo.channel = 2;
+		}
+
+		datagram.packets.push_back(std::move(fragment));
+		receive(datagram);
+	}
+
+	EXPECT_EQ(std::vector<size_t>({10, 20, 40, 3000}), delivered);
+
+	layer.GetEventHandler().RemoveEventsByOwner(nullptr);
+}
+
+TEST(SocketTests, ReassemblyBuffer)
+{
+	auto now = std::chrono::steady_clock::now();
+
+	std::vector<char> message(2500);
+
+	for (size_t i = 0; i < message.size(); ++i)
+		message[i] = static_cast<char>(i * 7);
+
+	knet::internal::ReassemblyBuffer buffer;
+	knet::ReliablePacket complete;
+
+	// The last fragment arrives first and already sizes the whole message
+	auto last = MakeFragment(message, 1, 1000, 2);
+	EXPECT_FALSE(buffer.Add(last, complete, now));
+	EXPECT_EQ(1u, buffer.Size());
+	EXPECT_EQ(message.size(), buffer.GetBytes());
+
+	auto duplicate = MakeFragment(message, 1, 1000, 2);
+	EXPECT_FALSE(buffer.Add(duplicate, complete, now));
+
+	// A fragment which does not match its offset is dropped
+	auto truncated = MakeFragment(message, 1, 1000, 1);
+	truncated.splitInfo.index = 2;
+	EXPECT_FALSE(buffer.Add(truncated, complete, now));
+
+	auto first = MakeFragment(message, 1, 1000, 0);
+	auto middle = MakeFragment(message, 1, 1000, 1);
+	EXPECT_FALSE(buffer.Add(first, complete, now));
+	ASSERT_TRUE(buffer.Add(middle, complete, now));
+
+	// The first fragment tells how to deliver it
+	EXPECT_TRUE(buffer.Empty());
+	EXPECT_EQ(0u, buffer.GetBytes());
+	EXPECT_EQ(knet::PacketReliability::RELIABLE_ORDERED, complete.reliability);
+	EXPECT_EQ(7, complete.orderedInfo.index);
+	EXPECT_EQ(2, complete.orderedInfo.channel);
+	ASSERT_EQ(message.size(), complete.Size());
+	EXPECT_EQ(0, memcmp(message.data(), complete.Data(), message.size()));
+
+	// Messages beyond the memory limit are dropped, unfinished ones time out
+	buffer.SetMemoryLimit(4000);
+	buffer.SetTimeout(std::chrono::milliseconds(100));
+
+	auto fragment = MakeFragment(message, 2, 1000, 0);
+	EXPECT_FALSE(buffer.Add(fragment, complete, now));
+
+	fragment = MakeFragment(message, 3, 1000, 0);
+	EXPECT_FALSE(buffer.Add(fragment, complete, now));
+	EXPECT_EQ(1u, buffer.Size());
+	EXPECT_EQ(1u, buffer.GetDropped());
+
+	EXPECT_EQ(0u, buffer.Expire(now + std::chrono::milliseconds(50)));
+	EXPECT_EQ(1u, buffer.Expire(now + std::chrono::milliseconds(100)));
+	EXPECT_TRUE(buffer.Empty());
+	EXPECT_EQ(0u, buffer.GetBytes());
+	EXPECT_EQ(2u, buffer.GetDropped());
+
+	// Room again once the old one expired
+	fragment = MakeFragment(message, 3, 1000, 0);
+	EXPECT_FALSE(buffer.Add(fragment, complete, now));
+	EXPECT_EQ(1u, buffer.Size());
+}
+
+TEST(SocketTests, SplitAndStreamInfoWireFormat)
+{
+	std::vector<char> message(3000, 'x');
+
+	auto fragment = MakeFragment(message, 5, 1200, 2);
+	fragment.splitInfo.isEnd = true;
+
+	knet::BitStream bitStream{knet::MAX_MTU_SIZE};
+	fragment.Serialize(bitStream);
+
+	// The fields are packed, none of the struct's padding goes on the wire
+	EXPECT_EQ(1u + 11u + 2u + 600u, bitStream.Size());
+	EXPECT_EQ(fragment.GetSizeToSend(), bitStream.Size());
+
+	knet::ReliablePacket readFragment;
+	readFragment.isSplit = true;
+
+	knet::BitStream fragmentReader{reinterpret_cast<unsigned char*>(bitStream.Data()), bitStream.Size(), true};
+	readFragment.Deserialize(fragmentReader);
+
+	EXPECT_EQ(3000u, readFragment.splitInfo.messageSize);
+	EXPECT_EQ(2, readFragment.splitInfo.index);
+	EXPECT_EQ(5, readFragment.splitInfo.packetIndex);
+	EXPECT_EQ(1200, readFragment.splitInfo.fragmentSize);
+	EXPECT_TRUE(readFragment.splitInfo.isEnd);
+	EXPECT_EQ(600, readFragment.Size());
+
+	knet::ReliablePacket chunk{message.data(), 100};
+	chunk.isStream = true;
+	chunk.reliability = knet::PacketReliability::RELIABLE;
+	chunk.streamInfo.size = 1ull << 33;
+	chunk.streamInfo.offset = 1ull << 32;
+	chunk.streamInfo.id = 9;
+	chunk.streamInfo.chunkSize = 1000;
+
+	bitStream.Reset();
+	chunk.Serialize(bitStream);
+
+	EXPECT_EQ(1u + 22u + 2u + 100u, bitStream.Size());
+	EXPECT_EQ(chunk.GetSizeToSend(), bitStream.Size());
+
+	knet::ReliablePacket readChunk;
+	readChunk.isStream = true;
+
+	knet::BitStream chunkReader{reinterpret_cast<unsigned char*>(bitStream.Data()), bitStream.Size(), true};
+	readChunk.Deserialize(chunkReader);
+
+	EXPECT_EQ(1ull << 33, readChunk.streamInfo.size);
+	EXPECT_EQ(1ull << 32, readChunk.streamInfo.offset);
+	EXPECT_EQ(9u, readChunk.streamInfo.id);
+	EXPECT_EQ(1000, readChunk.streamInfo.chunkSize);
+	EXPECT_EQ(100, readChunk.Size());
+}
+
+TEST(SocketTests, SplitMessageRoundTrip)
+{
+	auto senderSocket = std::make_shared<knet::BerkleySocket>();
+	auto captureSocket = std::make_shared<knet::BerkleySocket>();
+	auto receiverSocket = std::make_shared<knet::BerkleySocket>();
+
+	knet::SocketBindArguments bindArgs;
+	bindArgs.szHostAddress = "127.0.0.1";
+
+	bindArgs.usPort = 6592;
+	ASSERT_TRUE(senderSocket->Bind(bindArgs));
+
+	bindArgs.usPort = 6593;
+	ASSERT_TRUE(captureSocket->Bind(bindArgs));
+
+	bindArgs.usPort = 6594;
+	ASSERT_TRUE(receiverSocket->Bind(bindArgs));
+
+	std::mutex receivedMutex;
+	std::vector<std::vector<char>> received;
+
+	captureSocket->GetEventHandler().AddEvent(knet::SocketEvents::RECEIVE, nullptr, [&](knet::InternalRecvPacket* pPacket) {
+		std::lock_guard<std::mutex> lock{receivedMutex};
+		received.emplace_back(pPacket->buffer, pPacket->buffer + pPacket->bytesRead);
+		pPacket->Release();
+		return true;
+	});
+
+	captureSocket->StartReceiving();
+
+	auto captureAddress = captureSocket->GetSocketAddress();
+	auto senderAddress = senderSocket->GetSocketAddress();
+
+	// Nothing acks the fragments, without a congestion window all of them fit the split window
+	knet::ReliabilityLayer sender{senderSocket};
+	sender.SetRemoteAddress(captureAddress);
+	sender.SetCongestionControl(knet::CongestionControlType::None);
+
+	std::vector<char> message(20000);
+
+	for (size_t i = 0; i < message.size(); ++i)
+		message[i] = static_cast<char>(i * 13);
+
+	// Message sizes are 16 bit, larger ones are refused instead of being dropped silently
+	std::vector<char> tooLarge(knet::internal::ReassemblyBuffer::maxMessageSize + 1);
+	EXPECT_FALSE(sender.Send(tooLarge.data(), tooLarge.size()));
+
+	EXPECT_TRUE(sender.Send(message.data(), message.size(), knet::PacketPriority::MEDIUM, knet::PacketReliability::RELIABLE_ORDERED));
+	sender.Process();
+
+	const size_t fragments = message.size() / knet::MAX_MTU_SIZE + 1;
+	auto start = std::chrono::system_clock::now();
+	std::vector<std::vector<char>> datagrams;
+
+	while (std::chrono::system_clock::now() < start + std::chrono::seconds(5))
+	{
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+
+		std::lock_guard<std::mutex> lock{receivedMutex};
+
+		if (received.size() >= fragments)
+		{
+			datagrams = received;
+			break;
+		}
+	}
+
+	captureSocket->StopReceiving(true);
+	captureSocket->GetEventHandler().RemoveEventsByOwner(nullptr);
+
+	ASSERT_EQ(fragments, datagrams.size());
+
+	for (auto &datagram : datagrams)
+		EXPECT_LE(datagram.size(), knet::MAX_MTU_SIZE);
+
+	knet::ReliabilityLayer receiver{receiverSocket};
+	receiver.SetRemoteAddress(senderAddress);
+
+	std::vector<std::vector<char>> delivered;
+
+	receiver.GetEventHandler().AddEvent(knet::ReliabilityEvents::HANDLE_PACKET, nullptr, [&](knet::ReliablePacket &packet, knet::SocketAddress &) {
+		delivered.emplace_back(packet.Data(), packet.Data() + packet.Size());
+		return true;
+	});
+
+	// The fragments arrive backwards and one of them twice
+	datagrams.push_back(datagrams[1]);
+	std::reverse(datagrams.begin(), datagrams.end());
+
+	for (auto &datagram : datagrams)
+	{
+		auto pPacket = knet::InternalRecvPacket::Acquire();
+		memcpy(pPacket->buffer, datagram.data(), datagram.size());
+		pPacket->bytesRead = datagram.size();
+		pPacket->remoteAddress = senderAddress;
+
+		receiver.OnReceive(pPacket);
+	}
+
+	receiver.Process();
+
+	ASSERT_EQ(1u, delivered.size());
+	EXPECT_EQ(message, delivered[0]);
+	EXPECT_EQ(0u, receiver.GetDroppedSplitMessages());
+
+	receiver.GetEventHandler().RemoveEventsByOwner(nullptr);
+}
+
+TEST(SocketTests, StreamRoundTrip)
+{
+	auto senderSocket = std::make_shared<knet::BerkleySocket>();
+	auto captureSocket = std::make_shared<knet::BerkleySocket>();
+	auto receiverSocket = std::make_shared<knet::BerkleySocket>();
+
+	knet::SocketBindArguments bindArgs;
+	bindArgs.szHostAddress = "127.0.0.1";
+
+	bindArgs.usPort = 6597;
+	ASSERT_TRUE(senderSocket->Bind(bindArgs));
+
+	bindArgs.usPort = 6598;
+	ASSERT_TRUE(captureSocket->Bind(bindArgs));
+
+	bindArgs.usPort = 6599;
+	ASSERT_TRUE(receiverSocket->Bind(bindArgs));
+
+	std::mutex receivedMutex;
+	std::vector<std::vector<char>> received;
+
+	captureSocket->GetEventHandler().AddEvent(knet::SocketEvents::RECEIVE, nullptr, [&](knet::InternalRecvPacket* pPacket) {
+		std::lock_guard<std::mutex> lock{receivedMutex};
+		received.emplace_back(pPacket->buffer, pPacket->buffer + pPacket->bytesRead);
+		pPacket->Release();
+		return true;
+	});
+
+	captureSocket->StartReceiving();
+
+	auto captureAddress = captureSocket->GetSocketAddress();
+	auto senderAddress = senderSocket->GetSocketAddress();
+
+	knet::ReliabilityLayer sender{senderSocket};
+	sender.SetRemoteAddress(captureAddress);
+	sender.SetCongestionControl(knet::CongestionControlType::None);
+
+	std::vector<char> data(100000);
+
+	for (size_t i = 0; i < data.size(); ++i)
+		data[i] = static_cast<char>(i * 7 + i / 251);
+
+	// Hands the data out in small parts and runs dry once half of it was read
+	size_t position = 0;
+	bool stalled = false;
+
+	auto id = sender.SendStream(data.size(), [&](char *buffer, size_t maxBytes) -> size_t {
+		if (position >= data.size() / 2 && !stalled)
+		{
+			stalled = true;
+			return 0;
+		}
+
+		const size_t size = std::min<size_t>({maxBytes, 1000, data.size() - position});
+		memcpy(buffer, data.data() + position, size);
+		position += size;
+
+		return size;
+	});
+
+	ASSERT_NE(0u, id);
+	EXPECT_EQ(0u, sender.SendStream(0, [](char *, size_t) { return size_t(0); }));
+
+	sender.Process();
+
+	knet::StreamProgress progress;
+	ASSERT_TRUE(sender.GetSendProgress(id, progress));
+	EXPECT_EQ(data.size(), progress.size);
+	EXPECT_LT(progress.transferred, progress.size);
+	EXPECT_GE(progress.transferred + knet::MAX_MTU_SIZE, data.size() / 2);
+
+	sender.Process();
+
+	ASSERT_TRUE(sender.GetSendProgress(id, progress));
+	EXPECT_EQ(data.size(), progress.transferred);
+	EXPECT_EQ(0u, progress.acknowledged);
+
+	// The chunks are a little smaller than a datagram, collect them until no more come
+	auto start = std::chrono::system_clock::now();
+	std::vector<std::vector<char>> datagrams;
+
+	while (std::chrono::system_clock::now() < start + std::chrono::seconds(5))
+	{
+		std::this_thread::sleep_for(std::chrono::milliseconds(50));
+
+		std::lock_guard<std::mutex> lock{receivedMutex};
+
+		if (!received.empty() && received.size() == datagrams.size())
+			break;
+
+		datagrams = received;
+	}
+
+	captureSocket->StopReceiving(true);
+	captureSocket->GetEventHandler().RemoveEventsByOwner(nullptr);
+
+	ASSERT_GT(datagrams.size(), data.size() / knet::MAX_MTU_SIZE);
+
+	for (auto &datagram : datagrams)
+		EXPECT_LE(datagram.size(), knet::MAX_MTU_SIZE);
+
+	knet::ReliabilityLayer receiver{receiverSocket};
+	receiver.SetRemoteAddress(senderAddress);
+
+	std::vector<char> sunk(data.size());
+	size_t finished = 0;
+
+	receiver.SetStreamAcceptor([&](knet::StreamId streamId, uint64_t size) -> std::shared_ptr<knet::IStreamSink> {
+		EXPECT_EQ(id, streamId);
+		EXPECT_EQ(data.size(), size);
+		return std::make_shared<knet::MemoryStreamSink>(sunk.data(), sunk.size());
+	});
+
+	receiver.GetEventHandler().AddEvent(knet::ReliabilityEvents::STREAM_RECEIVED, nullptr, [&](knet::StreamId streamId, uint64_t size) {
+		EXPECT_EQ(id, streamId);
+		EXPECT_EQ(data.size(), size);
+		++finished;
+		return true;
+	});
+
+	// The chunks arrive backwards, one twice and one again after the stream finished
+	datagrams.push_back(datagrams[1]);
+	std::reverse(datagrams.begin(), datagrams.end());
+	datagrams.push_back(datagrams[2]);
+
+	for (size_t i = 0; i < datagrams.size(); ++i)
+	{
+		auto pPacket = knet::InternalRecvPacket::Acquire();
+		memcpy(pPacket->buffer, datagrams[i].data(), datagrams[i].size());
+		pPacket->bytesRead = datagrams[i].size();
+		pPacket->remoteAddress = senderAddress;
+
+		receiver.OnReceive(pPacket);
+
+		if (i == datagrams.size() / 2)
+		{
+			receiver.Process();
+
+			ASSERT_TRUE(receiver.GetReceiveProgress(id, progress));
+			EXPECT_EQ(data.size(), progress.size);
+			EXPECT_LT(progress.transferred, progress.size);
+		}
+	}
+
+	receiver.Process();
+
+	EXPECT_EQ(1u, finished);
+	EXPECT_EQ(data, sunk);
+	EXPECT_FALSE(receiver.GetReceiveProgress(id, progress));
+
+	receiver.GetEventHandler().RemoveEventsByOwner(nullptr);
+}
+
+TEST(SocketTests, SendFileStream)
+{
+	const char *path = "knet_stream_test.bin";
+	std::vector<char> data(50000);
+
+	for (size_t i = 0; i < data.size(); ++i)
+		data[i] = static_cast<char>(i * 31 + 5);
+
+	{
+		std::ofstream file{path, std::ios::binary};
+		file.write(data.data(), data.size());
+	}
+
+	auto senderSocket = std::make_shared<knet::BerkleySocket>();
+	auto receiverSocket = std::make_shared<knet::BerkleySocket>();
+
+	knet::SocketBindArguments bindArgs;
+	bindArgs.szHostAddress = "127.0.0.1";
+
+	bindArgs.usPort = 6600;
+	ASSERT_TRUE(senderSocket->Bind(bindArgs));
+
+	bindArgs.usPort = 6601;
+	ASSERT_TRUE(receiverSocket->Bind(bindArgs));
+
+	auto senderAddress = senderSocket->GetSocketAddress();
+	auto receiverAddress = receiverSocket->GetSocketAddress();
+
+	knet::ReliabilityLayer sender{senderSocket};
+	sender.SetRemoteAddress(receiverAddress);
+	sender.SetCongestionControl(knet::CongestionControlType::None);
+
+	knet::ReliabilityLayer receiver{receiverSocket};
+	receiver.SetRemoteAddress(senderAddress);
+
+	senderSocket->GetEventHandler().AddEvent(knet::SocketEvents::RECEIVE, nullptr, [&](knet::InternalRecvPacket* pPacket) {
+		return sender.OnReceive(pPacket);
+	});
+
+	receiverSocket->GetEventHandler().AddEvent(knet::SocketEvents::RECEIVE, nullptr, [&](knet::InternalRecvPacket* pPacket) {
+		return receiver.OnReceive(pPacket);
+	});
+
+	senderSocket->StartReceiving();
+	receiverSocket->StartReceiving();
+
+	// Without a sink the chunks come as events
+	std::vector<char> assembled(data.size());
+	bool received = false;
+	bool sent = false;
+
+	receiver.GetEventHandler().AddEvent(knet::ReliabilityEvents::STREAM_CHUNK, nullptr, [&](knet::StreamId, uint64_t offset, const char *chunk, size_t size) {
+		EXPECT_LE(offset + size, assembled.size());
+		memcpy(assembled.data() + offset, chunk, size);
+		return true;
+	});
+
+	receiver.GetEventHandler().AddEvent(knet::ReliabilityEvents::STREAM_RECEIVED, nullptr, [&](knet::StreamId, uint64_t) {
+		received = true;
+		return true;
+	});
+
+	EXPECT_EQ(0u, sender.SendFile("knet_missing_stream_test.bin"));
+
+	auto id = sender.SendFile(path);
+	ASSERT_NE(0u, id);
+
+	sender.GetEventHandler().AddEvent(knet::ReliabilityEvents::STREAM_SENT, nullptr, [&](knet::StreamId streamId) {
+		EXPECT_EQ(id, streamId);
+		sent = true;
+		return true;
+	});
+
+	auto start = std::chrono::system_clock::now();
+
+	while (!(received && sent) && std::chrono::system_clock::now() < start + std::chrono::seconds(5))
+	{
+		sender.Process();
+		receiver.Process();
+
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+	}
+
+	senderSocket->StopReceiving(true);
+	receiverSocket->StopReceiving(true);
+	senderSocket->GetEventHandler().RemoveEventsByOwner(nullptr);
+	receiverSocket->GetEventHandler().RemoveEventsByOwner(nullptr);
+
+	EXPECT_TRUE(received);
+	EXPECT_TRUE(sent);
+	EXPECT_EQ(data, assembled);
+
+	knet::StreamProgress progress;
+	EXPECT_FALSE(sender.GetSendProgress(id, progress));
+
+	sender.GetEventHandler().RemoveEventsByOwner(nullptr);
+	receiver.GetEventHandler().RemoveEventsByOwner(nullptr);
+
+	std::remove(path);
+}
+
+static knet::InternalRecvPacket * MakeStreamDatagram(const knet::SocketAddress &from, knet::SequenceNumberType sequenceNumber, knet::StreamId id, uint64_t size, uint64_t offset, uint16_t chunkSize, size_t bytes)
+{
+	std::vector<char> chunk(bytes, 's');
+
+	knet::DatagramPacket datagram;
+	datagram.header.isACK = false;
+	datagram.header.isNACK = false;
+	datagram.header.isReliable = true;
+	datagram.header.isStream = true;
+	datagram.header.sequenceNumber = sequenceNumber;
+
+	knet::ReliablePacket packet{chunk.data(), chunk.size()};
+	packet.reliability = knet::PacketReliability::RELIABLE;
+	packet.isStream = true;
+	packet.streamInfo.id = id;
+	packet.streamInfo.size = size;
+	packet.streamInfo.offset = offset;
+	packet.streamInfo.chunkSize = chunkSize;
+
+	datagram.packets.push_back(std::move(packet));
+
+	knet::BitStream bitStream{knet::MAX_MTU_SIZE};
+	datagram.Serialize(bitStream);
+
+	auto pPacket = knet::InternalRecvPacket::Acquire();
+	memcpy(pPacket->buffer, bitStream.Data(), bitStream.Size());
+	pPacket->bytesRead = bitStream.Size();
+	pPacket->remoteAddress = from;
+	pPacket->kernelTimeStamp = std::chrono::steady_clock::now();
+
+	return pPacket;
+}
+
+TEST(SocketTests, StreamChunksAdmittedBeforeAck)
+{
+	auto socket = std::make_shared<knet::BerkleySocket>();
+	auto remoteSocket = std::make_shared<knet::BerkleySocket>();
+
+	knet::SocketBindArguments bindArgs;
+	bindArgs.szHostAddress = "127.0.0.1";
+
+	bindArgs.usPort = 6617;
+	ASSERT_TRUE(socket->Bind(bindArgs));
+
+	bindArgs.usPort = 6618;
+	ASSERT_TRUE(remoteSocket->Bind(bindArgs));
+
+	std::mutex acksMutex;
+	std::vector<std::pair<int32_t, int32_t>> acked;
+	size_t ackDatagrams = 0;
+	size_t nackDatagrams = 0;
+
+	remoteSocket->GetEventHandler().AddEvent(knet::SocketEvents::RECEIVE, nullptr, [&](knet::InternalRecvPacket* pPacket) {
+		knet::BitStream bitStream{reinterpret_cast<unsigned char*>(pPacket->buffer), static_cast<size_t>(pPacket->bytesRead), true};
+
+		knet::DatagramHeader dh;
+		dh.Deserialize(bitStream);
+
+		if (dh.isACK)
+		{
+			std::lock_guard<std::mutex> lock{acksMutex};
+			knet::internal::AckWindow::Read(bitStream, acked);
+			++ackDatagrams;
+		}
+		else if (dh.isNACK)
+		{
+			std::lock_guard<std::mutex> lock{acksMutex};
+			++nackDatagrams;
+		}
+
+		pPacket->Release();
+		return true;
+	});
+
+	remoteSocket->StartReceiving();
+
+	auto remote = remoteSocket->GetSocketAddress();
+
+	knet::ReliabilityLayer layer{socket};
+	layer.SetRemoteAddress(remote);
+	layer.SetReassemblyLimits(4 * 1024 * 1024, std::chrono::milliseconds(100));
+
+	// Tiny chunks, a size the stream did not start with, and a bitmap beyond the memory limit are refused
+	layer.OnReceive(MakeStreamDatagram(remote, 0, 1, 64, 0, 16, 16));
+	layer.OnReceive(MakeStreamDatagram(remote, 1, 1, 2000, 0, 1000, 1000));
+	layer.OnReceive(MakeStreamDatagram(remote, 2, 1, 3000, 1000, 1000, 1000));
+	layer.OnReceive(MakeStreamDatagram(remote, 3, 2, uint64_t(16) * 1024 * 1024 * 1024, 0, 512, 512));
+
+	auto start = std::chrono::system_clock::now();
+
+	while (std::chrono::system_clock::now() < start + std::chrono::seconds(5))
+	{
+		layer.Process();
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+
+		std::lock_guard<std::mutex> lock{acksMutex};
+
+		if (ackDatagrams > 0)
+			break;
+	}
+
+	{
+		std::lock_guard<std::mutex> lock{acksMutex};
+		ASSERT_EQ(1u, acked.size());
+		EXPECT_EQ(1, acked[0].first);
+		EXPECT_EQ(1, acked[0].second);
+	}
+
+	knet::StreamProgress progress;
+	ASSERT_TRUE(layer.GetReceiveProgress(1, progress));
+	EXPECT_EQ(1000u, progress.transferred);
+	EXPECT_FALSE(layer.GetReceiveProgress(2, progress));
+
+	std::vector<knet::StreamId> aborted;
+
+	layer.GetEventHandler().AddEvent(knet::ReliabilityEvents::STREAM_ABORTED, nullptr, [&](knet::StreamId id, uint64_t size) {
+		EXPECT_EQ(2000u, size);
+		aborted.push_back(id);
+		return true;
+	});
+
+	// No chunk came for the timeout, the stream gives up its slot
+	std::this_thread::sleep_for(std::chrono::milliseconds(150));
+	layer.Process();
+
+	EXPECT_FALSE(layer.GetReceiveProgress(1, progress));
+	EXPECT_EQ((std::vector<knet::StreamId>{1}), aborted);
+
+	// Its late chunks are refused instead of starting it over, the next stream is taken
+	layer.OnReceive(MakeStreamDatagram(remote, 4, 1, 2000, 1000, 1000, 1000));
+	layer.OnReceive(MakeStreamDatagram(remote, 5, 3, 2000, 0, 1000, 1000));
+
+	start = std::chrono::system_clock::now();
+
+	while (std::chrono::system_clock::now() < start + std::chrono::seconds(5))
+	{
+		layer.Process();
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+
+		std::lock_guard<std::mutex> lock{acksMutex};
+
+		if (ackDatagrams > 1)
+			break;
+	}
+
+	// Give a nack which should not come the time to arrive
+	std::this_thread::sleep_for(std::chrono::milliseconds(20));
+
+	remoteSocket->StopReceiving(true);
+	remoteSocket->GetEventHandler().RemoveEventsByOwner(nullptr);
+	layer.GetEventHandler().RemoveEventsByOwner(nullptr);
+
+	EXPECT_FALSE(layer.GetReceiveProgress(1, progress));
+	EXPECT_TRUE(layer.GetReceiveProgress(3, progress));
+	EXPECT_EQ(1u, aborted.size());
+
+	// Refused chunks are neither acked nor reported as gaps, the remote would take that for congestion
+	for (auto &range : acked)
+	{
+		EXPECT_TRUE(range.first == 1 || range.first == 5) << range.first;
+		EXPECT_EQ(range.first, range.second);
+	}
+
+	EXPECT_EQ(0u, nackDatagrams);
+}
+
+// A stream whose chunks the remote does not acknowledge fails instead of being resent forever
+TEST(SocketTests, StreamFailsUnacknowledged)
+{
+	auto socket = std::make_shared<knet::BerkleySocket>();
+	auto remoteSocket = std::make_shared<knet::BerkleySocket>();
+
+	knet::SocketBindArguments bindArgs;
+	bindArgs.szHostAddress = "127.0.0.1";
+
+	bindArgs.usPort = 6624;
+	ASSERT_TRUE(socket->Bind(bindArgs));
+
+	bindArgs.usPort = 6625;
+	ASSERT_TRUE(remoteSocket->Bind(bindArgs));
+
+	// The remote takes the chunks but never acks them
+	remoteSocket->GetEventHandler().AddEvent(knet::SocketEvents::RECEIVE, nullptr, [&](knet::InternalRecvPacket* pPacket) {
+		pPacket->Release();
+		return true;
+	});
+
+	remoteSocket->StartReceiving();
+
+	auto remote = remoteSocket->GetSocketAddress();
+
+	knet::ReliabilityLayer layer{socket};
+	layer.SetRemoteAddress(remote);
+	layer.SetReassemblyLimits(4 * 1024 * 1024, std::chrono::milliseconds(100));
+
+	std::vector<char> data(10000, 'f');
+	size_t position = 0;
+
+	auto id = layer.SendStream(data.size(), [&](char *buffer, size_t maxBytes) {
+		const size_t size = std::min(maxBytes, data.size() - position);
+		memcpy(buffer, data.data() + position, size);
+		position += size;
+		return size;
+	});
+
+	ASSERT_NE(0u, id);
+
+	bool sent = false;
+	std::vector<knet::StreamId> failed;
+
+	layer.GetEventHandler().AddEvent(knet::ReliabilityEvents::STREAM_SENT, nullptr, [&](knet::StreamId) {
+		sent = true;
+		return true;
+	});
+
+	layer.GetEventHandler().AddEvent(knet::ReliabilityEvents::STREAM_FAILED, nullptr, [&](knet::StreamId streamId) {
+		failed.push_back(streamId);
+		return true;
+	});
+
+	auto start = std::chrono::system_clock::now();
+
+	while (failed.empty() && std::chrono::system_clock::now() < start + std::chrono::seconds(5))
+	{
+		layer.Process();
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+	}
+
+	// Nothing of it is left to resend
+	layer.Process();
+
+	remoteSocket->StopReceiving(true);
+	remoteSocket->GetEventHandler().RemoveEventsByOwner(nullptr);
+	layer.GetEventHandler().RemoveEventsByOwner(nullptr);
+
+	EXPECT_FALSE(sent);
+	EXPECT_EQ((std::vector<knet::StreamId>{id}), failed);
+
+	knet::StreamProgress progress;
+	EXPECT_FALSE(layer.GetSendProgress(id, progress));
+	EXPECT_EQ(0u, layer.GetBytesInFlight());
+}
+
+TEST(SocketTests, ReceivedWindow)
+{
+	using AddResult = knet::internal::ReceivedWindow::AddResult;
+
+	knet::internal::ReceivedWindow window{128};
+
+	EXPECT_EQ(128u, window.Capacity());
+	EXPECT_FALSE(window.Contains(0));
+
+	EXPECT_EQ(AddResult::New, window.Add(10));
+	EXPECT_EQ(AddResult::Duplicate, window.Add(10));
+
+	// Late ones are new once
+	EXPECT_EQ(AddResult::New, window.Add(12));
+	EXPECT_EQ(AddResult::New, window.Add(11));
+	EXPECT_EQ(AddResult::Duplicate, window.Add(11));
+	EXPECT_EQ(12, window.GetHighest());
+
+	// Moving ahead forgets what was a window ago, the bits are reused
+	EXPECT_EQ(AddResult::New, window.Add(12 + 127));
+	EXPECT_TRUE(window.Contains(12));
+	EXPECT_FALSE(window.Contains(10));
+	EXPECT_EQ(AddResult::TooOld, window.Add(10));
+	EXPECT_FALSE(window.Contains(12 + 128));
+
+	EXPECT_EQ(AddResult::New, window.Add(12 + 128));
+	EXPECT_FALSE(window.Contains(12));
+	EXPECT_TRUE(window.Contains(12 + 127));
+
+	// A jump beyond the window clears it
+	EXPECT_EQ(AddResult::New, window.Add(1000));
+	EXPECT_FALSE(window.Contains(12 + 128));
+	EXPECT_EQ(AddResult::New, window.Add(999));
+
+	// Sequence numbers wrap from the largest one to 0
+	const int32_t largest = std::numeric_limits<int32_t>::max();
+
+	window.Reset();
+	EXPECT_TRUE(window.Empty());
+
+	EXPECT_EQ(AddResult::New, window.Add(largest - 1));
+	EXPECT_EQ(AddResult::New, window.Add(1));
+	EXPECT_EQ(1, window.GetHighest());
+	EXPECT_TRUE(window.Contains(largest - 1));
+	EXPECT_FALSE(window.Contains(largest));
+	EXPECT_EQ(AddResult::New, window.Add(largest));
+	EXPECT_EQ(AddResult::Duplicate, window.Add(largest - 1));
+	EXPECT_EQ(AddResult::New, window.Add(0));
+	EXPECT_EQ(AddResult::Duplicate, window.Add(1));
+}
+
+TEST(SocketTests, DuplicateDatagramsDropped)
+{
+	auto socket = std::make_shared<knet::BerkleySocket>();
+	auto remoteSocket = std::make_shared<knet::BerkleySocket>();
+
+	knet::SocketBindArguments bindArgs;
+	bindArgs.szHostAddress = "127.0.0.1";
+
+	bindArgs.usPort = 6602;
+	ASSERT_TRUE(socket->Bind(bindArgs));
+
+	bindArgs.usPort = 6603;
+	ASSERT_TRUE(remoteSocket->Bind(bindArgs));
+
+	std::mutex acksMutex;
+	std::vector<std::pair<int32_t, int32_t>> acked;
+	size_t ackDatagrams = 0;
+
+	remoteSocket->GetEventHandler().AddEvent(knet::SocketEvents::RECEIVE, nullptr, [&](knet::InternalRecvPacket* pPacket) {
+		knet::BitStream bitStream{reinterpret_cast<unsigned char*>(pPacket->buffer), static_cast<size_t>(pPacket->bytesRead), true};
+
+		knet::DatagramHeader dh;
+		dh.Deserialize(bitStream);
+
+		if (dh.isACK)
+		{
+			std::lock_guard<std::mutex> lock{acksMutex};
+			knet::internal::AckWindow::Read(bitStream, acked);
+			++ackDatagrams;
+		}
+
+		pPacket->Release();
+		return true;
+	});
+
+	remoteSocket->StartReceiving();
+
+	auto remote = remoteSocket->GetSocketAddress();
+
+	knet::ReliabilityLayer layer{socket};
+	layer.SetRemoteAddress(remote);
+
+	size_t delivered = 0;
+
+	layer.GetEventHandler().AddEvent(knet::ReliabilityEvents::HANDLE_PACKET, nullptr, [&](knet::ReliablePacket &, knet::SocketAddress &) {
+		++delivered;
+		return true;
+	});
+
+	auto waitForAcks = [&](size_t count) {
+		auto start = std::chrono::system_clock::now();
+
+		while (std::chrono::system_clock::now() < start + std::chrono::seconds(5))
+		{
+			layer.Process();
+			std::this_thread::sleep_for(std::chrono::milliseconds(1));
+
+			std::lock_guard<std::mutex> lock{acksMutex};
+
+			if (ackDatagrams >= count)
+				return;
+		}
+	};
+
+	for (knet::SequenceNumberType sequenceNumber : {0, 1, 2})
+		layer.OnReceive(MakeReliableDatagram(remote, sequenceNumber));
+
+	waitForAcks(1);
+
+	EXPECT_EQ(3u, delivered);
+	EXPECT_EQ(0u, layer.GetDuplicateDatagrams());
+
+	// The ack for 1 got lost, the remote sends it again after the acks went out
+	{
+		std::lock_guard<std::mutex> lock{acksMutex};
+		acked.clear();
+	}
+
+	layer.OnReceive(MakeReliableDatagram(remote, 1));
+	layer.OnReceive(MakeReliableDatagram(remote, 3));
+
+	waitForAcks(2);
+
+	// Stopping wakes the socket with a datagram of its own, look at the acks before
+	std::vector<std::pair<int32_t, int32_t>> reackedRanges;
+	{
+		std::lock_guard<std::mutex> lock{acksMutex};
+		reackedRanges = acked;
+	}
+
+	remoteSocket->StopReceiving(true);
+	remoteSocket->GetEventHandler().RemoveEventsByOwner(nullptr);
+	layer.GetEventHandler().RemoveEventsByOwner(nullptr);
+
+	EXPECT_EQ(4u, delivered);
+	EXPECT_EQ(1u, layer.GetDuplicateDatagrams());
+
+	// It is acknowledged again all the same
+	bool reacked = false;
+
+	for (auto &range : reackedRanges)
+		reacked = reacked || (range.first <= 1 && range.second >= 1);
+
+	EXPECT_TRUE(reacked);
+}